@@ -27,6 +27,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #if defined(__linux__)
 #include <sys/sysinfo.h>
 #elif defined(__FreeBSD__)
@@ -36,6 +37,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #ifdef DEDICATED
 #include <sys/wait.h>
 #endif
@@ -78,6 +81,183 @@ int64_t Sys_Microseconds()
 }
 
 
+// the worker threads are created on first use and live until the process exits
+// each batch bumps the generation so sleeping workers know there's new work
+
+typedef struct {
+	pthread_t		threads[MAX_WORKER_THREADS];
+	int				numThreads;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	wakeCond;
+	pthread_cond_t	doneCond;
+	jobFunction_t	function;
+	void*			data;
+	int				count;
+	volatile int	nextIndex;
+	int				generation;
+	int				startGeneration[MAX_WORKER_THREADS];	// generation when the thread was created
+	int				activeWorkers;	// workers taking part in the current batch
+	int				busyWorkers;	// active workers that haven't finished yet
+} workers_t;
+
+static workers_t workers;
+
+
+static void LIN_RunJobs()
+{
+	for (;;) {
+		const int index = __sync_fetch_and_add( &workers.nextIndex, 1 );
+		if (index >= workers.count)
+			break;
+		workers.function( workers.data, index );
+	}
+}
+
+
+static void* LIN_WorkerThread( void* arg )
+{
+	const int workerIndex = (int)(intptr_t)arg;
+
+	pthread_mutex_lock( &workers.mutex );
+	int generation = workers.startGeneration[workerIndex];
+	for (;;) {
+		while (generation == workers.generation)
+			pthread_cond_wait( &workers.wakeCond, &workers.mutex );
+		generation = workers.generation;
+		if (workerIndex >= workers.activeWorkers)
+			continue;
+
+		pthread_mutex_unlock( &workers.mutex );
+		LIN_RunJobs();
+		pthread_mutex_lock( &workers.mutex );
+
+		if (--workers.busyWorkers == 0)
+			pthread_cond_signal( &workers.doneCond );
+	}
+
+	return NULL;
+}
+
+
+static void LIN_CreateWorkers( int count )
+{
+	if (workers.numThreads == 0) {
+		pthread_mutex_init( &workers.mutex, NULL );
+		pthread_cond_init( &workers.wakeCond, NULL );
+		pthread_cond_init( &workers.doneCond, NULL );
+	}
+
+	while (workers.numThreads < count) {
+		const int index = workers.numThreads;
+		workers.startGeneration[index] = workers.generation;
+		if (pthread_create( &workers.threads[index], NULL, LIN_WorkerThread, (void*)(intptr_t)index ) != 0)
+			break;
+		++workers.numThreads;
+	}
+}
+
+
+int Sys_GetCoreCount()
+{
+	const long count = sysconf( _SC_NPROCESSORS_ONLN );
+
+	return count > 0 ? (int)count : 1;
+}
+
+
+void Sys_RunParallel( jobFunction_t function, void* data, int count, int threadCount )
+{
+	if (count <= 0)
+		return;
+
+	const int workerCount = min( min( threadCount, count ), MAX_WORKER_THREADS + 1 ) - 1;
+	if (workerCount > workers.numThreads)
+		LIN_CreateWorkers( workerCount );
+
+	workers.function = function;
+	workers.data = data;
+	workers.count = count;
+	workers.nextIndex = 0;
+
+	const int activeWorkers = min( workerCount, workers.numThreads );
+	if (activeWorkers <= 0) {
+		LIN_RunJobs();
+		return;
+	}
+
+	pthread_mutex_lock( &workers.mutex );
+	workers.activeWorkers = activeWorkers;
+	workers.busyWorkers = activeWorkers;
+	workers.generation++;
+	pthread_cond_broadcast( &workers.wakeCond );
+	pthread_mutex_unlock( &workers.mutex );
+
+	LIN_RunJobs();
+
+	pthread_mutex_lock( &workers.mutex );
+	while (workers.busyWorkers > 0)
+		pthread_cond_wait( &workers.doneCond, &workers.mutex );
+	pthread_mutex_unlock( &workers.mutex );
+}
+
+
+int Sys_AtomicAdd( volatile int* value, int amount )
+{
+	return __sync_fetch_and_add( value, amount );
+}
+
+
+static pthread_t profiledThread;
+static profileSampler_t profileSampler;
+
+
+static void LIN_ProfileSignal( int sig )
+{
+	// SIGPROF goes to whichever thread is running
+	if (!pthread_equal( pthread_self(), profiledThread ))
+		return;
+
+	const int savedErrno = errno;
+	profileSampler();
+	errno = savedErrno;
+}
+
+
+qbool Sys_StartProfileSampling( int intervalUS, profileSampler_t sampler )
+{
+	profiledThread = pthread_self();
+	profileSampler = sampler;
+
+	struct sigaction action;
+	memset( &action, 0, sizeof(action) );
+	action.sa_handler = LIN_ProfileSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset( &action.sa_mask );
+	if (sigaction( SIGPROF, &action, NULL ) != 0)
+		return qfalse;
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = intervalUS / 1000000;
+	timer.it_interval.tv_usec = intervalUS % 1000000;
+	timer.it_value = timer.it_interval;
+	if (setitimer( ITIMER_PROF, &timer, NULL ) != 0) {
+		signal( SIGPROF, SIG_IGN );
+		return qfalse;
+	}
+
+	return qtrue;
+}
+
+
+void Sys_StopProfileSampling()
+{
+	struct itimerval timer;
+	memset( &timer, 0, sizeof(timer) );
+	setitimer( ITIMER_PROF, &timer, NULL );
+	signal( SIGPROF, SIG_IGN );
+}
+
+
 qboolean Sys_LowPhysicalMemory()
 {
 	return qfalse; // FIXME
@@ -613,6 +793,39 @@ void	Sys_FreeFileList( char **list ) {
 }
 
 
+const byte* Sys_MapFile( const char* path, int* size )
+{
+	*size = 0;
+
+	const int fd = open( path, O_RDONLY );
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat( fd, &st ) == -1 || st.st_size <= 0 || st.st_size > INT_MAX) {
+		close( fd );
+		return NULL;
+	}
+
+	void* const data = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd ); // the mapping keeps the file referenced
+	if (data == MAP_FAILED)
+		return NULL;
+
+	madvise( data, (size_t)st.st_size, MADV_SEQUENTIAL );
+	*size = (int)st.st_size;
+
+	return (const byte*)data;
+}
+
+
+void Sys_UnmapFile( const byte* data, int size )
+{
+	if (data)
+		munmap( (void*)data, (size_t)size );
+}
+
+
 const char* Sys_Cwd()
 {
 	static char cwd[MAX_OSPATH];
@@ -673,8 +886,7 @@ void Lin_QueEvent( int time, sysEventType_t type, int value, int value2, int ptr
 	if ( eventHead - eventTail >= MAX_QUED_EVENTS ) {
 		Com_Printf("Sys_QueEvent: overflow\n");
 		// we are discarding an event, but don't leak memory
-		if ( ev->evPtr )
-			Z_Free( ev->evPtr );
+		Com_FreeEventPtr( ev->evPtr );
 		++eventTail;
 	}
 
@@ -715,17 +927,28 @@ sysEvent_t Sys_GetEvent()
 #endif
 
 	// check for network packets
+	// they're received straight into a packet slot unless they're all in use
 	msg_t		netmsg;
 	netadr_t	adr;
 	static byte sys_packetReceived[MAX_MSGLEN]; // static or it'll blow half the stack
-	MSG_Init( &netmsg, sys_packetReceived, sizeof( sys_packetReceived ) );
+	packetSlot_t* const slot = Com_GetPacketSlot();
+	MSG_Init( &netmsg, slot ? slot->data : sys_packetReceived, MAX_MSGLEN );
 	if ( Sys_GetPacket( &adr, &netmsg ) ) {
-		// copy out to a separate buffer for queuing
-		int len = sizeof( netadr_t ) + netmsg.cursize;
-		netadr_t* buf = (netadr_t*)Z_Malloc( len );
-		*buf = adr;
-		memcpy( buf+1, netmsg.data, netmsg.cursize );
-		Lin_QueEvent( 0, SE_PACKET, 0, 0, len, buf );
+		// the readcount stepahead is for SOCKS support
+		const int len = sizeof( netadr_t ) + netmsg.cursize - netmsg.readcount;
+		if ( slot ) {
+			slot->from = adr;
+			if ( netmsg.readcount > 0 )
+				memmove( slot->data, slot->data + netmsg.readcount, netmsg.cursize - netmsg.readcount );
+			Com_QueuePacketSlot( slot );
+			Lin_QueEvent( 0, SE_PACKET, 0, 0, len, slot );
+		} else {
+			// copy out to a separate buffer for queuing
+			netadr_t* buf = (netadr_t*)Z_Malloc( len );
+			*buf = adr;
+			memcpy( buf+1, netmsg.data + netmsg.readcount, netmsg.cursize - netmsg.readcount );
+			Lin_QueEvent( 0, SE_PACKET, 0, 0, len, buf );
+		}
 	}
 
 	// return if we have data
@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 // cmodel.c -- model loading
 
 #include "cm_local.h"
+#include "cm_patch.h"
 
 
 // to allow boxes to be treated as brush models, we allocate
@@ -33,7 +34,6 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 
 clipMap_t cm;
-int c_traces, c_brush_traces, c_patch_traces, c_pointcontents;
 
 const byte* cmod_base;
 
@@ -42,6 +42,8 @@ const byte* cmod_base;
 cvar_t* cm_noAreas;
 cvar_t* cm_noCurves;
 cvar_t* cm_playerCurveClip;
+cvar_t* cm_debugSurfaceUpdate;
+cvar_t* cm_cache;
 #endif
 
 
@@ -184,13 +186,63 @@ static void CMod_LoadNodes( const lump_t* l )
 
 	cm.nodes = H_New<cNode_t>( cm.numNodes, h_high );
 
+	// renumber the nodes in depth-first order, front child first
+	// unreachable nodes are kept at the end so that the count doesn't change
+	int* const newIndex = (int*)Z_Malloc( cm.numNodes * sizeof(int) );
+	int* const oldIndex = (int*)Z_Malloc( cm.numNodes * sizeof(int) );
+	int* const stack = (int*)Z_Malloc( cm.numNodes * sizeof(int) );
+	for (int i = 0; i < cm.numNodes; ++i)
+		newIndex[i] = -1;
+
+	int count = 0;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0)
+	{
+		const int node = stack[--stackSize];
+		if (newIndex[node] >= 0)
+			continue;
+
+		newIndex[node] = count;
+		oldIndex[count++] = node;
+		for (int c = 1; c >= 0; --c)
+		{
+			const int child = LittleLong( in[node].children[c] );
+			if (child >= cm.numNodes)
+				Com_Error(ERR_DROP, "CMod_LoadNodes: bad child: %i", child);
+			if (child >= 0 && newIndex[child] < 0 && stackSize < cm.numNodes)
+				stack[stackSize++] = child;
+		}
+	}
+
+	for (int i = 0; i < cm.numNodes; ++i)
+	{
+		if (newIndex[i] < 0)
+		{
+			newIndex[i] = count;
+			oldIndex[count++] = i;
+		}
+	}
+
 	cNode_t* out = cm.nodes;
-	for (int i = 0; i < cm.numNodes; ++i, ++in, ++out)
+	for (int i = 0; i < cm.numNodes; ++i, ++out)
 	{
-		out->plane = cm.planes + LittleLong( in->planeNum );
-		out->children[0] = LittleLong( in->children[0] );
-		out->children[1] = LittleLong( in->children[1] );
+		const dnode_t* const node = &in[oldIndex[i]];
+		const int planeNum = LittleLong( node->planeNum );
+		if ( planeNum < 0 || planeNum >= cm.numPlanes )
+			Com_Error( ERR_DROP, "CMod_LoadNodes: bad planeNum: %i", planeNum );
+
+		out->plane = cm.planes[planeNum];
+		for (int c = 0; c < 2; ++c)
+		{
+			const int child = LittleLong( node->children[c] );
+			out->children[c] = child >= 0 ? newIndex[child] : child;
+		}
 	}
+
+	Z_Free( stack );
+	Z_Free( oldIndex );
+	Z_Free( newIndex );
 }
 
 
@@ -230,6 +282,28 @@ static void CMod_LoadBrushes( const lump_t* l )
 		out->contents = cm.shaders[out->shaderNum].contentFlags;
 		CM_BoundBrush( out );
 	}
+
+#if CM_SIMD_TRACES
+	// the padding lanes keep the hunk's zeroes, which never cull anything
+	int groupCount = 0;
+	for (int i = 0; i < cm.numBrushes; ++i)
+		groupCount += (cm.brushes[i].numsides + 3) / 4;
+
+	float* sidePlanes = H_New<float>( groupCount * 16, h_high );
+	for (int i = 0; i < cm.numBrushes; ++i) {
+		cbrush_t* const b = &cm.brushes[i];
+		b->sidePlanes = sidePlanes;
+		for (int s = 0; s < b->numsides; ++s) {
+			const cplane_t* const plane = b->sides[s].plane;
+			float* const group = sidePlanes + (s / 4) * 16 + (s % 4);
+			group[0] = plane->normal[0];
+			group[4] = plane->normal[1];
+			group[8] = plane->normal[2];
+			group[12] = plane->dist;
+		}
+		sidePlanes += ((b->numsides + 3) / 4) * 16;
+	}
+#endif
 }
 
 
@@ -381,10 +455,212 @@ static void CMod_LoadVisibility( const lump_t* l )
 }
 
 
-static void CMod_LoadPatches( const lump_t* surfs, const lump_t* verts )
+/*
+===============================================================================
+
+					COLLISION CACHE
+
+The patch collides are the only part of the collision model that is expensive
+to build, so they get saved to cmcache/<map>.cmc after the first load.
+The file is an image of the patchCollide_t structures with offsets instead of pointers:
+it is copied to the hunk in one go and the pointers are fixed up in place.
+
+===============================================================================
+*/
+
+
+#define	CM_CACHE_VERSION	1
+
+typedef struct {
+	char		magic[4];		// "CMCC"
+	int			version;
+	unsigned	checksum;		// of the whole BSP file
+	int			bspLength;
+	int			numSurfaces;
+	int			numPatches;
+	int			recordSize;		// the struct sizes make sure the cache came from a compatible build
+	int			planeSize;
+	int			facetSize;
+	int			dataSize;		// everything after the header
+} cmCacheHeader_t;
+
+typedef struct {
+	int				surfaceNum;
+	patchCollide_t	pc;			// planes and facets are byte offsets from the start of the data
+} cmCacheRecord_t;
+
+
+#define CM_CACHE_ALIGN( x )	(((x) + 15) & ~15)
+
+
+static void CM_CachePath( char* path, int size, const char* mapName )
+{
+	char baseName[MAX_QPATH];
+	COM_StripExtension( COM_SkipPath( (char*)mapName ), baseName, sizeof(baseName) );
+	Com_sprintf( path, size, "cmcache/%s.cmc", baseName );
+}
+
+
+static void CM_FillCacheHeader( cmCacheHeader_t* header, unsigned checksum, int bspLength, int numPatches, int dataSize )
+{
+	Com_Memset( header, 0, sizeof(*header) );
+	Com_Memcpy( header->magic, "CMCC", 4 );
+	header->version = CM_CACHE_VERSION;
+	header->checksum = checksum;
+	header->bspLength = bspLength;
+	header->numSurfaces = cm.numSurfaces;
+	header->numPatches = numPatches;
+	header->recordSize = sizeof(cmCacheRecord_t);
+	header->planeSize = sizeof(patchPlane_t);
+	header->facetSize = sizeof(facet_t);
+	header->dataSize = dataSize;
+}
+
+
+// returns qfalse if the cache is missing, stale or invalid
+static qbool CM_LoadCollisionCache( const dsurface_t* surfaces, const char* mapName, unsigned checksum, int bspLength )
+{
+	char path[MAX_QPATH];
+	CM_CachePath( path, sizeof(path), mapName );
+
+	int fileSize;
+	const byte* const file = FS_SV_MapFileRead( path, &fileSize );
+	if ( !file )
+		return qfalse;
+
+	cmCacheHeader_t header;
+	cmCacheHeader_t expected;
+	qbool valid = fileSize >= (int)sizeof(header);
+	if ( valid ) {
+		Com_Memcpy( &header, file, sizeof(header) );
+		CM_FillCacheHeader( &expected, checksum, bspLength, header.numPatches, header.dataSize );
+		valid =
+			!memcmp( &header, &expected, sizeof(header) ) &&
+			header.numPatches >= 0 && header.numPatches <= cm.numSurfaces &&
+			header.dataSize >= header.numPatches * (int)sizeof(cmCacheRecord_t) &&
+			header.dataSize == fileSize - (int)sizeof(header);
+	}
+
+	if ( !valid ) {
+		Sys_UnmapFile( file, fileSize );
+		return qfalse;
+	}
+
+	// validate everything before touching the hunk so that a bad file costs nothing
+	const byte* const fileData = file + sizeof(header);
+	const cmCacheRecord_t* const fileRecords = (const cmCacheRecord_t*)fileData;
+	for ( int i = 0; i < header.numPatches && valid; ++i ) {
+		const cmCacheRecord_t* const r = &fileRecords[i];
+		const intptr_t planes = (intptr_t)r->pc.planes;
+		const intptr_t facets = (intptr_t)r->pc.facets;
+		valid =
+			r->surfaceNum >= 0 && r->surfaceNum < cm.numSurfaces &&
+			LittleLong( surfaces[r->surfaceNum].surfaceType ) == MST_PATCH &&
+			r->pc.numPlanes >= 0 && r->pc.numPlanes <= MAX_PATCH_PLANES &&
+			r->pc.numFacets >= 0 && r->pc.numFacets <= MAX_PATCH_PLANES &&
+			planes >= 0 && planes + r->pc.numPlanes * (intptr_t)sizeof(patchPlane_t) <= header.dataSize &&
+			facets >= 0 && facets + r->pc.numFacets * (intptr_t)sizeof(facet_t) <= header.dataSize;
+		for ( int f = 0; f < r->pc.numFacets && valid; ++f ) {
+			const facet_t* const facet = (const facet_t*)(fileData + facets) + f;
+			valid =
+				facet->numBorders >= 0 && facet->numBorders <= (int)ARRAY_LEN(facet->borderPlanes) &&
+				facet->surfacePlane >= 0 && facet->surfacePlane < r->pc.numPlanes;
+			for ( int b = 0; b < facet->numBorders && valid; ++b ) {
+				valid = facet->borderPlanes[b] >= 0 && facet->borderPlanes[b] < r->pc.numPlanes;
+			}
+		}
+	}
+
+	if ( !valid ) {
+		Sys_UnmapFile( file, fileSize );
+		return qfalse;
+	}
+
+	byte* const data = H_New<byte>( header.dataSize, h_high );
+	Com_Memcpy( data, fileData, header.dataSize );
+	Sys_UnmapFile( file, fileSize );
+
+	cmCacheRecord_t* const records = (cmCacheRecord_t*)data;
+	for ( int i = 0; i < header.numPatches; ++i ) {
+		cmCacheRecord_t* const r = &records[i];
+		r->pc.planes = (patchPlane_t*)(data + (intptr_t)r->pc.planes);
+		r->pc.facets = (facet_t*)(data + (intptr_t)r->pc.facets);
+		cm.surfaces[r->surfaceNum] = H_New<cPatch_t>( h_high );
+		cm.surfaces[r->surfaceNum]->pc = &r->pc;
+	}
+
+	return qtrue;
+}
+
+
+static void CM_WriteCollisionCache( const char* mapName, unsigned checksum, int bspLength )
+{
+	int numPatches = 0;
+	int planeCount = 0;
+	int facetCount = 0;
+	for ( int i = 0; i < cm.numSurfaces; ++i ) {
+		if ( cm.surfaces[i] ) {
+			numPatches++;
+			planeCount += cm.surfaces[i]->pc->numPlanes;
+			facetCount += cm.surfaces[i]->pc->numFacets;
+		}
+	}
+
+	const int facetStart = CM_CACHE_ALIGN( numPatches * sizeof(cmCacheRecord_t) );
+	const int planeStart = CM_CACHE_ALIGN( facetStart + facetCount * sizeof(facet_t) );
+	const int dataSize = planeStart + planeCount * sizeof(patchPlane_t);
+	byte* const data = (byte*)Z_Malloc( dataSize );
+
+	cmCacheRecord_t* record = (cmCacheRecord_t*)data;
+	int facetOffset = facetStart;
+	int planeOffset = planeStart;
+	for ( int i = 0; i < cm.numSurfaces; ++i ) {
+		if ( !cm.surfaces[i] )
+			continue;
+
+		const patchCollide_t* const pc = cm.surfaces[i]->pc;
+		record->surfaceNum = i;
+		record->pc = *pc;
+		record->pc.facets = (facet_t*)(intptr_t)facetOffset;
+		record->pc.planes = (patchPlane_t*)(intptr_t)planeOffset;
+		Com_Memcpy( data + facetOffset, pc->facets, pc->numFacets * sizeof(facet_t) );
+		Com_Memcpy( data + planeOffset, pc->planes, pc->numPlanes * sizeof(patchPlane_t) );
+		facetOffset += pc->numFacets * sizeof(facet_t);
+		planeOffset += pc->numPlanes * sizeof(patchPlane_t);
+		record++;
+	}
+
+	// other server instances loading the same map may have the current file mapped,
+	// so it's only ever replaced by a complete one
+	char path[MAX_QPATH];
+	char tempPath[MAX_QPATH];
+	CM_CachePath( path, sizeof(path), mapName );
+	Com_sprintf( tempPath, sizeof(tempPath), "%s.tmp", path );
+	const fileHandle_t f = FS_SV_FOpenFileWrite( tempPath );
+	if ( f ) {
+		cmCacheHeader_t header;
+		CM_FillCacheHeader( &header, checksum, bspLength, numPatches, dataSize );
+		const qbool written =
+			FS_Write( &header, sizeof(header), f ) == (int)sizeof(header) &&
+			FS_Write( data, dataSize, f ) == dataSize;
+		FS_FCloseFile( f );
+		if ( !written ) {
+			FS_SV_RemoveFile( tempPath );
+			Com_DPrintf( "Couldn't write the collision cache %s\n", path );
+		} else if ( !FS_SV_ReplaceFile( tempPath, path ) ) {
+			Com_DPrintf( "Couldn't replace the collision cache %s\n", path );
+		}
+	} else {
+		Com_DPrintf( "Couldn't write the collision cache %s\n", path );
+	}
+
+	Z_Free( data );
+}
+
+
+static void CMod_LoadPatches( const lump_t* surfs, const lump_t* verts, const char* mapName, unsigned checksum, int bspLength )
 {
 	const int MAX_PATCH_VERTS = 1024;
-	vec3_t points[MAX_PATCH_VERTS];
 
 	const dsurface_t* in = (const dsurface_t*)(cmod_base + surfs->fileofs);
 	if (surfs->filelen % sizeof(*in))
@@ -396,37 +672,96 @@ static void CMod_LoadPatches( const lump_t* surfs, const lump_t* verts )
 	if (verts->filelen % sizeof(*dvBase))
 		Com_Error (ERR_DROP, "CMod_LoadPatches: funny lump size");
 
+#ifndef BSPC
+	const qbool useCache = cm_cache->integer != 0;
+#else
+	const qbool useCache = qfalse;
+#endif
+	const qbool cached = useCache && CM_LoadCollisionCache( in, mapName, checksum, bspLength );
+
+	// count what needs to be generated so that it can all be done in one parallel batch
+	int numPatches = 0;
+	int numPoints = 0;
+	for (int i = 0; i < cm.numSurfaces; ++i)
+	{
+		if ( LittleLong( in[i].surfaceType ) != MST_PATCH || (cached && cm.surfaces[i]) )
+			continue;
+
+		const int w = LittleLong( in[i].patchWidth );
+		const int h = LittleLong( in[i].patchHeight );
+		const int c = w * h;
+		if ( c > MAX_PATCH_VERTS )
+			Com_Error( ERR_DROP, "CMod_LoadPatches: exceeded MAX_PATCH_VERTS" );
+
+		numPatches++;
+		numPoints += max( c, 0 );
+	}
+
+	vec3_t* const points = (vec3_t*)Z_Malloc( numPoints * sizeof(vec3_t) + 1 );
+	cPatchPoints_t* const patches = (cPatchPoints_t*)Z_Malloc( numPatches * sizeof(cPatchPoints_t) + 1 );
+	patchCollide_t** const results = (patchCollide_t**)Z_Malloc( numPatches * sizeof(patchCollide_t*) + 1 );
+	int* const surfaceNums = (int*)Z_Malloc( numPatches * sizeof(int) + 1 );
+
 	// scan through all the surfaces, but only load patches, not planar faces
+	int patchIndex = 0;
+	int pointIndex = 0;
 	for (int i = 0; i < cm.numSurfaces; ++i, ++in)
 	{
 		if ( LittleLong( in->surfaceType ) != MST_PATCH )
 			continue;		// ignore other surfaces
 
+		int shaderNum = LittleLong( in->shaderNum );
+		if ( cached && cm.surfaces[i] ) {
+			cm.surfaces[i]->contents = cm.shaders[shaderNum].contentFlags;
+			cm.surfaces[i]->surfaceFlags = cm.shaders[shaderNum].surfaceFlags;
+			continue;
+		}
+
 		// FIXME: check for non-colliding patches
 
 		cm.surfaces[i] = H_New<cPatch_t>( h_high );
 
-		// load the full drawverts onto the stack
+		// load the full drawverts
 		int w = LittleLong( in->patchWidth );
 		int h = LittleLong( in->patchHeight );
-		int c = w * h;
-		if ( c > MAX_PATCH_VERTS )
-			Com_Error( ERR_DROP, "CMod_LoadPatches: exceeded MAX_PATCH_VERTS" );
+		int c = max( w * h, 0 );
+
+		cPatchPoints_t* const patch = &patches[patchIndex];
+		patch->width = w;
+		patch->height = h;
+		patch->points = points + pointIndex;
+		surfaceNums[patchIndex++] = i;
 
 		const drawVert_t* dv = dvBase + LittleLong( in->firstVert );
-		for (int j = 0; j < c; ++j, ++dv)
+		for (int j = 0; j < c; ++j, ++dv, ++pointIndex)
 		{
-			points[j][0] = LittleFloat( dv->xyz[0] );
-			points[j][1] = LittleFloat( dv->xyz[1] );
-			points[j][2] = LittleFloat( dv->xyz[2] );
+			points[pointIndex][0] = LittleFloat( dv->xyz[0] );
+			points[pointIndex][1] = LittleFloat( dv->xyz[1] );
+			points[pointIndex][2] = LittleFloat( dv->xyz[2] );
 		}
 
-		int shaderNum = LittleLong( in->shaderNum );
 		cm.surfaces[i]->contents = cm.shaders[shaderNum].contentFlags;
 		cm.surfaces[i]->surfaceFlags = cm.shaders[shaderNum].surfaceFlags;
-		// create the internal facet structure
-		cm.surfaces[i]->pc = CM_GeneratePatchCollide( w, h, points );
 	}
+
+	// create the internal facet structures
+	const int64_t startUS = Sys_Microseconds();
+	const int threadCount = Sys_GetCoreCount();
+	CM_GeneratePatchCollides( results, patches, numPatches, threadCount );
+	for (int i = 0; i < numPatches; ++i)
+		cm.surfaces[surfaceNums[i]]->pc = results[i];
+	if ( numPatches > 0 ) {
+		Com_DPrintf( "CM_LoadMap: generated %d patch collides on %d threads in %d us\n",
+			numPatches, min( threadCount, MAX_WORKER_THREADS + 1 ), (int)(Sys_Microseconds() - startUS) );
+	}
+
+	Z_Free( surfaceNums );
+	Z_Free( results );
+	Z_Free( patches );
+	Z_Free( points );
+
+	if ( useCache && !cached )
+		CM_WriteCollisionCache( mapName, checksum, bspLength );
 }
 
 
@@ -454,6 +789,10 @@ void CM_LoadMap( const char* name, qbool clientload, unsigned* checksum )
 
 	CM_ClearMap();
 
+	// for the load time breakdown
+	int64_t timeUS[5];
+	timeUS[0] = Sys_Microseconds();
+
 	int length;
 	byte* buf = 0;
 
@@ -461,6 +800,8 @@ void CM_LoadMap( const char* name, qbool clientload, unsigned* checksum )
 	cm_noAreas = Cvar_Get("cm_noAreas", "0", CVAR_CHEAT);
 	cm_noCurves = Cvar_Get("cm_noCurves", "0", CVAR_CHEAT);
 	cm_playerCurveClip = Cvar_Get("cm_playerCurveClip", "1", CVAR_CHEAT);
+	cm_debugSurfaceUpdate = Cvar_Get("r_debugSurfaceUpdate", "1", 0);
+	cm_cache = Cvar_Get("cm_cache", "1", CVAR_ARCHIVE);
 	length = FS_ReadFile( name, (void **)&buf );
 #else
 	length = LoadQuakeFile((quakefile_t *) name, (void **)&buf);
@@ -471,6 +812,7 @@ void CM_LoadMap( const char* name, qbool clientload, unsigned* checksum )
 
 	last_checksum = LittleLong( Com_BlockChecksum( buf, length ) );
 	*checksum = last_checksum;
+	timeUS[1] = Sys_Microseconds();
 
 	dheader_t header = *(dheader_t*)buf;
 	for (int i = 0; i < sizeof(dheader_t) / 4; ++i)
@@ -494,7 +836,9 @@ void CM_LoadMap( const char* name, qbool clientload, unsigned* checksum )
 	CMod_LoadNodes( &header.lumps[LUMP_NODES] );
 	CMod_LoadEntityString( &header.lumps[LUMP_ENTITIES] );
 	CMod_LoadVisibility( &header.lumps[LUMP_VISIBILITY] );
-	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS] );
+	timeUS[2] = Sys_Microseconds();
+	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS], name, last_checksum, length );
+	timeUS[3] = Sys_Microseconds();
 
 	// we are NOT freeing the file, because it is cached for the ref
 	FS_FreeFile(buf);
@@ -502,6 +846,11 @@ void CM_LoadMap( const char* name, qbool clientload, unsigned* checksum )
 	CM_InitBoxHull();
 
 	CM_FloodAreaConnections();
+	timeUS[4] = Sys_Microseconds();
+
+	Com_DPrintf( "CM_LoadMap: %s loaded in %d us (read %d, lumps %d, patches %d, areas %d)\n", name,
+		(int)(timeUS[4] - timeUS[0]), (int)(timeUS[1] - timeUS[0]), (int)(timeUS[2] - timeUS[1]),
+		(int)(timeUS[3] - timeUS[2]), (int)(timeUS[4] - timeUS[3]) );
 
 	// allow this to be cached if it is loaded by the server
 	if ( !clientload ) {
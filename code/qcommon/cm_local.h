@@ -29,9 +29,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define CAPSULE_MODEL_HANDLE	254
 
 
+// the plane is stored inline and the nodes are in depth-first order
+// so that walking the tree touches as few cache lines as possible
 typedef struct {
-	cplane_t	*plane;
+	cplane_t	plane;
 	int			children[2];		// negative numbers are leafs
+	int			pad;				// 32 bytes, 2 nodes per cache line
 } cNode_t;
 
 typedef struct {
@@ -62,12 +65,15 @@ typedef struct {
 	vec3_t		bounds[2];
 	int			numsides;
 	cbrushside_t	*sides;
-	int			checkcount;		// to avoid repeated testings
+	float		*sidePlanes;	// groups of 4 sides: normal x[4], y[4], z[4], dist[4]
 } cbrush_t;
 
+// CM_BoxTraceBatch evaluates 4 brush sides at once with SSE
+// 32-bit builds use x87 math for scalar floats, so their results wouldn't match
+#define CM_SIMD_TRACES	idx64
+
 
 typedef struct {
-	int			checkcount;				// to avoid repeated testings
 	int			surfaceFlags;
 	int			contents;
 	struct patchCollide_s	*pc;
@@ -125,20 +131,38 @@ typedef struct {
 	cPatch_t	**surfaces;			// non-patches will be NULL
 
 	int			floodvalid;
-	int			checkcount;					// incremented on each trace
 } clipMap_t;
 
 
+// everything a query writes to lives in a per-thread context
+// so that traces and point tests can run from multiple threads at once
+typedef struct {
+	int			*brushChecks;	// [brush index] checkcount of the last query that tested it
+	int			*patchChecks;	// [surface index] same for patches
+	int			maxBrushes;
+	int			maxPatches;
+	int			checkcount;		// incremented on each query to avoid repeated testings
+	int			traces;			// statistics, zeroed by CM_TakeTraceStats
+	int			brushTraces;
+	int			patchTraces;
+	int			pointContents;
+	const struct patchCollide_s	*debugPatchCollide;	// the last patch hit, drawn by r_debugSurface 1
+	int			debugFacet;		// index of the facet hit in debugPatchCollide
+} cmQueryContext_t;
+
+cmQueryContext_t* CM_GetQueryContext();
+void CM_ClearQueryDebugSurfaces();
+
+
 // keep 1/8 unit away to keep the position valid before network snapping
 // and to avoid various numeric issues
 #define	SURFACE_CLIP_EPSILON	(0.125)
 
 extern	clipMap_t	cm;
-extern	int			c_pointcontents;
-extern	int			c_traces, c_brush_traces, c_patch_traces;
 extern	cvar_t		*cm_noAreas;
 extern	cvar_t		*cm_noCurves;
 extern	cvar_t		*cm_playerCurveClip;
+extern	cvar_t		*cm_debugSurfaceUpdate;
 
 // cm_test.c
 extern void CM_FloodAreaConnections();
@@ -165,6 +189,8 @@ typedef struct {
 	qbool	isPoint;	// optimized case
 	trace_t		trace;		// returned from trace call
 	sphere_t	sphere;		// sphere for oriendted capsule collision
+	cmQueryContext_t	*query;	// the calling thread's context
+	qbool		batched;	// use the SIMD brush tests of CM_BoxTraceBatch
 } traceWork_t;
 
 typedef struct leafList_s {
@@ -174,6 +200,7 @@ typedef struct leafList_s {
 	int		*list;
 	vec3_t	bounds[2];
 	int		lastLeaf;		// for overflows where each leaf can't be stored individually
+	cmQueryContext_t	*query;	// only needed by CM_StoreBrushes
 	void	(*storeLeafs)( struct leafList_s *ll, int nodenum );
 } leafList_t;
 
@@ -193,7 +220,17 @@ qbool CM_BoundsIntersectPoint( const vec3_t mins, const vec3_t maxs, const vec3_
 
 // cm_patch.c
 
+typedef struct {
+	int				width;
+	int				height;
+	const vec3_t	*points;	// packed as concatenated rows
+} cPatchPoints_t;
+
 struct patchCollide_s* CM_GeneratePatchCollide( int width, int height, const vec3_t* points );
+void CM_GeneratePatchCollides( struct patchCollide_s** results, const cPatchPoints_t* patches, int count, int threadCount );
+// returns only on a worker thread: the patch is flagged and generated again on the main thread,
+// so callers, including the polylib functions, must bail out cleanly after it
+void CM_PatchError( errorParm_t code, const char* message );
 void CM_TraceThroughPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
 qbool CM_PositionTestInPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
 void CM_ClearLevelPatches( void );
@@ -84,8 +84,6 @@ int	c_totalPatchBlocks;
 int	c_totalPatchSurfaces;
 int	c_totalPatchEdges;
 
-static const patchCollide_t	*debugPatchCollide;
-static const facet_t		*debugFacet;
 static qbool		debugBlock;
 static vec3_t		debugBlockPoints[4];
 
@@ -95,8 +93,7 @@ CM_ClearLevelPatches
 =================
 */
 void CM_ClearLevelPatches( void ) {
-	debugPatchCollide = NULL;
-	debugFacet = NULL;
+	CM_ClearQueryDebugSurfaces();
 }
 
 /*
@@ -414,11 +411,53 @@ PATCH COLLIDE GENERATION
 ================================================================================
 */
 
-static	int				numPlanes;
-static	patchPlane_t	planes[MAX_PATCH_PLANES];
+// the main thread works in the static buffers, worker threads in their own
+// see CM_GeneratePatchCollides
+static	patchPlane_t	mainPlanes[MAX_PATCH_PLANES];
+static	facet_t			mainFacets[MAX_PATCH_PLANES]; //maybe MAX_FACETS ??
 
-static	int				numFacets;
-static	facet_t			facets[MAX_PATCH_PLANES]; //maybe MAX_FACETS ??
+static	THREAD_LOCAL	int				numPlanes;
+static	THREAD_LOCAL	patchPlane_t	*planes;
+
+static	THREAD_LOCAL	int				numFacets;
+static	THREAD_LOCAL	facet_t			*facets;
+
+// on a worker thread, errors and warnings only flag the patch
+// and it gets generated again on the main thread to report them
+static	THREAD_LOCAL	qbool			inPatchJob;
+static	THREAD_LOCAL	qbool			patchJobFailed;
+
+
+void CM_PatchError( errorParm_t code, const char* message )
+{
+	if ( inPatchJob ) {
+		patchJobFailed = qtrue;
+		return;
+	}
+
+	Com_Error( code, "%s", message );
+}
+
+
+static void CM_PatchWarning( const char* message )
+{
+	if ( inPatchJob ) {
+		patchJobFailed = qtrue;
+		return;
+	}
+
+	Com_Printf( "%s", message );
+}
+
+
+static void CM_PatchDeveloperWarning( const char* message )
+{
+	// Com_DPrintf would print nothing anyway
+	if ( !com_developer || !com_developer->integer )
+		return;
+
+	CM_PatchWarning( message );
+}
 
 #define	NORMAL_EPSILON	0.0001
 #define	DIST_EPSILON	0.02
@@ -483,7 +522,8 @@ static int CM_FindPlane2( float plane[4], qbool* flipped )
 
 	// add a new plane
 	if ( numPlanes == MAX_PATCH_PLANES ) {
-		Com_Error( ERR_DROP, "MAX_PATCH_PLANES" );
+		CM_PatchError( ERR_DROP, "MAX_PATCH_PLANES" );
+		return 0;
 	}
 
 	Vector4Copy( plane, planes[numPlanes].plane );
@@ -535,7 +575,8 @@ static int CM_FindPlane( float *p1, float *p2, float *p3 ) {
 
 	// add a new plane
 	if ( numPlanes == MAX_PATCH_PLANES ) {
-		Com_Error( ERR_DROP, "MAX_PATCH_PLANES" );
+		CM_PatchError( ERR_DROP, "MAX_PATCH_PLANES" );
+		return 0;
 	}
 
 	Vector4Copy( plane, planes[numPlanes].plane );
@@ -591,8 +632,8 @@ static int CM_GridPlane( int gridPlanes[MAX_GRID_SIZE][MAX_GRID_SIZE][2], int i,
 	}
 
 	// should never happen
-	Com_Printf( "WARNING: CM_GridPlane unresolvable\n" );
-	return -1;
+	CM_PatchWarning( "WARNING: CM_GridPlane unresolvable\n" );
+	return inPatchJob ? 0 : -1;
 }
 
 /*
@@ -650,7 +691,7 @@ static int CM_EdgePlaneNum( cGrid_t *grid, int gridPlanes[MAX_GRID_SIZE][MAX_GRI
 
 	}
 
-	Com_Error( ERR_DROP, "CM_EdgePlaneNum: bad k" );
+	CM_PatchError( ERR_DROP, "CM_EdgePlaneNum: bad k" );
 	return -1;
 }
 
@@ -687,8 +728,8 @@ static void CM_SetBorderInward( facet_t *facet, cGrid_t *grid, int gridPlanes[MA
 		break;
 	default:
         numPoints = 0;
-		Com_Error( ERR_FATAL, "CM_SetBorderInward: bad parameter" );
-		break;
+		CM_PatchError( ERR_FATAL, "CM_SetBorderInward: bad parameter" );
+		return;
 	}
 
 	for ( k = 0 ; k < facet->numBorders ; k++ ) {
@@ -717,6 +758,10 @@ static void CM_SetBorderInward( facet_t *facet, cGrid_t *grid, int gridPlanes[MA
 			facet->borderPlanes[k] = -1;
 		} else {
 			// bisecting side border
+			if ( inPatchJob ) {
+				patchJobFailed = qtrue;	// for the debug block
+				return;
+			}
 			Com_DPrintf( "WARNING: CM_SetBorderInward: mixed plane sides\n" );
 			facet->borderInward[k] = qfalse;
 			if ( !debugBlock ) {
@@ -839,7 +884,7 @@ static void CM_AddFacetBevels( facet_t *facet ) {
 			}
 
 			if ( i == facet->numBorders ) {
-				if (facet->numBorders > 4 + 6 + 16) Com_Printf("ERROR: too many bevels\n");
+				if (facet->numBorders > 4 + 6 + 16) CM_PatchWarning("ERROR: too many bevels\n");
 				facet->borderPlanes[facet->numBorders] = CM_FindPlane2(plane, &flipped);
 				facet->borderNoAdjust[facet->numBorders] = qfalse;
 				facet->borderInward[facet->numBorders] = flipped;
@@ -901,12 +946,12 @@ static void CM_AddFacetBevels( facet_t *facet ) {
 				}
 
 				if ( i == facet->numBorders ) {
-					if (facet->numBorders > 4 + 6 + 16) Com_Printf("ERROR: too many bevels\n");
+					if (facet->numBorders > 4 + 6 + 16) CM_PatchWarning("ERROR: too many bevels\n");
 					facet->borderPlanes[facet->numBorders] = CM_FindPlane2(plane, &flipped);
 
 					for ( k = 0 ; k < facet->numBorders ; k++ ) {
 						if (facet->borderPlanes[facet->numBorders] ==
-							facet->borderPlanes[k]) Com_Printf("WARNING: bevel plane already used\n");
+							facet->borderPlanes[k]) CM_PatchWarning("WARNING: bevel plane already used\n");
 					}
 
 					facet->borderNoAdjust[facet->numBorders] = qfalse;
@@ -921,7 +966,7 @@ static void CM_AddFacetBevels( facet_t *facet ) {
 					}
 					ChopWindingInPlace( &w2, newplane, newplane[3], 0.1f );
 					if (!w2) {
-						Com_DPrintf("WARNING: CM_AddFacetBevels... invalid bevel\n");
+						CM_PatchDeveloperWarning("WARNING: CM_AddFacetBevels... invalid bevel\n");
 						continue;
 					}
 					else {
@@ -1034,7 +1079,8 @@ static void CM_PatchCollideFromGrid( cGrid_t *grid, patchCollide_t *pf ) {
 			}
 
 			if ( numFacets == MAX_FACETS ) {
-				Com_Error( ERR_DROP, "MAX_FACETS" );
+				CM_PatchError( ERR_DROP, "MAX_FACETS" );
+				return;
 			}
 			facet = &facets[numFacets];
 			Com_Memset( facet, 0, sizeof( *facet ) );
@@ -1080,7 +1126,8 @@ static void CM_PatchCollideFromGrid( cGrid_t *grid, patchCollide_t *pf ) {
 				}
 
 				if ( numFacets == MAX_FACETS ) {
-					Com_Error( ERR_DROP, "MAX_FACETS" );
+					CM_PatchError( ERR_DROP, "MAX_FACETS" );
+					return;
 				}
 				facet = &facets[numFacets];
 				Com_Memset( facet, 0, sizeof( *facet ) );
@@ -1107,44 +1154,34 @@ static void CM_PatchCollideFromGrid( cGrid_t *grid, patchCollide_t *pf ) {
 		}
 	}
 
-	// copy the results out
 	pf->numPlanes = numPlanes;
 	pf->numFacets = numFacets;
-	pf->facets = (facet_t*)Hunk_Alloc( numFacets * sizeof( *pf->facets ), h_high );
-	Com_Memcpy( pf->facets, facets, numFacets * sizeof( *pf->facets ) );
-	pf->planes = (patchPlane_t*)Hunk_Alloc( numPlanes * sizeof( *pf->planes ), h_high );
-	Com_Memcpy( pf->planes, planes, numPlanes * sizeof( *pf->planes ) );
+}
+
+
+static qbool CM_ValidPatchParameters( int width, int height, const vec3_t* points )
+{
+	return
+		width > 2 && height > 2 && points &&
+		(width & 1) && (height & 1) &&
+		width <= MAX_GRID_SIZE && height <= MAX_GRID_SIZE;
 }
 
 
 /*
 ===================
-CM_GeneratePatchCollide
+CM_BuildPatchCollide
 
-Creates an internal structure that will be used to perform
-collision detection with a patch mesh.
-
-Points is packed as concatenated rows.
+Fills in pf's bounds and counts but leaves the facets and planes
+in the calling thread's buffers.
+Returns the number of grid blocks.
 ===================
 */
-struct patchCollide_s* CM_GeneratePatchCollide( int width, int height, const vec3_t* points )
+static int CM_BuildPatchCollide( int width, int height, const vec3_t* points, patchCollide_t* pf )
 {
 	cGrid_t			grid;
 	int				i, j;
 
-	if ( width <= 2 || height <= 2 || !points ) {
-		Com_Error( ERR_DROP, "CM_GeneratePatchFacets: bad parameters: (%i, %i, %p)",
-			width, height, points );
-	}
-
-	if ( !(width & 1) || !(height & 1) ) {
-		Com_Error( ERR_DROP, "CM_GeneratePatchFacets: even sizes are invalid for quadratic meshes" );
-	}
-
-	if ( width > MAX_GRID_SIZE || height > MAX_GRID_SIZE ) {
-		Com_Error( ERR_DROP, "CM_GeneratePatchFacets: source is > MAX_GRID_SIZE" );
-	}
-
 	// build a grid
 	grid.width = width;
 	grid.height = height;
@@ -1170,7 +1207,6 @@ struct patchCollide_s* CM_GeneratePatchCollide( int width, int height, const vec
 	// we now have a grid of points exactly on the curve
 	// the aproximate surface defined by these points will be
 	// collided against
-	patchCollide_t* pf = (patchCollide_t*)Hunk_Alloc( sizeof( *pf ), h_high );
 	ClearBounds( pf->bounds[0], pf->bounds[1] );
 	for ( i = 0 ; i < grid.width ; i++ ) {
 		for ( j = 0 ; j < grid.height ; j++ ) {
@@ -1178,8 +1214,6 @@ struct patchCollide_s* CM_GeneratePatchCollide( int width, int height, const vec
 		}
 	}
 
-	c_totalPatchBlocks += ( grid.width - 1 ) * ( grid.height - 1 );
-
 	// generate a bsp tree for the surface
 	CM_PatchCollideFromGrid( &grid, pf );
 
@@ -1192,9 +1226,154 @@ struct patchCollide_s* CM_GeneratePatchCollide( int width, int height, const vec
 	pf->bounds[1][1] += 1;
 	pf->bounds[1][2] += 1;
 
+	return ( grid.width - 1 ) * ( grid.height - 1 );
+}
+
+
+/*
+===================
+CM_GeneratePatchCollide
+
+Creates an internal structure that will be used to perform
+collision detection with a patch mesh.
+
+Points is packed as concatenated rows.
+===================
+*/
+struct patchCollide_s* CM_GeneratePatchCollide( int width, int height, const vec3_t* points )
+{
+	if ( width <= 2 || height <= 2 || !points ) {
+		Com_Error( ERR_DROP, "CM_GeneratePatchFacets: bad parameters: (%i, %i, %p)",
+			width, height, points );
+	}
+
+	if ( !(width & 1) || !(height & 1) ) {
+		Com_Error( ERR_DROP, "CM_GeneratePatchFacets: even sizes are invalid for quadratic meshes" );
+	}
+
+	if ( width > MAX_GRID_SIZE || height > MAX_GRID_SIZE ) {
+		Com_Error( ERR_DROP, "CM_GeneratePatchFacets: source is > MAX_GRID_SIZE" );
+	}
+
+	planes = mainPlanes;
+	facets = mainFacets;
+
+	patchCollide_t* pf = (patchCollide_t*)Hunk_Alloc( sizeof( *pf ), h_high );
+	c_totalPatchBlocks += CM_BuildPatchCollide( width, height, points, pf );
+
+	// copy the results out
+	pf->facets = (facet_t*)Hunk_Alloc( numFacets * sizeof( *pf->facets ), h_high );
+	Com_Memcpy( pf->facets, facets, numFacets * sizeof( *pf->facets ) );
+	pf->planes = (patchPlane_t*)Hunk_Alloc( numPlanes * sizeof( *pf->planes ), h_high );
+	Com_Memcpy( pf->planes, planes, numPlanes * sizeof( *pf->planes ) );
+
 	return pf;
 }
 
+
+typedef struct {
+	const cPatchPoints_t*	source;
+	patchCollide_t	pc;			// the facets and planes share one malloc'd block
+	int				blocks;
+	qbool			failed;		// generate it again on the main thread
+} patchJob_t;
+
+// kept for the thread's whole life
+static THREAD_LOCAL patchPlane_t*	threadPlanes;
+static THREAD_LOCAL facet_t*		threadFacets;
+
+
+static void CM_PatchCollideJob( void* data, int index )
+{
+	patchJob_t* const job = (patchJob_t*)data + index;
+	const cPatchPoints_t* const source = job->source;
+
+	job->failed = qtrue;
+	if ( !CM_ValidPatchParameters( source->width, source->height, source->points ) )
+		return;
+
+	if ( !threadPlanes ) {
+		threadPlanes = (patchPlane_t*)malloc( MAX_PATCH_PLANES * sizeof(patchPlane_t) );
+		if ( !threadPlanes )
+			return;
+	}
+	if ( !threadFacets ) {
+		threadFacets = (facet_t*)malloc( MAX_PATCH_PLANES * sizeof(facet_t) );
+		if ( !threadFacets )
+			return;
+	}
+
+	planes = threadPlanes;
+	facets = threadFacets;
+	inPatchJob = qtrue;
+	patchJobFailed = qfalse;
+	job->blocks = CM_BuildPatchCollide( source->width, source->height, source->points, &job->pc );
+	inPatchJob = qfalse;
+	if ( patchJobFailed )
+		return;
+
+	const int facetBytes = numFacets * sizeof(facet_t);
+	const int planeBytes = numPlanes * sizeof(patchPlane_t);
+	byte* const results = (byte*)malloc( facetBytes + planeBytes + 1 );
+	if ( !results )
+		return;
+
+	job->pc.facets = (facet_t*)results;
+	Com_Memcpy( job->pc.facets, facets, facetBytes );
+	job->pc.planes = (patchPlane_t*)(results + facetBytes);
+	Com_Memcpy( job->pc.planes, planes, planeBytes );
+	job->failed = qfalse;
+}
+
+
+/*
+===================
+CM_GeneratePatchCollides
+
+Same results as calling CM_GeneratePatchCollide for each patch,
+but the patches are generated on threadCount threads.
+A patch's planes only depend on its own points, so their order doesn't change.
+Patches that ran into errors or warnings are generated again on the main thread
+in their original order so that the messages stay the same.
+===================
+*/
+void CM_GeneratePatchCollides( struct patchCollide_s** results, const cPatchPoints_t* patches, int count, int threadCount )
+{
+	patchJob_t* const jobs = (patchJob_t*)Z_Malloc( count * sizeof(patchJob_t) );
+	for ( int i = 0; i < count; ++i ) {
+		jobs[i].source = &patches[i];
+	}
+
+	Sys_RunParallel( CM_PatchCollideJob, jobs, count, threadCount );
+
+	for ( int i = 0; i < count; ++i ) {
+		patchJob_t* const job = &jobs[i];
+		if ( job->failed ) {
+			results[i] = NULL;
+			continue;
+		}
+
+		patchCollide_t* const pf = (patchCollide_t*)Hunk_Alloc( sizeof( *pf ), h_high );
+		*pf = job->pc;
+		pf->facets = (facet_t*)Hunk_Alloc( pf->numFacets * sizeof( *pf->facets ), h_high );
+		Com_Memcpy( pf->facets, job->pc.facets, pf->numFacets * sizeof( *pf->facets ) );
+		pf->planes = (patchPlane_t*)Hunk_Alloc( pf->numPlanes * sizeof( *pf->planes ), h_high );
+		Com_Memcpy( pf->planes, job->pc.planes, pf->numPlanes * sizeof( *pf->planes ) );
+		free( job->pc.facets );
+		c_totalPatchBlocks += job->blocks;
+		results[i] = pf;
+	}
+
+	Z_Free( jobs );
+
+	// the serial path can raise errors, so nothing is left to free by now
+	for ( int i = 0; i < count; ++i ) {
+		if ( !results[i] ) {
+			results[i] = CM_GeneratePatchCollide( patches[i].width, patches[i].height, patches[i].points );
+		}
+	}
+}
+
 /*
 ================================================================================
 
@@ -1219,9 +1398,6 @@ static void CM_TracePointThroughPatchCollide( traceWork_t *tw, const struct patc
 	int			i, j, k;
 	float		offset;
 	float		d1, d2;
-#ifndef BSPC
-	static cvar_t *cv;
-#endif //BSPC
 
 #ifndef BSPC
 	if ( !cm_playerCurveClip->integer || !tw->isPoint ) {
@@ -1279,12 +1455,9 @@ static void CM_TracePointThroughPatchCollide( traceWork_t *tw, const struct patc
 		if ( j == facet->numBorders ) {
 			// we hit this facet
 #ifndef BSPC
-			if (!cv) {
-				cv = Cvar_Get( "r_debugSurfaceUpdate", "1", 0 );
-			}
-			if (cv->integer) {
-				debugPatchCollide = pc;
-				debugFacet = facet;
+			if (cm_debugSurfaceUpdate->integer) {
+				tw->query->debugPatchCollide = pc;
+				tw->query->debugFacet = facet - pc->facets;
 			}
 #endif //BSPC
 			lplanes = &pc->planes[facet->surfacePlane];
@@ -1363,9 +1536,6 @@ void CM_TraceThroughPatchCollide( traceWork_t *tw, const struct patchCollide_s *
 	facet_t	*facet;
 	float plane[4] = {0, 0, 0, 0}, bestplane[4] = {0, 0, 0, 0};
 	vec3_t startp, endp;
-#ifndef BSPC
-	static cvar_t *cv;
-#endif //BSPC
 
 	if (!CM_BoundsIntersect( tw->bounds[0], tw->bounds[1], pc->bounds[0], pc->bounds[1] ))
 		return;
@@ -1464,12 +1634,9 @@ void CM_TraceThroughPatchCollide( traceWork_t *tw, const struct patchCollide_s *
 					enterFrac = 0;
 				}
 #ifndef BSPC
-				if (!cv) {
-					cv = Cvar_Get( "r_debugSurfaceUpdate", "1", 0 );
-				}
-				if (cv && cv->integer) {
-					debugPatchCollide = pc;
-					debugFacet = facet;
+				if (cm_debugSurfaceUpdate->integer) {
+					tw->query->debugPatchCollide = pc;
+					tw->query->debugFacet = facet - pc->facets;
 				}
 #endif //BSPC
 
@@ -1627,7 +1794,9 @@ void CM_DrawDebugSurface( void (*drawPoly)(int color, int numPoints, const float
 	}
 #endif
 
-	if ( !debugPatchCollide ) {
+	// only the drawing thread's own traces are shown
+	const cmQueryContext_t* const query = CM_GetQueryContext();
+	if ( !query->debugPatchCollide ) {
 		return;
 	}
 
@@ -1636,7 +1805,7 @@ void CM_DrawDebugSurface( void (*drawPoly)(int color, int numPoints, const float
 		cv = Cvar_Get( "cm_debugSize", "2", 0 );
 	}
 #endif
-	pc = debugPatchCollide;
+	pc = query->debugPatchCollide;
 
 	for ( i = 0, facet = pc->facets ; i < pc->numFacets ; i++, facet++ ) {
 
@@ -1705,7 +1874,7 @@ void CM_DrawDebugSurface( void (*drawPoly)(int color, int numPoints, const float
 				ChopWindingInPlace( &w, plane, plane[3], 0.1f );
 			}
 			if ( w ) {
-				if ( facet == debugFacet ) {
+				if ( i == query->debugFacet ) {
 					drawPoly( 4, w->numpoints, w->p[0] );
 					//Com_Printf("blue facet has %d border planes\n", facet->numBorders);
 				} else {
@@ -26,12 +26,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "cm_local.h"
 
 
-// counters are only bumped when running single threaded,
-// because they are an awful coherence problem
-int	c_active_windings;
+// windings are created by patch collision generation on worker threads,
+// so the counters are atomic and the peak is only a rough estimate
+volatile int	c_active_windings;
 int	c_peak_windings;
-int	c_winding_allocs;
-int	c_winding_points;
+volatile int	c_winding_allocs;
+volatile int	c_winding_points;
 
 void pw(winding_t *w)
 {
@@ -43,14 +43,16 @@ void pw(winding_t *w)
 
 static winding_t* AllocWinding( int points )
 {
-	c_winding_allocs++;
-	c_winding_points += points;
-	c_active_windings++;
-	if (c_active_windings > c_peak_windings)
-		c_peak_windings = c_active_windings;
+	Sys_AtomicAdd(&c_winding_allocs, 1);
+	Sys_AtomicAdd(&c_winding_points, points);
+	const int active = Sys_AtomicAdd(&c_active_windings, 1) + 1;
+	if (active > c_peak_windings)
+		c_peak_windings = active;
 
 	int s = sizeof(vec_t)*3*points + sizeof(int);
-	winding_t* w = (winding_t*)Z_Malloc(s);
+	winding_t* w = (winding_t*)malloc(s);
+	if (!w)
+		Com_Error (ERR_FATAL, "AllocWinding: failed to allocate %d bytes", s);
 	Com_Memset(w, 0, s);
 	return w;
 }
@@ -61,8 +63,8 @@ void FreeWinding (winding_t *w)
 		Com_Error (ERR_FATAL, "FreeWinding: freed a freed winding");
 	*(unsigned *)w = 0xdeaddead;
 
-	c_active_windings--;
-	Z_Free (w);
+	Sys_AtomicAdd(&c_active_windings, -1);
+	free (w);
 }
 
 
@@ -169,8 +171,10 @@ winding_t *BaseWindingForPlane (vec3_t normal, vec_t dist)
 			max = v;
 		}
 	}
-	if (x==-1)
-		Com_Error (ERR_DROP, "BaseWindingForPlane: no axis found");
+	if (x==-1) {
+		CM_PatchError (ERR_DROP, "BaseWindingForPlane: no axis found");
+		return NULL;
+	}
 		
 	VectorCopy (vec3_origin, vup);	
 	switch (x)
@@ -262,7 +266,7 @@ void	ClipWindingEpsilon (winding_t *in, vec3_t normal, vec_t dist,
 	vec_t	dists[MAX_POINTS_ON_WINDING+4];
 	int		sides[MAX_POINTS_ON_WINDING+4];
 	int		counts[3];
-	static	vec_t	dot;		// VC 4.2 optimizer bug if not static
+	vec_t	dot;
 	int		i, j;
 	vec_t	*p1, *p2;
 	vec3_t	mid;
@@ -356,10 +360,17 @@ void	ClipWindingEpsilon (winding_t *in, vec3_t normal, vec_t dist,
 		b->numpoints++;
 	}
 	
+	const char* error = NULL;
 	if (f->numpoints > maxpts || b->numpoints > maxpts)
-		Com_Error (ERR_DROP, "ClipWinding: points exceeded estimate");
-	if (f->numpoints > MAX_POINTS_ON_WINDING || b->numpoints > MAX_POINTS_ON_WINDING)
-		Com_Error (ERR_DROP, "ClipWinding: MAX_POINTS_ON_WINDING");
+		error = "ClipWinding: points exceeded estimate";
+	else if (f->numpoints > MAX_POINTS_ON_WINDING || b->numpoints > MAX_POINTS_ON_WINDING)
+		error = "ClipWinding: MAX_POINTS_ON_WINDING";
+	if (error) {
+		CM_PatchError (ERR_DROP, error);
+		FreeWinding (f);
+		FreeWinding (b);
+		*front = *back = NULL;
+	}
 }
 
 
@@ -374,7 +385,7 @@ void ChopWindingInPlace (winding_t **inout, vec3_t normal, vec_t dist, vec_t eps
 	vec_t	dists[MAX_POINTS_ON_WINDING+4];
 	int		sides[MAX_POINTS_ON_WINDING+4];
 	int		counts[3];
-	static	vec_t	dot;		// VC 4.2 optimizer bug if not static
+	vec_t	dot;
 	int		i, j;
 	vec_t	*p1, *p2;
 	vec3_t	mid;
@@ -455,10 +466,16 @@ void ChopWindingInPlace (winding_t **inout, vec3_t normal, vec_t dist, vec_t eps
 		f->numpoints++;
 	}
 	
+	const char* error = NULL;
 	if (f->numpoints > maxpts)
-		Com_Error (ERR_DROP, "ClipWinding: points exceeded estimate");
-	if (f->numpoints > MAX_POINTS_ON_WINDING)
-		Com_Error (ERR_DROP, "ClipWinding: MAX_POINTS_ON_WINDING");
+		error = "ClipWinding: points exceeded estimate";
+	else if (f->numpoints > MAX_POINTS_ON_WINDING)
+		error = "ClipWinding: MAX_POINTS_ON_WINDING";
+	if (error) {
+		CM_PatchError (ERR_DROP, error);
+		FreeWinding (f);
+		f = NULL;
+	}
 
 	FreeWinding (in);
 	*inout = f;
@@ -45,6 +45,18 @@ void		CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t
 						  clipHandle_t model, int brushmask,
 						  const vec3_t origin, const vec3_t angles, int capsule );
 
+typedef struct {
+	vec3_t		start;
+	vec3_t		end;
+	vec3_t		mins;
+	vec3_t		maxs;
+	int			brushmask;
+	int			capsule;
+} cmTraceQuery_t;
+
+// same results as calling CM_BoxTrace for each query
+void		CM_BoxTraceBatch( trace_t *results, const cmTraceQuery_t *queries, int count, clipHandle_t model );
+
 const byte* CM_ClusterPVS( int cluster );
 
 int			CM_PointLeafnum( const vec3_t p );
@@ -71,5 +83,11 @@ int			CM_LerpTag( orientation_t *tag,  clipHandle_t model, int startFrame, int e
 int	CM_MarkFragments( int numPoints, const vec3_t *points, const vec3_t projection,
 				   int maxPoints, vec3_t pointBuffer, int maxFragments, markFragment_t *fragmentBuffer );
 
+// cm_trace.c
+void CM_TakeTraceStats( int* traces, int* brushTraces, int* patchTraces, int* pointContents );	// zeroes them
+void CM_TraceTest_f();
+void CM_TraceRecord_f();
+void CM_TraceBenchmark_f();
+
 // cm_patch.c
 void CM_DrawDebugSurface( void (*drawPoly)(int color, int numPoints, const float* points) );
@@ -30,25 +30,24 @@ CM_PointLeafnum_r
 */
 int CM_PointLeafnum_r( const vec3_t p, int num ) {
 	float		d;
-	cNode_t		*node;
-	cplane_t	*plane;
+	const cNode_t	*node;
+	const cplane_t	*plane;
 
 	while (num >= 0)
 	{
 		node = cm.nodes + num;
-		plane = node->plane;
-		
-		if (plane->type < 3)
-			d = p[plane->type] - plane->dist;
-		else
-			d = DotProduct (plane->normal, p) - plane->dist;
+		plane = &node->plane;
+
+		// an axial normal has a single 1 and the products with its 0s are exact,
+		// so this gives the same result as p[plane->type] - plane->dist without a branch
+		d = DotProduct (plane->normal, p) - plane->dist;
 		if (d < 0)
 			num = node->children[1];
 		else
 			num = node->children[0];
 	}
 
-	c_pointcontents++;		// optimize counter
+	CM_GetQueryContext()->pointContents++;		// optimize counter
 
 	return -1 - num;
 }
@@ -101,10 +100,10 @@ void CM_StoreBrushes( leafList_t *ll, int nodenum ) {
 	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
 		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
+		if ( ll->query->brushChecks[brushnum] == ll->query->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		ll->query->brushChecks[brushnum] = ll->query->checkcount;
 		for ( i = 0 ; i < 3 ; i++ ) {
 			if ( b->bounds[0][i] >= ll->bounds[1][i] || b->bounds[1][i] <= ll->bounds[0][i] ) {
 				break;
@@ -149,7 +148,7 @@ void CM_BoxLeafnums_r( leafList_t *ll, int nodenum ) {
 		}
 
 		node = &cm.nodes[nodenum];
-		plane = node->plane;
+		plane = &node->plane;
 		s = BoxOnPlaneSide( ll->bounds[0], ll->bounds[1], plane );
 		if (s == 1) {
 			nodenum = node->children[0];
@@ -172,8 +171,6 @@ CM_BoxLeafnums
 int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsize, int *lastLeaf) {
 	leafList_t	ll;
 
-	cm.checkcount++;
-
 	VectorCopy( mins, ll.bounds[0] );
 	VectorCopy( maxs, ll.bounds[1] );
 	ll.count = 0;
@@ -182,6 +179,7 @@ int	CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsiz
 	ll.storeLeafs = CM_StoreLeafs;
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
+	ll.query = NULL;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
@@ -197,8 +195,6 @@ CM_BoxBrushes
 int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int listsize ) {
 	leafList_t	ll;
 
-	cm.checkcount++;
-
 	VectorCopy( mins, ll.bounds[0] );
 	VectorCopy( maxs, ll.bounds[1] );
 	ll.count = 0;
@@ -207,6 +203,8 @@ int CM_BoxBrushes( const vec3_t mins, const vec3_t maxs, cbrush_t **list, int li
 	ll.storeLeafs = CM_StoreBrushes;
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
+	ll.query = CM_GetQueryContext();
+	ll.query->checkcount++;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
@@ -20,6 +20,9 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 ===========================================================================
 */
 #include "cm_local.h"
+#if CM_SIMD_TRACES
+#include <emmintrin.h>
+#endif
 
 // always use bbox vs. bbox collision and never capsule vs. bbox or vice versa
 //#define ALWAYS_BBOX_VS_BBOX
@@ -148,6 +151,92 @@ float SquareRootFloat(float number) {
 }
 
 
+/*
+===============================================================================
+
+QUERY CONTEXTS
+
+===============================================================================
+*/
+
+// contexts are never freed, so a thread keeps the same one for its whole life
+// the checkcount only ever goes up, so stale marks from a previous map are harmless
+#define	MAX_QUERY_CONTEXTS	64
+
+static cmQueryContext_t cm_queryContexts[MAX_QUERY_CONTEXTS];
+static volatile int cm_numQueryContexts;
+static THREAD_LOCAL cmQueryContext_t* cm_threadQueryContext;
+
+
+static int* CM_GrowChecks( int* checks, int oldCount, int newCount )
+{
+	checks = (int*)realloc( checks, newCount * sizeof(int) );
+	if ( !checks )
+		Com_Error( ERR_FATAL, "CM_GrowChecks: failed to allocate %d entries\n", newCount );
+	memset( checks + oldCount, 0, (newCount - oldCount) * sizeof(int) );
+
+	return checks;
+}
+
+
+cmQueryContext_t* CM_GetQueryContext()
+{
+	cmQueryContext_t* query = cm_threadQueryContext;
+	if ( !query ) {
+		const int index = Sys_AtomicAdd( &cm_numQueryContexts, 1 );
+		if ( index >= MAX_QUERY_CONTEXTS )
+			Com_Error( ERR_FATAL, "CM_GetQueryContext: too many threads\n" );
+		query = &cm_queryContexts[index];
+		cm_threadQueryContext = query;
+	}
+
+	// +1 for the temporary box model's brush
+	if ( query->maxBrushes < cm.numBrushes + 1 ) {
+		query->brushChecks = CM_GrowChecks( query->brushChecks, query->maxBrushes, cm.numBrushes + 1 );
+		query->maxBrushes = cm.numBrushes + 1;
+	}
+	if ( query->maxPatches < cm.numSurfaces ) {
+		query->patchChecks = CM_GrowChecks( query->patchChecks, query->maxPatches, cm.numSurfaces );
+		query->maxPatches = cm.numSurfaces;
+	}
+
+	return query;
+}
+
+
+void CM_TakeTraceStats( int* traces, int* brushTraces, int* patchTraces, int* pointContents )
+{
+	*traces = 0;
+	*brushTraces = 0;
+	*patchTraces = 0;
+	*pointContents = 0;
+
+	const int count = min( (int)cm_numQueryContexts, MAX_QUERY_CONTEXTS );
+	for ( int i = 0; i < count; ++i ) {
+		cmQueryContext_t* const query = &cm_queryContexts[i];
+		*traces += query->traces;
+		*brushTraces += query->brushTraces;
+		*patchTraces += query->patchTraces;
+		*pointContents += query->pointContents;
+		query->traces = 0;
+		query->brushTraces = 0;
+		query->patchTraces = 0;
+		query->pointContents = 0;
+	}
+}
+
+
+// the patches the contexts point to are gone after a map change
+void CM_ClearQueryDebugSurfaces()
+{
+	const int count = min( (int)cm_numQueryContexts, MAX_QUERY_CONTEXTS );
+	for ( int i = 0; i < count; ++i ) {
+		cm_queryContexts[i].debugPatchCollide = NULL;
+		cm_queryContexts[i].debugFacet = -1;
+	}
+}
+
+
 /*
 ===============================================================================
 
@@ -247,10 +336,10 @@ static void CM_TestInLeaf( traceWork_t* tw, const cLeaf_t* leaf )
 	for (k=0 ; k<leaf->numLeafBrushes ; k++) {
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
 		b = &cm.brushes[brushnum];
-		if (b->checkcount == cm.checkcount) {
+		if (tw->query->brushChecks[brushnum] == tw->query->checkcount) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		tw->query->brushChecks[brushnum] = tw->query->checkcount;
 
 		if ( !(b->contents & tw->contents)) {
 			continue;
@@ -269,14 +358,15 @@ static void CM_TestInLeaf( traceWork_t* tw, const cLeaf_t* leaf )
 	if ( !cm_noCurves->integer ) {
 #endif //BSPC
 		for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-			patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+			const int patchnum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+			patch = cm.surfaces[ patchnum ];
 			if ( !patch ) {
 				continue;
 			}
-			if ( patch->checkcount == cm.checkcount ) {
+			if ( tw->query->patchChecks[patchnum] == tw->query->checkcount ) {
 				continue;	// already checked this brush in another leaf
 			}
-			patch->checkcount = cm.checkcount;
+			tw->query->patchChecks[patchnum] = tw->query->checkcount;
 
 			if ( !(patch->contents & tw->contents)) {
 				continue;
@@ -424,14 +514,10 @@ void CM_PositionTest( traceWork_t *tw ) {
 	ll.storeLeafs = CM_StoreLeafs;
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
-
-	cm.checkcount++;
+	ll.query = NULL;
 
 	CM_BoxLeafnums_r( &ll, 0 );
 
-
-	cm.checkcount++;
-
 	// test the contents of the leafs
 	for (i=0 ; i < ll.count ; i++) {
 		CM_TestInLeaf( tw, &cm.leafs[leafs[i]] );
@@ -459,7 +545,7 @@ CM_TraceThroughPatch
 void CM_TraceThroughPatch( traceWork_t *tw, cPatch_t *patch ) {
 	float		oldFrac;
 
-	c_patch_traces++;
+	tw->query->patchTraces++;
 
 	oldFrac = tw->trace.fraction;
 
@@ -471,6 +557,73 @@ void CM_TraceThroughPatch( traceWork_t *tw, cPatch_t *patch ) {
 	}
 }
 
+#if CM_SIMD_TRACES
+
+#define MAX_SIMD_BRUSH_SIDES	128
+
+/*
+================
+CM_BrushSideDistances
+
+Computes the start and end distances to all planes of the brush, 4 sides at a time,
+with the same operations as the scalar code so the results match exactly.
+Returns qfalse if the trace is completely in front of a face.
+================
+*/
+static qbool CM_BrushSideDistances( const traceWork_t* tw, const cbrush_t* brush, float* d1s, float* d2s ) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 epsilon = _mm_set1_ps( SURFACE_CLIP_EPSILON );
+	const __m128 minX = _mm_set1_ps( tw->size[0][0] );
+	const __m128 minY = _mm_set1_ps( tw->size[0][1] );
+	const __m128 minZ = _mm_set1_ps( tw->size[0][2] );
+	const __m128 maxX = _mm_set1_ps( tw->size[1][0] );
+	const __m128 maxY = _mm_set1_ps( tw->size[1][1] );
+	const __m128 maxZ = _mm_set1_ps( tw->size[1][2] );
+	const __m128 startX = _mm_set1_ps( tw->start[0] );
+	const __m128 startY = _mm_set1_ps( tw->start[1] );
+	const __m128 startZ = _mm_set1_ps( tw->start[2] );
+	const __m128 endX = _mm_set1_ps( tw->end[0] );
+	const __m128 endY = _mm_set1_ps( tw->end[1] );
+	const __m128 endZ = _mm_set1_ps( tw->end[2] );
+
+	const float* group = brush->sidePlanes;
+	for ( int i = 0; i < brush->numsides; i += 4, group += 16 ) {
+		const __m128 nx = _mm_loadu_ps( group + 0 );
+		const __m128 ny = _mm_loadu_ps( group + 4 );
+		const __m128 nz = _mm_loadu_ps( group + 8 );
+		const __m128 pd = _mm_loadu_ps( group + 12 );
+
+		// tw->offsets[ plane->signbits ] takes the maxs on axes where the normal is negative
+		const __m128 negX = _mm_cmplt_ps( nx, zero );
+		const __m128 negY = _mm_cmplt_ps( ny, zero );
+		const __m128 negZ = _mm_cmplt_ps( nz, zero );
+		const __m128 ox = _mm_or_ps( _mm_and_ps( negX, maxX ), _mm_andnot_ps( negX, minX ) );
+		const __m128 oy = _mm_or_ps( _mm_and_ps( negY, maxY ), _mm_andnot_ps( negY, minY ) );
+		const __m128 oz = _mm_or_ps( _mm_and_ps( negZ, maxZ ), _mm_andnot_ps( negZ, minZ ) );
+
+		const __m128 dist = _mm_sub_ps( pd,
+			_mm_add_ps( _mm_add_ps( _mm_mul_ps( ox, nx ), _mm_mul_ps( oy, ny ) ), _mm_mul_ps( oz, nz ) ) );
+		const __m128 d1 = _mm_sub_ps(
+			_mm_add_ps( _mm_add_ps( _mm_mul_ps( startX, nx ), _mm_mul_ps( startY, ny ) ), _mm_mul_ps( startZ, nz ) ), dist );
+		const __m128 d2 = _mm_sub_ps(
+			_mm_add_ps( _mm_add_ps( _mm_mul_ps( endX, nx ), _mm_mul_ps( endY, ny ) ), _mm_mul_ps( endZ, nz ) ), dist );
+		_mm_storeu_ps( d1s + i, d1 );
+		_mm_storeu_ps( d2s + i, d2 );
+
+		// the scalar loop returns at the first such side without touching the trace,
+		// so culling on any of them gives the same result
+		const __m128 front = _mm_and_ps( _mm_cmpgt_ps( d1, zero ),
+			_mm_or_ps( _mm_cmpge_ps( d2, epsilon ), _mm_cmpge_ps( d2, d1 ) ) );
+		if ( _mm_movemask_ps( front ) ) {
+			return qfalse;
+		}
+	}
+
+	return qtrue;
+}
+
+#endif
+
 /*
 ================
 CM_TraceThroughBrush
@@ -497,7 +650,7 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 		return;
 	}
 
-	c_brush_traces++;
+	tw->query->brushTraces++;
 
 	getout = qfalse;
 	startout = qfalse;
@@ -572,6 +725,20 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 			}
 		}
 	} else {
+		const float* d1s = NULL;
+		const float* d2s = NULL;
+#if CM_SIMD_TRACES
+		float simdD1s[MAX_SIMD_BRUSH_SIDES];
+		float simdD2s[MAX_SIMD_BRUSH_SIDES];
+		if ( tw->batched && brush->sidePlanes && brush->numsides <= MAX_SIMD_BRUSH_SIDES ) {
+			if ( !CM_BrushSideDistances( tw, brush, simdD1s, simdD2s ) ) {
+				return;
+			}
+			d1s = simdD1s;
+			d2s = simdD2s;
+		}
+#endif
+
 		//
 		// compare the trace against all planes of the brush
 		// find the latest time the trace crosses a plane towards the interior
@@ -581,11 +748,16 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 			side = brush->sides + i;
 			plane = side->plane;
 
-			// adjust the plane distance apropriately for mins/maxs
-			dist = plane->dist - DotProduct( tw->offsets[ plane->signbits ], plane->normal );
+			if ( d1s ) {
+				d1 = d1s[i];
+				d2 = d2s[i];
+			} else {
+				// adjust the plane distance apropriately for mins/maxs
+				dist = plane->dist - DotProduct( tw->offsets[ plane->signbits ], plane->normal );
 
-			d1 = DotProduct( tw->start, plane->normal ) - dist;
-			d2 = DotProduct( tw->end, plane->normal ) - dist;
+				d1 = DotProduct( tw->start, plane->normal ) - dist;
+				d2 = DotProduct( tw->end, plane->normal ) - dist;
+			}
 
 			if (d2 > 0) {
 				getout = qtrue;	// endpoint is not in solid
@@ -667,10 +839,10 @@ static void CM_TraceThroughLeaf( traceWork_t* tw, const cLeaf_t* leaf )
 		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
 
 		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
+		if ( tw->query->brushChecks[brushnum] == tw->query->checkcount ) {
 			continue;	// already checked this brush in another leaf
 		}
-		b->checkcount = cm.checkcount;
+		tw->query->brushChecks[brushnum] = tw->query->checkcount;
 
 		if ( !(b->contents & tw->contents) ) {
 			continue;
@@ -692,14 +864,15 @@ static void CM_TraceThroughLeaf( traceWork_t* tw, const cLeaf_t* leaf )
 	if ( !cm_noCurves->integer ) {
 #endif
 		for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-			patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+			const int patchnum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+			patch = cm.surfaces[ patchnum ];
 			if ( !patch ) {
 				continue;
 			}
-			if ( patch->checkcount == cm.checkcount ) {
+			if ( tw->query->patchChecks[patchnum] == tw->query->checkcount ) {
 				continue;	// already checked this patch in another leaf
 			}
-			patch->checkcount = cm.checkcount;
+			tw->query->patchChecks[patchnum] = tw->query->checkcount;
 
 			if ( !(patch->contents & tw->contents) ) {
 				continue;
@@ -1018,8 +1191,8 @@ a smaller intercept fraction.
 ==================
 */
 void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f, vec3_t p1, vec3_t p2) {
-	cNode_t		*node;
-	cplane_t	*plane;
+	const cNode_t	*node;
+	const cplane_t	*plane;
 	float		t1, t2, offset;
 	float		frac, frac2;
 	float		idist;
@@ -1042,16 +1215,16 @@ void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f, vec3_t
 	// and the offset for the size of the box
 	//
 	node = cm.nodes + num;
-	plane = node->plane;
+	plane = &node->plane;
+
+	// exact for axial planes too, see CM_PointLeafnum_r
+	t1 = DotProduct (plane->normal, p1) - plane->dist;
+	t2 = DotProduct (plane->normal, p2) - plane->dist;
 
 	// adjust the plane distance apropriately for mins/maxs
 	if ( plane->type < 3 ) {
-		t1 = p1[plane->type] - plane->dist;
-		t2 = p2[plane->type] - plane->dist;
 		offset = tw->extents[plane->type];
 	} else {
-		t1 = DotProduct (plane->normal, p1) - plane->dist;
-		t2 = DotProduct (plane->normal, p2) - plane->dist;
 		if ( tw->isPoint ) {
 			offset = 0;
 		} else {
@@ -1136,28 +1309,63 @@ void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f, vec3_t
 //======================================================================
 
 
+// world traces can be recorded to a file and replayed by /tracebench
+#define	MAX_RECORDED_TRACES	(1 << 18)
+#define	TRACE_FILE_VERSION	1
+
+typedef struct {
+	char		magic[4];	// "CMTR"
+	int			version;
+	char		mapName[MAX_QPATH];
+	int			count;
+} traceFileHeader_t;
+
+static struct {
+	cmTraceQuery_t*	queries;	// NULL when not recording
+	volatile int	count;
+	char			fileName[MAX_QPATH];
+	char			mapName[MAX_QPATH];
+} cm_traceRecord;
+
+
+static void CM_RecordTrace( const vec3_t start, const vec3_t end, const vec3_t mins, const vec3_t maxs, int brushmask, int capsule )
+{
+	const int index = Sys_AtomicAdd( &cm_traceRecord.count, 1 );
+	if ( index >= MAX_RECORDED_TRACES )
+		return;
+
+	cmTraceQuery_t* const q = &cm_traceRecord.queries[index];
+	VectorCopy( start, q->start );
+	VectorCopy( end, q->end );
+	VectorCopy( mins ? mins : vec3_origin, q->mins );
+	VectorCopy( maxs ? maxs : vec3_origin, q->maxs );
+	q->brushmask = brushmask;
+	q->capsule = capsule;
+}
+
 /*
 ==================
 CM_Trace
 ==================
 */
 void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, const vec3_t mins, const vec3_t maxs,
-						clipHandle_t model, const vec3_t origin, int brushmask, int capsule, sphere_t *sphere ) {
+						clipHandle_t model, const vec3_t origin, int brushmask, int capsule, sphere_t *sphere, qbool batched ) {
 	int			i;
 	traceWork_t	tw;
 	vec3_t		offset;
 
 	const cmodel_t* cmod = CM_ClipHandleToModel( model );
 
-	cm.checkcount++;		// for multi-check avoidance
-
-	c_traces++;				// for statistics, may be zeroed
-
 	// fill in a default trace
 	Com_Memset( &tw, 0, sizeof(tw) );
 	tw.trace.fraction = 1;	// assume it goes the entire distance until shown otherwise
 	VectorCopy(origin, tw.modelOrigin);
 
+	tw.query = CM_GetQueryContext();
+	tw.query->checkcount++;	// for multi-check avoidance
+	tw.query->traces++;		// for statistics, may be zeroed
+	tw.batched = batched;
+
 	if (!cm.numNodes) {
 		*results = tw.trace;
 		return;	// map not loaded, shouldn't happen
@@ -1360,7 +1568,26 @@ CM_BoxTrace
 void CM_BoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
 						  const vec3_t mins, const vec3_t maxs,
 						  clipHandle_t model, int brushmask, int capsule ) {
-	CM_Trace( results, start, end, mins, maxs, model, vec3_origin, brushmask, capsule, NULL );
+	if ( cm_traceRecord.queries && model == 0 ) {
+		CM_RecordTrace( start, end, mins, maxs, brushmask, capsule );
+	}
+
+	CM_Trace( results, start, end, mins, maxs, model, vec3_origin, brushmask, capsule, NULL, qfalse );
+}
+
+/*
+==================
+CM_BoxTraceBatch
+
+Same results as calling CM_BoxTrace for each query,
+but the brush tests are done with SIMD when available
+==================
+*/
+void CM_BoxTraceBatch( trace_t *results, const cmTraceQuery_t *queries, int count, clipHandle_t model ) {
+	for ( int i = 0; i < count; ++i ) {
+		const cmTraceQuery_t* const q = &queries[i];
+		CM_Trace( &results[i], q->start, q->end, q->mins, q->maxs, model, vec3_origin, q->brushmask, q->capsule, NULL, qtrue );
+	}
 }
 
 /*
@@ -1445,7 +1672,7 @@ void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t
 	}
 
 	// sweep the box through the model
-	CM_Trace( &trace, start_l, end_l, symetricSize[0], symetricSize[1], model, origin, brushmask, capsule, &sphere );
+	CM_Trace( &trace, start_l, end_l, symetricSize[0], symetricSize[1], model, origin, brushmask, capsule, &sphere, qfalse );
 
 	// if the bmodel was rotated and there was a collision
 	if ( rotated && trace.fraction != 1.0 ) {
@@ -1462,3 +1689,295 @@ void CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t
 
 	*results = trace;
 }
+
+
+/*
+===============================================================================
+
+MULTITHREADED TRACE TEST
+
+===============================================================================
+*/
+
+typedef struct {
+	const cmTraceQuery_t*	queries;
+	trace_t*				results;
+} traceTestJob_t;
+
+
+static float CM_TraceTestRandom( unsigned int* seed, float min, float max )
+{
+	*seed = *seed * 1664525 + 1013904223;
+
+	return min + (max - min) * (float)(*seed >> 8) / (float)(1 << 24);
+}
+
+
+static void CM_TraceTestJob( void* data, int index )
+{
+	const traceTestJob_t* const job = (const traceTestJob_t*)data;
+	const cmTraceQuery_t* const q = &job->queries[index];
+
+	CM_BoxTrace( &job->results[index], q->start, q->end, q->mins, q->maxs, 0, q->brushmask, q->capsule );
+}
+
+
+static qbool CM_TracesEqual( const trace_t* a, const trace_t* b )
+{
+	return
+		a->allsolid == b->allsolid &&
+		a->startsolid == b->startsolid &&
+		a->fraction == b->fraction &&
+		VectorCompare( a->endpos, b->endpos ) &&
+		VectorCompare( a->plane.normal, b->plane.normal ) &&
+		a->plane.dist == b->plane.dist &&
+		a->surfaceFlags == b->surfaceFlags &&
+		a->contents == b->contents;
+}
+
+
+// runs the same random traces through the world serially and in parallel
+// and makes sure the results are identical
+void CM_TraceTest_f()
+{
+	if ( !cm.numNodes ) {
+		Com_Printf( "No map loaded\n" );
+		return;
+	}
+
+	const int count = Cmd_Argc() > 1 ? atoi( Cmd_Argv(1) ) : 65536;
+	const int threads = Cmd_Argc() > 2 ? atoi( Cmd_Argv(2) ) : Sys_GetCoreCount();
+	if ( count <= 0 || count > (1 << 20) || threads <= 0 || threads > MAX_WORKER_THREADS + 1 ) {
+		Com_Printf( "usage: %s [traces=65536] [threads=%d]\n", Cmd_Argv(0), Sys_GetCoreCount() );
+		return;
+	}
+
+	cmTraceQuery_t* const queries = (cmTraceQuery_t*)malloc( count * sizeof(cmTraceQuery_t) );
+	trace_t* const serial = (trace_t*)malloc( count * sizeof(trace_t) );
+	trace_t* const parallel = (trace_t*)malloc( count * sizeof(trace_t) );
+	if ( !queries || !serial || !parallel ) {
+		free( queries );
+		free( serial );
+		free( parallel );
+		Com_Printf( "Not enough memory for %d traces\n", count );
+		return;
+	}
+
+	// mix of point traces, box sweeps, capsule sweeps and position tests
+	vec3_t worldMins, worldMaxs;
+	CM_ModelBounds( 0, worldMins, worldMaxs );
+	unsigned int seed = 1337;
+	for ( int i = 0; i < count; ++i ) {
+		cmTraceQuery_t* const q = &queries[i];
+		const int type = i & 3;
+		for ( int j = 0; j < 3; ++j ) {
+			q->start[j] = CM_TraceTestRandom( &seed, worldMins[j], worldMaxs[j] );
+			q->end[j] = type == 3 ? q->start[j] : q->start[j] + CM_TraceTestRandom( &seed, -1024.0f, 1024.0f );
+			q->mins[j] = type == 0 ? 0.0f : -CM_TraceTestRandom( &seed, 1.0f, 32.0f );
+			q->maxs[j] = type == 0 ? 0.0f : CM_TraceTestRandom( &seed, 1.0f, 32.0f );
+		}
+		q->brushmask = CONTENTS_SOLID | CONTENTS_PLAYERCLIP | CONTENTS_BODY;
+		q->capsule = type == 2;
+	}
+
+	traceTestJob_t job;
+	job.queries = queries;
+
+	job.results = serial;
+	const int64_t serialStart = Sys_Microseconds();
+	for ( int i = 0; i < count; ++i )
+		CM_TraceTestJob( &job, i );
+	const int64_t serialUS = Sys_Microseconds() - serialStart;
+
+	// several passes to give races a chance to show up
+	const int passes = 4;
+	int mismatches = 0;
+	int64_t parallelUS = 0;
+	job.results = parallel;
+	for ( int p = 0; p < passes; ++p ) {
+		Com_Memset( parallel, 0, count * sizeof(trace_t) );
+		const int64_t parallelStart = Sys_Microseconds();
+		Sys_RunParallel( CM_TraceTestJob, &job, count, threads );
+		parallelUS += Sys_Microseconds() - parallelStart;
+
+		for ( int i = 0; i < count; ++i ) {
+			if ( CM_TracesEqual( &serial[i], &parallel[i] ) )
+				continue;
+			if ( mismatches++ < 8 ) {
+				Com_Printf( "^3trace %d mismatch: fraction %g vs %g, contents %d vs %d\n",
+					i, serial[i].fraction, parallel[i].fraction, serial[i].contents, parallel[i].contents );
+			}
+		}
+	}
+
+	Com_Printf( "%d traces, %d threads\n", count, threads );
+	Com_Printf( "serial  : %d us\n", (int)serialUS );
+	Com_Printf( "parallel: %d us (average of %d passes)\n", (int)(parallelUS / passes), passes );
+	if ( mismatches > 0 )
+		Com_Printf( "^1%d mismatches\n", mismatches );
+	else
+		Com_Printf( "^2all results match\n" );
+
+	free( queries );
+	free( serial );
+	free( parallel );
+}
+
+
+static void CM_WriteTraceRecord()
+{
+	const int count = min( (int)cm_traceRecord.count, MAX_RECORDED_TRACES );
+
+	const fileHandle_t f = FS_FOpenFileWrite( cm_traceRecord.fileName );
+	if ( f ) {
+		traceFileHeader_t header;
+		Com_Memset( &header, 0, sizeof(header) );
+		Com_Memcpy( header.magic, "CMTR", 4 );
+		header.version = LittleLong( TRACE_FILE_VERSION );
+		Q_strncpyz( header.mapName, cm_traceRecord.mapName, sizeof(header.mapName) );
+		header.count = LittleLong( count );
+		FS_Write( &header, sizeof(header), f );
+		FS_Write( cm_traceRecord.queries, count * sizeof(cmTraceQuery_t), f );
+		FS_FCloseFile( f );
+		Com_Printf( "Wrote %d traces to %s\n", count, cm_traceRecord.fileName );
+	} else {
+		Com_Printf( "Couldn't open %s for writing\n", cm_traceRecord.fileName );
+	}
+
+	free( cm_traceRecord.queries );
+	cm_traceRecord.queries = NULL;
+	cm_traceRecord.count = 0;
+}
+
+
+void CM_TraceRecord_f()
+{
+	if ( Cmd_Argc() != 2 ) {
+		Com_Printf( "usage: %s <file>|stop\n", Cmd_Argv(0) );
+		return;
+	}
+
+	if ( !Q_stricmp( Cmd_Argv(1), "stop" ) ) {
+		if ( !cm_traceRecord.queries ) {
+			Com_Printf( "Not recording traces\n" );
+			return;
+		}
+		CM_WriteTraceRecord();
+		return;
+	}
+
+	if ( cm_traceRecord.queries ) {
+		Com_Printf( "Already recording traces to %s\n", cm_traceRecord.fileName );
+		return;
+	}
+
+	if ( !cm.numNodes ) {
+		Com_Printf( "No map loaded\n" );
+		return;
+	}
+
+	cmTraceQuery_t* const queries = (cmTraceQuery_t*)malloc( MAX_RECORDED_TRACES * sizeof(cmTraceQuery_t) );
+	if ( !queries ) {
+		Com_Printf( "Not enough memory to record traces\n" );
+		return;
+	}
+
+	Q_strncpyz( cm_traceRecord.fileName, Cmd_Argv(1), sizeof(cm_traceRecord.fileName) );
+	COM_DefaultExtension( cm_traceRecord.fileName, sizeof(cm_traceRecord.fileName), ".trc" );
+	Q_strncpyz( cm_traceRecord.mapName, cm.name, sizeof(cm_traceRecord.mapName) );
+	cm_traceRecord.count = 0;
+	cm_traceRecord.queries = queries;
+	Com_Printf( "Recording up to %d world traces on %s\n", MAX_RECORDED_TRACES, cm.name );
+}
+
+
+// replays recorded traces through CM_BoxTrace and CM_BoxTraceBatch
+// and makes sure the results are identical
+void CM_TraceBenchmark_f()
+{
+	if ( Cmd_Argc() < 2 ) {
+		Com_Printf( "usage: %s <file> [runs=5]\n", Cmd_Argv(0) );
+		return;
+	}
+
+	if ( cm_traceRecord.queries ) {
+		Com_Printf( "Can't benchmark while recording traces\n" );
+		return;
+	}
+
+	char fileName[MAX_QPATH];
+	Q_strncpyz( fileName, Cmd_Argv(1), sizeof(fileName) );
+	COM_DefaultExtension( fileName, sizeof(fileName), ".trc" );
+
+	byte* file;
+	const int fileSize = FS_ReadFile( fileName, (void**)&file );
+	if ( fileSize <= 0 || file == NULL ) {
+		Com_Printf( "couldn't load %s\n", fileName );
+		return;
+	}
+
+	traceFileHeader_t header;
+	Com_Memcpy( &header, file, min( fileSize, (int)sizeof(header) ) );
+	header.mapName[sizeof(header.mapName) - 1] = '\0';
+	const int count = LittleLong( header.count );
+	if ( fileSize < (int)sizeof(header) || memcmp( header.magic, "CMTR", 4 ) ||
+		LittleLong( header.version ) != TRACE_FILE_VERSION ||
+		count < 0 || count > MAX_RECORDED_TRACES ||
+		fileSize < (int)sizeof(header) + count * (int)sizeof(cmTraceQuery_t) ) {
+		Com_Printf( "%s is not a valid trace file\n", fileName );
+		FS_FreeFile( file );
+		return;
+	}
+
+	if ( Q_stricmp( header.mapName, cm.name ) ) {
+		Com_Printf( "%s was recorded on %s, load that map first\n", fileName, header.mapName );
+		FS_FreeFile( file );
+		return;
+	}
+
+	const int runs = Cmd_Argc() > 2 ? Com_Clamp( 1, 100, atoi( Cmd_Argv(2) ) ) : 5;
+	const cmTraceQuery_t* const queries = (const cmTraceQuery_t*)(file + sizeof(header));
+	trace_t* const scalar = (trace_t*)malloc( count * sizeof(trace_t) );
+	trace_t* const batched = (trace_t*)malloc( count * sizeof(trace_t) );
+	if ( !scalar || !batched ) {
+		free( scalar );
+		free( batched );
+		FS_FreeFile( file );
+		Com_Printf( "Not enough memory for %d traces\n", count );
+		return;
+	}
+
+	// best of several runs to filter out noise
+	int64_t scalarUS = INT64_MAX;
+	int64_t batchedUS = INT64_MAX;
+	for ( int r = 0; r < runs; ++r ) {
+		int64_t start = Sys_Microseconds();
+		for ( int i = 0; i < count; ++i ) {
+			const cmTraceQuery_t* const q = &queries[i];
+			CM_BoxTrace( &scalar[i], q->start, q->end, q->mins, q->maxs, 0, q->brushmask, q->capsule );
+		}
+		scalarUS = min( scalarUS, Sys_Microseconds() - start );
+
+		start = Sys_Microseconds();
+		CM_BoxTraceBatch( batched, queries, count, 0 );
+		batchedUS = min( batchedUS, Sys_Microseconds() - start );
+	}
+
+	int mismatches = 0;
+	for ( int i = 0; i < count; ++i ) {
+		if ( !CM_TracesEqual( &scalar[i], &batched[i] ) )
+			mismatches++;
+	}
+
+	Com_Printf( "%d traces on %s, best of %d runs\n", count, header.mapName, runs );
+	Com_Printf( "scalar : %d us\n", (int)scalarUS );
+	Com_Printf( "batched: %d us (%.2fx)\n", (int)batchedUS, batchedUS > 0 ? (double)scalarUS / (double)batchedUS : 0.0 );
+	if ( mismatches > 0 )
+		Com_Printf( "^1%d mismatches\n", mismatches );
+	else
+		Com_Printf( "^2all results match\n" );
+
+	free( scalar );
+	free( batched );
+	FS_FreeFile( file );
+}
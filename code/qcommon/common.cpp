@@ -83,6 +83,10 @@ cvar_t	*cl_paused = 0;
 cvar_t	*sv_paused = 0;
 cvar_t	*cl_packetdelay = 0;
 cvar_t	*sv_packetdelay = 0;
+cvar_t	*cl_packetjitter = 0;
+cvar_t	*sv_packetjitter = 0;
+cvar_t	*cl_packetloss = 0;
+cvar_t	*sv_packetloss = 0;
 #if defined(_WIN32) && defined(_DEBUG)
 cvar_t	*com_noErrorInterrupt;
 #endif
@@ -687,10 +691,17 @@ int Com_RealTime( qtime_t* qtime )
 
 						ZONE MEMORY ALLOCATION
 
-There is never any space between memblocks, and there will never be two
-contiguous free memblocks.
+Each zone is a two-level segregated fit allocator (TLSF).
+Free blocks are kept in lists indexed by size class and two levels of bitmaps
+say which lists aren't empty, so Z_TagMalloc and Z_Free are O(1)
+no matter how many blocks the zone has.
+
+The first level splits the sizes by powers of 2 and the second level splits
+each of those ranges into ZONE_SL_COUNT linear classes.
+All sizes below ZONE_SMALL_BLOCK go into the first level's slot 0.
 
-The rover can be left pointing at a non-empty block
+There is never any space between memblocks, and there will never be two
+contiguous free memblocks. An empty in-use block caps the end of the zone.
 
 The zone calls are pretty much only used for small strings and structures,
 all big things are allocated on the hunk.
@@ -700,6 +711,12 @@ all big things are allocated on the hunk.
 #define	ZONEID	0x1d4a11
 #define MINFRAGMENT	64
 
+#define ZONE_SL_LOG2		4
+#define ZONE_SL_COUNT		(1 << ZONE_SL_LOG2)
+#define ZONE_FL_SHIFT		8
+#define ZONE_SMALL_BLOCK	(1 << ZONE_FL_SHIFT)
+#define ZONE_FL_COUNT		(31 - ZONE_FL_SHIFT + 1)	// enough for any int size
+
 typedef struct zonedebug_s {
 	char *label;
 	char *file;
@@ -710,7 +727,8 @@ typedef struct zonedebug_s {
 typedef struct memblock_s {
 	int		size;           // including the header and possibly tiny fragments
 	int     tag;            // a tag of 0 is a free block
-	struct memblock_s       *next, *prev;
+	struct memblock_s       *next, *prev;	// free list links, only valid for free blocks
+	struct memblock_s       *prevPhys;		// the block right before this one in memory
 	int     id;        		// should be ZONEID
 #ifdef ZONE_DEBUG
 	zonedebug_t d;
@@ -720,8 +738,9 @@ typedef struct memblock_s {
 typedef struct {
 	int		size;			// total bytes malloced, including header
 	int		used;			// total bytes used
-	memblock_t	blocklist;	// start / end cap for linked list
-	memblock_t	*rover;
+	unsigned int	flBitmap;					// bit i is set when slBitmap[i] isn't 0
+	unsigned int	slBitmap[ZONE_FL_COUNT];	// bit j of [i] is set when freeLists[i][j] isn't empty
+	memblock_t*		freeLists[ZONE_FL_COUNT][ZONE_SL_COUNT];
 } memzone_t;
 
 // main zone for all "dynamic" memory allocation
@@ -731,25 +750,150 @@ static memzone_t* mainzone = NULL;
 static memzone_t* smallzone = NULL;
 
 
-static void Z_ClearZone( memzone_t* zone, int size )
+static int Z_LowestBit( unsigned int mask )
 {
-	memblock_t* block;
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward( &index, mask );
+	return (int)index;
+#else
+	return __builtin_ctz( mask );
+#endif
+}
 
-	// set the entire zone to one free block
 
-	zone->blocklist.next = zone->blocklist.prev = block =
-		(memblock_t *)( (byte *)zone + sizeof(memzone_t) );
-	zone->blocklist.tag = 1;	// in use block
-	zone->blocklist.id = 0;
-	zone->blocklist.size = 0;
-	zone->rover = block;
+static int Z_HighestBit( unsigned int mask )
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse( &index, mask );
+	return (int)index;
+#else
+	return 31 - __builtin_clz( mask );
+#endif
+}
+
+
+static void Z_MapSize( int size, int* fl, int* sl )
+{
+	if ( size < ZONE_SMALL_BLOCK ) {
+		*fl = 0;
+		*sl = size / (ZONE_SMALL_BLOCK / ZONE_SL_COUNT);
+	} else {
+		const int log2 = Z_HighestBit( size );
+		*fl = log2 - ZONE_FL_SHIFT + 1;
+		*sl = (size >> (log2 - ZONE_SL_LOG2)) - ZONE_SL_COUNT;
+	}
+}
+
+
+static memblock_t* Z_FirstBlock( const memzone_t* zone )
+{
+	return (memblock_t*)( (byte*)zone + sizeof(memzone_t) );
+}
+
+
+static memblock_t* Z_NextBlock( const memblock_t* block )
+{
+	return (memblock_t*)( (byte*)block + block->size );
+}
+
+
+static void Z_InsertFreeBlock( memzone_t* zone, memblock_t* block )
+{
+	int fl, sl;
+	Z_MapSize( block->size, &fl, &sl );
+
+	memblock_t* const head = zone->freeLists[fl][sl];
+	block->tag = 0;		// mark as free
+	block->prev = NULL;
+	block->next = head;
+	if ( head )
+		head->prev = block;
+	zone->freeLists[fl][sl] = block;
+	zone->flBitmap |= 1u << fl;
+	zone->slBitmap[fl] |= 1u << sl;
+}
+
+
+static void Z_RemoveFreeBlock( memzone_t* zone, memblock_t* block )
+{
+	int fl, sl;
+	Z_MapSize( block->size, &fl, &sl );
+
+	if ( block->next )
+		block->next->prev = block->prev;
+	if ( block->prev ) {
+		block->prev->next = block->next;
+		return;
+	}
+
+	zone->freeLists[fl][sl] = block->next;
+	if ( !block->next ) {
+		zone->slBitmap[fl] &= ~(1u << sl);
+		if ( !zone->slBitmap[fl] )
+			zone->flBitmap &= ~(1u << fl);
+	}
+}
+
+
+static memblock_t* Z_FindFreeBlock( const memzone_t* zone, int size )
+{
+	if ( size <= 0 || size > zone->size )
+		return NULL;
+
+	// round up to the next class boundary so that any block of the list we land on is big enough
+	int roundedSize;
+	if ( size < ZONE_SMALL_BLOCK )
+		roundedSize = size + (ZONE_SMALL_BLOCK / ZONE_SL_COUNT) - 1;
+	else
+		roundedSize = size + (1 << (Z_HighestBit( size ) - ZONE_SL_LOG2)) - 1;
+
+	int fl, sl;
+	Z_MapSize( roundedSize, &fl, &sl );
+	if ( fl < ZONE_FL_COUNT ) {
+		unsigned int slMap = zone->slBitmap[fl] & (~0u << sl);
+		if ( !slMap ) {
+			const unsigned int flMap = zone->flBitmap & (~0u << (fl + 1));
+			if ( flMap ) {
+				fl = Z_LowestBit( flMap );
+				slMap = zone->slBitmap[fl];
+			}
+		}
+		if ( slMap )
+			return zone->freeLists[fl][Z_LowestBit( slMap )];
+	}
+
+	// when nearly out of memory, the request's own class might still have a block big enough
+	Z_MapSize( size, &fl, &sl );
+	for ( memblock_t* block = zone->freeLists[fl][sl]; block; block = block->next ) {
+		if ( block->size >= size )
+			return block;
+	}
+
+	return NULL;
+}
+
+
+static void Z_ClearZone( memzone_t* zone, int size )
+{
+	Com_Memset( zone, 0, sizeof(memzone_t) );
 	zone->size = size;
 	zone->used = 0;
 
-	block->prev = block->next = &zone->blocklist;
-	block->tag = 0;			// free block
+	// set the entire zone to one free block followed by the end cap
+	memblock_t* const block = Z_FirstBlock( zone );
+	block->size = (size - (int)sizeof(memzone_t) - (int)sizeof(memblock_t)) & ~((int)sizeof(intptr_t) - 1);
+	block->prevPhys = NULL;
 	block->id = ZONEID;
-	block->size = size - sizeof(memzone_t);
+	Z_InsertFreeBlock( zone, block );
+
+	memblock_t* const cap = Z_NextBlock( block );
+	cap->size = 0;
+	cap->tag = 1;	// in use block
+	cap->next = cap->prev = NULL;
+	cap->prevPhys = block;
+	cap->id = 0;
 }
 
 
@@ -765,12 +909,204 @@ int Z_AvailableMemory( void )
 }
 
 
+/*
+==============================================================================
+
+						SMALL OBJECT SLABS
+
+TAG_SMALL allocations of up to SLAB_MAX_SIZE bytes use fixed-size slots
+instead of zone blocks. The slab arena is split into pages and each page in use
+holds the slots of a single size class. Each class keeps a list of its pages
+that have free slots and each page keeps a free list and a bitmap of its slots,
+so allocating and freeing a slot is O(1).
+
+The arena is a single contiguous allocation, so Z_Free finds the page of a slot
+from its address alone and slots don't need a memblock_t header.
+
+When all pages are in use, small allocations fall back to the small zone.
+==============================================================================
+*/
+
+#define SLAB_PAGE_SIZE		4096
+#define SLAB_PAGE_COUNT		128
+#define SLAB_MIN_SIZE		16
+#define SLAB_CLASS_COUNT	5	// 16, 32, 64, 128 and 256 bytes
+#define SLAB_MAX_SIZE		(SLAB_MIN_SIZE << (SLAB_CLASS_COUNT - 1))
+#define SLAB_MAX_SLOTS		(SLAB_PAGE_SIZE / SLAB_MIN_SIZE)
+
+typedef struct slabPage_s {
+	struct slabPage_s	*next, *prev;	// in its class's list of pages with free slots or in the unused page list
+	void*	freeSlots;		// linked through the first bytes of each free slot
+	int		slotClass;		// -1 when the page is unused
+	int		usedSlots;
+	int		touchedSlots;	// slots from this index on were never handed out
+	unsigned int	usedBitmap[SLAB_MAX_SLOTS / 32];
+} slabPage_t;
+
+typedef struct {
+	slabPage_t*	partialPages;	// pages with at least 1 free slot
+	int		pages;
+	int		usedSlots;
+} slabClass_t;
+
+static byte*		slabArena = NULL;
+static slabPage_t	slabPages[SLAB_PAGE_COUNT];
+static slabPage_t*	slabUnusedPages = NULL;
+static slabClass_t	slabClasses[SLAB_CLASS_COUNT];
+static int			slabOverflows = 0;	// small allocations that went to the zone because the arena was full
+
+
+static void S_LinkPage( slabPage_t** list, slabPage_t* page )
+{
+	page->prev = NULL;
+	page->next = *list;
+	if ( *list )
+		(*list)->prev = page;
+	*list = page;
+}
+
+
+static void S_UnlinkPage( slabPage_t** list, slabPage_t* page )
+{
+	if ( page->next )
+		page->next->prev = page->prev;
+	if ( page->prev )
+		page->prev->next = page->next;
+	else
+		*list = page->next;
+	page->next = page->prev = NULL;
+}
+
+
+static byte* S_PageData( const slabPage_t* page )
+{
+	return slabArena + (page - slabPages) * SLAB_PAGE_SIZE;
+}
+
+
+static int S_SlotShift( int slotClass )
+{
+	return 4 + slotClass;	// log2 of SLAB_MIN_SIZE
+}
+
+
+static void S_InitSlabs()
+{
+	slabArena = (byte*)calloc( SLAB_PAGE_COUNT, SLAB_PAGE_SIZE );
+	if ( !slabArena )
+		Com_Error( ERR_FATAL, "Slab data failed to allocate %i KB", (SLAB_PAGE_COUNT * SLAB_PAGE_SIZE) / 1024 );
+
+	Com_Memset( slabClasses, 0, sizeof(slabClasses) );
+	slabUnusedPages = NULL;
+	for ( int i = SLAB_PAGE_COUNT - 1; i >= 0; --i ) {
+		slabPages[i].slotClass = -1;
+		S_LinkPage( &slabUnusedPages, &slabPages[i] );
+	}
+}
+
+
+static qbool S_IsSlabPointer( const void* ptr )
+{
+	return (const byte*)ptr >= slabArena && (const byte*)ptr < slabArena + SLAB_PAGE_COUNT * SLAB_PAGE_SIZE;
+}
+
+
+// returns NULL when no page of the size's class has a free slot and there are no unused pages left
+static void* S_SlabAlloc( int size )
+{
+	const int slotClass = size <= SLAB_MIN_SIZE ? 0 : Z_HighestBit( size - 1 ) - 3;
+	const int slotShift = S_SlotShift( slotClass );
+	slabClass_t* const sc = &slabClasses[slotClass];
+
+	slabPage_t* page = sc->partialPages;
+	if ( !page ) {
+		page = slabUnusedPages;
+		if ( !page )
+			return NULL;
+		S_UnlinkPage( &slabUnusedPages, page );
+		page->freeSlots = NULL;
+		page->slotClass = slotClass;
+		page->usedSlots = 0;
+		page->touchedSlots = 0;
+		Com_Memset( page->usedBitmap, 0, sizeof(page->usedBitmap) );
+		S_LinkPage( &sc->partialPages, page );
+		sc->pages++;
+	}
+
+	byte* slot;
+	if ( page->freeSlots ) {
+		slot = (byte*)page->freeSlots;
+		page->freeSlots = *(void**)slot;
+	} else {
+		slot = S_PageData( page ) + (page->touchedSlots++ << slotShift);
+	}
+
+	const int index = (int)(slot - S_PageData( page )) >> slotShift;
+	page->usedBitmap[index >> 5] |= 1u << (index & 31);
+	page->usedSlots++;
+	sc->usedSlots++;
+	if ( page->usedSlots == SLAB_PAGE_SIZE >> slotShift )
+		S_UnlinkPage( &sc->partialPages, page );
+
+	return slot;
+}
+
+
+static void S_SlabFree( void* ptr )
+{
+	slabPage_t* const page = &slabPages[((byte*)ptr - slabArena) / SLAB_PAGE_SIZE];
+	if ( page->slotClass < 0 ) {
+		Com_Error( ERR_FATAL, "Z_Free: freed a pointer in an unused slab page" );
+	}
+
+	const int slotShift = S_SlotShift( page->slotClass );
+	const int offset = (int)((byte*)ptr - S_PageData( page ));
+	if ( offset & ((1 << slotShift) - 1) ) {
+		Com_Error( ERR_FATAL, "Z_Free: freed a pointer that doesn't start a slab slot" );
+	}
+
+	const int index = offset >> slotShift;
+	const unsigned int bit = 1u << (index & 31);
+	if ( !(page->usedBitmap[index >> 5] & bit) ) {
+		Com_Error( ERR_FATAL, "Z_Free: freed a freed pointer" );
+	}
+	page->usedBitmap[index >> 5] &= ~bit;
+
+#ifdef ZONE_DEBUG
+	// set the slot to something that should cause problems
+	// if it is referenced...
+	Com_Memset( ptr, 0xaa, 1 << slotShift );
+#endif
+	*(void**)ptr = page->freeSlots;
+	page->freeSlots = ptr;
+
+	slabClass_t* const sc = &slabClasses[page->slotClass];
+	if ( page->usedSlots == SLAB_PAGE_SIZE >> slotShift )
+		S_LinkPage( &sc->partialPages, page );
+	page->usedSlots--;
+	sc->usedSlots--;
+
+	if ( page->usedSlots == 0 ) {
+		// give the page back so that any class can use it
+		S_UnlinkPage( &sc->partialPages, page );
+		sc->pages--;
+		page->slotClass = -1;
+		S_LinkPage( &slabUnusedPages, page );
+	}
+}
+
+
 void Z_Free( void* ptr )
 {
 	if (!ptr) {
 		Com_Error( ERR_DROP, "Z_Free: NULL pointer" );
 	}
 
+	if (S_IsSlabPointer(ptr)) {
+		S_SlabFree( ptr );
+		return;
+	}
+
 	memblock_t* block = (memblock_t*)((byte*)ptr - sizeof(memblock_t));
 	if (block->id != ZONEID) {
 		Com_Error( ERR_FATAL, "Z_Free: freed a pointer without ZONEID" );
@@ -790,36 +1126,29 @@ void Z_Free( void* ptr )
 
 	memzone_t* zone = (block->tag == TAG_SMALL) ? smallzone : mainzone;
 	zone->used -= block->size;
+#ifdef ZONE_DEBUG
 	// set the block to something that should cause problems
 	// if it is referenced...
 	Com_Memset( ptr, 0xaa, block->size - sizeof( *block ) );
+#endif
 
-	block->tag = 0;		// mark as free
-
-	memblock_t* other = block->prev;
-	if (!other->tag) {
+	memblock_t* other = block->prevPhys;
+	if ( other && !other->tag ) {
 		// merge with previous free block
+		Z_RemoveFreeBlock( zone, other );
 		other->size += block->size;
-		other->next = block->next;
-		other->next->prev = other;
-		if (block == zone->rover) {
-			zone->rover = other;
-		}
 		block = other;
 	}
 
-	zone->rover = block;
-
-	other = block->next;
+	other = Z_NextBlock( block );
 	if ( !other->tag ) {
 		// merge the next free block onto the end
+		Z_RemoveFreeBlock( zone, other );
 		block->size += other->size;
-		block->next = other->next;
-		block->next->prev = block;
-		if (other == zone->rover) {
-			zone->rover = block;
-		}
 	}
+
+	Z_NextBlock( block )->prevPhys = block;
+	Z_InsertFreeBlock( zone, block );
 }
 
 
@@ -838,7 +1167,7 @@ static void Z_LogZoneHeap( const memzone_t* zone, const char* name )
 	size = allocSize = numBlocks = 0;
 	Com_sprintf(buf, sizeof(buf), "\r\n================\r\n%s log\r\n================\r\n", name);
 	FS_Write(buf, strlen(buf), logfile);
-	for (block = zone->blocklist.next ; block->next != &zone->blocklist; block = block->next) {
+	for (block = Z_FirstBlock(zone) ; block->size; block = Z_NextBlock(block)) {
 		if (block->tag) {
 			ptr = ((char *) block) + sizeof(memblock_t);
 			j = 0;
@@ -890,13 +1219,21 @@ void *Z_TagMallocDebug( int size, int tag, char *label, char *file, int line ) {
 void *Z_TagMalloc( int size, int tag ) {
 #endif
 	int		extra, allocSize;
-	memblock_t	*start, *rover, *base;
+	memblock_t	*base;
 	memzone_t *zone;
 
 	if (!tag) {
 		Com_Error( ERR_FATAL, "Z_TagMalloc: tried to use a 0 tag" );
 	}
 
+	if ( tag == TAG_SMALL && size >= 0 && size <= SLAB_MAX_SIZE ) {
+		void* const slot = S_SlabAlloc( size );
+		if ( slot ) {
+			return slot;
+		}
+		slabOverflows++;
+	}
+
 	if ( tag == TAG_SMALL ) {
 		zone = smallzone;
 	}
@@ -905,33 +1242,20 @@ void *Z_TagMalloc( int size, int tag ) {
 	}
 
 	allocSize = size;
-	//
-	// scan through the block list looking for the first free block
-	// of sufficient size
-	//
 	size += sizeof(memblock_t);	// account for size of block header
 	size += 4;					// space for memory trash tester
 	size = PAD(size, sizeof(intptr_t));		// align to 32/64 bit boundary
 
-	base = rover = zone->rover;
-	start = base->prev;
-
-	do {
-		if (rover == start) {
+	base = Z_FindFreeBlock( zone, size );
+	if (!base) {
 #ifdef ZONE_DEBUG
-			Z_LogHeap();
+		Z_LogHeap();
 #endif
-			// scaned all the way around the list
-			Com_Error( ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes from the %s zone",
-								size, zone == smallzone ? "small" : "main");
-			return NULL;
-		}
-		if (rover->tag) {
-			base = rover = rover->next;
-		} else {
-			rover = rover->next;
-		}
-	} while (base->tag || base->size < size);
+		Com_Error( ERR_FATAL, "Z_Malloc: failed on allocation of %i bytes from the %s zone",
+							size, zone == smallzone ? "small" : "main");
+		return NULL;
+	}
+	Z_RemoveFreeBlock( zone, base );
 
 	//
 	// found a block big enough
@@ -941,18 +1265,16 @@ void *Z_TagMalloc( int size, int tag ) {
 		// there will be a free fragment after the allocated block
 		memblock_t* p = (memblock_t *) ((byte *)base + size );
 		p->size = extra;
-		p->tag = 0;			// free block
-		p->prev = base;
+		p->prevPhys = base;
 		p->id = ZONEID;
-		p->next = base->next;
-		p->next->prev = p;
-		base->next = p;
+		Z_NextBlock( p )->prevPhys = p;
+		Z_InsertFreeBlock( zone, p );
 		base->size = size;
 	}
 
 	base->tag = tag;			// no longer a free block
+	base->next = base->prev = NULL;
 
-	zone->rover = base->next;	// next allocation will start looking here
 	zone->used += base->size;	//
 
 	base->id = ZONEID;
@@ -974,17 +1296,16 @@ void *Z_TagMalloc( int size, int tag ) {
 static void Z_CheckHeap()
 {
 	const memblock_t* block;
+	const byte* const end = (const byte*)mainzone + mainzone->size;
 
-	for (block = mainzone->blocklist.next ; ; block = block->next) {
-		if (block->next == &mainzone->blocklist) {
-			break;			// all blocks have been hit
-		}
-		if ( (byte *)block + block->size != (byte *)block->next)
-			Com_Error( ERR_FATAL, "Z_CheckHeap: block size does not touch the next block\n" );
-		if ( block->next->prev != block) {
+	for (block = Z_FirstBlock(mainzone) ; block->size; block = Z_NextBlock(block)) {
+		const memblock_t* const next = Z_NextBlock(block);
+		if ( (const byte*)next + sizeof(memblock_t) > end )
+			Com_Error( ERR_FATAL, "Z_CheckHeap: block size goes past the end of the zone\n" );
+		if ( next->prevPhys != block ) {
 			Com_Error( ERR_FATAL, "Z_CheckHeap: next block doesn't have proper back link\n" );
 		}
-		if ( !block->tag && !block->next->tag ) {
+		if ( !block->tag && !next->tag ) {
 			Com_Error( ERR_FATAL, "Z_CheckHeap: two consecutive free blocks\n" );
 		}
 	}
@@ -1027,18 +1348,18 @@ typedef struct memstatic_s {
 } memstatic_t;
 
 static memstatic_t emptystring =
-	{ {(sizeof(memblock_t)+2 + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'\0', '\0'} };
+	{ {(sizeof(memblock_t)+2 + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'\0', '\0'} };
 static memstatic_t numberstring[] = {
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'0', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'1', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'2', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'3', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'4', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'5', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'6', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'7', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'8', '\0'} },
-	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, ZONEID}, {'9', '\0'} }
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'0', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'1', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'2', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'3', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'4', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'5', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'6', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'7', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'8', '\0'} },
+	{ {(sizeof(memstatic_t) + 3) & ~3, TAG_STATIC, NULL, NULL, NULL, ZONEID}, {'9', '\0'} }
 };
 
 /*
@@ -1139,6 +1460,47 @@ static hunkblock_t* hunkblocks = NULL;
 #endif
 
 
+// fragmentation is the share of the free memory that the largest free block can't serve
+static void Com_PrintZoneFragmentation( const memzone_t* zone, const char* name )
+{
+	int freeBytes = 0;
+	int freeBlocks = 0;
+	int largestFree = 0;
+
+	for (const memblock_t* block = Z_FirstBlock(zone) ; block->size; block = Z_NextBlock(block)) {
+		if ( !block->tag ) {
+			freeBytes += block->size;
+			freeBlocks++;
+			largestFree = max( largestFree, block->size );
+		}
+	}
+
+	const float fragmentation = freeBytes > 0 ? 100.0f * (float)(freeBytes - largestFree) / (float)freeBytes : 0.0f;
+	Com_Printf( "%8i bytes free in %i %s zone blocks\n", freeBytes, freeBlocks, name );
+	Com_Printf( "   %8i bytes in the largest free block\n", largestFree );
+	Com_Printf( "   %8.1f%% fragmentation\n", fragmentation );
+}
+
+
+static void Com_PrintSlabOccupancy()
+{
+	int usedPages = 0;
+	for ( int i = 0; i < SLAB_CLASS_COUNT; ++i ) {
+		usedPages += slabClasses[i].pages;
+	}
+
+	Com_Printf( "%8i of %i slab pages in use\n", usedPages, SLAB_PAGE_COUNT );
+	for ( int i = 0; i < SLAB_CLASS_COUNT; ++i ) {
+		const slabClass_t* const sc = &slabClasses[i];
+		const int slots = sc->pages * (SLAB_PAGE_SIZE >> S_SlotShift( i ));
+		const float occupancy = slots > 0 ? 100.0f * (float)sc->usedSlots / (float)slots : 0.0f;
+		Com_Printf( "   %8i of %i %i-byte slots used in %i pages (%.1f%%)\n",
+			sc->usedSlots, slots, SLAB_MIN_SIZE << i, sc->pages, occupancy );
+	}
+	Com_Printf( "%8i small allocations didn't fit in the slabs\n", slabOverflows );
+}
+
+
 static void Com_Meminfo_f( void )
 {
 	const memblock_t* block;
@@ -1147,7 +1509,7 @@ static void Com_Meminfo_f( void )
 	int botlibBytes = 0;
 	int rendererBytes = 0;
 
-	for (block = mainzone->blocklist.next ; ; block = block->next) {
+	for (block = Z_FirstBlock(mainzone) ; block->size; block = Z_NextBlock(block)) {
 		if ( Cmd_Argc() != 1 ) {
 			Com_Printf ("block:%p    size:%7i    tag:%3i\n",
 				block, block->size, block->tag);
@@ -1162,31 +1524,23 @@ static void Com_Meminfo_f( void )
 			}
 		}
 
-		if (block->next == &mainzone->blocklist) {
-			break;			// all blocks have been hit
-		}
-		if ( (byte *)block + block->size != (byte *)block->next) {
-			Com_Printf ("ERROR: block size does not touch the next block\n");
-		}
-		if ( block->next->prev != block) {
+		const memblock_t* const next = Z_NextBlock(block);
+		if ( next->prevPhys != block) {
 			Com_Printf ("ERROR: next block doesn't have proper back link\n");
+			break;
 		}
-		if ( !block->tag && !block->next->tag ) {
+		if ( !block->tag && !next->tag ) {
 			Com_Printf ("ERROR: two consecutive free blocks\n");
 		}
 	}
 
 	int smallZoneBytes = 0;
 	int smallZoneBlocks = 0;
-	for (block = smallzone->blocklist.next ; ; block = block->next) {
+	for (block = Z_FirstBlock(smallzone) ; block->size; block = Z_NextBlock(block)) {
 		if ( block->tag ) {
 			smallZoneBytes += block->size;
 			smallZoneBlocks++;
 		}
-
-		if (block->next == &smallzone->blocklist) {
-			break;			// all blocks have been hit
-		}
 	}
 
 	Com_Printf( "%8i bytes total hunk\n", s_hunkTotal );
@@ -1223,6 +1577,13 @@ static void Com_Meminfo_f( void )
 	Com_Printf( "   %8i bytes in dynamic renderer\n", rendererBytes );
 	Com_Printf( "   %8i bytes in dynamic other\n", zoneBytes - ( botlibBytes + rendererBytes ) );
 	Com_Printf( "   %8i bytes in small Zone memory\n", smallZoneBytes );
+	Com_Printf( "\n" );
+
+	Com_PrintZoneFragmentation( mainzone, "main" );
+	Com_PrintZoneFragmentation( smallzone, "small" );
+	Com_Printf( "\n" );
+
+	Com_PrintSlabOccupancy();
 }
 
 
@@ -1249,16 +1610,13 @@ void Com_TouchMemory()
 		sum += ((int *)s_hunkData)[i];
 	}
 
-	for (block = mainzone->blocklist.next ; ; block = block->next) {
+	for (block = Z_FirstBlock(mainzone) ; block->size; block = Z_NextBlock(block)) {
 		if ( block->tag ) {
 			j = block->size >> 2;
 			for ( i = 0 ; i < j ; i+=64 ) {				// only need to touch each page
 				sum += ((int *)block)[i];
 			}
 		}
-		if ( block->next == &mainzone->blocklist ) {
-			break;			// all blocks have been hit
-		}
 	}
 
 	int end = Sys_Milliseconds();
@@ -1276,6 +1634,8 @@ static void Com_InitSmallZoneMemory()
 		Com_Error( ERR_FATAL, "Small zone data failed to allocate %1.1f megs", (float)s_smallZoneTotal / (1024*1024) );
 
 	Z_ClearZone( smallzone, s_smallZoneTotal );
+
+	S_InitSlabs();
 }
 
 
@@ -1711,6 +2071,112 @@ static int com_pushedEventsHead;
 static int com_pushedEventsTail;
 
 
+// received packets are stored in a ring of preallocated slots so that the path
+// from the socket to SV_PacketEvent/CL_PacketEvent never touches the zone
+// slots are handed out in order and skipped when still in use, so they can be freed in any order
+
+#define MAX_PACKET_SLOTS	64	// must be a power of 2
+
+typedef enum {
+	PSS_FREE,
+	PSS_RESERVED,	// a batched socket read may be writing to it
+	PSS_QUEUED,		// waiting in an event queue
+	PSS_PROCESSING	// being read by Com_EventLoop
+} packetSlotState_t;
+
+static packetSlot_t			com_packetSlots[MAX_PACKET_SLOTS];
+static packetSlotState_t	com_packetSlotStates[MAX_PACKET_SLOTS];
+static int					com_packetSlotHead;
+
+
+packetSlot_t* Com_GetPacketSlot()
+{
+	COMPILE_TIME_ASSERT( sizeof( packetSlot_t ) == sizeof( netadr_t ) + MAX_MSGLEN );
+
+	// reserved slots are handed out in order, so the first reserved slot
+	// is the one that holds the next packet of the batched read
+	for ( int i = 0; i < MAX_PACKET_SLOTS; ++i ) {
+		const int index = com_packetSlotHead & (MAX_PACKET_SLOTS - 1);
+		if ( com_packetSlotStates[index] == PSS_FREE || com_packetSlotStates[index] == PSS_RESERVED ) {
+			return &com_packetSlots[index];
+		}
+		com_packetSlotHead++;
+	}
+
+	return NULL;
+}
+
+
+// slots in use are skipped here like in Com_GetPacketSlot, so the order matches
+int Com_ReservePacketSlots( packetSlot_t** slots, int maxCount )
+{
+	int count = 0;
+	for ( int i = 0; i < MAX_PACKET_SLOTS && count < maxCount; ++i ) {
+		const int index = (com_packetSlotHead + i) & (MAX_PACKET_SLOTS - 1);
+		if ( com_packetSlotStates[index] == PSS_FREE ) {
+			com_packetSlotStates[index] = PSS_RESERVED;
+			slots[count++] = &com_packetSlots[index];
+		}
+	}
+
+	return count;
+}
+
+
+void Com_ReleasePacketSlot( const packetSlot_t* slot )
+{
+	packetSlotState_t* const state = &com_packetSlotStates[slot - com_packetSlots];
+	if ( *state == PSS_RESERVED ) {
+		*state = PSS_FREE;
+	}
+}
+
+
+void Com_QueuePacketSlot( const packetSlot_t* slot )
+{
+	com_packetSlotStates[slot - com_packetSlots] = PSS_QUEUED;
+	com_packetSlotHead++;
+}
+
+
+static packetSlot_t* Com_PacketSlotForPointer( void* ptr )
+{
+	const byte* const p = (const byte*)ptr;
+	if ( p < (const byte*)com_packetSlots || p >= (const byte*)(com_packetSlots + MAX_PACKET_SLOTS) ) {
+		return NULL;
+	}
+
+	return (packetSlot_t*)ptr;
+}
+
+
+void Com_FreeEventPtr( void* ptr )
+{
+	if ( ptr == NULL ) {
+		return;
+	}
+
+	packetSlot_t* const slot = Com_PacketSlotForPointer( ptr );
+	if ( slot != NULL ) {
+		com_packetSlotStates[slot - com_packetSlots] = PSS_FREE;
+	} else {
+		Z_Free( ptr );
+	}
+}
+
+
+// an error can interrupt the processing of packets, even in nested event loops
+
+static void Com_FreeAbandonedPacketSlots()
+{
+	for ( int i = 0; i < MAX_PACKET_SLOTS; ++i ) {
+		if ( com_packetSlotStates[i] == PSS_PROCESSING ) {
+			com_packetSlotStates[i] = PSS_FREE;
+		}
+	}
+}
+
+
 static void Com_InitJournaling()
 {
 	Com_StartupVariable( "journal" );
@@ -1792,9 +2258,7 @@ static void Com_PushEvent( const sysEvent_t* event )
 			Com_Printf( "WARNING: Com_PushEvent overflow\n" );
 		}
 
-		if ( ev->evPtr ) {
-			Z_Free( ev->evPtr );
-		}
+		Com_FreeEventPtr( ev->evPtr );
 		com_pushedEventsTail++;
 	} else {
 		printedWarning = qfalse;
@@ -1818,9 +2282,12 @@ static sysEvent_t Com_GetEvent()
 static void Com_RunAndTimeServerPacket( const netadr_t& from, msg_t* msg )
 {
 	int t1 = (com_speeds->integer == 3) ? Sys_Milliseconds() : 0;
+	const int64_t startUS = Sys_Microseconds();
 
 	SV_PacketEvent( from, msg );
 
+	SV_ProfileAdd( SVP_PACKETS, startUS );
+
 	if (com_speeds->integer == 3) {
 		int ms = Sys_Milliseconds() - t1;
 		Com_Printf( "SV_PacketEvent time: %i\n", ms );
@@ -1828,6 +2295,18 @@ static void Com_RunAndTimeServerPacket( const netadr_t& from, msg_t* msg )
 }
 
 
+static void Com_PacketEvent( const netadr_t& from, msg_t* msg )
+{
+	if ( com_sv_running->integer ) {
+		Com_RunAndTimeServerPacket( from, msg );
+	} else {
+#ifndef DEDICATED
+		CL_PacketEvent( from, msg );
+#endif
+	}
+}
+
+
 // returns last event time
 
 int Com_EventLoop()
@@ -1888,6 +2367,17 @@ int Com_EventLoop()
 			break;
 		case SE_PACKET:
 			evFrom = *(netadr_t *)ev.evPtr;
+			if ( packetSlot_t* const slot = Com_PacketSlotForPointer( ev.evPtr ) ) {
+				// slots are large enough for fragment reassembly,
+				// so the message can be processed in place
+				msg_t slotMsg;
+				MSG_Init( &slotMsg, slot->data, sizeof( slot->data ) );
+				slotMsg.cursize = ev.evPtrLength - sizeof( evFrom );
+				com_packetSlotStates[slot - com_packetSlots] = PSS_PROCESSING;
+				Com_PacketEvent( evFrom, &slotMsg );
+				break;
+			}
+
 			buf.cursize = ev.evPtrLength - sizeof( evFrom );
 
 			// we must copy the contents of the message out, because
@@ -1896,23 +2386,15 @@ int Com_EventLoop()
 			// enough to hold fragment reassembly
 			if ( (unsigned)buf.cursize > buf.maxsize ) {
 				Com_Printf("Com_EventLoop: oversize packet\n");
-				continue;
+				break;
 			}
 			Com_Memcpy( buf.data, (byte *)((netadr_t *)ev.evPtr + 1), buf.cursize );
-			if ( com_sv_running->integer ) {
-				Com_RunAndTimeServerPacket( evFrom, &buf );
-			} else {
-#ifndef DEDICATED
-				CL_PacketEvent( evFrom, &buf );
-#endif
-			}
+			Com_PacketEvent( evFrom, &buf );
 			break;
 		}
 
 		// free any block data
-		if ( ev.evPtr ) {
-			Z_Free( ev.evPtr );
-		}
+		Com_FreeEventPtr( ev.evPtr );
 	}
 
 	return 0;	// never reached
@@ -2180,6 +2662,10 @@ static const cmdTableItem_t com_cmds[] =
 	{ "rand", Com_Rand_f },
 #endif
 	{ "quit", Com_Quit_f, NULL, "closes the application" },
+	{ "huffbench", MSG_Benchmark_f, NULL, "benchmarks Huffman decoding and encoding with a demo file" },
+	{ "tracetest", CM_TraceTest_f, NULL, "checks that parallel collision traces match serial ones" },
+	{ "tracerecord", CM_TraceRecord_f, NULL, "records world collision traces to a file for /tracebench" },
+	{ "tracebench", CM_TraceBenchmark_f, NULL, "benchmarks batched collision traces with a recorded trace file" },
 	{ "writeconfig", Com_WriteConfig_f, Com_CompleteWriteConfig_f, "write the cvars and key binds to a file" }
 };
 
@@ -2199,6 +2685,10 @@ static const cvarTableItem_t com_cvars[] =
 	{ &sv_paused, "sv_paused", "0", CVAR_ROM, CVART_BOOL },
 	{ &cl_packetdelay, "cl_packetdelay", "0", CVAR_CHEAT, CVART_INTEGER, "0", NULL },
 	{ &sv_packetdelay, "sv_packetdelay", "0", CVAR_CHEAT, CVART_INTEGER, "0", NULL },
+	{ &cl_packetjitter, "cl_packetjitter", "0", CVAR_CHEAT, CVART_INTEGER, "0", "500", "max. random delay added to sent client packets, in ms" },
+	{ &sv_packetjitter, "sv_packetjitter", "0", CVAR_CHEAT, CVART_INTEGER, "0", "500", "max. random delay added to sent server packets, in ms" },
+	{ &cl_packetloss, "cl_packetloss", "0", CVAR_CHEAT, CVART_INTEGER, "0", "100", "percentage of sent client packets that get dropped" },
+	{ &sv_packetloss, "sv_packetloss", "0", CVAR_CHEAT, CVART_INTEGER, "0", "100", "percentage of sent server packets that get dropped" },
 	{ &com_sv_running, "sv_running", "0", CVAR_ROM, CVART_BOOL },
 	{ &com_cl_running, "cl_running", "0", CVAR_ROM, CVART_BOOL },
 #if defined(_WIN32) && defined(_DEBUG)
@@ -2494,6 +2984,7 @@ static void Com_FrameSleep( qbool demoPlayback )
 void Com_Frame( qbool demoPlayback )
 {
 	if ( setjmp(abortframe) ) {
+		Com_FreeAbandonedPacketSlots();
 		return;			// an ERR_DROP was thrown
 	}
 
@@ -2614,13 +3105,17 @@ void Com_Frame( qbool demoPlayback )
 	// trace optimization tracking
 	//
 	if ( com_showtrace->integer ) {
-		extern int c_traces, c_brush_traces, c_patch_traces, c_pointcontents;
+		int traces, brushTraces, patchTraces, pointContents;
+		CM_TakeTraceStats( &traces, &brushTraces, &patchTraces, &pointContents );
 		Com_Printf( "%4i traces  (%ib %ip) %4i points\n",
-				c_traces, c_brush_traces, c_patch_traces, c_pointcontents );
-		c_traces = 0;
-		c_brush_traces = 0;
-		c_patch_traces = 0;
-		c_pointcontents = 0;
+				traces, brushTraces, patchTraces, pointContents );
+
+		int cacheHits, cacheLookups;
+		SV_TakeTraceCacheStats( &cacheHits, &cacheLookups );
+		if ( cacheLookups > 0 ) {
+			Com_Printf( "%4i cached  (%i%% of %i lookups)\n",
+					cacheHits, (100 * cacheHits) / cacheLookups, cacheLookups );
+		}
 	}
 
 	com_frameNumber++;
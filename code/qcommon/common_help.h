@@ -58,6 +58,20 @@ S_COLOR_VAL "    0 " S_COLOR_HELP "= Shared library (native code)\n" \
 S_COLOR_VAL "    1 " S_COLOR_HELP "= Interpreted QVM\n" \
 S_COLOR_VAL "    2 " S_COLOR_HELP "= JIT-compiled QVM"
 
+#define help_vmprofile \
+"\n" \
+S_COLOR_CMD "start " S_COLOR_HELP "[samples per second] starts sampling (default: 1000)\n" \
+S_COLOR_CMD "stop  " S_COLOR_HELP "stops sampling\n" \
+S_COLOR_CMD "dump  " S_COLOR_HELP "[file] writes the folded stacks (default: vmprofile.txt)\n" \
+"Function names come from the QVM's .map file in the vm folder."
+
+#define help_vmtrace \
+"\n" \
+S_COLOR_CMD "start " S_COLOR_HELP "<qagame|cgame|ui> [file] starts recording (default: <vm name>.vmt)\n" \
+S_COLOR_CMD "stop  " S_COLOR_HELP "stops recording\n" \
+"The trace holds the data segment, every vmMain call and every system call's results.\n" \
+"cnq3-vmbench replays it against the interpreter and the JIT without the engine."
+
 #define help_com_maxfps \
 "max. allowed framerate\n" \
 "It's highly recommended to only use " S_COLOR_VAL "125 " S_COLOR_HELP "or " S_COLOR_VAL "250 " S_COLOR_HELP "with V-Sync disabled.\n" \
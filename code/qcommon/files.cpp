@@ -627,6 +627,41 @@ int FS_SV_FOpenFileRead( const char *filename, fileHandle_t *fp )
 }
 
 
+/*
+===========
+FS_SV_MapFileRead
+maps a file found like FS_SV_FOpenFileRead does so it can be read without any copies
+===========
+*/
+const byte* FS_SV_MapFileRead( const char *filename, int *size )
+{
+	if ( !fs_searchpaths ) {
+		Com_Error( ERR_FATAL, "Filesystem call made without initialization\n" );
+	}
+
+	*size = 0;
+
+	char* ospath = FS_BuildOSPath( fs_homepath->string, filename, "" );
+	ospath[strlen(ospath)-1] = '\0';
+	if ( fs_debug->integer ) {
+		Com_Printf( "FS_SV_MapFileRead (fs_homepath): %s\n", ospath );
+	}
+
+	const byte* data = Sys_MapFile( ospath, size );
+	if ( !data && Q_stricmp(fs_homepath->string, fs_basepath->string) ) {
+		ospath = FS_BuildOSPath( fs_basepath->string, filename, "" );
+		ospath[strlen(ospath)-1] = '\0';
+		if ( fs_debug->integer ) {
+			Com_Printf( "FS_SV_MapFileRead (fs_basepath): %s\n", ospath );
+		}
+
+		data = Sys_MapFile( ospath, size );
+	}
+
+	return data;
+}
+
+
 /*
 ===========
 FS_SV_Rename
@@ -660,6 +695,63 @@ void FS_SV_Rename( const char *from, const char *to ) {
 }
 
 
+/*
+===========
+FS_SV_RemoveFile
+
+===========
+*/
+void FS_SV_RemoveFile( const char *filename )
+{
+	if ( !fs_searchpaths ) {
+		Com_Error( ERR_FATAL, "Filesystem call made without initialization\n" );
+	}
+
+	char* ospath = FS_BuildOSPath( fs_homepath->string, filename, "" );
+	ospath[strlen(ospath)-1] = '\0';
+	remove( ospath );
+}
+
+
+/*
+===========
+FS_SV_ReplaceFile
+moves a completely written file over another one so that readers
+(other processes included) see either the old file or the new one
+deletes the source and returns qfalse on failure
+===========
+*/
+qbool FS_SV_ReplaceFile( const char *from, const char *to )
+{
+	if ( !fs_searchpaths ) {
+		Com_Error( ERR_FATAL, "Filesystem call made without initialization\n" );
+	}
+
+	char fromPath[MAX_OSPATH];
+	char toPath[MAX_OSPATH];
+	Q_strncpyz( fromPath, FS_BuildOSPath( fs_homepath->string, from, "" ), sizeof( fromPath ) );
+	Q_strncpyz( toPath, FS_BuildOSPath( fs_homepath->string, to, "" ), sizeof( toPath ) );
+	fromPath[strlen(fromPath)-1] = '\0';
+	toPath[strlen(toPath)-1] = '\0';
+
+	if ( fs_debug->integer ) {
+		Com_Printf( "FS_SV_ReplaceFile: %s --> %s\n", fromPath, toPath );
+	}
+
+#if defined( _WIN32 )
+	// rename doesn't overwrite on Windows
+	// if the old file is still open somewhere, the removal fails and so does the rename
+	remove( toPath );
+#endif
+	if ( rename( fromPath, toPath ) ) {
+		remove( fromPath );
+		return qfalse;
+	}
+
+	return qtrue;
+}
+
+
 /*
 ===========
 FS_Rename
@@ -98,6 +98,23 @@ typedef struct {
 typedef struct gentity_s gentity_t;
 
 
+// queries of the batched extensions, see G_EXT_TRACEBATCH and G_EXT_POINTCONTENTSBATCH
+typedef struct {
+	vec3_t		start;
+	vec3_t		end;
+	vec3_t		mins;
+	vec3_t		maxs;
+	int			passEntityNum;
+	int			contentmask;
+	int			capsule;		// qtrue for trap_TraceCapsule behavior
+} gameTraceQuery_t;
+
+typedef struct {
+	vec3_t		point;
+	int			passEntityNum;
+} gamePointContentsQuery_t;
+
+
 //===============================================================
 
 //
@@ -408,7 +425,9 @@ typedef enum {
 	G_EXT_CVAR_SETRANGE,
 	G_EXT_CVAR_SETHELP,
 	G_EXT_CMD_SETHELP,
-	G_EXT_ERROR2
+	G_EXT_ERROR2,
+	G_EXT_TRACEBATCH,			// ( const gameTraceQuery_t *queries, trace_t *results, int count );
+	G_EXT_POINTCONTENTSBATCH	// ( const gamePointContentsQuery_t *queries, int *results, int count );
 } gameImport_t;
 
 
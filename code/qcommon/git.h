@@ -0,0 +1,2 @@
+#define GIT_COMMIT "0d00a65c6567f65c303b945a9e56894176fb23df"
+#define GIT_BRANCH "master"
@@ -220,3 +220,56 @@ int StatHuff_WriteSymbol( int symbol, byte* buffer, int bitIndex )
 	return bitCount;
 }
 
+
+// the values are stored as in MSG_WriteBits: the (bits & 7) low bits are written raw,
+// then every remaining byte is written as a symbol
+// codes are at most 11 bits long, so a 32-bit value always fits in a single 64-bit word
+
+int StatHuff_ReadBits( uint32_t* value, int bits, const byte* buffer, int bitIndex )
+{
+	uint64_t word;
+	memcpy(&word, buffer + (bitIndex >> 3), sizeof(word));
+	word >>= (uint32_t)bitIndex & 7;
+
+	const int rawBits = bits & 7;
+	uint32_t result = (uint32_t)word & ((1u << rawBits) - 1);
+	word >>= rawBits;
+	int bitCount = rawBits;
+
+	for (int i = rawBits; i < bits; i += 8) {
+		const uint16_t entry = huff_decodeTable[word & 0x7FF];
+		const int length = (int)(entry >> 8);
+		result |= (uint32_t)(entry & 0xFF) << i;
+		word >>= length;
+		bitCount += length;
+	}
+
+	*value = result;
+
+	return bitCount;
+}
+
+
+int StatHuff_WriteBits( uint32_t value, int bits, byte* buffer, int bitIndex )
+{
+	const int rawBits = bits & 7;
+	uint64_t codes = value & ((1u << rawBits) - 1);
+	int bitCount = rawBits;
+	value >>= rawBits;
+
+	for (int i = rawBits; i < bits; i += 8) {
+		const uint16_t entry = huff_encodeTable[value & 0xFF];
+		codes |= (uint64_t)((entry >> 4) & 0x7FF) << bitCount;
+		bitCount += (int)(entry & 15);
+		value >>= 8;
+	}
+
+	// keep the bits already written to the current byte and flush the whole word
+	byte* const out = buffer + (bitIndex >> 3);
+	const uint32_t shift = (uint32_t)bitIndex & 7;
+	const uint64_t word = (uint64_t)(out[0] & ((1u << shift) - 1)) | (codes << shift);
+	memcpy(out, &word, sizeof(word));
+
+	return bitCount;
+}
+
@@ -75,6 +75,7 @@ void MSG_Copy( msg_t* buf, byte* data, int length, const msg_t* src )
 	}
 	Com_Memcpy(buf, src, sizeof(msg_t));
 	buf->data = data;
+	buf->maxsize = length;
 	Com_Memcpy(buf->data, src->data, src->cursize);
 }
 
@@ -123,7 +124,12 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 		} else {
 			Com_Error(ERR_DROP, "can't write %d bits\n", bits);
 		}
+	} else if ( msg->maxsize - (msg->bit >> 3) >= 8 ) {
+		value &= (0xffffffff>>(32-bits));
+		msg->bit += StatHuff_WriteBits( (uint32_t)value, bits, msg->data, msg->bit );
+		msg->cursize = (msg->bit>>3)+1;
 	} else {
+		// too close to the end of the buffer for whole words
 		value &= (0xffffffff>>(32-bits));
 		if (bits&7) {
 			int nbits;
@@ -149,6 +155,37 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 	}
 }
 
+// appends bits written by MSG_WriteBits to another message starting at bit 0
+// since the Huffman codes are static, the result is the same as writing them again
+void MSG_WriteBitstream( msg_t* msg, const byte* data, int numBits )
+{
+	if ( numBits <= 0 ) {
+		return;
+	}
+
+	// this isn't an exact overflow check either
+	if ( msg->maxsize - ((msg->bit + numBits) >> 3) < 4 ) {
+		msg->overflowed = qtrue;
+		return;
+	}
+
+	const int numBytes = (numBits + 7) >> 3;
+	const int shift = msg->bit & 7;
+	byte* const out = msg->data + (msg->bit >> 3);
+	if ( shift == 0 ) {
+		Com_Memcpy( out, data, numBytes );
+	} else {
+		// the bits past msg->bit in the current byte are always clear
+		for ( int i = 0; i < numBytes; ++i ) {
+			out[i] |= (byte)(data[i] << shift);
+			out[i + 1] = (byte)(data[i] >> (8 - shift));
+		}
+	}
+
+	msg->bit += numBits;
+	msg->cursize = (msg->bit>>3)+1;
+}
+
 int MSG_ReadBits( msg_t *msg, int bits ) {
 	int			value;
 	int			get;
@@ -182,7 +219,14 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 		} else {
 			Com_Error(ERR_DROP, "can't read %d bits\n", bits);
 		}
+	} else if ( msg->maxsize - (msg->bit >> 3) >= 8 ) {
+		uint32_t word;
+		msg->bit += StatHuff_ReadBits( &word, bits, msg->data, msg->bit );
+		msg->readcount = (msg->bit>>3)+1;
+		value = (int)word;
+		bits -= bits & 7;	// the sign extension below has always ignored the raw bits
 	} else {
+		// too close to the end of the buffer for whole words
 		nbits = 0;
 		if (bits&7) {
 			nbits = bits&7;
@@ -1199,3 +1243,175 @@ void MSG_ReadDeltaPlayerstate( msg_t* msg, const playerState_t* from, playerStat
 	}
 }
 
+
+
+/*
+=============================================================================
+
+Huffman bit stream benchmark
+
+Decodes and re-encodes every message of a demo with the per-symbol
+functions and with the word-at-a-time ones, checks that the results match
+and prints the throughput of both.
+
+=============================================================================
+*/
+
+#define HUFFBENCH_PASSES	16
+#define HUFFBENCH_PADDING	8	// the word-at-a-time functions access up to 8 bytes at once
+
+
+typedef struct {
+	int64_t	readUS[2];	// per-symbol, word-at-a-time
+	int64_t	writeUS[2];
+	int		messages;
+	int		bytes;
+	int		symbols;
+	qbool	mismatch;
+} huffBenchmark_t;
+
+
+static void MSG_BenchmarkMessage( huffBenchmark_t* bench, const byte* data, int length )
+{
+	static byte input[MAX_MSGLEN + HUFFBENCH_PADDING];
+	static byte output[2][MAX_MSGLEN * 2 + HUFFBENCH_PADDING];
+	static int symbols[2][MAX_MSGLEN * 4];	// codes are at least 2 bits long
+
+	Com_Memcpy( input, data, length );
+	Com_Memset( input + length, 0, HUFFBENCH_PADDING );
+	const int numBits = length * 8;
+
+	// decode
+	int numSymbols = 0;
+	int64_t start = Sys_Microseconds();
+	for ( int p = 0; p < HUFFBENCH_PASSES; ++p ) {
+		int bitIndex = 0;
+		numSymbols = 0;
+		while ( bitIndex < numBits ) {
+			bitIndex += StatHuff_ReadSymbol( &symbols[0][numSymbols++], input, bitIndex );
+		}
+	}
+	bench->readUS[0] += Sys_Microseconds() - start;
+
+	const int numWords = numSymbols / 4;
+	start = Sys_Microseconds();
+	for ( int p = 0; p < HUFFBENCH_PASSES; ++p ) {
+		int bitIndex = 0;
+		int s = 0;
+		for ( int w = 0; w < numWords; ++w, s += 4 ) {
+			uint32_t value;
+			bitIndex += StatHuff_ReadBits( &value, 32, input, bitIndex );
+			symbols[1][s + 0] = value & 0xFF;
+			symbols[1][s + 1] = (value >> 8) & 0xFF;
+			symbols[1][s + 2] = (value >> 16) & 0xFF;
+			symbols[1][s + 3] = value >> 24;
+		}
+		for ( ; s < numSymbols; ++s ) {
+			uint32_t value;
+			bitIndex += StatHuff_ReadBits( &value, 8, input, bitIndex );
+			symbols[1][s] = value;
+		}
+	}
+	bench->readUS[1] += Sys_Microseconds() - start;
+
+	// encode
+	int outputBits[2] = { 0, 0 };
+	start = Sys_Microseconds();
+	for ( int p = 0; p < HUFFBENCH_PASSES; ++p ) {
+		int bitIndex = 0;
+		for ( int s = 0; s < numSymbols; ++s ) {
+			bitIndex += StatHuff_WriteSymbol( symbols[0][s], output[0], bitIndex );
+		}
+		outputBits[0] = bitIndex;
+	}
+	bench->writeUS[0] += Sys_Microseconds() - start;
+
+	start = Sys_Microseconds();
+	for ( int p = 0; p < HUFFBENCH_PASSES; ++p ) {
+		int bitIndex = 0;
+		int s = 0;
+		for ( int w = 0; w < numWords; ++w, s += 4 ) {
+			const uint32_t value =
+				(uint32_t)symbols[0][s + 0] |
+				((uint32_t)symbols[0][s + 1] << 8) |
+				((uint32_t)symbols[0][s + 2] << 16) |
+				((uint32_t)symbols[0][s + 3] << 24);
+			bitIndex += StatHuff_WriteBits( value, 32, output[1], bitIndex );
+		}
+		for ( ; s < numSymbols; ++s ) {
+			bitIndex += StatHuff_WriteBits( (uint32_t)symbols[0][s], 8, output[1], bitIndex );
+		}
+		outputBits[1] = bitIndex;
+	}
+	bench->writeUS[1] += Sys_Microseconds() - start;
+
+	// the last symbol can straddle the end of the message, so only the complete bytes are compared
+	const int numBytes = min( length, outputBits[0] >> 3 );
+	if ( memcmp( symbols[0], symbols[1], numSymbols * sizeof(symbols[0][0]) ) != 0 ||
+		outputBits[0] != outputBits[1] ||
+		memcmp( output[0], output[1], outputBits[0] >> 3 ) != 0 ||
+		memcmp( output[0], input, numBytes ) != 0 ) {
+		bench->mismatch = qtrue;
+	}
+
+	bench->messages++;
+	bench->bytes += length;
+	bench->symbols += numSymbols;
+}
+
+
+static void MSG_PrintBenchmarkSpeed( const char* name, int bytes, int64_t us0, int64_t us1 )
+{
+	const double megaBytes = (double)bytes * HUFFBENCH_PASSES / (1024.0 * 1024.0);
+	const double speed0 = us0 > 0 ? megaBytes / ((double)us0 / 1000000.0) : 0.0;
+	const double speed1 = us1 > 0 ? megaBytes / ((double)us1 / 1000000.0) : 0.0;
+
+	Com_Printf( "%s: %7.1f MB/s per symbol, %7.1f MB/s per word (%.2fx)\n",
+		name, speed0, speed1, us1 > 0 ? (double)us0 / (double)us1 : 0.0 );
+}
+
+
+void MSG_Benchmark_f()
+{
+	if ( Cmd_Argc() != 2 ) {
+		Com_Printf( "usage: %s <demofile>\n", Cmd_Argv(0) );
+		return;
+	}
+
+	byte* file;
+	const int fileSize = FS_ReadFile( Cmd_Argv(1), (void**)&file );
+	if ( fileSize <= 0 || file == NULL ) {
+		Com_Printf( "couldn't load %s\n", Cmd_Argv(1) );
+		return;
+	}
+
+	huffBenchmark_t bench;
+	Com_Memset( &bench, 0, sizeof(bench) );
+
+	// each message is stored as: sequence number, length, data
+	int offset = 0;
+	while ( offset + 8 <= fileSize ) {
+		const int length = LittleLong( *(const int*)(file + offset + 4) );
+		offset += 8;
+		if ( length == -1 ) {
+			break;
+		}
+		if ( length < 0 || length > MAX_MSGLEN || offset + length > fileSize ) {
+			Com_Printf( "^3WARNING: %s is corrupted or truncated\n", Cmd_Argv(1) );
+			break;
+		}
+		MSG_BenchmarkMessage( &bench, file + offset, length );
+		offset += length;
+	}
+
+	FS_FreeFile( file );
+
+	Com_Printf( "%d messages, %d KB, %d symbols, %d passes\n", bench.messages, bench.bytes >> 10, bench.symbols, HUFFBENCH_PASSES );
+	MSG_PrintBenchmarkSpeed( "Decode", bench.bytes, bench.readUS[0], bench.readUS[1] );
+	MSG_PrintBenchmarkSpeed( "Encode", bench.bytes, bench.writeUS[0], bench.writeUS[1] );
+	if ( bench.mismatch ) {
+		Com_Printf( "^1ERROR: the per-symbol and per-word bit streams don't match\n" );
+	} else {
+		Com_Printf( "The per-symbol and per-word bit streams match\n" );
+	}
+}
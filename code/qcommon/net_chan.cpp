@@ -48,8 +48,6 @@ to the new value before sending out any replies.
 */
 
 
-#define	MAX_PACKETLEN			1400		// max size of a network packet
-
 #define	FRAGMENT_SIZE			(MAX_PACKETLEN - 100)
 #define	PACKET_HEADER			10			// two ints and a short
 
@@ -480,55 +478,152 @@ static void NET_SendLoopPacket( netsrc_t sock, int length, const void* data, con
 
 //=============================================================================
 
-typedef struct packetQueue_s {
-	struct packetQueue_s* next;
-	int length;
-	byte* data;
-	netadr_t to;
-	int release;
-} packetQueue_t;
+// delayed packets for network emulation (cl/sv_packetdelay, jitter and loss)
+// they're stored in a timing wheel with one bucket per millisecond,
+// so queuing a packet is O(1) and flushing only visits the elapsed buckets
+
+#define PACKET_WHEEL_SIZE		2048	// must be a power of 2 and more than the max. delay in ms
+#define PACKET_WHEEL_MASK		(PACKET_WHEEL_SIZE - 1)
+#define MAX_PACKET_DELAY		999
+#define MAX_PACKET_JITTER		500
+#define DELAYED_PACKETS_PER_BLOCK	256
+
+typedef struct delayedPacket_s {
+	struct delayedPacket_s* next;
+	int64_t		release;	// Sys_Microseconds time
+	netadr_t	to;
+	int			length;
+	byte*		data;		// points to buffer unless the packet didn't fit
+	byte		buffer[MAX_PACKETLEN];
+} delayedPacket_t;
+
+typedef struct {
+	delayedPacket_t*	head;
+	delayedPacket_t*	tail;
+} packetBucket_t;
 
-static packetQueue_t* packetQueue = NULL;
+typedef struct {
+	packetBucket_t		buckets[PACKET_WHEEL_SIZE];
+	int64_t				currentMS;		// the next bucket to flush
+	int					count;			// packets in the wheel
+	delayedPacket_t*	freePackets;	// allocated in blocks that are never released
+} packetWheel_t;
 
-static void NET_QueuePacket( int length, const void* data, netadr_t to, int offset )
+static packetWheel_t packetWheel;
+
+
+static delayedPacket_t* NET_AllocDelayedPacket()
 {
-	packetQueue_t* pq = (packetQueue_t*)S_Malloc(sizeof(packetQueue_t));
-	pq->data = (byte*)S_Malloc(length);
-	Com_Memcpy( pq->data, data, length );
-	pq->length = length;
-	pq->to = to;
-	pq->release = Sys_Milliseconds() + ((float)min(offset, 999) / com_timescale->value);
-	pq->next = NULL;
-
-	if (!packetQueue) {
-		packetQueue = pq;
-		return;
+	if ( !packetWheel.freePackets ) {
+		delayedPacket_t* const block = (delayedPacket_t*)Z_Malloc( DELAYED_PACKETS_PER_BLOCK * sizeof(delayedPacket_t) );
+		for ( int i = 0; i < DELAYED_PACKETS_PER_BLOCK; ++i ) {
+			block[i].next = packetWheel.freePackets;
+			packetWheel.freePackets = &block[i];
+		}
 	}
 
-	packetQueue_t* next = packetQueue;
-	while (next) {
-		if (!next->next) {
-			next->next = pq;
-			return;
-		}
-		next = next->next;
+	delayedPacket_t* const packet = packetWheel.freePackets;
+	packetWheel.freePackets = packet->next;
+
+	return packet;
+}
+
+
+static void NET_FreeDelayedPacket( delayedPacket_t* packet )
+{
+	if ( packet->data != packet->buffer ) {
+		Z_Free( packet->data );
+	}
+	packet->next = packetWheel.freePackets;
+	packetWheel.freePackets = packet;
+}
+
+
+static void NET_QueuePacket( int length, const void* data, const netadr_t& to, int delay, int jitter )
+{
+	if ( jitter > 0 ) {
+		delay += rand() % (min( jitter, MAX_PACKET_JITTER ) + 1);
+	}
+
+	int64_t delayUS = (int64_t)min( delay, MAX_PACKET_DELAY + MAX_PACKET_JITTER ) * 1000;
+	if ( com_timescale->value > 0.0f ) {
+		delayUS = (int64_t)( (double)delayUS / com_timescale->value );
+	}
+
+	const int64_t now = Sys_Microseconds();
+	if ( packetWheel.count == 0 ) {
+		packetWheel.currentMS = now / 1000;
+	}
+
+	// the wheel can't hold packets more than a turn ahead
+	const int64_t release = min( now + delayUS, (packetWheel.currentMS + PACKET_WHEEL_SIZE - 1) * 1000 );
+
+	delayedPacket_t* const packet = NET_AllocDelayedPacket();
+	packet->next = NULL;
+	packet->release = release;
+	packet->to = to;
+	packet->length = length;
+	packet->data = length <= (int)sizeof(packet->buffer) ? packet->buffer : (byte*)Z_Malloc( length );
+	Com_Memcpy( packet->data, data, length );
+
+	packetBucket_t* const bucket = &packetWheel.buckets[(release / 1000) & PACKET_WHEEL_MASK];
+	if ( bucket->tail ) {
+		bucket->tail->next = packet;
+	} else {
+		bucket->head = packet;
 	}
+	bucket->tail = packet;
+	packetWheel.count++;
 }
 
 
 void NET_FlushPacketQueue()
 {
-	packetQueue_t* last;
+	if ( packetWheel.count == 0 ) {
+		return;
+	}
+
+	const int64_t now = Sys_Microseconds();
+	const int64_t nowMS = now / 1000;
+
+	// after a long hitch, every bucket is visited once
+	const int64_t firstMS = max( packetWheel.currentMS, nowMS - PACKET_WHEEL_SIZE + 1 );
+	for ( int64_t ms = firstMS; ms <= nowMS && packetWheel.count > 0; ++ms ) {
+		packetBucket_t* const bucket = &packetWheel.buckets[ms & PACKET_WHEEL_MASK];
+		delayedPacket_t* prev = NULL;
+		delayedPacket_t* packet = bucket->head;
+		while ( packet ) {
+			delayedPacket_t* const next = packet->next;
+			if ( packet->release > now ) {
+				prev = packet;
+				packet = next;
+				continue;
+			}
 
-	while (packetQueue) {
-		if (packetQueue->release >= Sys_Milliseconds())
-			break;
-		Sys_SendPacket( packetQueue->length, packetQueue->data, packetQueue->to );
-		last = packetQueue;
-		packetQueue = packetQueue->next;
-		Z_Free(last->data);
-		Z_Free(last);
+			if ( prev ) {
+				prev->next = next;
+			} else {
+				bucket->head = next;
+			}
+			if ( bucket->tail == packet ) {
+				bucket->tail = prev;
+			}
+
+			Sys_SendPacket( packet->length, packet->data, packet->to );
+			NET_FreeDelayedPacket( packet );
+			packetWheel.count--;
+			packet = next;
+		}
 	}
+
+	// the current millisecond's bucket can still get packets released later in it
+	packetWheel.currentMS = nowMS;
+}
+
+
+static qbool NET_DropPacket( int lossPercentage )
+{
+	return lossPercentage > 0 && (rand() % 100) < lossPercentage;
 }
 
 
@@ -550,15 +645,26 @@ void NET_SendPacket( netsrc_t sock, int length, const void* data, const netadr_t
 		return;
 	}
 
-	if ( sock == NS_CLIENT && cl_packetdelay->integer > 0 ) {
-		NET_QueuePacket( length, data, to, cl_packetdelay->integer );
-	}
-	else if ( sock == NS_SERVER && sv_packetdelay->integer > 0 ) {
-		NET_QueuePacket( length, data, to, sv_packetdelay->integer );
+	if ( sock == NS_CLIENT ) {
+		if ( NET_DropPacket( cl_packetloss->integer ) ) {
+			return;
+		}
+		if ( cl_packetdelay->integer > 0 || cl_packetjitter->integer > 0 ) {
+			NET_QueuePacket( length, data, to, cl_packetdelay->integer, cl_packetjitter->integer );
+			return;
+		}
 	}
-	else {
-		Sys_SendPacket( length, data, to );
+	else if ( sock == NS_SERVER ) {
+		if ( NET_DropPacket( sv_packetloss->integer ) ) {
+			return;
+		}
+		if ( sv_packetdelay->integer > 0 || sv_packetjitter->integer > 0 ) {
+			NET_QueuePacket( length, data, to, sv_packetdelay->integer, sv_packetjitter->integer );
+			return;
+		}
 	}
+
+	Sys_SendPacket( length, data, to );
 }
 
 
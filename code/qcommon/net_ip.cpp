@@ -225,34 +225,60 @@ qbool Sys_StringToAdr( const char *s, netadr_t *a )
 
 // never called by the game logic, just the system event queing
 
-#ifdef _DEBUG
-static int recvfromCount;
+// on Linux, we use recvmmsg/sendmmsg to move several datagrams per syscall:
+// - Sys_GetPacket drains the socket into a ring and hands out one packet per call
+//   the datagrams are read straight into reserved packet slots when enough of them are free
+// - Sys_SendPacket queues datagrams between Sys_BeginPacketBatch and Sys_EndPacketBatch
+#if defined(__linux__)
+#define NET_BATCHED_IO
 #endif
 
-qbool Sys_GetPacket( netadr_t* net_from, msg_t* net_message )
-{
-	if (ip_socket == INVALID_SOCKET)
-		return qfalse;
+#define NET_RECV_BATCH	32
+#define NET_SEND_BATCH	64
+
+typedef struct {
+	int64_t	recvCalls;
+	int64_t	recvPackets;
+	int64_t	sendCalls;
+	int64_t	sendPackets;
+} netStats_t;
+
+static netStats_t netStats;
+
+#if defined(NET_BATCHED_IO)
+
+typedef struct {
+	byte				data[NET_RECV_BATCH][MAX_MSGLEN];	// used when no packet slot could be reserved
+	packetSlot_t*		slots[NET_RECV_BATCH];	// reserved packet slots, NULL when data[i] is used
+	struct sockaddr		from[NET_RECV_BATCH];
+	struct iovec		iovecs[NET_RECV_BATCH];
+	struct mmsghdr		headers[NET_RECV_BATCH];
+	int					count;	// number of packets read by the last recvmmsg
+	int					next;	// index of the next packet to hand out
+} recvRing_t;
+
+typedef struct {
+	byte				data[NET_SEND_BATCH][MAX_PACKETLEN];
+	struct sockaddr		to[NET_SEND_BATCH];
+	struct iovec		iovecs[NET_SEND_BATCH];
+	struct mmsghdr		headers[NET_SEND_BATCH];
+	netadrtype_t		types[NET_SEND_BATCH];
+	int					count;
+	qbool				active;
+} sendBatch_t;
+
+static recvRing_t recvRing;
+static sendBatch_t sendBatch;
 
-#ifdef _DEBUG
-	++recvfromCount;
 #endif
 
-	struct sockaddr from;
-	socklen_t fromlen = sizeof(from);
-	int ret = recvfrom( ip_socket, (char*)net_message->data, net_message->maxsize, 0, (struct sockaddr *)&from, &fromlen );
-	if (ret == SOCKET_ERROR) {
-		int err = socketError;
-		if (err == EAGAIN || err == ECONNRESET)
-			return qfalse;
-		Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
-		return qfalse;
-	}
 
-	memset( ((struct sockaddr_in *)&from)->sin_zero, 0, 8 );
+static qbool NET_ProcessPacket( struct sockaddr* from, socklen_t fromlen, int length, netadr_t* net_from, msg_t* net_message )
+{
+	memset( ((struct sockaddr_in *)from)->sin_zero, 0, 8 );
 
-	if ( usingSocks && memcmp( &from, &socksRelayAddr, fromlen ) == 0 ) {
-		if ( ret < 10 || net_message->data[0] != 0 || net_message->data[1] != 0 || net_message->data[2] != 0 || net_message->data[3] != 1 ) {
+	if ( usingSocks && memcmp( from, &socksRelayAddr, fromlen ) == 0 ) {
+		if ( length < 10 || net_message->data[0] != 0 || net_message->data[1] != 0 || net_message->data[2] != 0 || net_message->data[3] != 1 ) {
 			return qfalse;
 		}
 		net_from->type = NA_IP;
@@ -264,20 +290,197 @@ qbool Sys_GetPacket( netadr_t* net_from, msg_t* net_message )
 		net_message->readcount = 10;
 	}
 	else {
-		SockadrToNetadr( &from, net_from );
+		SockadrToNetadr( from, net_from );
 		net_message->readcount = 0;
 	}
 
-	if( ret == net_message->maxsize ) {
+	if( length >= net_message->maxsize ) {
 		Com_Printf( "Oversize packet from %s\n", NET_AdrToString (*net_from) );
 		return qfalse;
 	}
 
-	net_message->cursize = ret;
+	net_message->cursize = length;
 	return qtrue;
 }
 
 
+#if defined(NET_BATCHED_IO)
+
+static void NET_ReleaseRecvSlot( int index )
+{
+	if (recvRing.slots[index] != NULL) {
+		Com_ReleasePacketSlot( recvRing.slots[index] );
+		recvRing.slots[index] = NULL;
+	}
+}
+
+
+// gives back the slots of the packets that weren't handed out yet
+static void NET_ClearRecvRing()
+{
+	for (int i = recvRing.next; i < recvRing.count; ++i)
+		NET_ReleaseRecvSlot( i );
+	recvRing.count = 0;
+	recvRing.next = 0;
+}
+
+
+static void NET_FillRecvRing()
+{
+	recvRing.count = 0;
+	recvRing.next = 0;
+
+	const int reserved = Com_ReservePacketSlots( recvRing.slots, NET_RECV_BATCH );
+	for (int i = 0; i < NET_RECV_BATCH; ++i) {
+		if (i >= reserved)
+			recvRing.slots[i] = NULL;
+		recvRing.iovecs[i].iov_base = recvRing.slots[i] != NULL ? recvRing.slots[i]->data : recvRing.data[i];
+		recvRing.iovecs[i].iov_len = MAX_MSGLEN;
+		struct msghdr* const hdr = &recvRing.headers[i].msg_hdr;
+		memset( hdr, 0, sizeof(*hdr) );
+		hdr->msg_name = &recvRing.from[i];
+		hdr->msg_namelen = sizeof(recvRing.from[i]);
+		hdr->msg_iov = &recvRing.iovecs[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	++netStats.recvCalls;
+	const int ret = recvmmsg( ip_socket, recvRing.headers, NET_RECV_BATCH, MSG_DONTWAIT, NULL );
+	if (ret == SOCKET_ERROR) {
+		const int err = socketError;
+		if (err != EAGAIN && err != ECONNRESET)
+			Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
+		for (int i = 0; i < reserved; ++i)
+			NET_ReleaseRecvSlot( i );
+		return;
+	}
+
+	for (int i = ret; i < reserved; ++i)
+		NET_ReleaseRecvSlot( i );
+	recvRing.count = ret;
+	netStats.recvPackets += ret;
+}
+
+
+qbool Sys_GetPacket( netadr_t* net_from, msg_t* net_message )
+{
+	if (ip_socket == INVALID_SOCKET)
+		return qfalse;
+
+	for (;;) {
+		if (recvRing.next >= recvRing.count) {
+			NET_FillRecvRing();
+			if (recvRing.count <= 0)
+				return qfalse;
+		}
+
+		const int i = recvRing.next++;
+		const struct msghdr* const hdr = &recvRing.headers[i].msg_hdr;
+		int length = (int)recvRing.headers[i].msg_len;
+		if (hdr->msg_flags & MSG_TRUNC)
+			length = MAX_MSGLEN;
+
+		// when the caller's buffer is the packet's own slot, the packet is already in place
+		const byte* const data = (const byte*)recvRing.iovecs[i].iov_base;
+		if (data != net_message->data) {
+			Com_Memcpy( net_message->data, data, min(length, net_message->maxsize) );
+			NET_ReleaseRecvSlot( i );
+		}
+		if (NET_ProcessPacket( &recvRing.from[i], hdr->msg_namelen, length, net_from, net_message ))
+			return qtrue;
+
+		// dropped, but the caller can still use its buffer for the next packet
+		NET_ReleaseRecvSlot( i );
+	}
+}
+
+#else
+
+qbool Sys_GetPacket( netadr_t* net_from, msg_t* net_message )
+{
+	if (ip_socket == INVALID_SOCKET)
+		return qfalse;
+
+	struct sockaddr from;
+	socklen_t fromlen = sizeof(from);
+	++netStats.recvCalls;
+	int ret = recvfrom( ip_socket, (char*)net_message->data, net_message->maxsize, 0, (struct sockaddr *)&from, &fromlen );
+	if (ret == SOCKET_ERROR) {
+		int err = socketError;
+		if (err == EAGAIN || err == ECONNRESET)
+			return qfalse;
+		Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
+		return qfalse;
+	}
+	++netStats.recvPackets;
+
+	return NET_ProcessPacket( &from, fromlen, ret, net_from, net_message );
+}
+
+#endif
+
+
+static void NET_PrintSendError( netadrtype_t type )
+{
+	int err = socketError;
+
+	// wouldblock is silent
+	if( err == EAGAIN ) {
+		return;
+	}
+
+	// some PPP links do not allow broadcasts and return an error
+	if( ( err == EADDRNOTAVAIL ) && ( ( type == NA_BROADCAST ) ) ) {
+		return;
+	}
+
+	Com_Printf( "NET_SendPacket: %s\n", NET_ErrorString() );
+}
+
+
+#if defined(NET_BATCHED_IO)
+
+static void NET_FlushSendBatch()
+{
+	int sent = 0;
+	while (sent < sendBatch.count) {
+		++netStats.sendCalls;
+		const int ret = sendmmsg( ip_socket, sendBatch.headers + sent, sendBatch.count - sent, 0 );
+		if (ret == SOCKET_ERROR) {
+			// the first datagram failed, report it and move on to the next
+			NET_PrintSendError( sendBatch.types[sent] );
+			++sent;
+			continue;
+		}
+		netStats.sendPackets += ret;
+		sent += ret;
+	}
+
+	sendBatch.count = 0;
+}
+
+#endif
+
+
+void Sys_BeginPacketBatch()
+{
+#if defined(NET_BATCHED_IO)
+	sendBatch.active = qtrue;
+#endif
+}
+
+
+void Sys_EndPacketBatch()
+{
+#if defined(NET_BATCHED_IO)
+	if (sendBatch.count > 0 && ip_socket != INVALID_SOCKET)
+		NET_FlushSendBatch();
+	sendBatch.count = 0;
+	sendBatch.active = qfalse;
+#endif
+}
+
+
 void Sys_SendPacket( int length, const void* data, netadr_t to )
 {
 	static char socksBuf[4096];
@@ -294,6 +497,31 @@ void Sys_SendPacket( int length, const void* data, netadr_t to )
 	struct sockaddr addr;
 	NetadrToSockadr( &to, &addr );
 
+#if defined(NET_BATCHED_IO)
+	if( sendBatch.active && !usingSocks && to.type == NA_IP && length <= MAX_PACKETLEN ) {
+		const int i = sendBatch.count++;
+		Com_Memcpy( sendBatch.data[i], data, length );
+		sendBatch.to[i] = addr;
+		sendBatch.types[i] = to.type;
+		sendBatch.iovecs[i].iov_base = sendBatch.data[i];
+		sendBatch.iovecs[i].iov_len = length;
+		struct msghdr* const hdr = &sendBatch.headers[i].msg_hdr;
+		memset( hdr, 0, sizeof(*hdr) );
+		hdr->msg_name = &sendBatch.to[i];
+		hdr->msg_namelen = sizeof(sendBatch.to[i]);
+		hdr->msg_iov = &sendBatch.iovecs[i];
+		hdr->msg_iovlen = 1;
+		if (sendBatch.count == NET_SEND_BATCH)
+			NET_FlushSendBatch();
+		return;
+	}
+
+	// keep the datagrams in order
+	if( sendBatch.count > 0 )
+		NET_FlushSendBatch();
+#endif
+
+	++netStats.sendCalls;
 	if( usingSocks && to.type == NA_IP ) {
 		socksBuf[0] = 0;	// reserved
 		socksBuf[1] = 0;
@@ -309,20 +537,34 @@ void Sys_SendPacket( int length, const void* data, netadr_t to )
 	}
 
 	if (ret == SOCKET_ERROR) {
-		int err = socketError;
+		NET_PrintSendError( to.type );
+		return;
+	}
+	++netStats.sendPackets;
+}
 
-		// wouldblock is silent
-		if( err == EAGAIN ) {
-			return;
-		}
 
-		// some PPP links do not allow broadcasts and return an error
-		if( ( err == EADDRNOTAVAIL ) && ( ( to.type == NA_BROADCAST ) ) ) {
-			return;
-		}
+static void NET_PrintRatio( const char* name, int64_t packets, int64_t calls )
+{
+	Com_Printf( "%s: %lld packets, %lld syscalls, %.2f packets/syscall\n",
+		name, (long long)packets, (long long)calls, calls > 0 ? (double)packets / (double)calls : 0.0 );
+}
 
-		Com_Printf( "NET_SendPacket: %s\n", NET_ErrorString() );
+
+static void NET_Stats_f()
+{
+	if ( Cmd_Argc() == 2 && !Q_stricmp( Cmd_Argv(1), "reset" ) ) {
+		Com_Memset( &netStats, 0, sizeof(netStats) );
+		return;
 	}
+
+#if defined(NET_BATCHED_IO)
+	Com_Printf( "Batched I/O: recvmmsg/sendmmsg\n" );
+#else
+	Com_Printf( "Batched I/O: not available\n" );
+#endif
+	NET_PrintRatio( "Received", netStats.recvPackets, netStats.recvCalls );
+	NET_PrintRatio( "Sent    ", netStats.sendPackets, netStats.sendCalls );
 }
 
 
@@ -869,6 +1111,11 @@ static void NET_Config( qboolean enableNetworking )
 			closesocket( socks_socket );
 			socks_socket = INVALID_SOCKET;
 		}
+
+#if defined(NET_BATCHED_IO)
+		NET_ClearRecvRing();
+		sendBatch.count = 0;
+#endif
 	}
 
 	if (enableNetworking && !net_noudp->integer) {
@@ -877,6 +1124,12 @@ static void NET_Config( qboolean enableNetworking )
 }
 
 
+static const cmdTableItem_t net_cmds[] =
+{
+	{ "net_stats", NET_Stats_f, NULL, "prints packets per syscall, " S_COLOR_VAL "reset " S_COLOR_HELP "clears the counters" }
+};
+
+
 void NET_Init()
 {
 	QSUBSYSTEM_INIT_START( "Networking" );
@@ -893,6 +1146,8 @@ void NET_Init()
 	// this is really just to get the cvars registered
 	NET_GetCvars();
 
+	Cmd_RegisterArray( net_cmds, MODULE_COMMON );
+
 	NET_Config( qtrue );
 
 	QSUBSYSTEM_INIT_DONE( "Networking" );
@@ -53,6 +53,7 @@ void MSG_Bitstream( msg_t *buf );
 void MSG_Copy( msg_t* buf, byte* data, int length, const msg_t* src );
 
 void MSG_WriteBits( msg_t *msg, int value, int bits );
+void MSG_WriteBitstream( msg_t* msg, const byte* data, int numBits );
 
 void MSG_WriteByte (msg_t *sb, int c);
 void MSG_WriteShort (msg_t *sb, int c);
@@ -83,6 +84,8 @@ void MSG_ReadDeltaEntity( msg_t* msg, const entityState_t* from, entityState_t*
 void MSG_WriteDeltaPlayerstate( msg_t* msg, const playerState_t* from, playerState_t* to );
 void MSG_ReadDeltaPlayerstate( msg_t* msg, const playerState_t* from, playerState_t* to );
 
+void MSG_Benchmark_f();	// compares the Huffman bit stream functions using a demo
+
 
 /*
 ==============================================================
@@ -139,6 +142,7 @@ void NET_Sleep( int msec );
 
 
 #define MAX_MSGLEN 16384 // max length of a message, which may be fragmented into multiple packets
+#define MAX_PACKETLEN 1400 // max size of a network packet
 
 
 /*
@@ -656,7 +660,12 @@ fileHandle_t	FS_FOpenFileWrite( const char *qpath );
 
 fileHandle_t FS_SV_FOpenFileWrite( const char *filename );
 int		FS_SV_FOpenFileRead( const char *filename, fileHandle_t *fp );
+const byte*	FS_SV_MapFileRead( const char *filename, int *size );
+// maps a file like FS_SV_FOpenFileRead finds it, release with Sys_UnmapFile
 void	FS_SV_Rename( const char *from, const char *to );
+void	FS_SV_RemoveFile( const char *filename );
+qbool	FS_SV_ReplaceFile( const char *from, const char *to );
+// renames a fully written file over another one, deletes the source and returns qfalse on failure
 int		FS_FOpenFileRead( const char *qpath, fileHandle_t *file, qbool uniqueFILE );
 // if uniqueFILE is qtrue, then a new FILE will be fopened even if the file
 // is found in an already open pak file.  If uniqueFILE is qfalse, you must call
@@ -871,6 +880,10 @@ extern	cvar_t	*sv_paused;
 
 extern	cvar_t	*cl_packetdelay;
 extern	cvar_t	*sv_packetdelay;
+extern	cvar_t	*cl_packetjitter;
+extern	cvar_t	*sv_packetjitter;
+extern	cvar_t	*cl_packetloss;
+extern	cvar_t	*sv_packetloss;
 
 // com_speeds times
 extern	int		time_game;
@@ -1041,9 +1054,25 @@ void SV_Init();
 void SV_Shutdown( const char* finalmsg );
 void SV_Frame( int msec );
 int SV_FrameSleepMS();	// the number of milli-seconds Com_Frame should sleep
+void SV_TakeTraceCacheStats( int* hits, int* lookups );	// zeroes them
 void SV_PacketEvent( const netadr_t& from, msg_t* msg );
 qbool SV_GameCommand();
 
+// server frame profiler, the time spent in each phase is summed up per server frame
+typedef enum {
+	SVP_FRAME,		// SV_Frame after the early outs
+	SVP_PACKETS,	// SV_PacketEvent
+	SVP_GAME,		// the game VM's frames
+	SVP_PINGS,		// SV_CalcPings
+	SVP_TIMEOUTS,	// SV_CheckTimeouts
+	SVP_BUILD,		// snapshot entity culling and copies
+	SVP_ENCODE,		// snapshot delta encoding
+	SVP_SEND,		// downloads, netchan and sockets
+	SVP_COUNT
+} serverPhase_t;
+
+void SV_ProfileAdd( serverPhase_t phase, int64_t startUS );	// adds the time elapsed since startUS (Sys_Microseconds)
+
 
 //
 // UI interface
@@ -1089,6 +1118,18 @@ typedef struct {
 
 sysEvent_t	Sys_GetEvent();
 
+// the layout matches the SE_PACKET event data, so a slot can be used as evPtr
+typedef struct {
+	netadr_t	from;
+	byte		data[MAX_MSGLEN];
+} packetSlot_t;
+
+packetSlot_t*	Com_GetPacketSlot();	// returns NULL when the next slot is still in use
+void			Com_QueuePacketSlot( const packetSlot_t* slot );	// call when the slot holds a packet
+int				Com_ReservePacketSlots( packetSlot_t** slots, int maxCount );	// the free slots from the head on, in hand-out order
+void			Com_ReleasePacketSlot( const packetSlot_t* slot );	// gives back a reserved slot that won't be queued
+void			Com_FreeEventPtr( void* ptr );	// frees sysEvent_t::evPtr, whether it's a packet slot or not
+
 void	Sys_Init();
 void	Sys_Quit( int status ); // status is the engine's exit code
 
@@ -1123,6 +1164,8 @@ void	Sys_SetErrorText( const char *text );
 // system-specific but not implemented in the platform layer
 qbool	Sys_GetPacket( netadr_t* net_from, msg_t* net_message );
 void	Sys_SendPacket( int length, const void *data, netadr_t to );
+void	Sys_BeginPacketBatch();	// Sys_SendPacket will queue datagrams where possible
+void	Sys_EndPacketBatch();	// sends all queued datagrams
 qbool	Sys_StringToAdr( const char *s, netadr_t *a );	// does NOT parse port numbers, only base addresses
 qbool	Sys_IsLANAddress( const netadr_t& adr );
 void	Sys_ShowIP();
@@ -1134,6 +1177,9 @@ const char* Sys_DefaultHomePath();
 char**	Sys_ListFiles( const char *directory, const char *extension, const char *filter, int *numfiles, qbool wantsubs );
 void	Sys_FreeFileList( char **list );
 
+const byte*	Sys_MapFile( const char* path, int* size );	// read-only, NULL if missing or empty
+void		Sys_UnmapFile( const byte* data, int size );
+
 qbool	Sys_LowPhysicalMemory( void );
 
 qbool	Sys_HardReboot(); // qtrue when the server can restart itself
@@ -1148,6 +1194,29 @@ void	Sys_Sleep( int ms );
 void	Sys_MicroSleep( int us );
 int64_t	Sys_Microseconds();
 
+// worker threads for data-parallel work, the calling thread always takes part
+// jobs run in no particular order and must not call Com_Printf, Com_Error, Z_Malloc, etc
+// when threadCount is 1, the jobs run on the calling thread in increasing index order
+#define MAX_WORKER_THREADS	32
+typedef void (*jobFunction_t)( void* data, int index );
+int		Sys_GetCoreCount();
+void	Sys_RunParallel( jobFunction_t function, void* data, int count, int threadCount );
+int		Sys_AtomicAdd( volatile int* value, int amount );	// returns the previous value
+
+// calls the sampler at regular intervals while the thread that started sampling is interrupted
+// it runs in a signal handler or while the thread is suspended,
+// so it may only read memory and write to preallocated buffers
+typedef void (*profileSampler_t)();
+qbool	Sys_StartProfileSampling( int intervalUS, profileSampler_t sampler );
+void	Sys_StopProfileSampling();
+
+// for globals that each thread needs its own copy of
+#if defined(_MSC_VER)
+#define THREAD_LOCAL	__declspec(thread)
+#else
+#define THREAD_LOCAL	__thread
+#endif
+
 #ifndef DEDICATED
 qbool	Sys_IsMinimized();
 #endif
@@ -1163,6 +1232,10 @@ int		StatHuff_ReadBit( byte* buffer, int bitIndex );                 // returns
 void	StatHuff_WriteBit( int bit, byte* buffer, int bitIndex );
 int		StatHuff_ReadSymbol( int* symbol, byte* buffer, int bitIndex ); // returns the number of bits read
 int		StatHuff_WriteSymbol( int symbol, byte* buffer, int bitIndex ); // returns the number of bits written
+// word-at-a-time versions for up to 32 bits, they access 8 bytes at buffer + (bitIndex >> 3)
+// like StatHuff_ReadSymbol, they expect a little-endian CPU
+int		StatHuff_ReadBits( uint32_t* value, int bits, const byte* buffer, int bitIndex );  // returns the number of bits read
+int		StatHuff_WriteBits( uint32_t value, int bits, byte* buffer, int bitIndex );     // returns the number of bits written
 
 
 #define SV_ENCODE_START		4
@@ -119,6 +119,8 @@ opcode_info_t ops[ OP_MAX ] =
 vm_t	*currentVM = NULL;
 vm_t	*lastVM    = NULL;
 
+cvar_t	*vm_cache;
+
 #define	MAX_VM		3
 vm_t	vmTable[MAX_VM];
 
@@ -133,7 +135,22 @@ static const cvarTableItem_t vm_cvars[] =
 {
 	{ NULL, "vm_cgame", "2", CVAR_ARCHIVE, CVART_INTEGER, "0", "2", "how to load the cgame VM" help_vm_load },
 	{ NULL, "vm_game", "2", CVAR_ARCHIVE, CVART_INTEGER, "0", "2", "how to load the qagame VM" help_vm_load },
-	{ NULL, "vm_ui", "2", CVAR_ARCHIVE, CVART_INTEGER, "0", "2", "how to load the ui VM" help_vm_load }
+	{ NULL, "vm_ui", "2", CVAR_ARCHIVE, CVART_INTEGER, "0", "2", "how to load the ui VM" help_vm_load },
+	{ &vm_cache, "vm_cache", "1", CVAR_ARCHIVE, CVART_BOOL, NULL, NULL, "caches JIT-compiled QVM code on disk" }
+};
+
+
+static void VM_Profile_f();
+static void VM_Trace_f();
+static qbool VM_IsTraced( const vm_t* vm );
+static void VM_StopTrace();
+static void VM_TraceCall( const vm_t* vm, int callnum, va_list argptr );
+static void VM_TraceReturn( const vm_t* vm, int value );
+
+static const cmdTableItem_t vm_cmds[] =
+{
+	{ "vmprofile", VM_Profile_f, NULL, "samples QVM call stacks for flame graphs" help_vmprofile },
+	{ "vmtrace", VM_Trace_f, NULL, "records QVM calls for cnq3-vmbench" help_vmtrace }
 };
 
 
@@ -144,6 +161,7 @@ VM_Init
 */
 void VM_Init( void ) {
 	Cvar_RegisterArray( vm_cvars, MODULE_COMMON );
+	Cmd_RegisterArray( vm_cmds, MODULE_COMMON );
 
 	Com_Memset( vmTable, 0, sizeof( vmTable ) );
 }
@@ -177,46 +195,24 @@ static int ParseHex( const char* text )
 	return value;
 }
 
+typedef void (*symbolCallback_t)( void* userData, int value, const char* name );
+
+
 /*
 ===============
-VM_LoadSymbols
+VM_ParseSymbols
+
+Calls the callback with each code segment symbol of a .map file
 ===============
 */
-void VM_LoadSymbols( vm_t *vm ) {
-	union {
-		char	*c;
-		void	*v;
-	}			mapfile;
+static void VM_ParseSymbols( const char* text, symbolCallback_t callback, void* userData )
+{
 	const char	*text_p;
 	const char	*token;
-	char		name[MAX_QPATH];
-	char		symbols[MAX_QPATH];
-	vmSymbol_t	**prev, *sym;
-	int			count;
 	int			value;
-	int			chars;
 	int			segment;
-	int			numInstructions;
 
-	// don't load symbols if not developer
-	if ( !com_developer->integer ) {
-		return;
-	}
-
-	COM_StripExtension(vm->name, name, sizeof(name));
-	Com_sprintf( symbols, sizeof( symbols ), "vm/%s.map", name );
-	FS_ReadFile( symbols, &mapfile.v );
-	if ( !mapfile.c ) {
-		Com_Printf( "Couldn't load symbol file: %s\n", symbols );
-		return;
-	}
-
-	numInstructions = vm->instructionCount;
-
-	// parse the symbols
-	text_p = mapfile.c;
-	prev = &vm->symbols;
-	count = 0;
+	text_p = text;
 
 	while ( 1 ) {
 		token = COM_Parse( &text_p );
@@ -242,26 +238,83 @@ void VM_LoadSymbols( vm_t *vm ) {
 			Com_Printf( "WARNING: incomplete line at end of file\n" );
 			break;
 		}
-		chars = strlen( token );
-		sym = (vmSymbol_t*)Hunk_Alloc( sizeof( *sym ) + chars, h_high );
-		*prev = sym;
-		prev = &sym->next;
-		sym->next = NULL;
-
-		// convert value from an instruction number to a code offset
-		if ( vm->instructionPointers && value >= 0 && value < numInstructions ) {
-			value = vm->instructionPointers[value];
-		}
 
-		sym->symValue = value;
-		Q_strncpyz( sym->symName, token, chars + 1 );
+		callback( userData, value, token );
+	}
+}
+
+
+static void* VM_ReadSymbolFile( const vm_t* vm, char* path, int pathSize )
+{
+	char name[MAX_QPATH];
+	void* mapfile;
+
+	COM_StripExtension( vm->name, name, sizeof(name) );
+	Com_sprintf( path, pathSize, "vm/%s.map", name );
+	FS_ReadFile( path, &mapfile );
+
+	return mapfile;
+}
+
+
+typedef struct {
+	vm_t		*vm;
+	vmSymbol_t	**prev;
+	int			count;
+} symbolLoader_t;
+
 
-		count++;
+static void VM_AddSymbol( void* userData, int value, const char* name )
+{
+	symbolLoader_t* const loader = (symbolLoader_t*)userData;
+	const vm_t* const vm = loader->vm;
+	const int chars = strlen( name );
+
+	vmSymbol_t* const sym = (vmSymbol_t*)Hunk_Alloc( sizeof( *sym ) + chars, h_high );
+	*loader->prev = sym;
+	loader->prev = &sym->next;
+	sym->next = NULL;
+
+	// convert value from an instruction number to a code offset
+	if ( vm->instructionPointers && value >= 0 && value < vm->instructionCount ) {
+		value = vm->instructionPointers[value];
+	}
+
+	sym->symValue = value;
+	Q_strncpyz( sym->symName, name, chars + 1 );
+
+	loader->count++;
+}
+
+
+/*
+===============
+VM_LoadSymbols
+===============
+*/
+void VM_LoadSymbols( vm_t *vm ) {
+	char			symbols[MAX_QPATH];
+	symbolLoader_t	loader;
+
+	// don't load symbols if not developer
+	if ( !com_developer->integer ) {
+		return;
+	}
+
+	void* const mapfile = VM_ReadSymbolFile( vm, symbols, sizeof( symbols ) );
+	if ( !mapfile ) {
+		Com_Printf( "Couldn't load symbol file: %s\n", symbols );
+		return;
 	}
 
-	vm->numSymbols = count;
-	Com_Printf( "%i symbols parsed from %s\n", count, symbols );
-	FS_FreeFile( mapfile.v );
+	loader.vm = vm;
+	loader.prev = &vm->symbols;
+	loader.count = 0;
+	VM_ParseSymbols( (const char*)mapfile, VM_AddSymbol, &loader );
+
+	vm->numSymbols = loader.count;
+	Com_Printf( "%i symbols parsed from %s\n", loader.count, symbols );
+	FS_FreeFile( mapfile );
 }
 
 
@@ -475,6 +528,7 @@ vmHeader_t *VM_LoadQVM( vm_t *vm, qboolean alloc ) {
 	CRC32_ProcessBlock( &crc32, header, length );
 	CRC32_End( &crc32 );
 	Crash_SaveQVMChecksum( vm->index, crc32 );
+	vm->checksum = crc32;
 
 	return header;
 }
@@ -872,6 +926,10 @@ vm_t *VM_Restart( vm_t *vm ) {
 		return vm;
 	}
 
+	// the data is reset, so the trace can't continue
+	if ( VM_IsTraced( vm ) )
+		VM_StopTrace();
+
 	// load the image
 	Com_Printf( "VM_Restart()\n" );
 
@@ -1017,6 +1075,9 @@ void VM_Free( vm_t *vm ) {
 
 	Crash_SaveQVMPointer( vm->index, NULL );
 
+	if ( VM_IsTraced( vm ) )
+		VM_StopTrace();
+
 	if ( vm->destroy )
 		vm->destroy( vm );
 
@@ -1052,6 +1113,30 @@ intptr_t VM_ArgPtr( intptr_t intValue )
 }
 
 
+// unlike single items, arrays of arbitrary length could reach past the data segment
+void* VM_ArgArray( intptr_t intValue, int count, int itemSize )
+{
+	if ( count < 0 || count > 0x7FFFFFFF / itemSize )
+		Com_Error( ERR_DROP, "VM_ArgArray: bad count %d", count );
+
+	if ( count == 0 )
+		return NULL;
+
+	if ( !intValue || !currentVM )
+		Com_Error( ERR_DROP, "VM_ArgArray: NULL array" );
+
+	if ( currentVM->entryPoint )
+		return currentVM->dataBase + intValue;
+
+	const unsigned int offset = (unsigned int)intValue;
+	if ( offset > (unsigned int)currentVM->dataMask ||
+		 (unsigned int)( count * itemSize ) > (unsigned int)currentVM->dataMask + 1 - offset )
+		Com_Error( ERR_DROP, "VM_ArgArray: %d items of %d bytes at %d are out of range", count, itemSize, (int)intValue );
+
+	return currentVM->dataBase + offset;
+}
+
+
 intptr_t VM_ExplicitArgPtr( const vm_t* vm, intptr_t intValue )
 {
 	if (!intValue || !vm)
@@ -1104,6 +1189,13 @@ intptr_t QDECL VM_Call( vm_t *vm, int callnum, ... )
 	currentVM = vm;
 	lastVM = vm;
 
+	if ( VM_IsTraced( vm ) ) {
+		va_list ap;
+		va_start( ap, callnum );
+		VM_TraceCall( vm, callnum, ap );
+		va_end( ap );
+	}
+
 	++vm->callLevel;
 
 	intptr_t r;
@@ -1153,8 +1245,595 @@ intptr_t QDECL VM_Call( vm_t *vm, int callnum, ... )
 	}
 	--vm->callLevel;
 
+	if ( VM_IsTraced( vm ) )
+		VM_TraceReturn( vm, (int)r );
+
 	if ( oldVM != NULL )
 	  currentVM = oldVM;
 	return r;
 }
 
+
+
+/*
+===============================================================================
+
+PROFILING
+
+The sampler copies the call stack of the running QVM at regular intervals.
+The interpreter and the JIT both track the stack for crash reports:
+entries are the ENTER instructions of each function,
+the JIT also pushes the sites of indirect calls
+and the interpreter pushes system calls as negative numbers.
+
+"vmprofile dump" aggregates identical stacks and writes them
+in the folded format expected by flamegraph.pl:
+qagame;vmMain;G_RunFrame;G_RunClient 42
+
+===============================================================================
+*/
+
+
+#define VMP_MAX_INTS		(4 << 20)	// 16 MB
+#define VMP_DEFAULT_RATE	1000		// samples per second
+#define VMP_MAX_RATE		10000
+
+
+typedef struct {
+	int				*data;			// for each sample: header, then the call stack entries
+	volatile int	numInts;
+	volatile int	numSamples;
+	volatile int	numDropped;		// the buffer was full
+	int				rate;
+	qbool			running;
+} vmProfile_t;
+
+static vmProfile_t vmp;
+
+#define VMP_HEADER( vmIndex, depth )	( (vmIndex) | ( (depth) << 8 ) )
+#define VMP_VM( header )				( (header) & 0xFF )
+#define VMP_DEPTH( header )				( (header) >> 8 )
+
+
+// runs in a signal handler or while the main thread is suspended
+static void VM_ProfileSample()
+{
+	const vm_t* const vm = currentVM;
+	if ( vm == NULL || vm->callLevel <= 0 || vm->entryPoint != NULL )
+		return;
+
+	const int depth = min( vm->callStackDepth, MAX_VM_CALL_STACK_DEPTH );
+	if ( depth <= 0 )
+		return;
+
+	const int numInts = vmp.numInts;
+	if ( numInts + 1 + depth > VMP_MAX_INTS ) {
+		vmp.numDropped++;
+		return;
+	}
+
+	int* const sample = vmp.data + numInts;
+	sample[0] = VMP_HEADER( (int)( vm - vmTable ), depth );
+	for ( int i = 0; i < depth; ++i ) {
+		sample[i + 1] = vm->callStack[i];
+	}
+	vmp.numInts = numInts + 1 + depth;
+	vmp.numSamples++;
+}
+
+
+typedef struct {
+	int		value;		// instruction number
+	int		name;		// offset into names
+} vmProfileSymbol_t;
+
+typedef struct {
+	vmProfileSymbol_t	*symbols;	// NULL while counting
+	char				*names;
+	int					count;
+	int					chars;
+} vmProfileSymbols_t;
+
+
+static void VM_AddProfileSymbol( void* userData, int value, const char* name )
+{
+	vmProfileSymbols_t* const list = (vmProfileSymbols_t*)userData;
+	const int length = strlen( name ) + 1;
+
+	if ( list->symbols ) {
+		list->symbols[list->count].value = value;
+		list->symbols[list->count].name = list->chars;
+		memcpy( list->names + list->chars, name, length );
+	}
+	list->count++;
+	list->chars += length;
+}
+
+
+static void VM_ListProfileSymbols( const vm_t* vm, const char* mapText, vmProfileSymbols_t* list )
+{
+	list->count = 0;
+	list->chars = 0;
+
+	if ( vm->symbols ) {
+		for ( const vmSymbol_t* sym = vm->symbols; sym != NULL; sym = sym->next ) {
+			VM_AddProfileSymbol( list, sym->symValue, sym->symName );
+		}
+	} else if ( mapText ) {
+		VM_ParseSymbols( mapText, VM_AddProfileSymbol, list );
+	}
+}
+
+
+static int VM_CompareProfileSymbols( const void* a, const void* b )
+{
+	return ((const vmProfileSymbol_t*)a)->value - ((const vmProfileSymbol_t*)b)->value;
+}
+
+
+// the symbols of VMs loaded without com_developer come straight from the .map file
+static void VM_LoadProfileSymbols( const vm_t* vm, vmProfileSymbols_t* list )
+{
+	char path[MAX_QPATH];
+	void* mapfile = NULL;
+
+	if ( !vm->symbols ) {
+		mapfile = VM_ReadSymbolFile( vm, path, sizeof(path) );
+		if ( !mapfile )
+			Com_Printf( "Couldn't load symbol file: %s\n", path );
+	}
+
+	list->symbols = NULL;
+	VM_ListProfileSymbols( vm, (const char*)mapfile, list );
+	list->symbols = (vmProfileSymbol_t*)malloc( max( list->count, 1 ) * sizeof(vmProfileSymbol_t) );
+	list->names = (char*)malloc( max( list->chars, 1 ) );
+	if ( list->symbols == NULL || list->names == NULL ) {
+		free( list->symbols );
+		free( list->names );
+		list->symbols = NULL;
+		list->names = NULL;
+		list->count = 0;
+	} else {
+		VM_ListProfileSymbols( vm, (const char*)mapfile, list );
+		qsort( list->symbols, list->count, sizeof(vmProfileSymbol_t), VM_CompareProfileSymbols );
+	}
+
+	if ( mapfile )
+		FS_FreeFile( mapfile );
+}
+
+
+// returns the symbol of the function containing the instruction or NULL
+static const vmProfileSymbol_t* VM_FindProfileSymbol( const vmProfileSymbols_t* list, int value )
+{
+	int lo = 0;
+	int hi = list->count - 1;
+	const vmProfileSymbol_t* result = NULL;
+
+	while ( lo <= hi ) {
+		const int mid = ( lo + hi ) / 2;
+		if ( list->symbols[mid].value <= value ) {
+			result = &list->symbols[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return result;
+}
+
+
+static int VM_CompareProfileSamples( const void* a, const void* b )
+{
+	const int* const sampleA = vmp.data + *(const int*)a;
+	const int* const sampleB = vmp.data + *(const int*)b;
+	if ( sampleA[0] != sampleB[0] )
+		return sampleA[0] < sampleB[0] ? -1 : 1;
+
+	const int depth = VMP_DEPTH( sampleA[0] );
+	for ( int i = 1; i <= depth; ++i ) {
+		if ( sampleA[i] != sampleB[i] )
+			return sampleA[i] < sampleB[i] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+static void VM_WriteProfileStack( fileHandle_t f, const int* sample, int count, const vmProfileSymbols_t* symbols )
+{
+	char stack[MAX_VM_CALL_STACK_DEPTH * 64];
+	const int depth = VMP_DEPTH( sample[0] );
+	const vmProfileSymbol_t* prevSymbol = NULL;
+
+	Q_strncpyz( stack, vmName[VMP_VM( sample[0] )], sizeof(stack) );
+	for ( int i = 1; i <= depth; ++i ) {
+		const int value = sample[i];
+		char frame[MAX_QPATH];
+
+		if ( value < 0 ) {
+			Com_sprintf( frame, sizeof(frame), ";syscall_%d", ~value );
+			prevSymbol = NULL;
+		} else {
+			const vmProfileSymbol_t* const symbol = VM_FindProfileSymbol( symbols, value );
+			if ( symbol == NULL ) {
+				Com_sprintf( frame, sizeof(frame), ";0x%X", value );
+			} else if ( symbol == prevSymbol && symbol->value != value ) {
+				continue; // call site inside the function we're already in
+			} else {
+				Com_sprintf( frame, sizeof(frame), ";%s", symbols->names + symbol->name );
+			}
+			prevSymbol = symbol;
+		}
+
+		Q_strcat( stack, sizeof(stack), frame );
+	}
+
+	FS_Printf( f, "%s %d\n", stack, count );
+}
+
+
+static void VM_DumpProfile( const char* fileName )
+{
+	// samples taken from here on aren't included
+	const int numInts = vmp.numInts;
+	const int numSamples = vmp.numSamples;
+	if ( numSamples <= 0 ) {
+		Com_Printf( "No QVM samples to write\n" );
+		return;
+	}
+
+	int* const samples = (int*)malloc( numSamples * sizeof(int) );
+	if ( samples == NULL ) {
+		Com_Printf( "ERROR: failed to allocate %d sample offsets\n", numSamples );
+		return;
+	}
+
+	int count = 0;
+	for ( int offset = 0; offset < numInts && count < numSamples; offset += 1 + VMP_DEPTH( vmp.data[offset] ) ) {
+		samples[count++] = offset;
+	}
+	qsort( samples, count, sizeof(int), VM_CompareProfileSamples );
+
+	const fileHandle_t f = FS_FOpenFileWrite( fileName );
+	if ( f == 0 ) {
+		Com_Printf( "ERROR: couldn't open %s\n", fileName );
+		free( samples );
+		return;
+	}
+
+	vmProfileSymbols_t symbols[VM_COUNT];
+	qbool symbolsLoaded[VM_COUNT];
+	Com_Memset( symbols, 0, sizeof(symbols) );
+	Com_Memset( symbolsLoaded, 0, sizeof(symbolsLoaded) );
+
+	int numStacks = 0;
+	for ( int i = 0; i < count; ) {
+		int j = i + 1;
+		while ( j < count && VM_CompareProfileSamples( &samples[i], &samples[j] ) == 0 )
+			++j;
+
+		const int* const sample = vmp.data + samples[i];
+		const int vmIndex = VMP_VM( sample[0] );
+		if ( !symbolsLoaded[vmIndex] ) {
+			VM_LoadProfileSymbols( &vmTable[vmIndex], &symbols[vmIndex] );
+			symbolsLoaded[vmIndex] = qtrue;
+		}
+
+		VM_WriteProfileStack( f, sample, j - i, &symbols[vmIndex] );
+		numStacks++;
+		i = j;
+	}
+
+	FS_FCloseFile( f );
+
+	for ( int i = 0; i < VM_COUNT; ++i ) {
+		free( symbols[i].symbols );
+		free( symbols[i].names );
+	}
+	free( samples );
+
+	Com_Printf( "%d samples (%d unique stacks, %d dropped) written to %s\n", count, numStacks, vmp.numDropped, fileName );
+}
+
+
+static void VM_Profile_f()
+{
+	const char* const action = Cmd_Argv(1);
+
+	if ( !Q_stricmp( action, "start" ) ) {
+		if ( vmp.running ) {
+			Com_Printf( "The QVM profiler is already running\n" );
+			return;
+		}
+
+		int rate = VMP_DEFAULT_RATE;
+		if ( Cmd_Argc() >= 3 )
+			rate = Com_ClampInt( 1, VMP_MAX_RATE, atoi( Cmd_Argv(2) ) );
+
+		if ( vmp.data == NULL ) {
+			vmp.data = (int*)malloc( VMP_MAX_INTS * sizeof(int) );
+			if ( vmp.data == NULL ) {
+				Com_Printf( "ERROR: failed to allocate the QVM profiler's sample buffer\n" );
+				return;
+			}
+		}
+
+		vmp.numInts = 0;
+		vmp.numSamples = 0;
+		vmp.numDropped = 0;
+		vmp.rate = rate;
+		if ( !Sys_StartProfileSampling( 1000000 / rate, VM_ProfileSample ) ) {
+			Com_Printf( "ERROR: failed to start the profiling timer\n" );
+			return;
+		}
+
+		vmp.running = qtrue;
+		Com_Printf( "QVM profiler started at %d samples per second\n", rate );
+		return;
+	}
+
+	if ( !Q_stricmp( action, "stop" ) ) {
+		if ( !vmp.running ) {
+			Com_Printf( "The QVM profiler isn't running\n" );
+			return;
+		}
+
+		Sys_StopProfileSampling();
+		vmp.running = qfalse;
+		Com_Printf( "QVM profiler stopped after %d samples\n", vmp.numSamples );
+		return;
+	}
+
+	if ( !Q_stricmp( action, "dump" ) ) {
+		char fileName[MAX_QPATH];
+		Q_strncpyz( fileName, Cmd_Argc() >= 3 ? Cmd_Argv(2) : "vmprofile", sizeof(fileName) );
+		COM_DefaultExtension( fileName, sizeof(fileName), ".txt" );
+		VM_DumpProfile( fileName );
+		return;
+	}
+
+	Com_Printf( "usage: %s start [samples per second]|stop|dump [file]\n", Cmd_Argv(0) );
+}
+
+
+/*
+===============================================================================
+
+CALL TRACES
+
+/vmtrace records everything needed to replay a QVM's work outside the engine:
+a snapshot of its data segment, then every vmMain call with its return value
+and every system call with its return value and the memory it wrote.
+
+System calls write through pointer arguments of unknown size,
+so a window after each argument that could be a pointer is compared
+before and after the call and the changed range is saved.
+This makes recording slow but replaying needs no engine code at all.
+
+===============================================================================
+*/
+
+
+#define VMT_SYSCALL_ARGS	12		// arguments checked for writes
+#define VMT_WINDOW_SIZE		4096	// bytes checked after each argument
+#define VMT_MAX_DEPTH		8		// nested system calls through recursive vmMain calls
+
+
+typedef struct {
+	fileHandle_t	file;
+	vm_t			*vm;			// NULL when not recording
+	syscall_t		systemCall;		// the real one
+	byte			*windows;		// [VMT_MAX_DEPTH][VMT_SYSCALL_ARGS][VMT_WINDOW_SIZE]
+	int				depth;
+	int				numCalls;
+	int				numSyscalls;
+} vmTrace_t;
+
+static vmTrace_t vmt;
+
+
+static qbool VM_IsTraced( const vm_t* vm )
+{
+	return vm == vmt.vm;
+}
+
+
+static void VM_TraceWrite( const void* data, int length )
+{
+	FS_Write( data, length, vmt.file );
+}
+
+
+static void VM_TraceWriteInt( int value )
+{
+	FS_Write( &value, sizeof(value), vmt.file );
+}
+
+
+static void VM_StopTrace()
+{
+	if ( vmt.vm == NULL )
+		return;
+
+	vmt.vm->systemCall = vmt.systemCall;
+	FS_FCloseFile( vmt.file );
+	Com_Printf( "QVM trace stopped after %d calls and %d system calls\n", vmt.numCalls, vmt.numSyscalls );
+
+	vmt.vm = NULL;
+	vmt.file = 0;
+}
+
+
+static intptr_t QDECL VM_TraceSystemCall( intptr_t *args )
+{
+	vm_t* const vm = vmt.vm;
+	if ( vmt.depth >= VMT_MAX_DEPTH ) {
+		Com_Printf( "ERROR: too many nested system calls to trace\n" );
+		VM_StopTrace();
+	}
+	if ( vmt.vm == NULL )
+		return vm->systemCall( args );
+
+	const int dataSize = vm->dataMask + 1;
+	byte* const windows = vmt.windows + vmt.depth * VMT_SYSCALL_ARGS * VMT_WINDOW_SIZE;
+	int starts[VMT_SYSCALL_ARGS];
+	int lengths[VMT_SYSCALL_ARGS];
+	for ( int i = 0; i < VMT_SYSCALL_ARGS; ++i ) {
+		const intptr_t arg = args[i + 1];
+		starts[i] = 0;
+		lengths[i] = 0;
+		if ( arg > 0 && arg < dataSize ) {
+			starts[i] = (int)arg;
+			lengths[i] = min( VMT_WINDOW_SIZE, dataSize - (int)arg );
+			Com_Memcpy( windows + i * VMT_WINDOW_SIZE, vm->dataBase + arg, lengths[i] );
+		}
+	}
+
+	vmt.depth++;
+	const syscall_t systemCall = vmt.systemCall;
+	const intptr_t result = systemCall( args );
+	vmt.depth--;
+
+	// the system call might have stopped the trace
+	if ( vmt.vm != vm )
+		return result;
+
+	int numWrites = 0;
+	for ( int i = 0; i < VMT_SYSCALL_ARGS; ++i ) {
+		const byte* const before = windows + i * VMT_WINDOW_SIZE;
+		const byte* const after = vm->dataBase + starts[i];
+		int first = 0;
+		int last = lengths[i] - 1;
+		while ( first <= last && before[first] == after[first] )
+			first++;
+		while ( last >= first && before[last] == after[last] )
+			last--;
+		starts[i] += first;
+		lengths[i] = last - first + 1;
+		if ( lengths[i] > 0 )
+			numWrites++;
+	}
+
+	VM_TraceWriteInt( VMTE_SYSCALL );
+	VM_TraceWriteInt( (int)args[0] );
+	VM_TraceWriteInt( (int)result );
+	VM_TraceWriteInt( numWrites );
+	for ( int i = 0; i < VMT_SYSCALL_ARGS; ++i ) {
+		if ( lengths[i] <= 0 )
+			continue;
+		const int zero = 0;
+		VM_TraceWriteInt( starts[i] );
+		VM_TraceWriteInt( lengths[i] );
+		VM_TraceWrite( vm->dataBase + starts[i], lengths[i] );
+		VM_TraceWrite( &zero, VM_TRACE_PAD( lengths[i] ) - lengths[i] );
+	}
+	vmt.numSyscalls++;
+
+	return result;
+}
+
+
+static void VM_TraceCall( const vm_t* vm, int callnum, va_list argptr )
+{
+	VM_TraceWriteInt( VMTE_CALL );
+	VM_TraceWriteInt( callnum );
+	for ( int i = 1; i < VMMAIN_CALL_ARGS; ++i ) {
+		VM_TraceWriteInt( va_arg( argptr, int ) );
+	}
+	vmt.numCalls++;
+}
+
+
+static void VM_TraceReturn( const vm_t* vm, int value )
+{
+	VM_TraceWriteInt( VMTE_RETURN );
+	VM_TraceWriteInt( value );
+}
+
+
+static void VM_StartTrace( vm_t* vm, const char* fileName )
+{
+	if ( vmt.windows == NULL ) {
+		vmt.windows = (byte*)malloc( VMT_MAX_DEPTH * VMT_SYSCALL_ARGS * VMT_WINDOW_SIZE );
+		if ( vmt.windows == NULL ) {
+			Com_Printf( "ERROR: failed to allocate the QVM trace buffers\n" );
+			return;
+		}
+	}
+
+	vmt.file = FS_FOpenFileWrite( fileName );
+	if ( vmt.file == 0 ) {
+		Com_Printf( "ERROR: couldn't open %s\n", fileName );
+		return;
+	}
+
+	vmTraceHeader_t header;
+	Com_Memset( &header, 0, sizeof(header) );
+	Com_Memcpy( header.magic, "QVMT", 4 );
+	header.version = VM_TRACE_VERSION;
+	header.vmIndex = vm->index;
+	header.checksum = vm->checksum;
+	header.dataSize = vm->dataMask + 1;
+	FS_Write( &header, sizeof(header), vmt.file );
+	FS_Write( vm->dataBase, header.dataSize, vmt.file );
+
+	vmt.vm = vm;
+	vmt.systemCall = vm->systemCall;
+	vmt.depth = 0;
+	vmt.numCalls = 0;
+	vmt.numSyscalls = 0;
+	vm->systemCall = VM_TraceSystemCall;
+
+	Com_Printf( "Recording the %s QVM's calls to %s\n", vmName[vm->index], fileName );
+}
+
+
+static void VM_Trace_f()
+{
+	const char* const action = Cmd_Argv(1);
+
+	if ( !Q_stricmp( action, "stop" ) ) {
+		if ( vmt.vm == NULL )
+			Com_Printf( "No QVM trace is being recorded\n" );
+		VM_StopTrace();
+		return;
+	}
+
+	if ( Q_stricmp( action, "start" ) || Cmd_Argc() < 3 ) {
+		Com_Printf( "usage: %s start <qagame|cgame|ui> [file]|stop\n", Cmd_Argv(0) );
+		return;
+	}
+
+	if ( vmt.vm != NULL ) {
+		Com_Printf( "A QVM trace is already being recorded\n" );
+		return;
+	}
+
+	vm_t* vm = NULL;
+	for ( int i = 0; i < VM_COUNT; ++i ) {
+		if ( !Q_stricmp( Cmd_Argv(2), vmName[i] ) )
+			vm = &vmTable[i];
+	}
+
+	if ( vm == NULL || vm->name == NULL ) {
+		Com_Printf( "The %s VM isn't loaded\n", Cmd_Argv(2) );
+		return;
+	}
+
+	if ( vm->dllHandle != NULL ) {
+		Com_Printf( "Only QVMs can be traced\n" );
+		return;
+	}
+
+	if ( vm->callLevel > 0 ) {
+		Com_Printf( "The %s QVM can't be traced from inside one of its calls\n", vm->name );
+		return;
+	}
+
+	char fileName[MAX_QPATH];
+	Q_strncpyz( fileName, Cmd_Argc() >= 4 ? Cmd_Argv(3) : vm->name, sizeof(fileName) );
+	COM_DefaultExtension( fileName, sizeof(fileName), ".vmt" );
+	VM_StartTrace( vm, fileName );
+}
@@ -113,6 +113,101 @@ static const char *opnames[256] = {
 #endif
 
 
+/*
+The instructions are decoded into a separate array with the same indices,
+so that jump targets, return addresses and call stack entries don't change.
+
+With GCC and Clang, each decoded instruction holds the address of its handler
+and every handler ends with an indirect jump to the next one.
+Other compilers dispatch through a switch on the decoded opcode.
+
+Common sequences are fused into superinstructions stored in place of their first instruction.
+The fused instructions keep their own decoded slots but are skipped over,
+which is only safe because nothing jumps to them.
+*/
+
+#if defined(__GNUC__)
+#define VM_THREADED_DISPATCH
+#endif
+
+// superinstructions
+typedef enum {
+	SOP_LOCAL_LOAD4 = OP_MAX,	// LOCAL + LOAD4
+	SOP_CONST_ADD,				// CONST + ADD
+	SOP_CONST_EQ,				// CONST + integer compare and branch, value2 is the jump target
+	SOP_CONST_NE,
+	SOP_CONST_LTI,
+	SOP_CONST_LEI,
+	SOP_CONST_GTI,
+	SOP_CONST_GEI,
+	SOP_CONST_LTU,
+	SOP_CONST_LEU,
+	SOP_CONST_GTU,
+	SOP_CONST_GEU,
+	SOP_MAX
+} superOpcode_t;
+
+typedef struct {
+#ifdef VM_THREADED_DISPATCH
+	const void	*handler;
+#endif
+	int			op;
+	int			value;
+	int			value2;		// opStack slots for OP_ENTER, jump target for compares
+} interpInstruction_t;
+
+
+static int VM_Interpret( vm_t *vm, int *args, const void* const** handlerTable );
+
+
+static int VM_SuperOpcode( const instruction_t *ci, const instruction_t *ni )
+{
+	if ( ni->jused )
+		return ci->op;
+
+	if ( ci->op == OP_LOCAL && ni->op == OP_LOAD4 )
+		return SOP_LOCAL_LOAD4;
+
+	if ( ci->op == OP_CONST && ni->op == OP_ADD )
+		return SOP_CONST_ADD;
+
+	if ( ci->op == OP_CONST && ni->op >= OP_EQ && ni->op <= OP_GEU )
+		return SOP_CONST_EQ + ni->op - OP_EQ;
+
+	return ci->op;
+}
+
+
+static void VM_DecodeInstructions( const instruction_t *in, interpInstruction_t *out, int count )
+{
+#ifdef VM_THREADED_DISPATCH
+	const void* const* handlers;
+	VM_Interpret( NULL, NULL, &handlers );
+#endif
+
+	for ( int i = 0; i < count; i++ ) {
+		const instruction_t* const ci = &in[i];
+		interpInstruction_t* const di = &out[i];
+
+		di->op = ci->op;
+		di->value = ci->value;
+		di->value2 = 0;
+		if ( ci->op == OP_ENTER ) {
+			di->value2 = ci->opStack / 4;
+		} else if ( i + 1 < count ) {
+			di->op = VM_SuperOpcode( ci, ci + 1 );
+			if ( di->op >= SOP_CONST_EQ && di->op <= SOP_CONST_GEU ) {
+				di->value2 = ci[1].value;
+			}
+		}
+
+#ifdef VM_THREADED_DISPATCH
+		di->handler = handlers[di->op];
+#endif
+	}
+}
+
+
 /*
 ====================
 VM_PrepareInterpreter2
@@ -122,18 +217,23 @@ qboolean VM_PrepareInterpreter2( vm_t *vm, vmHeader_t *header )
 {
 	const char *errMsg;
 	instruction_t *buf;
-	buf = ( instruction_t *) Hunk_Alloc( (vm->instructionCount + 8) * sizeof( instruction_t ), h_high );
+	buf = ( instruction_t *) Z_Malloc( (vm->instructionCount + 8) * sizeof( instruction_t ) );
 
 	errMsg = VM_LoadInstructions( header, buf );
 	if ( !errMsg ) {
 		errMsg = VM_CheckInstructions( buf, vm->instructionCount, vm->jumpTableTargets, vm->numJumpTableTargets, vm->dataLength );
 	}
 	if ( errMsg ) {
+		Z_Free( buf );
 		Com_Printf( "VM_PrepareInterpreter2 error: %s\n", errMsg );
 		return qfalse;
 	}
 
-	vm->codeBase.ptr = (byte*)buf;
+	interpInstruction_t* const code = (interpInstruction_t*)Hunk_Alloc( vm->instructionCount * sizeof( interpInstruction_t ), h_high );
+	VM_DecodeInstructions( buf, code, vm->instructionCount );
+	Z_Free( buf );
+
+	vm->codeBase.ptr = (byte*)code;
 	return qtrue;
 }
 
@@ -154,6 +254,37 @@ static void CallStackPop( vm_t *vm )
 }
 
 
+#ifdef VM_COUNT_INSTRUCTIONS
+int64_t vm_executedInstructions;
+#define COUNT( n )		executed += (n)
+#else
+#define COUNT( n )
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+#define CASE( op )		L_##op:
+#define NEXT()			do { COUNT( 1 ); v0 = ci->value; goto *(ci++)->handler; } while (0)
+#else
+#define CASE( op )		case op:
+#define NEXT()			goto nextInstruction
+#endif
+
+// r0 and r1 cache the top 2 opStack values, they must be reloaded when it changes
+#define NEXT_RELOAD()	do { r0.i = opStack[0]; r1.i = opStack[-1]; NEXT(); } while (0)
+
+#define BRANCH( cond ) \
+	opStack -= 2; \
+	if ( cond ) \
+		ci = code + v0; \
+	NEXT_RELOAD();
+
+#define BRANCH_CONST( cond ) \
+	COUNT( 1 ); \
+	opStack--; \
+	ci = ( cond ) ? code + (ci-1)->value2 : ci + 1; \
+	NEXT_RELOAD();
+
+
 /*
 ==============
 VM_CallInterpreted2
@@ -178,6 +309,12 @@ locals from sp
 ==============
 */
 int	VM_CallInterpreted2( vm_t *vm, int *args ) {
+	return VM_Interpret( vm, args, NULL );
+}
+
+
+// with vm NULL, only returns the handler addresses for VM_DecodeInstructions
+static int VM_Interpret( vm_t *vm, int *args, const void* const** handlerTable ) {
 	typedef union floatint_u {
 		int i;
 		unsigned int u;
@@ -193,11 +330,46 @@ int	VM_CallInterpreted2( vm_t *vm, int *args ) {
 	byte	*image;
 	int		v1, v0;
 	int		dataMask;
-	instruction_t *inst, *ci;
+	const interpInstruction_t *code, *ci;
 	floatint_t	r0, r1;
-	int		opcode;
 	int		*img;
 	int		i;
+#ifdef VM_COUNT_INSTRUCTIONS
+	int64_t	executed = 0;
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+	static const void* const handlers[] = {
+		&&L_OP_UNDEF, &&L_OP_IGNORE, &&L_OP_BREAK,
+		&&L_OP_ENTER, &&L_OP_LEAVE, &&L_OP_CALL, &&L_OP_PUSH, &&L_OP_POP,
+		&&L_OP_CONST, &&L_OP_LOCAL, &&L_OP_JUMP,
+		&&L_OP_EQ, &&L_OP_NE,
+		&&L_OP_LTI, &&L_OP_LEI, &&L_OP_GTI, &&L_OP_GEI,
+		&&L_OP_LTU, &&L_OP_LEU, &&L_OP_GTU, &&L_OP_GEU,
+		&&L_OP_EQF, &&L_OP_NEF,
+		&&L_OP_LTF, &&L_OP_LEF, &&L_OP_GTF, &&L_OP_GEF,
+		&&L_OP_LOAD1, &&L_OP_LOAD2, &&L_OP_LOAD4,
+		&&L_OP_STORE1, &&L_OP_STORE2, &&L_OP_STORE4,
+		&&L_OP_ARG, &&L_OP_BLOCK_COPY,
+		&&L_OP_SEX8, &&L_OP_SEX16,
+		&&L_OP_NEGI, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_DIVI, &&L_OP_DIVU,
+		&&L_OP_MODI, &&L_OP_MODU, &&L_OP_MULI, &&L_OP_MULU,
+		&&L_OP_BAND, &&L_OP_BOR, &&L_OP_BXOR, &&L_OP_BCOM,
+		&&L_OP_LSH, &&L_OP_RSHI, &&L_OP_RSHU,
+		&&L_OP_NEGF, &&L_OP_ADDF, &&L_OP_SUBF, &&L_OP_DIVF, &&L_OP_MULF,
+		&&L_OP_CVIF, &&L_OP_CVFI,
+		&&L_SOP_LOCAL_LOAD4, &&L_SOP_CONST_ADD,
+		&&L_SOP_CONST_EQ, &&L_SOP_CONST_NE,
+		&&L_SOP_CONST_LTI, &&L_SOP_CONST_LEI, &&L_SOP_CONST_GTI, &&L_SOP_CONST_GEI,
+		&&L_SOP_CONST_LTU, &&L_SOP_CONST_LEU, &&L_SOP_CONST_GTU, &&L_SOP_CONST_GEU
+	};
+	COMPILE_TIME_ASSERT( ARRAY_LEN( handlers ) == SOP_MAX );
+
+	if ( handlerTable ) {
+		*handlerTable = handlers;
+		return 0;
+	}
+#endif
 
 	// interpret the code
 	vm->currentlyInterpreting = qtrue;
@@ -207,7 +379,7 @@ int	VM_CallInterpreted2( vm_t *vm, int *args ) {
 
 	// set up the stack frame
 	image = vm->dataBase;
-	inst = (instruction_t *)vm->codeBase.ptr;
+	code = (const interpInstruction_t *)vm->codeBase.ptr;
 	dataMask = vm->dataMask;
 
 	// leave a free spot at start of stack so
@@ -224,41 +396,46 @@ int	VM_CallInterpreted2( vm_t *vm, int *args ) {
 	img[ 1 ] = 0; 	// return stack
 	img[ 0 ] = -1;	// will terminate the loop on return
 
-	ci = inst;
+	ci = code;
 
 	// main interpreter loop, will exit when a LEAVE instruction
 	// grabs the -1 program counter
 
-	while ( 1 ) {
-
-		r0.i = opStack[0];
-		r1.i = opStack[-1];
+#ifdef VM_THREADED_DISPATCH
+	NEXT_RELOAD();
+#else
+	r0.i = opStack[0];
+	r1.i = opStack[-1];
 
-nextInstruction2:
+nextInstruction:
+	COUNT( 1 );
+	v0 = ci->value;
+	ci++;
 
-		v0 = ci->value;
-		opcode = ci->op;
-		ci++;
+	switch ( (ci-1)->op ) {
+#endif
 
-		switch ( opcode ) {
+		CASE( OP_UNDEF )
+		CASE( OP_IGNORE )
+			NEXT_RELOAD();
 
-		case OP_BREAK:
+		CASE( OP_BREAK )
 			vm->breakCount++;
-			goto nextInstruction2;
+			NEXT();
 
-		case OP_ENTER:
+		CASE( OP_ENTER )
 			// get size of stack frame
 			programStack -= v0;
 			if ( programStack <= vm->stackBottom ) {
 				Com_Error( ERR_DROP, "VM programStack overflow" );
 			}
-			if ( opStack + ((ci-1)->opStack/4) >= opStackTop ) {
+			if ( opStack + (ci-1)->value2 >= opStackTop ) {
 				Com_Error( ERR_DROP, "VM opStack overflow" );
 			}
-			CallStackPush( vm, &callStackDepth, (int)(ci - (instruction_t*)vm->codeBase.ptr) - 1 );
-			break;
+			CallStackPush( vm, &callStackDepth, (int)(ci - code) - 1 );
+			NEXT_RELOAD();
 
-		case OP_LEAVE:
+		CASE( OP_LEAVE )
 			CallStackPop( vm );
 
 			// remove our stack frame
@@ -272,12 +449,12 @@ nextInstruction2:
 			} else if ( (unsigned)v1 >= vm->instructionCount ) {
 				Com_Error( ERR_DROP, "VM program counter out of range in OP_LEAVE" );
 			}
-			ci = inst + v1;
-			break;
+			ci = code + v1;
+			NEXT_RELOAD();
 
-		case OP_CALL:
+		CASE( OP_CALL )
 			// save current program counter
-			*(int *)&image[ programStack ] = ci - inst;
+			*(int *)&image[ programStack ] = ci - code;
 
 			// jump to the location on the stack
 			if ( r0.i < 0 ) {
@@ -306,45 +483,45 @@ nextInstruction2:
 
 				// save return value
 				//opStack++;
-				ci = inst + *(int *)&image[ programStack ];
+				ci = code + *(int *)&image[ programStack ];
 				*opStack = v0;
 			} else if ( r0.u < vm->instructionCount ) {
 				// vm call
-				ci = inst + r0.i;
+				ci = code + r0.i;
 				opStack--;
 			} else {
 				Com_Error( ERR_DROP, "VM program counter out of range in OP_CALL" );
 			}
-			break;
+			NEXT_RELOAD();
 
 		// push and pop are only needed for discarded or bad function return values
-		case OP_PUSH:
+		CASE( OP_PUSH )
 			opStack++;
-			break;
+			NEXT_RELOAD();
 
-		case OP_POP:
+		CASE( OP_POP )
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_CONST:
+		CASE( OP_CONST )
 			opStack++;
 			r1.i = r0.i;
 			r0.i = *opStack = v0;
-			goto nextInstruction2;
+			NEXT();
 
-		case OP_LOCAL:
+		CASE( OP_LOCAL )
 			opStack++;
 			r1.i = r0.i;
 			r0.i = *opStack = v0 + programStack;
-			goto nextInstruction2;
+			NEXT();
 
-		case OP_JUMP:
+		CASE( OP_JUMP )
 			if ( r0.u >= vm->instructionCount ) {
 				Com_Error( ERR_DROP, "VM program counter out of range in OP_JUMP" );
 			}
-			ci = inst + r0.i;
+			ci = code + r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
 		/*
 		===================================================================
@@ -352,138 +529,59 @@ nextInstruction2:
 		===================================================================
 		*/
 
-		case OP_EQ:
-			opStack -= 2;
-			if ( r1.i == r0.i )
-				ci = inst + v0;
-			break;
-
-		case OP_NE:
-			opStack -= 2;
-			if ( r1.i != r0.i )
-				ci = inst + v0;
-			break;
-
-		case OP_LTI:
-			opStack -= 2;
-			if ( r1.i < r0.i )
-				ci = inst + v0;
-			break;
-
-		case OP_LEI:
-			opStack -= 2;
-			if ( r1.i <= r0.i )
-				ci = inst + v0;
-			break;
-
-		case OP_GTI:
-			opStack -= 2;
-			if ( r1.i > r0.i )
-				ci = inst + v0;
-			break;
-
-		case OP_GEI:
-			opStack -= 2;
-			if ( r1.i >= r0.i )
-				ci = inst + v0;
-			break;
-
-		case OP_LTU:
-			opStack -= 2;
-			if ( r1.u < r0.u )
-				ci = inst + v0;
-			break;
-
-		case OP_LEU:
-			opStack -= 2;
-			if ( r1.u <= r0.u )
-				ci = inst + v0;
-			break;
-
-		case OP_GTU:
-			opStack -= 2;
-			if ( r1.u > r0.u )
-				ci = inst + v0;
-			break;
-
-		case OP_GEU:
-			opStack -= 2;
-			if ( r1.u >= r0.u )
-				ci = inst + v0;
-			break;
-
-		case OP_EQF:
-			opStack -= 2;
-			if ( r1.f == r0.f )
-				ci = inst + v0;
-			break;
-
-		case OP_NEF:
-			opStack -= 2;
-			if ( r1.f != r0.f )
-				ci = inst + v0;
-			break;
-
-		case OP_LTF:
-			opStack -= 2;
-			if ( r1.f < r0.f )
-				ci = inst + v0;
-			break;
-
-		case OP_LEF:
-			opStack -= 2;
-			if ( r1.f <= r0.f )
-				ci = inst + v0;
-			break;
-
-		case OP_GTF:
-			opStack -= 2;
-			if ( r1.f > r0.f )
-				ci = inst + v0;
-			break;
-
-		case OP_GEF:
-			opStack -= 2;
-			if ( r1.f >= r0.f )
-				ci = inst + v0;
-			break;
+		CASE( OP_EQ )	BRANCH( r1.i == r0.i )
+		CASE( OP_NE )	BRANCH( r1.i != r0.i )
+		CASE( OP_LTI )	BRANCH( r1.i < r0.i )
+		CASE( OP_LEI )	BRANCH( r1.i <= r0.i )
+		CASE( OP_GTI )	BRANCH( r1.i > r0.i )
+		CASE( OP_GEI )	BRANCH( r1.i >= r0.i )
+		CASE( OP_LTU )	BRANCH( r1.u < r0.u )
+		CASE( OP_LEU )	BRANCH( r1.u <= r0.u )
+		CASE( OP_GTU )	BRANCH( r1.u > r0.u )
+		CASE( OP_GEU )	BRANCH( r1.u >= r0.u )
+		CASE( OP_EQF )	BRANCH( r1.f == r0.f )
+		CASE( OP_NEF )	BRANCH( r1.f != r0.f )
+		CASE( OP_LTF )	BRANCH( r1.f < r0.f )
+		CASE( OP_LEF )	BRANCH( r1.f <= r0.f )
+		CASE( OP_GTF )	BRANCH( r1.f > r0.f )
+		CASE( OP_GEF )	BRANCH( r1.f >= r0.f )
 
 		//===================================================================
 
-		case OP_LOAD1:
+		CASE( OP_LOAD1 )
 			r0.i = *opStack = image[ r0.i & dataMask ];
-			goto nextInstruction2;
+			NEXT();
 
-		case OP_LOAD2:
+		CASE( OP_LOAD2 )
 			r0.i = *opStack = *(unsigned short *)&image[ r0.i & ( dataMask & ~1 ) ];
-			goto nextInstruction2;
+			NEXT();
 
-		case OP_LOAD4:
+		CASE( OP_LOAD4 )
 			r0.i = *opStack = *(int *)&image[ r0.i & ( dataMask & ~3 ) ];
-			goto nextInstruction2;
+			NEXT();
 
-		case OP_STORE1:
+		CASE( OP_STORE1 )
 			image[ r1.i & dataMask ] = r0.i;
 			opStack -= 2;
-			break;
+			NEXT_RELOAD();
 
-		case OP_STORE2:
+		CASE( OP_STORE2 )
 			*(short *)&image[ r1.i & (dataMask & ~1) ] = r0.i;
 			opStack -= 2;
-			break;
+			NEXT_RELOAD();
 
-		case OP_STORE4:
+		CASE( OP_STORE4 )
 			*(int *)&image[ r1.i & (dataMask & ~3) ] = r0.i;
 			opStack -= 2;
-			break;
+			NEXT_RELOAD();
 
-		case OP_ARG:
+		CASE( OP_ARG )
 			// single byte offset from programStack
 			*(int *)&image[ ( v0 + programStack ) /*& ( dataMask & ~3 ) */ ] = r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_BLOCK_COPY:
+		CASE( OP_BLOCK_COPY )
 			{
 				int		*src, *dest;
 				int		count, srci, desti;
@@ -501,130 +599,168 @@ nextInstruction2:
 				memcpy( dest, src, count );
 				opStack -= 2;
 			}
-			break;
+			NEXT_RELOAD();
 
-		case OP_SEX8:
+		CASE( OP_SEX8 )
 			*opStack = (signed char)*opStack;
-			break;
+			NEXT_RELOAD();
 
-		case OP_SEX16:
+		CASE( OP_SEX16 )
 			*opStack = (short)*opStack;
-			break;
+			NEXT_RELOAD();
 
-		case OP_NEGI:
+		CASE( OP_NEGI )
 			*opStack = -r0.i;
-			break;
+			NEXT_RELOAD();
 
-		case OP_ADD:
+		CASE( OP_ADD )
 			opStack[-1] = r1.i + r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_SUB:
+		CASE( OP_SUB )
 			opStack[-1] = r1.i - r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_DIVI:
+		CASE( OP_DIVI )
 			opStack[-1] = r1.i / r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_DIVU:
+		CASE( OP_DIVU )
 			opStack[-1] = r1.u / r0.u;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_MODI:
+		CASE( OP_MODI )
 			opStack[-1] = r1.i % r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_MODU:
+		CASE( OP_MODU )
 			opStack[-1] = r1.u % r0.u;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_MULI:
+		CASE( OP_MULI )
 			opStack[-1] = r1.i * r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_MULU:
+		CASE( OP_MULU )
 			opStack[-1] = r1.u * r0.u;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_BAND:
+		CASE( OP_BAND )
 			opStack[-1] = r1.u & r0.u;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_BOR:
+		CASE( OP_BOR )
 			opStack[-1] = r1.u | r0.u;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_BXOR:
+		CASE( OP_BXOR )
 			opStack[-1] = r1.u ^ r0.u;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_BCOM:
+		CASE( OP_BCOM )
 			*opStack = ~ r0.u; // id bug: was writing to opStack[-1]
-			break;
+			NEXT_RELOAD();
 
-		case OP_LSH:
+		CASE( OP_LSH )
 			opStack[-1] = r1.i << r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_RSHI:
+		CASE( OP_RSHI )
 			opStack[-1] = r1.i >> r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_RSHU:
+		CASE( OP_RSHU )
 			opStack[-1] = r1.u >> r0.i;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_NEGF:
+		CASE( OP_NEGF )
 			*(float *)opStack =  - r0.f;
-			break;
+			NEXT_RELOAD();
 
-		case OP_ADDF:
+		CASE( OP_ADDF )
 			*(float *)(opStack-1) = r1.f + r0.f;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_SUBF:
+		CASE( OP_SUBF )
 			*(float *)(opStack-1) = r1.f - r0.f;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_DIVF:
+		CASE( OP_DIVF )
 			*(float *)(opStack-1) = r1.f / r0.f;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_MULF:
+		CASE( OP_MULF )
 			*(float *)(opStack-1) = r1.f * r0.f;
 			opStack--;
-			break;
+			NEXT_RELOAD();
 
-		case OP_CVIF:
+		CASE( OP_CVIF )
 			*(float *)opStack = (float) r0.i;
-			break;
+			NEXT_RELOAD();
 
-		case OP_CVFI:
+		CASE( OP_CVFI )
 			*opStack = (int) r0.f;
-			break;
-		}
+			NEXT_RELOAD();
+
+		/*
+		===================================================================
+		SUPERINSTRUCTIONS
+		===================================================================
+		*/
+
+		CASE( SOP_LOCAL_LOAD4 )
+			opStack++;
+			r1.i = r0.i;
+			r0.i = *opStack = *(int *)&image[ ( v0 + programStack ) & ( dataMask & ~3 ) ];
+			ci++;
+			COUNT( 1 );
+			NEXT();
+
+		CASE( SOP_CONST_ADD )
+			r0.i = *opStack = r0.i + v0;
+			ci++;
+			COUNT( 1 );
+			NEXT();
+
+		CASE( SOP_CONST_EQ )	BRANCH_CONST( r0.i == v0 )
+		CASE( SOP_CONST_NE )	BRANCH_CONST( r0.i != v0 )
+		CASE( SOP_CONST_LTI )	BRANCH_CONST( r0.i < v0 )
+		CASE( SOP_CONST_LEI )	BRANCH_CONST( r0.i <= v0 )
+		CASE( SOP_CONST_GTI )	BRANCH_CONST( r0.i > v0 )
+		CASE( SOP_CONST_GEI )	BRANCH_CONST( r0.i >= v0 )
+		CASE( SOP_CONST_LTU )	BRANCH_CONST( r0.u < (unsigned int)v0 )
+		CASE( SOP_CONST_LEU )	BRANCH_CONST( r0.u <= (unsigned int)v0 )
+		CASE( SOP_CONST_GTU )	BRANCH_CONST( r0.u > (unsigned int)v0 )
+		CASE( SOP_CONST_GEU )	BRANCH_CONST( r0.u >= (unsigned int)v0 )
+
+#ifndef VM_THREADED_DISPATCH
+		default:
+			NEXT_RELOAD();
 	}
+#endif
 
 done:
 	//vm->currentlyInterpreting = qfalse;
+#ifdef VM_COUNT_INSTRUCTIONS
+	vm_executedInstructions += executed;
+#endif
 
 	if ( opStack != &stack[1] ) {
 		Com_Error( ERR_DROP, "Interpreter error: opStack = %ld", (long int) (opStack - stack) );
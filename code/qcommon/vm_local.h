@@ -127,7 +127,10 @@ typedef enum {
 	MOP_SUB4,
 	MOP_BAND4,
 	MOP_BOR4,
-	MOP_CALCF4,
+	MOP_CALCF4,			// float op on 2 locals
+	MOP_CMP_LOCAL_CONST,
+	MOP_CMP_LOCAL_LOCAL,
+	MOP_STORE_LOCAL4	// value is the local's address, its OP_LOCAL is ignored
 } macro_op_t;
 
 typedef struct {
@@ -203,6 +206,7 @@ struct vm_s {
 	int			numJumpTableTargets;
 
 	vmIndex_t	index;
+	unsigned int	checksum;		// CRC32 of the .qvm file
 
 	int			callStackDepth;
 	int			lastCallStackDepth;
@@ -211,6 +215,35 @@ struct vm_s {
 };
 
 extern	vm_t	*currentVM;
+extern	cvar_t	*vm_cache;
+
+#ifdef VM_COUNT_INSTRUCTIONS
+extern	int64_t	vm_executedInstructions;	// only counted by the interpreter
+#endif
+
+/*
+QVM call traces are recorded by /vmtrace and replayed by cnq3-vmbench.
+The header is followed by a snapshot of the data segment and a stream of events.
+All values are native ints.
+*/
+#define VM_TRACE_VERSION	1
+
+typedef struct {
+	char			magic[4];		// "QVMT"
+	int				version;
+	int				vmIndex;
+	unsigned int	checksum;		// of the .qvm file
+	int				dataSize;		// of the snapshot
+} vmTraceHeader_t;
+
+typedef enum {
+	VMTE_CALL,		// args[VMMAIN_CALL_ARGS], starting with vmMain's command
+	VMTE_RETURN,	// value
+	VMTE_SYSCALL,	// number, value, numWrites, then each write: offset, length, bytes padded to 4
+	VMTE_COUNT
+} vmTraceEvent_t;
+
+#define VM_TRACE_PAD( length )	( ( (length) + 3 ) & ~3 )
 
 #define	VM_MAGIC		0x12721444
 typedef struct {
@@ -240,6 +273,7 @@ const char *VM_CheckInstructions( instruction_t *buf, int instructionCount,
 								 int dataLength );
 
 intptr_t VM_ArgPtr( intptr_t intValue );
+void* VM_ArgArray( intptr_t intValue, int count, int itemSize );	// drops when not entirely in the VM's memory
 intptr_t VM_ExplicitArgPtr( const vm_t* vm, intptr_t intValue );
 
 static ID_INLINE float _vmf(intptr_t x)
@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 // load time compiler and execution environment for x86, 32-bit and 64-bit
 
 #include "vm_local.h"
+#include "git.h"
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -48,6 +49,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 static const int vm_rtChecks = -1;
 
 static void *VM_Alloc_Compiled( vm_t *vm, int codeLength, int tableLength );
+static qbool VM_Protect_Compiled( vm_t *vm );
 static void VM_Destroy_Compiled( vm_t *vm );
 
 /*
@@ -124,26 +126,20 @@ static void VM_Destroy_Compiled( vm_t *vm );
 #define ISS8(V) ( (V) >= -128 && (V) <= 127 )
 #define ISU8(V) ( (V) >= 0 && (V) <= 127 )
 
-#define REWIND(N) { compiledOfs -= (N); instructionOffsets[ ip-1 ] = compiledOfs; };
-
+// also the ModRM register fields of eax/xmm0 and ecx/xmm1
 typedef enum
 {
 	REG_EAX = 0,
 	REG_ECX
 } reg_t;
 
-
+// where the value of the top opStack slot currently is
 typedef enum
 {
-	LAST_COMMAND_NONE = 0,
-	LAST_COMMAND_MOV_EDI_EAX,
-	LAST_COMMAND_MOV_EDI_CONST,
-	LAST_COMMAND_MOV_EAX_EDI,
-	LAST_COMMAND_MOV_EAX_EDI_CALL,
-	LAST_COMMAND_SUB_DI_4,
-	LAST_COMMAND_SUB_DI_8,
-	LAST_COMMAND_STORE_FLOAT_EDI
-} ELastCommand;
+	TOP_MEMORY = 0,	// only in the opStack
+	TOP_EAX,
+	TOP_XMM0
+} opStackTop_t;
 
 typedef enum
 {
@@ -169,11 +165,17 @@ static  instruction_t *ci;
 static  instruction_t *ni;
 
 static	int			ip;
-static	int			lastConst;
-static	opcode_t	pop1;
 
-static	ELastCommand	LastCommand;
-static	int				floatStoreInstLength; // so we know by how much to rewind
+/*
+  The opStack is cached while compiling a basic block:
+  - edi is only moved when the opStack must be in memory, the top slot is at [edi + opStackDelta]
+  - the top slot can stay in eax or xmm0 and is only written when it has to be
+  At jump labels, jumps, calls and returns everything is flushed
+  and edi points to the top slot as the interpreter's opStack does.
+*/
+static	int				opStackDelta;
+static	opStackTop_t	opStackTop;
+static	qbool			opStackTopDirty;	// the top's register holds a value that isn't in memory
 
 int		funcOffset[FUNC_LAST];
 
@@ -222,14 +224,94 @@ static void (*const badOpStackPtr)(void) = BadOpStack;
 static void (*const badDataPtr)(void) = BadData;
 
 
+/*
+  Every absolute address in the generated code is recorded in the final pass
+  so that the code can be saved to the JIT cache and relocated when loaded back
+*/
+typedef enum {
+	VMR_VM,			// a vm_t member
+	VMR_DATA,		// the data segment
+	VMR_CODE,		// the generated code and its instruction pointer table
+	VMR_GLOBAL,		// delta is the index in vmGlobals
+	VMR_COUNT
+} vmRelocType_t;
+
+typedef struct {
+	int		offset;		// of the pointer in the code
+	int		type;		// vmRelocType_t
+	int		delta;		// from the start of the target
+} vmReloc_t;
+
+static	vm_t		*relocVM;
+static	vmReloc_t	*relocs;
+static	int			numRelocs;
+static	int			maxRelocs;
+static	qbool		relocsValid;	// qfalse if the code has an address we don't know how to relocate
+
+static const void* const vmGlobals[] = {
+#ifdef DEBUG_VM
+	&errParam,
+#endif
+	&errJumpPtr,
+	&badJumpPtr,
+	&badStackPtr,
+	&badOpStackPtr,
+	&badDataPtr
+};
+
+
 static void VM_FreeBuffers( void )
 {
 	// should be freed in reversed allocation order
+	if ( relocs ) {
+		Z_Free( relocs );
+		relocs = NULL;
+	}
 	Z_Free( instructionOffsets );
 	Z_Free( inst );
 }
 
 
+static void VM_AddReloc( const void *ptr )
+{
+	const int index = numRelocs++;
+	if ( relocs == NULL )
+		return; // the first pass only counts them
+
+	if ( index >= maxRelocs ) {
+		relocsValid = qfalse;
+		return;
+	}
+
+	const vm_t* const vm = relocVM;
+	const byte* const p = (const byte*)ptr;
+	vmReloc_t* const r = &relocs[index];
+	r->offset = compiledOfs;
+
+	if ( p >= (const byte*)vm && p < (const byte*)( vm + 1 ) ) {
+		r->type = VMR_VM;
+		r->delta = (int)( p - (const byte*)vm );
+	} else if ( p >= vm->dataBase && p <= vm->dataBase + vm->dataMask + 1 ) {
+		r->type = VMR_DATA;
+		r->delta = (int)( p - vm->dataBase );
+	} else if ( p >= code && p <= code + vm->allocSize ) {
+		r->type = VMR_CODE;
+		r->delta = (int)( p - code );
+	} else {
+		r->type = VMR_GLOBAL;
+		r->delta = -1;
+		for ( int i = 0; i < ARRAY_LEN( vmGlobals ); ++i ) {
+			if ( ptr == vmGlobals[i] ) {
+				r->delta = i;
+				break;
+			}
+		}
+		if ( r->delta < 0 )
+			relocsValid = qfalse;
+	}
+}
+
+
 static void Emit1( int v )
 {
 	if ( code )
@@ -237,8 +319,6 @@ static void Emit1( int v )
 		code[ compiledOfs ] = v;
 	}
 	compiledOfs++;
-
-	LastCommand = LAST_COMMAND_NONE;
 }
 
 
@@ -268,6 +348,7 @@ static void Emit8( int64_t v )
 
 static void EmitPtr( const void *ptr )
 {
+	VM_AddReloc( ptr );
 #if idx64
 	Emit8( (intptr_t)ptr );
 #else
@@ -328,175 +409,144 @@ static void EmitAlign( int align )
 {
 	int i, n;
 
-	n = compiledOfs & ( align - 1 );
+	n = ( align - ( compiledOfs & ( align - 1 ) ) ) & ( align - 1 );
 
 	for ( i = 0; i < n ; i++ )
 		EmitString( "90" );	// nop
 }
 
 
-static void EmitCommand( ELastCommand command )
+// emits the ModRM byte and displacement for [edi + offset of the slot], the top slot is 0
+static void EmitOpStackAddr( int reg, int slot )
 {
-	switch( command )
-	{
-		case LAST_COMMAND_MOV_EDI_EAX:
-			EmitString( "89 07" );		// mov dword ptr [edi], eax
-			break;
-
-		case LAST_COMMAND_MOV_EAX_EDI:
-			EmitString( "8B 07" );		// mov eax, dword ptr [edi]
-			break;
+	const int v = opStackDelta - slot * 4;
 
-		case LAST_COMMAND_SUB_DI_4:
-			EmitRexString( "83 EF 04" );	// sub edi, 4
-			break;
-
-		case LAST_COMMAND_SUB_DI_8:
-			EmitRexString( "83 EF 08" );	// sub edi, 8
-			break;
-
-		case LAST_COMMAND_STORE_FLOAT_EDI:
-		{
-			const int oldOffset = compiledOfs;
-			EmitString( "f3 0f 11 07" );	// movss dword ptr [edi], xmm0
-			floatStoreInstLength = compiledOfs - oldOffset;
-			break;
-		}
-
-		default:
-			break;
+	if ( v == 0 ) {
+		Emit1( 0x07 | ( reg << 3 ) );	// [edi]
+	} else if ( ISS8( v ) ) {
+		Emit1( 0x47 | ( reg << 3 ) );	// [edi + 0x7F]
+		Emit1( v );
+	} else {
+		Emit1( 0x87 | ( reg << 3 ) );	// [edi + 0x12345678]
+		Emit4( v );
 	}
-	LastCommand = command;
 }
 
 
-static void EmitAddEDI4( vm_t *vm )
+// writes the cached top slot to memory, it stays cached
+static void EmitStoreTop( void )
 {
-	if ( LastCommand == LAST_COMMAND_NONE )
-	{
-		EmitRexString( "83 C7 04" );			// add edi,4
+	if ( !opStackTopDirty )
 		return;
-	}
 
-	if ( LastCommand == LAST_COMMAND_SUB_DI_4 ) // sub edi, 4
-	{
-#if idx64
-		REWIND( 4 );
-#else
-		REWIND( 3 );
-#endif
-		LastCommand = LAST_COMMAND_NONE;
-		return;
+	if ( opStackTop == TOP_EAX ) {
+		EmitString( "89" );				// mov dword ptr [opStack], eax
+		EmitOpStackAddr( REG_EAX, 0 );
+	} else if ( opStackTop == TOP_XMM0 ) {
+		EmitString( "f3 0f 11" );		// movss dword ptr [opStack], xmm0
+		EmitOpStackAddr( REG_EAX, 0 );
 	}
-
-	if ( LastCommand == LAST_COMMAND_SUB_DI_8 ) // sub edi, 8
-	{
-#if idx64
-		REWIND( 4 );
-#else
-		REWIND( 3 );
-#endif
-		EmitCommand( LAST_COMMAND_SUB_DI_4 );
-		return;
-	}
-
-	EmitRexString( "83 C7 04" );				// add edi,4
+	opStackTopDirty = qfalse;
 }
 
 
-static void EmitMovEAXEDI( vm_t *vm )
+// writes the cached top slot to memory and moves edi to it
+static void EmitFlushOpStack( void )
 {
-	opcode_t pop = pop1;
-	pop1 = OP_UNDEF;
+	EmitStoreTop();
+	opStackTop = TOP_MEMORY;
 
-	if ( LastCommand == LAST_COMMAND_NONE )
-	{
-		EmitString( "8B 07" );		// mov eax, dword ptr [edi]
+	if ( opStackDelta == 0 )
 		return;
+
+	// lea doesn't change the flags so this can go between a compare and its jump
+	if ( ISS8( opStackDelta ) ) {
+		EmitRexString( "8D 7F" );		// lea edi, [edi + 0x7F]
+		Emit1( opStackDelta );
+	} else {
+		EmitRexString( "8D BF" );		// lea edi, [edi + 0x12345678]
+		Emit4( opStackDelta );
 	}
+	opStackDelta = 0;
+}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EAX_EDI )
-		return;
 
-	if ( LastCommand == LAST_COMMAND_MOV_EAX_EDI_CALL )
-		return;
+// forgets the cached state at the start of code that can be jumped to
+static void ResetOpStack( void )
+{
+	opStackDelta = 0;
+	opStackTop = TOP_MEMORY;
+	opStackTopDirty = qfalse;
+}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EDI_EAX ) // mov [edi], eax
-	{
-		REWIND( 2 );
-		LastCommand = LAST_COMMAND_NONE;
-		return;
-	}
 
-	if ( pop == OP_DIVI || pop == OP_DIVU || pop == OP_MULI || pop == OP_MULU ||
-		pop == OP_STORE4 || pop == OP_STORE2 || pop == OP_STORE1 )
-	{
-		return;
-	}
+// a new top slot whose value the caller sets with SetTop or writes to memory
+static void EmitPushOpStack( void )
+{
+	EmitStoreTop();
+	opStackTop = TOP_MEMORY;
+	opStackDelta += 4;
+}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EDI_CONST ) // mov dword ptr [edi], 0x12345678
-	{
-		REWIND( 6 );
-		if ( lastConst == 0 ) {
-			EmitString( "31 C0" );		// xor eax, eax
-		} else {
-			EmitString( "B8" );			// mov	eax, 0x12345678
-			Emit4( lastConst );
-		}
-		return;
-	}
 
-	EmitString( "8B 07" );		    // mov eax, dword ptr [edi]
+// popped slots are never written to memory
+static void PopOpStack( int count )
+{
+	opStackTop = TOP_MEMORY;
+	opStackTopDirty = qfalse;
+	opStackDelta -= count * 4;
 }
 
 
-void EmitMovECXEDI( vm_t *vm )
+// the value of the top slot is now only in eax or xmm0
+static void SetTop( opStackTop_t top )
 {
-	opcode_t pop = pop1;
-	pop1 = OP_UNDEF;
+	opStackTop = top;
+	opStackTopDirty = qtrue;
+}
 
-	if ( LastCommand == LAST_COMMAND_NONE )
-	{
-		EmitString( "8B 0F" );		// mov ecx, dword ptr [edi]
-		return;
-	}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EAX_EDI_CALL )
-	{
-		EmitString( "89 C1" );		// mov ecx, eax
+static void EmitTopToEAX( void )
+{
+	if ( opStackTop == TOP_EAX )
 		return;
-	}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EAX_EDI ) // mov eax, dword ptr [edi]
-	{
-		REWIND( 2 );
-		EmitString( "8B 0F" );		// mov ecx, dword ptr [edi]
-		return;
+	if ( opStackTop == TOP_XMM0 ) {
+		EmitString( "66 0f 7e c0" );	// movd eax, xmm0
+	} else {
+		EmitString( "8B" );				// mov eax, dword ptr [opStack]
+		EmitOpStackAddr( REG_EAX, 0 );
 	}
+	opStackTop = TOP_EAX;
+}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EDI_EAX ) // mov [edi], eax
-	{
-		REWIND( 2 );
-		EmitString( "89 C1" );		// mov ecx, eax
-		return;
-	}
 
-	if (pop == OP_DIVI || pop == OP_DIVU || pop == OP_MULI || pop == OP_MULU ||
-		pop == OP_STORE4 || pop == OP_STORE2 || pop == OP_STORE1 )
-	{
-		EmitString( "89 C1" );		// mov ecx, eax
-		return;
+// the top slot stays where it is
+static void EmitTopToECX( void )
+{
+	if ( opStackTop == TOP_EAX ) {
+		EmitString( "89 C1" );			// mov ecx, eax
+	} else if ( opStackTop == TOP_XMM0 ) {
+		EmitString( "66 0f 7e c1" );	// movd ecx, xmm0
+	} else {
+		EmitString( "8B" );				// mov ecx, dword ptr [opStack]
+		EmitOpStackAddr( REG_ECX, 0 );
 	}
+}
 
-	if ( LastCommand == LAST_COMMAND_MOV_EDI_CONST ) // mov dword ptr [edi], 0x12345678
-	{
-		REWIND( 6 );
-		EmitString( "B9" );			// mov ecx, 0x12345678
-		Emit4( lastConst );
+
+static void EmitTopToXMM0( void )
+{
+	if ( opStackTop == TOP_XMM0 )
 		return;
-	}
 
-	EmitString( "8B 0F" );		    // mov ecx, dword ptr [edi]
+	if ( opStackTop == TOP_EAX ) {
+		EmitString( "66 0f 6e c0" );	// movd xmm0, eax
+	} else {
+		EmitString( "f3 0f 10" );		// movss xmm0, dword ptr [opStack]
+		EmitOpStackAddr( REG_EAX, 0 );
+	}
+	opStackTop = TOP_XMM0;
 }
 
 
@@ -530,23 +580,6 @@ static void EmitCheckReg( vm_t *vm, int reg, int size )
 }
 
 
-static int EmitLoadFloatEDI( vm_t *vm )
-{
-	// movss dword ptr [edi], xmm0
-	if ( LastCommand == LAST_COMMAND_STORE_FLOAT_EDI )
-	{
-		if ( !vm )
-			return 1;
-		REWIND( floatStoreInstLength );
-		LastCommand = LAST_COMMAND_NONE;
-		return 1;
-	}
-
-	EmitString( "f3 0f 10 07" ); // movss xmm0, dword ptr [edi]
-	return 0;
-}
-
-
 const char *FarJumpStr( int op, int *n )
 {
 	switch ( op )
@@ -580,11 +613,14 @@ const char *FarJumpStr( int op, int *n )
 }
 
 
+// jump targets expect a flushed opStack, the flush leaves the flags alone
 void EmitJump( vm_t *vm, instruction_t *i, int op, int addr )
 {
 	const char *str;
 	int v, jump_size;
 
+	EmitFlushOpStack();
+
 	v = instructionOffsets[ addr ] - compiledOfs;
 
 	str = FarJumpStr( op, &jump_size );
@@ -639,7 +675,7 @@ static void EmitCallFunc(vm_t *vm)
 		Emit4( n - 6 );
 	}
 
-	EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+	EmitRexString( "83 EF 04" );		// sub edi, 4
 
 	// save proc base and programStack
 	EmitString( "55" );				// push ebp
@@ -668,7 +704,7 @@ sysCallOffset = compiledOfs - sysCallOffset;
 	// and store right before the first arg
 	EmitString( "F7 D0" );          // not eax
 
-	EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+	EmitRexString( "83 EF 04" );		// sub edi, 4
 
 	// we may jump here from ConstOptimize() also
 funcOffset[FUNC_SYSC] = compiledOfs;
@@ -735,8 +771,8 @@ funcOffset[FUNC_SYSC] = compiledOfs;
 	EmitString( "4C 8B 4A 18" );			// mov r9,  [rdx+24]
 
 	// we added the return value: *(opstack+1) = eax
-	EmitAddEDI4( vm );						// add edi, 4
-	EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov [edi], eax
+	EmitRexString( "83 C7 04" );			// add edi, 4
+	EmitString( "89 07" );					// mov [edi], eax
 
 	// return stack
 	EmitString( "48 81 C4" );				// add rsp, 200
@@ -776,13 +812,8 @@ funcOffset[FUNC_SYSC] = compiledOfs;
 	EmitPtr( &vm->systemCall );
 
 	// we added the return value: *(opstack+1) = eax
-#if 0
-	EmitAddEDI4( vm );						// add edi, 4
-	EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov [edi], eax
-#else // break dependency from edi value?
 	EmitString( "89 47 04" );				// mov [edi+4], eax
-	EmitAddEDI4( vm );						// add edi, 4
-#endif
+	EmitRexString( "83 C7 04" );			// add edi, 4
 
 	// function epilogue
 	EmitRexString( "89 EC" );				// mov esp, ebp
@@ -813,7 +844,7 @@ static void EmitBCPYFunc(vm_t *vm)
 	EmitString( "F3 A5" );					// rep movsd
 	EmitString( "5F" );						// pop edi
 	EmitString( "5E" );						// pop esi
-	EmitCommand( LAST_COMMAND_SUB_DI_8 );	// sub edi, 8
+	EmitRexString( "83 EF 08" );			// sub edi, 8
 	EmitString( "C3" );						// ret
 }
 
@@ -896,7 +927,7 @@ static qboolean ConstOptimize(vm_t *vm)
 	switch ( op1 ) {
 
 	case OP_LOAD4:
-		EmitAddEDI4( vm );
+		EmitPushOpStack();
 		if ( ISS8( ci->value ) ) {
 			EmitString( "8B 43" );		// mov eax, dword ptr [ebx+0x7F]
 			Emit1( ci->value );
@@ -904,12 +935,12 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "8B 83" );		// mov eax, dword ptr [ebx+0x12345678]
 			Emit4( ci->value );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX ); // mov dword ptr [edi], eax
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_LOAD2:
-		EmitAddEDI4( vm );
+		EmitPushOpStack();
 		if ( ISS8( ci->value ) ) {
 			EmitString( "0F B7 43" );	// movzx eax, word ptr [ebx+0x7F]
 			Emit1( ci->value );
@@ -917,12 +948,12 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "0F B7 83" );	// movzx eax, word ptr [ebx+0x12345678]
 			Emit4( ci->value );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX ); // mov dword ptr [edi], eax
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_LOAD1:
-		EmitAddEDI4( vm );
+		EmitPushOpStack();
 		if ( ISS8( ci->value ) ) {
 			EmitString( "0F B6 43" );	// movzx eax, byte ptr [ebx+0x7F]
 			Emit1( ci->value );
@@ -930,12 +961,12 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "0F B6 83" );	// movzx eax, word ptr [ebx+0x12345678]
 			Emit4( ci->value );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX ); // mov dword ptr [edi], eax
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_STORE4:
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( !ci->value ) {
 			EmitString( "31 C9" );		// xor ecx, ecx
 		} else {
@@ -944,12 +975,12 @@ static qboolean ConstOptimize(vm_t *vm)
 		}
 		EmitCheckReg( vm, REG_EAX, 4 );
 		EmitString( "89 0C 03" );     // mov dword ptr [ebx + eax], ecx
-		EmitCommand( LAST_COMMAND_SUB_DI_4 );		// sub edi, 4
+		PopOpStack( 1 );
 		ip += 1;
 		return qtrue;
 
 	case OP_STORE2:
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( !ci->value ) {
 			EmitString( "31 C9" );		// xor ecx, ecx
 		} else {
@@ -958,12 +989,12 @@ static qboolean ConstOptimize(vm_t *vm)
 		}
 		EmitCheckReg( vm, REG_EAX, 2 );
 		EmitString( "66 89 0C 03" );   // mov word ptr [ebx + eax], cx
-		EmitCommand( LAST_COMMAND_SUB_DI_4 ); // sub edi, 4
+		PopOpStack( 1 );
 		ip += 1;
 		return qtrue;
 
 	case OP_STORE1:
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( !ci->value ) {
 			EmitString( "31 C9" );		// xor ecx, ecx
 		} else {
@@ -972,13 +1003,29 @@ static qboolean ConstOptimize(vm_t *vm)
 		}
 		EmitCheckReg( vm, REG_EAX, 1 );
 		EmitString( "88 0C 03" );		// mov byte ptr [ebx + eax], cl
-		EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+		PopOpStack( 1 );
+		ip += 1;
+		return qtrue;
+
+	case MOP_STORE_LOCAL4:
+		// let EmitMOPs keep the value on the opStack when it's read back right away
+		if ( inst[ip+1].op == OP_LOCAL && inst[ip+1].value == ni->value && inst[ip+2].op == OP_LOAD4 )
+			break;
+		v = ni->value;
+		if ( ISS8( v ) ) {
+			EmitString( "C7 45" );		// mov dword ptr [ebp + 0x7F], 0x12345678
+			Emit1( v );
+		} else {
+			EmitString( "C7 85" );		// mov dword ptr [ebp + 0x12345678], 0x12345678
+			Emit4( v );
+		}
+		Emit4( ci->value );
 		ip += 1;
 		return qtrue;
 
 	case OP_ADD:
 		v = ci->value;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( ISS8( v ) ) {
 			EmitString( "83 C0" );	// add eax, 0x7F
 			Emit1( v );
@@ -986,13 +1033,13 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "05" );	    // add eax, 0x12345678
 			Emit4( v );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1; // OP_ADD
 		return qtrue;
 
 	case OP_SUB:
 		v = ci->value;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( ISS8( v ) ) {
 			EmitString( "83 E8" );	// sub eax, 0x7F
 			Emit1( v );
@@ -1000,13 +1047,13 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "2D" );		// sub eax, 0x12345678
 			Emit4( v );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_MULI:
 		v = ci->value;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( ISS8( v ) ) {
 			EmitString( "6B C0" );	// imul eax, 0x7F
 			Emit1( v );
@@ -1014,7 +1061,7 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "69 C0" );	// imul eax, 0x12345678
 			Emit4( v );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
@@ -1023,17 +1070,17 @@ static qboolean ConstOptimize(vm_t *vm)
 	case OP_ADDF:
 	case OP_SUBF:
 		v = ci->value;
-		EmitLoadFloatEDI( vm );
-		EmitString( "C7 45 00" );							// mov dword ptr [ebp], v
+		EmitTopToXMM0();
+		EmitString( "B8" );									// mov eax, v
 		Emit4( v );
-		EmitString( "f3 0f 10 4d 00" );						// movss xmm1, dword ptr [ebp]
+		EmitString( "66 0f 6e c8" );						// movd xmm1, eax
 		switch( op1 ) {
-			case OP_ADDF: EmitString( "0f 58 c1" ); break;	// addps xmm0, xmm1
-			case OP_SUBF: EmitString( "0f 5c c1" ); break;	// subps xmm0, xmm1
-			case OP_MULF: EmitString( "0f 59 c1" ); break;	// mulps xmm0, xmm1
-			case OP_DIVF: EmitString( "0f 5e c1" ); break;	// divps xmm0, xmm1
+			case OP_ADDF: EmitString( "f3 0f 58 c1" ); break;	// addss xmm0, xmm1
+			case OP_SUBF: EmitString( "f3 0f 5c c1" ); break;	// subss xmm0, xmm1
+			case OP_MULF: EmitString( "f3 0f 59 c1" ); break;	// mulss xmm0, xmm1
+			case OP_DIVF: EmitString( "f3 0f 5e c1" ); break;	// divss xmm0, xmm1
 		}
-		EmitCommand( LAST_COMMAND_STORE_FLOAT_EDI );
+		SetTop( TOP_XMM0 );
 		ip +=1;
 		return qtrue;
 
@@ -1041,10 +1088,10 @@ static qboolean ConstOptimize(vm_t *vm)
 		v = ci->value;
 		if ( v < 0 || v > 31 )
 			break;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		EmitString( "C1 E0" );	// shl eax, 0x12
 		Emit1( v );
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1; // OP_LSH
 		return qtrue;
 
@@ -1052,10 +1099,10 @@ static qboolean ConstOptimize(vm_t *vm)
 		v = ci->value;
 		if ( v < 0 || v > 31 )
 			break;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		EmitString( "C1 F8" );	// sar eax, 0x12
 		Emit1( v );
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
@@ -1063,16 +1110,16 @@ static qboolean ConstOptimize(vm_t *vm)
 		v = ci->value;
 		if ( v < 0 || v > 31 )
 			break;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		EmitString( "C1 E8" );	// shr eax, 0x12
 		Emit1( v );
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_BAND:
 		v = ci->value;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( ISU8( v ) ) {
 			EmitString( "83 E0" ); // and eax, 0x7F
 			Emit1( v );
@@ -1080,13 +1127,13 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "25" ); // and eax, 0x12345678
 			Emit4( v );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_BOR:
 		v = ci->value;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( ISU8( v ) ) {
 			EmitString( "83 C8" ); // or eax, 0x7F
 			Emit1( v );
@@ -1094,13 +1141,13 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "0D" );    // or eax, 0x12345678
 			Emit4( v );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
 	case OP_BXOR:
 		v = ci->value;
-		EmitMovEAXEDI( vm );
+		EmitTopToEAX();
 		if ( ISU8( v ) ) {
 			EmitString( "83 F0" ); // xor eax, 0x7F
 			Emit1( v );
@@ -1108,7 +1155,7 @@ static qboolean ConstOptimize(vm_t *vm)
 			EmitString( "35" );    // xor eax, 0x12345678
 			Emit4( v );
 		}
-		EmitCommand( LAST_COMMAND_MOV_EDI_EAX );
+		SetTop( TOP_EAX );
 		ip += 1;
 		return qtrue;
 
@@ -1126,34 +1173,36 @@ static qboolean ConstOptimize(vm_t *vm)
 		v = ci->value;
 		// try to inline some syscalls
 		if ( v == ~TRAP_SQRT ) {
+			EmitPushOpStack();
 			EmitString( "f3 0f 10 45 08" );		// movss xmm0, dword ptr [ebp + 8]
-			EmitAddEDI4( vm );
 			EmitString( "f3 0f 51 c0" );		// sqrtss xmm0, xmm0
-			EmitCommand( LAST_COMMAND_STORE_FLOAT_EDI );
+			SetTop( TOP_XMM0 );
 			ip += 1;
 			return qtrue;
 		} else if ( IsFloorTrap( vm, v ) && ( cpu_features & CPU_SSE41 ) != 0 ) {
+			EmitPushOpStack();
 			EmitString( "f3 0f 10 45 08" );		// movss xmm0, dword ptr [ebp + 8]
-			EmitAddEDI4( vm );
 			EmitString( "66 0f 3a 0a c0 01" );	// roundss xmm0, xmm0, 1 (exceptions not masked)
-			EmitCommand( LAST_COMMAND_STORE_FLOAT_EDI );
+			SetTop( TOP_XMM0 );
 			ip += 1;
 			return qtrue;
 		} else if ( IsCeilTrap( vm, v ) && ( cpu_features & CPU_SSE41 ) != 0 ) {
+			EmitPushOpStack();
 			EmitString( "f3 0f 10 45 08" );		// movss xmm0, dword ptr [ebp + 8]
-			EmitAddEDI4( vm );
 			EmitString( "66 0f 3a 0a c0 02" );	// roundss xmm0, xmm0, 2 (exceptions not masked)
-			EmitCommand( LAST_COMMAND_STORE_FLOAT_EDI );
+			SetTop( TOP_XMM0 );
 			ip += 1;
 			return qtrue;
 		}
 
+		EmitFlushOpStack();
 		if ( v < 0 ) // syscall
 		{
 			EmitString( "B8" );		// mov eax, 0x12345678
 			Emit4( ~v );
 			EmitCallOffset( FUNC_SYSC );
-			LastCommand = LAST_COMMAND_MOV_EAX_EDI_CALL;
+			// the result is in memory and still in eax
+			opStackTop = TOP_EAX;
 			ip += 1; // OP_CALL
 			return qtrue;
 		}
@@ -1173,15 +1222,15 @@ static qboolean ConstOptimize(vm_t *vm)
 	case OP_LEF:
 	case OP_GTF:
 	case OP_GEF:
-		EmitLoadFloatEDI( vm );
-		EmitCommand( LAST_COMMAND_SUB_DI_4 );
+		EmitTopToXMM0();
+		PopOpStack( 1 );
 		v = ci->value;
 		if ( v == 0 ) {
 			EmitString( "0f 57 c9" );			// xorps xmm1, xmm1
 		} else {
-			EmitString( "C7 45 00" );			// mov dword ptr [ebp], v
+			EmitString( "B8" );					// mov eax, v
 			Emit4( v );
-			EmitString( "f3 0f 10 4d 00" );		// movss xmm1, dword ptr [ebp]
+			EmitString( "66 0f 6e c8" );		// movd xmm1, eax
 		}
 		EmitString( "0f 2f c1" );				// comiss xmm0, xmm1
 		EmitJump( vm, ni, ni->op, ni->value );
@@ -1198,8 +1247,8 @@ static qboolean ConstOptimize(vm_t *vm)
 	case OP_LEU:
 	case OP_LEI:
 	case OP_LTI:
-		EmitMovEAXEDI( vm );
-		EmitCommand( LAST_COMMAND_SUB_DI_4 );
+		EmitTopToEAX();
+		PopOpStack( 1 );
 		v = ci->value;
 		if ( v == 0 && ( op1 == OP_EQ || op1 == OP_NE ) ) {
 			EmitString( "85 C0" );       // test eax, eax
@@ -1223,6 +1272,165 @@ static qboolean ConstOptimize(vm_t *vm)
 	return qfalse;
 }
 
+/*
+=================
+VM_FoldedValueValid
+
+Folding can create new constant and local addresses,
+so they must pass the checks of VM_CheckInstructions for their consumer
+=================
+*/
+static qbool VM_FoldedValueValid( const vm_t *vm, int op, int v, const instruction_t *next, int pstack )
+{
+	int size;
+
+	switch ( next->op ) {
+		case OP_LOAD1: size = 1; break;
+		case OP_LOAD2: size = 2; break;
+		case OP_LOAD4: size = 4; break;
+		case OP_JUMP:
+		case OP_CALL:
+			return op != OP_CONST;
+		default:
+			return qtrue;
+	}
+
+	if ( op == OP_LOCAL )
+		return v >= 8 && v < pstack + 256;
+
+	return v >= 0 && v <= vm->dataLength - size;
+}
+
+
+/*
+=================
+VM_FoldConstants
+
+Evaluates integer operations on constants and constant offsets to local addresses.
+The result replaces the last instruction of the sequence so that
+it's still next to its consumer for ConstOptimize and VM_FindMOps.
+Instructions with opStack > 0 can't be jump labels,
+so only the first instruction of a sequence may be one.
+=================
+*/
+static void VM_FoldConstants( const vm_t *vm, instruction_t *buf, int instructionCount )
+{
+	int i, op0, op1;
+	unsigned int a, b, v;
+	int pstack;
+	instruction_t *lci;
+
+	pstack = 0;
+	for ( i = 0, lci = buf; i < instructionCount - 2; i++, lci++ ) {
+		op0 = lci->op;
+		if ( op0 == OP_ENTER ) {
+			pstack = lci->value;
+			continue;
+		}
+
+		if ( op0 != OP_CONST && op0 != OP_LOCAL )
+			continue;
+
+		a = (unsigned int)lci->value;
+
+		// CONST + NEGI/BCOM
+		op1 = (lci+1)->op;
+		if ( op0 == OP_CONST && ( op1 == OP_NEGI || op1 == OP_BCOM ) && !(lci+1)->jused ) {
+			v = op1 == OP_NEGI ? 0u - a : ~a;
+			if ( VM_FoldedValueValid( vm, OP_CONST, (int)v, lci+2, pstack ) ) {
+				lci->op = OP_IGNORE;
+				(lci+1)->op = OP_CONST;
+				(lci+1)->value = (int)v;
+			}
+			continue;
+		}
+
+		// CONST/LOCAL + CONST + OP_XXX
+		if ( op1 != OP_CONST || (lci+1)->jused || (lci+2)->jused )
+			continue;
+
+		b = (unsigned int)(lci+1)->value;
+		switch ( (lci+2)->op ) {
+			case OP_ADD:	v = a + b; break;
+			case OP_SUB:	v = a - b; break;
+			case OP_MULI:
+			case OP_MULU:	v = a * b; break;
+			case OP_BAND:	v = a & b; break;
+			case OP_BOR:	v = a | b; break;
+			case OP_BXOR:	v = a ^ b; break;
+			case OP_LSH:	if ( b > 31 ) continue; v = a << b; break;
+			case OP_RSHI:	if ( b > 31 ) continue; v = (unsigned int)( (int)a >> b ); break;
+			case OP_RSHU:	if ( b > 31 ) continue; v = a >> b; break;
+			default:		continue;
+		}
+
+		// only offsets can be added to or subtracted from local addresses
+		if ( op0 == OP_LOCAL && (lci+2)->op != OP_ADD && (lci+2)->op != OP_SUB )
+			continue;
+
+		if ( i + 3 >= instructionCount || !VM_FoldedValueValid( vm, op0, (int)v, lci+3, pstack ) )
+			continue;
+
+		lci->op = OP_IGNORE;
+		(lci+1)->op = OP_IGNORE;
+		(lci+2)->op = op0;
+		(lci+2)->value = (int)v;
+		// the result can be folded again with what follows
+		i++;
+		lci++;
+	}
+}
+
+
+/*
+=================
+VM_FindLocalStore
+
+Looks for the OP_STORE4 that consumes the address pushed by OP_LOCAL at index start.
+The address doesn't have to be pushed when nothing in between touches its opStack slot.
+=================
+*/
+static int VM_FindLocalStore( const instruction_t *buf, int instructionCount, int start )
+{
+	const int slot = buf[start].opStack + 4;
+	int i, after;
+
+	for ( i = start + 1; i < instructionCount - 1 && i < start + 64; i++ ) {
+		const instruction_t *ci = &buf[i];
+		if ( ci->jused )
+			return -1;
+
+		if ( ci->op == OP_STORE4 && ci->opStack == slot + 4 )
+			return i;
+
+		if ( ci->op == OP_IGNORE )
+			continue;
+
+		if ( ci->op == OP_ENTER || ci->op == OP_LEAVE || ( ci->op >= OP_JUMP && ci->op <= OP_GEF ) )
+			return -1;
+
+		// the opStack depth after the instruction
+		after = buf[i+1].opStack;
+		if ( after > slot )
+			continue;
+
+		// popping the value above the slot is fine as long as nothing is written back
+		if ( after == slot && ( ci->op == OP_ARG || ci->op == OP_POP ||
+			ci->op == OP_STORE1 || ci->op == OP_STORE2 || ci->op == OP_STORE4 || ci->op == OP_BLOCK_COPY ) )
+			continue;
+
+		return -1;
+	}
+
+	return -1;
+}
+
+
+static qbool IsIntCompare( int op )
+{
+	return op >= OP_EQ && op <= OP_GEU;
+}
+
 
 /*
 =================
@@ -1231,18 +1439,23 @@ VM_FindMOps
 Search for known macro-op sequences
 =================
 */
-static void VM_FindMOps(instruction_t *buf, int instructionCount)
+static void VM_FindMOps( const vm_t *vm, instruction_t *buf, int instructionCount )
 {
-	int i, v, op0;
+	int i, v, n, op0, pstack;
 	instruction_t *lci;
 
+	VM_FoldConstants( vm, buf, instructionCount );
+
 	lci = buf;
 	i = 0;
+	pstack = 0;
 
 	while ( i < instructionCount )
 	{
 		op0 = lci->op;
-		if ( op0 == OP_LOCAL ) {
+		if ( op0 == OP_ENTER ) {
+			pstack = lci->value;
+		} else if ( op0 == OP_LOCAL ) {
 			// OP_LOCAL + OP_LOCAL + OP_LOAD4 + OP_CONST + OP_XXX + OP_STORE4
 			if ( (lci+1)->op == OP_LOCAL && lci->value == (lci+1)->value && (lci+2)->op == OP_LOAD4 && (lci+3)->op == OP_CONST && (lci+4)->op != OP_UNDEF && (lci+5)->op == OP_STORE4 ) {
 				v = (lci+4)->op;
@@ -1274,6 +1487,40 @@ static void VM_FindMOps(instruction_t *buf, int instructionCount)
 				lci += 4; i += 4;
 				continue;
 			}
+
+			// OP_LOCAL + OP_LOAD4 + OP_CONST + OP_EQ..OP_GEU
+			if ( (lci+1)->op == OP_LOAD4 && (lci+2)->op == OP_CONST && IsIntCompare( (lci+3)->op ) && !(lci+3)->jused ) {
+				lci->op = MOP_CMP_LOCAL_CONST;
+				lci += 4; i += 4;
+				continue;
+			}
+
+			if ( (lci+1)->op == OP_LOAD4 && (lci+2)->op == OP_LOCAL && (lci+3)->op == OP_LOAD4 && !(lci+4)->jused ) {
+				v = (lci+4)->op;
+				// OP_LOCAL + OP_LOAD4 + OP_LOCAL + OP_LOAD4 + OP_EQ..OP_GEU
+				if ( IsIntCompare( v ) ) {
+					lci->op = MOP_CMP_LOCAL_LOCAL;
+					lci += 5; i += 5;
+					continue;
+				}
+				// OP_LOCAL + OP_LOAD4 + OP_LOCAL + OP_LOAD4 + OP_ADDF..OP_MULF
+				if ( v == OP_ADDF || v == OP_SUBF || v == OP_MULF || v == OP_DIVF ) {
+					lci->op = MOP_CALCF4;
+					lci += 5; i += 5;
+					continue;
+				}
+			}
+
+			// OP_LOCAL + ... + OP_STORE4: write straight to the local
+			v = lci->value;
+			if ( (lci+1)->op != OP_LOAD1 && (lci+1)->op != OP_LOAD2 && (lci+1)->op != OP_LOAD4 && v >= 8 && v <= pstack - 4 ) {
+				n = VM_FindLocalStore( buf, instructionCount, i );
+				if ( n != -1 ) {
+					lci->op = OP_IGNORE;
+					buf[n].op = MOP_STORE_LOCAL4;
+					buf[n].value = v;
+				}
+			}
 		}
 
 		lci++;
@@ -1409,6 +1656,111 @@ static qboolean EmitMOPs(vm_t *vm, int op)
 			ip += 3;
 			return qtrue;
 
+		// [local] op [local]
+		case MOP_CALCF4:
+			EmitPushOpStack();
+			v = ci->value;
+			if ( ISS8( v ) ) {
+				EmitString( "f3 0f 10 45" );	// movss xmm0, dword ptr [ebp + 0x7F]
+				Emit1( v );
+			} else {
+				EmitString( "f3 0f 10 85" );	// movss xmm0, dword ptr [ebp + 0x12345678]
+				Emit4( v );
+			}
+			switch( inst[ip+3].op ) {
+				case OP_ADDF: EmitString( "f3 0f 58" ); break;	// addss xmm0, dword ptr [ebp + v]
+				case OP_SUBF: EmitString( "f3 0f 5c" ); break;	// subss xmm0, dword ptr [ebp + v]
+				case OP_MULF: EmitString( "f3 0f 59" ); break;	// mulss xmm0, dword ptr [ebp + v]
+				case OP_DIVF: EmitString( "f3 0f 5e" ); break;	// divss xmm0, dword ptr [ebp + v]
+			}
+			v = inst[ip+1].value;
+			if ( ISS8( v ) ) {
+				EmitString( "45" );
+				Emit1( v );
+			} else {
+				EmitString( "85" );
+				Emit4( v );
+			}
+			SetTop( TOP_XMM0 );
+			ip += 4;
+			return qtrue;
+
+		// if ( [local] cmp CONST ) goto
+		case MOP_CMP_LOCAL_CONST:
+			n = inst[ip+1].value;
+			v = ci->value; // local variable address
+			if ( ISS8( n ) ) {
+				if ( ISS8( v ) ) {
+					EmitString( "83 7D" );	// cmp dword ptr [ebp + 0x7F], 0x12
+					Emit1( v );
+					Emit1( n );
+				} else {
+					EmitString( "83 BD" );	// cmp dword ptr [ebp + 0x12345678], 0x12
+					Emit4( v );
+					Emit1( n );
+				}
+			} else {
+				if ( ISS8( v ) ) {
+					EmitString( "81 7D" );	// cmp dword ptr [ebp + 0x7F], 0x12345678
+					Emit1( v );
+					Emit4( n );
+				} else {
+					EmitString( "81 BD" );	// cmp dword ptr [ebp + 0x12345678], 0x12345678
+					Emit4( v );
+					Emit4( n );
+				}
+			}
+			EmitJump( vm, &inst[ip+2], inst[ip+2].op, inst[ip+2].value );
+			ip += 3;
+			return qtrue;
+
+		// if ( [local] cmp [local] ) goto
+		case MOP_CMP_LOCAL_LOCAL:
+			EmitFlushOpStack();
+			v = inst[ip+1].value;
+			if ( ISS8( v ) ) {
+				EmitString( "8B 45" );		// mov eax, dword ptr [ebp + 0x7F]
+				Emit1( v );
+			} else {
+				EmitString( "8B 85" );		// mov eax, dword ptr [ebp + 0x12345678]
+				Emit4( v );
+			}
+			v = ci->value;
+			if ( ISS8( v ) ) {
+				EmitString( "39 45" );		// cmp dword ptr [ebp + 0x7F], eax
+				Emit1( v );
+			} else {
+				EmitString( "39 85" );		// cmp dword ptr [ebp + 0x12345678], eax
+				Emit4( v );
+			}
+			EmitJump( vm, &inst[ip+3], inst[ip+3].op, inst[ip+3].value );
+			ip += 4;
+			return qtrue;
+
+		// [local] = opStack top
+		case MOP_STORE_LOCAL4:
+			v = ci->value; // local variable address
+			if ( opStackTop == TOP_XMM0 ) {
+				EmitString( "f3 0f 11" );	// movss dword ptr [ebp + v], xmm0
+			} else {
+				EmitTopToEAX();
+				EmitString( "89" );			// mov dword ptr [ebp + v], eax
+			}
+			if ( ISS8( v ) ) {
+				EmitString( "45" );
+				Emit1( v );
+			} else {
+				EmitString( "85" );
+				Emit4( v );
+			}
+			// the value stays in the same opStack slot instead of being loaded back from the local
+			if ( ni->op == OP_LOCAL && ni->value == v && !ni->jused && inst[ip+1].op == OP_LOAD4 ) {
+				ip += 2;
+				return qtrue;
+			}
+			PopOpStack( 1 );
+			return qtrue;
+
 	};
 	return qfalse;
 }
@@ -1493,6 +1845,209 @@ static void EmitCallStackPop( vm_t *vm )
 }
 
 
+/*
+=================
+JIT cache
+
+The generated code only depends on the QVM and on this file,
+so it's saved to vmcache/<name>.jit with its relocations
+and the instruction offsets needed to rebuild the pointer table.
+=================
+*/
+
+#define VM_CACHE_VERSION	3
+
+typedef struct {
+	char		magic[4];		// "QJIT"
+	int			version;
+	char		build[96];		// the code generator has to be the exact same
+	int			cpuFeatures;	// ConstOptimize uses SSE4.1 when available
+	int			pointerSize;
+	int			relocSize;
+	unsigned	checksum;		// of the .qvm file
+	int			instructionCount;
+	int			dataMask;
+	int			codeLength;		// the instruction offsets and relocations follow the code
+	int			numRelocs;
+	unsigned	payloadCRC;		// of the code, instruction offsets and relocations
+} vmCacheHeader_t;
+
+
+static void VM_CachePath( char *path, int size, const vm_t *vm )
+{
+	Com_sprintf( path, size, "vmcache/%s.jit", vm->name );
+}
+
+
+static void VM_FillCacheHeader( vmCacheHeader_t *header, const vm_t *vm, int codeLength, int relocCount )
+{
+	Com_Memset( header, 0, sizeof( *header ) );
+	Com_Memcpy( header->magic, "QJIT", 4 );
+	header->version = VM_CACHE_VERSION;
+	Q_strncpyz( header->build, GIT_COMMIT " " __DATE__ " " __TIME__, sizeof( header->build ) );
+	header->cpuFeatures = cpu_features;
+	header->pointerSize = sizeof( intptr_t );
+	header->relocSize = sizeof( vmReloc_t );
+	header->checksum = vm->checksum;
+	header->instructionCount = vm->instructionCount;
+	header->dataMask = vm->dataMask;
+	header->codeLength = codeLength;
+	header->numRelocs = relocCount;
+}
+
+
+static qbool VM_RelocValid( const vm_t *vm, const vmReloc_t *r, int codeLength, int tableLength )
+{
+	if ( r->offset < 0 || r->offset > codeLength - (int)sizeof( intptr_t ) || r->delta < 0 )
+		return qfalse;
+
+	switch ( r->type ) {
+		case VMR_VM: return r->delta <= (int)sizeof( vm_t );
+		case VMR_DATA: return r->delta <= vm->dataMask + 1;
+		case VMR_CODE: return r->delta <= codeLength + tableLength;
+		case VMR_GLOBAL: return r->delta < ARRAY_LEN( vmGlobals );
+		default: return qfalse;
+	}
+}
+
+
+static intptr_t VM_RelocTarget( const vm_t *vm, const vmReloc_t *r )
+{
+	switch ( r->type ) {
+		case VMR_VM: return (intptr_t)vm + r->delta;
+		case VMR_DATA: return (intptr_t)vm->dataBase + r->delta;
+		case VMR_CODE: return (intptr_t)vm->codeBase.ptr + r->delta;
+		default: return (intptr_t)vmGlobals[r->delta];
+	}
+}
+
+
+// returns qfalse if the cache is missing, stale or invalid
+static qbool VM_LoadCompiledCache( vm_t *vm )
+{
+	if ( !vm_cache->integer )
+		return qfalse;
+
+	char path[MAX_QPATH];
+	VM_CachePath( path, sizeof( path ), vm );
+
+	int fileSize;
+	const byte* const file = FS_SV_MapFileRead( path, &fileSize );
+	if ( !file )
+		return qfalse;
+
+	vmCacheHeader_t header;
+	vmCacheHeader_t expected;
+	qbool valid = fileSize >= (int)sizeof( header );
+	if ( valid ) {
+		Com_Memcpy( &header, file, sizeof( header ) );
+		VM_FillCacheHeader( &expected, vm, header.codeLength, header.numRelocs );
+		expected.payloadCRC = header.payloadCRC;
+		valid =
+			!memcmp( &header, &expected, sizeof( header ) ) &&
+			header.codeLength > 0 && header.codeLength % sizeof( intptr_t ) == 0 &&
+			header.numRelocs >= 0 &&
+			(int64_t)fileSize == (int64_t)sizeof( header ) + header.codeLength +
+				(int64_t)header.instructionCount * sizeof( int ) +
+				(int64_t)header.numRelocs * sizeof( vmReloc_t );
+	}
+
+	// the file could come from fs_basepath or have been damaged,
+	// so the code doesn't get anywhere near executable memory unless it's intact
+	if ( valid ) {
+		unsigned crc;
+		CRC32_Begin( &crc );
+		CRC32_ProcessBlock( &crc, file + sizeof( header ), fileSize - sizeof( header ) );
+		CRC32_End( &crc );
+		valid = crc == header.payloadCRC;
+	}
+
+	if ( !valid ) {
+		Sys_UnmapFile( file, fileSize );
+		return qfalse;
+	}
+
+	const byte* const fileCode = file + sizeof( header );
+	const int* const fileOffsets = (const int*)( fileCode + header.codeLength );
+	const vmReloc_t* const fileRelocs = (const vmReloc_t*)( fileOffsets + header.instructionCount );
+	const int tableLength = header.instructionCount * sizeof( intptr_t );
+
+	// validate everything before allocating so that a bad file costs nothing
+	for ( int i = 0; valid && i < header.instructionCount; ++i ) {
+		valid = fileOffsets[i] >= -1 && fileOffsets[i] < header.codeLength;
+	}
+	for ( int i = 0; valid && i < header.numRelocs; ++i ) {
+		valid = VM_RelocValid( vm, &fileRelocs[i], header.codeLength, tableLength );
+	}
+
+	if ( !valid ) {
+		Sys_UnmapFile( file, fileSize );
+		return qfalse;
+	}
+
+	byte* const base = (byte*)VM_Alloc_Compiled( vm, header.codeLength, tableLength );
+	Com_Memcpy( base, fileCode, header.codeLength );
+
+	for ( int i = 0; i < header.numRelocs; ++i ) {
+		const intptr_t target = VM_RelocTarget( vm, &fileRelocs[i] );
+		Com_Memcpy( base + fileRelocs[i].offset, &target, sizeof( target ) );
+	}
+
+	intptr_t* const table = (intptr_t*)( base + header.codeLength );
+	for ( int i = 0; i < header.instructionCount; ++i ) {
+		table[i] = fileOffsets[i] < 0 ? (intptr_t)badJumpPtr : (intptr_t)base + fileOffsets[i];
+	}
+
+	Sys_UnmapFile( file, fileSize );
+
+	return VM_Protect_Compiled( vm );
+}
+
+
+static void VM_WriteCompiledCache( const vm_t *vm )
+{
+	if ( !vm_cache->integer || !relocsValid || numRelocs != maxRelocs )
+		return;
+
+	const int offsetsSize = vm->instructionCount * sizeof( int );
+	const int relocsSize = numRelocs * sizeof( vmReloc_t );
+
+	vmCacheHeader_t header;
+	VM_FillCacheHeader( &header, vm, vm->codeLength, numRelocs );
+	CRC32_Begin( &header.payloadCRC );
+	CRC32_ProcessBlock( &header.payloadCRC, vm->codeBase.ptr, vm->codeLength );
+	CRC32_ProcessBlock( &header.payloadCRC, instructionOffsets, offsetsSize );
+	CRC32_ProcessBlock( &header.payloadCRC, relocs, relocsSize );
+	CRC32_End( &header.payloadCRC );
+
+	// other server instances may have the current file mapped,
+	// so it's only ever replaced by a complete one
+	char path[MAX_QPATH];
+	char tempPath[MAX_QPATH];
+	VM_CachePath( path, sizeof( path ), vm );
+	Com_sprintf( tempPath, sizeof( tempPath ), "%s.tmp", path );
+	const fileHandle_t f = FS_SV_FOpenFileWrite( tempPath );
+	if ( !f ) {
+		Com_DPrintf( "Couldn't write the JIT cache %s\n", path );
+		return;
+	}
+
+	const qbool written =
+		FS_Write( &header, sizeof( header ), f ) == (int)sizeof( header ) &&
+		FS_Write( vm->codeBase.ptr, vm->codeLength, f ) == vm->codeLength &&
+		FS_Write( instructionOffsets, offsetsSize, f ) == offsetsSize &&
+		FS_Write( relocs, relocsSize, f ) == relocsSize;
+	FS_FCloseFile( f );
+
+	if ( !written ) {
+		FS_SV_RemoveFile( tempPath );
+		Com_DPrintf( "Couldn't write the JIT cache %s\n", path );
+	} else if ( !FS_SV_ReplaceFile( tempPath, path ) ) {
+		Com_DPrintf( "Couldn't replace the JIT cache %s\n", path );
+	}
+}
+
+
 /*
 =================
 VM_Compile
@@ -1505,6 +2060,12 @@ qboolean VM_Compile( vm_t *vm, vmHeader_t *header ) {
 	int		proc_len;
 	int		i, n, v;
 
+	if ( VM_LoadCompiledCache( vm ) ) {
+		vm->destroy = VM_Destroy_Compiled;
+		Com_Printf( "VM file %s loaded from the JIT cache with %i bytes of code\n", vm->name, vm->codeLength );
+		return qtrue;
+	}
+
 	inst = (instruction_t*)Z_Malloc((header->instructionCount + 8) * sizeof(instruction_t));
 	instructionOffsets = (int*)Z_Malloc( header->instructionCount * sizeof( int ) );
 
@@ -1518,7 +2079,7 @@ qboolean VM_Compile( vm_t *vm, vmHeader_t *header ) {
 		return qfalse;
 	}
 
-	VM_FindMOps( inst, vm->instructionCount );
+	VM_FindMOps( vm, inst, vm->instructionCount );
 
 	code = NULL; // we will allocate memory later, after last defined pass
 	instructionPointers = NULL;
@@ -1527,14 +2088,17 @@ qboolean VM_Compile( vm_t *vm, vmHeader_t *header ) {
 
 	instructionCount = header->instructionCount;
 
+	relocVM = vm;
+	relocs = NULL;
+	relocsValid = qtrue;
+
 __compile:
-	pop1 = OP_UNDEF;
-	lastConst = 0;
+	numRelocs = 0;
 
 	// translate all instructions
 	ip = 0;
 	compiledOfs = 0;
-	LastCommand = LAST_COMMAND_NONE;
+	ResetOpStack();
 
 	proc_base = -1;
 	proc_len = 0;
@@ -1633,17 +2197,17 @@ __compile:
 
 	while ( ip < instructionCount )
 	{
-		instructionOffsets[ ip ] = compiledOfs;
-
 		ci = &inst[ ip ];
 		ni = &inst[ ip + 1 ];
-		ip++;
 
+		// code jumping here expects the opStack in memory
 		if ( ci->jused ) {
-			LastCommand = LAST_COMMAND_NONE;
-			pop1 = OP_UNDEF;
+			EmitFlushOpStack();
 		}
 
+		instructionOffsets[ ip ] = compiledOfs;
+		ip++;
+
 		switch ( ci->op ) {
 
 		case OP_UNDEF:
@@ -1655,6 +2219,7 @@ __compile:
 			break;
 
 		case OP_ENTER:
+			ResetOpStack();
 			EmitCallStackPush( vm );
 
 			v = ci->value;
@@ -1722,17 +2287,20 @@ __compile:
 			if ( !ni->jused && ConstOptimize( vm ) )
 				break;
 
-			EmitAddEDI4( vm );					// add edi, 4
-			EmitString( "C7 07" );				// mov dword ptr [edi], 0x12345678
-			lastConst = ci->value;
-			Emit4( lastConst );
-			LastCommand = LAST_COMMAND_MOV_EDI_CONST;
+			EmitPushOpStack();
+			if ( ci->value == 0 ) {
+				EmitString( "31 C0" );			// xor eax, eax
+			} else {
+				EmitString( "B8" );				// mov eax, 0x12345678
+				Emit4( ci->value );
+			}
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_LOCAL:
 			// optimization: merge OP_LOCAL + OP_LOAD4
 			if ( ni->op == OP_LOAD4 ) {
-				EmitAddEDI4( vm );				// add edi, 4
+				EmitPushOpStack();
 				v = ci->value;
 				if ( ISS8( v ) ) {
 					EmitString( "8B 45" );		// mov eax, dword ptr [ebp + 0x7F]
@@ -1741,14 +2309,14 @@ __compile:
 					EmitString( "8B 85" );		// mov eax, dword ptr [ebp + 0x12345678]
 					Emit4( v );
 				}
-				EmitCommand( LAST_COMMAND_MOV_EDI_EAX ); // mov dword ptr [edi], eax
+				SetTop( TOP_EAX );
 				ip++;
 				break;
 			}
 
 			// optimization: merge OP_LOCAL + OP_LOAD2
 			if ( ni->op == OP_LOAD2 ) {
-				EmitAddEDI4( vm );				// add edi, 4
+				EmitPushOpStack();
 				v = ci->value;
 				if ( ISS8( v ) ) {
 					EmitString( "0F B7 45" );	// movzx eax, word ptr [ebp + 0x7F]
@@ -1757,14 +2325,14 @@ __compile:
 					EmitString( "0F B7 85" );	// movzx eax, word ptr [ebp + 0x12345678]
 					Emit4( v );
 				}
-				EmitCommand( LAST_COMMAND_MOV_EDI_EAX ); // mov dword ptr [edi], eax
+				SetTop( TOP_EAX );
 				ip++;
 				break;
 			}
 
 			// optimization: merge OP_LOCAL + OP_LOAD1
 			if ( ni->op == OP_LOAD1 ) {
-				EmitAddEDI4( vm );				// add edi, 4
+				EmitPushOpStack();
 				v = ci->value;
 				if ( ISS8( v ) ) {
 					EmitString( "0F B6 45" );	// movzx eax, byte ptr [ebp + 0x7F]
@@ -1773,12 +2341,12 @@ __compile:
 					EmitString( "0F B6 85" );	// movzx eax, byte ptr [ebp + 0x12345678]
 					Emit4( v );
 				}
-				EmitCommand( LAST_COMMAND_MOV_EDI_EAX ); // mov dword ptr [edi], eax
+				SetTop( TOP_EAX );
 				ip++;
 				break;
 			}
 
-			EmitAddEDI4( vm );					// add edi, 4
+			EmitPushOpStack();
 			v = ci->value;
 			if ( ISS8( v ) ) {
 				EmitString( "8D 46" );			// lea eax, [esi + 0x7F]
@@ -1787,40 +2355,50 @@ __compile:
 				EmitString( "8D 86" );			// lea eax, [esi + 0x12345678]
 				Emit4( v );
 			}
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_ARG:
-			EmitMovEAXEDI( vm );					// mov	eax, dword ptr [edi]
+			if ( opStackTop == TOP_XMM0 ) {
+				EmitString( "f3 0f 11" );				// movss dword ptr [ebp + v], xmm0
+			} else {
+				EmitTopToEAX();
+				EmitString( "89" );						// mov dword ptr [ebp + v], eax
+			}
 			v = ci->value;
 			if ( ISS8( v ) ) {
-				EmitString( "89 45" );				// mov	dword ptr [ebp + 0x7F], eax
+				EmitString( "45" );
 				Emit1( v );
 			} else {
-				EmitString( "89 85" );				// mov	dword ptr [ebp + 0x12345678], eax
+				EmitString( "85" );
 				Emit4( v );
 			}
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			PopOpStack( 1 );
 			break;
 
 		case OP_CALL:
+			// the call stack tracking uses the scratch registers
+			EmitStoreTop();
+			opStackTop = TOP_MEMORY;
 			EmitCallStackPush( vm );
 
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
+			EmitTopToEAX();							// mov eax, dword ptr [edi]
+			EmitFlushOpStack();
 			EmitCallOffset( FUNC_CALL );			// call +FUNC_CALL
 
 			EmitCallStackPop( vm );
 			break;
 
 		case OP_PUSH:
-			EmitAddEDI4( vm );						// add edi, 4
+			EmitPushOpStack();
 			break;
 
 		case OP_POP:
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			PopOpStack( 1 );
 			break;
 
 		case OP_LEAVE:
+			EmitFlushOpStack();
 #ifdef DEBUG_VM
 			v = ci->value;
 			if ( ISS8( v ) ) {
@@ -1836,69 +2414,55 @@ __compile:
 			break;
 
 		case OP_LOAD4:
-			if ( LastCommand == LAST_COMMAND_MOV_EDI_EAX ) {
-				REWIND( 2 );
-				EmitCheckReg( vm, REG_EAX, 4 );			// range check eax
-				EmitString( "8B 04 03" );				// mov	eax, dword ptr [ebx + eax]
-				EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
-				break;
-			}
-			EmitMovECXEDI( vm );						// mov ecx, dword ptr [edi]
-			EmitCheckReg( vm, REG_ECX, 4 );				// range check ecx
-			EmitString( "8B 04 0B" );					// mov	eax, dword ptr [ebx + ecx]
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );	// mov dword ptr [edi], eax
+			EmitTopToEAX();
+			EmitCheckReg( vm, REG_EAX, 4 );				// range check eax
+			EmitString( "8B 04 03" );					// mov	eax, dword ptr [ebx + eax]
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_LOAD2:
-			if ( LastCommand == LAST_COMMAND_MOV_EDI_EAX ) {
-				REWIND( 2 );
-				EmitCheckReg( vm, REG_EAX, 2 );			// range check eax
-				EmitString( "0F B7 04 03" );			// movzx eax, word ptr [ebx + eax]
-				EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
-				break;
-			}
-			EmitMovECXEDI( vm );						// mov ecx, dword ptr [edi]
-			EmitCheckReg( vm, REG_ECX, 2 );				// range check ecx
-			EmitString( "0F B7 04 0B" );				// movzx eax, word ptr [ebx + ecx]
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );	// mov dword ptr [edi], eax
+			EmitTopToEAX();
+			EmitCheckReg( vm, REG_EAX, 2 );				// range check eax
+			EmitString( "0F B7 04 03" );				// movzx eax, word ptr [ebx + eax]
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_LOAD1:
-			if ( LastCommand == LAST_COMMAND_MOV_EDI_EAX ) {
-				REWIND( 2 );
-				EmitCheckReg( vm, REG_EAX, 1 );			// range check eax
-				EmitString( "0F B6 04 03" );			// movzx eax, byte ptr [ebx + eax]
-				EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
-				break;
-			}
-			EmitMovECXEDI( vm );						// mov ecx, dword ptr [edi]
-			EmitCheckReg( vm, REG_ECX, 1 );				// range check ecx
-			EmitString( "0F B6 04 0B" );				// movzx eax, byte ptr [ebx + ecx]
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );	// mov dword ptr [edi], eax
+			EmitTopToEAX();
+			EmitCheckReg( vm, REG_EAX, 1 );				// range check eax
+			EmitString( "0F B6 04 03" );				// movzx eax, byte ptr [ebx + eax]
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_STORE4:
-			EmitMovEAXEDI( vm );						// mov eax, dword ptr [edi]
-			EmitString( "8B 4F FC" );					// mov ecx, dword ptr [edi-4]
+			EmitString( "8B" );							// mov ecx, dword ptr [edi-4]
+			EmitOpStackAddr( REG_ECX, 1 );
 			EmitCheckReg( vm, REG_ECX, 4 );				// range check
-			EmitString( "89 04 0B" );					// mov dword ptr [ebx + ecx], eax
-			EmitCommand( LAST_COMMAND_SUB_DI_8 );		// sub edi, 8
+			if ( opStackTop == TOP_XMM0 ) {
+				EmitString( "f3 0f 11 04 0B" );			// movss dword ptr [ebx + ecx], xmm0
+			} else {
+				EmitTopToEAX();							// mov eax, dword ptr [edi]
+				EmitString( "89 04 0B" );				// mov dword ptr [ebx + ecx], eax
+			}
+			PopOpStack( 2 );
 			break;
 
 		case OP_STORE2:
-			EmitMovEAXEDI( vm );						// mov eax, dword ptr [edi]
-			EmitString( "8B 4F FC" );					// mov ecx, dword ptr [edi-4]
+			EmitTopToEAX();								// mov eax, dword ptr [edi]
+			EmitString( "8B" );							// mov ecx, dword ptr [edi-4]
+			EmitOpStackAddr( REG_ECX, 1 );
 			EmitCheckReg( vm, REG_ECX, 2 );				// range check
 			EmitString( "66 89 04 0B" );				// mov word ptr [ebx + ecx], ax
-			EmitCommand( LAST_COMMAND_SUB_DI_8 );		// sub edi, 8
+			PopOpStack( 2 );
 			break;
 
 		case OP_STORE1:
-			EmitMovEAXEDI( vm );						// mov eax, dword ptr [edi]
-			EmitString( "8B 4F FC" );					// mov ecx, dword ptr [edi-4]
+			EmitTopToEAX();								// mov eax, dword ptr [edi]
+			EmitString( "8B" );							// mov ecx, dword ptr [edi-4]
+			EmitOpStackAddr( REG_ECX, 1 );
 			EmitCheckReg( vm, REG_ECX, 1 );				// range check
 			EmitString( "88 04 0B" );					// mov byte ptr [ebx + ecx], eax
-			EmitCommand( LAST_COMMAND_SUB_DI_8 );		// sub edi, 8
+			PopOpStack( 2 );
 			break;
 
 		case OP_EQ:
@@ -1911,9 +2475,10 @@ __compile:
 		case OP_LEU:
 		case OP_GTU:
 		case OP_GEU:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitCommand( LAST_COMMAND_SUB_DI_8 );	// sub edi, 8
-			EmitString( "39 47 04" );				// cmp dword ptr [edi+4], eax
+			EmitTopToEAX();							// mov eax, dword ptr [edi]
+			EmitString( "39" );						// cmp dword ptr [edi-4], eax
+			EmitOpStackAddr( REG_EAX, 1 );
+			PopOpStack( 2 );
 			EmitJump( vm, ci, ci->op, ci->value );
 			break;
 
@@ -1923,174 +2488,171 @@ __compile:
 		case OP_LEF:
 		case OP_GTF:
 		case OP_GEF:
-			EmitLoadFloatEDI( vm );
-			EmitString( "f3 0f 10 4f fc" );			// movss xmm1, dword ptr [edi-4]
-			EmitCommand( LAST_COMMAND_SUB_DI_8 );	// sub edi, 8
+			EmitTopToXMM0();
+			EmitString( "f3 0f 10" );				// movss xmm1, dword ptr [edi-4]
+			EmitOpStackAddr( REG_ECX, 1 );
+			PopOpStack( 2 );
 			EmitString( "0f 2f c8" );				// comiss xmm1, xmm0
 			EmitJump( vm, ci, ci->op, ci->value );
-			pop1 = OP_UNDEF;
 			break;
 
 		case OP_NEGI:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
+			EmitTopToEAX();							// mov eax, dword ptr [edi]
 			EmitString( "F7 D8" );					// neg eax
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_ADD:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitString( "01 47 FC" );				// add dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+		case OP_BAND:
+		case OP_BOR:
+		case OP_BXOR:
+		case OP_MULI:
+		case OP_MULU:
+			EmitTopToEAX();							// mov eax, dword ptr [edi]
+			switch ( ci->op ) {
+				case OP_ADD:  EmitString( "03" ); break;		// add eax, dword ptr [edi-4]
+				case OP_BAND: EmitString( "23" ); break;		// and eax, dword ptr [edi-4]
+				case OP_BOR:  EmitString( "0B" ); break;		// or eax, dword ptr [edi-4]
+				case OP_BXOR: EmitString( "33" ); break;		// xor eax, dword ptr [edi-4]
+				default:      EmitString( "0F AF" ); break;	// imul eax, dword ptr [edi-4]
+			}
+			EmitOpStackAddr( REG_EAX, 1 );
+			PopOpStack( 1 );
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_SUB:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitString( "29 47 FC" );				// sub dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			EmitTopToECX();							// mov ecx, dword ptr [edi]
+			EmitString( "8B" );						// mov eax, dword ptr [edi-4]
+			EmitOpStackAddr( REG_EAX, 1 );
+			EmitString( "29 C8" );					// sub eax, ecx
+			PopOpStack( 1 );
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_DIVI:
-			EmitString( "8B 47 FC" );				// mov eax,dword ptr [edi-4]
-			EmitString( "99" );						// cdq
-			EmitString( "F7 3F" );					// idiv dword ptr [edi]
-			EmitString( "89 47 FC" );				// mov dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
 		case OP_DIVU:
-			EmitString( "8B 47 FC" );				// mov eax,dword ptr [edi-4]
-			EmitString( "33 D2" );					// xor edx, edx
-			EmitString( "F7 37" );					// div dword ptr [edi]
-			EmitString( "89 47 FC" );				// mov dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
 		case OP_MODI:
-			EmitString( "8B 47 FC" );				// mov eax,dword ptr [edi-4]
-			EmitString( "99" );						// cdq
-			EmitString( "F7 3F" );					// idiv dword ptr [edi]
-			EmitString( "89 57 FC" );				// mov dword ptr [edi-4],edx
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
 		case OP_MODU:
-			EmitString( "8B 47 FC" );				// mov eax,dword ptr [edi-4]
-			EmitString( "33 D2" );					// xor edx, edx
-			EmitString( "F7 37" );					// div dword ptr [edi]
-			EmitString( "89 57 FC" );				// mov dword ptr [edi-4],edx
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
-		case OP_MULI:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitString( "F7 6F FC" );				// imul eax, dword ptr [edi-4]
-			EmitString( "89 47 FC" );				// mov dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
-		case OP_MULU:
-			EmitString( "8B 47 FC" );				// mov eax,dword ptr [edi-4]
-			EmitString( "F7 27" );					// mul dword ptr [edi]
-			EmitString( "89 47 FC" );				// mov dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
-		case OP_BAND:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitString( "21 47 FC" );				// and dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
-		case OP_BOR:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitString( "09 47 FC" );				// or dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
-		case OP_BXOR:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitString( "31 47 FC" );				// xor dword ptr [edi-4],eax
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			EmitTopToECX();							// mov ecx, dword ptr [edi]
+			EmitString( "8B" );						// mov eax, dword ptr [edi-4]
+			EmitOpStackAddr( REG_EAX, 1 );
+			if ( ci->op == OP_DIVI || ci->op == OP_MODI ) {
+				EmitString( "99" );					// cdq
+				EmitString( "F7 F9" );				// idiv ecx
+			} else {
+				EmitString( "31 D2" );				// xor edx, edx
+				EmitString( "F7 F1" );				// div ecx
+			}
+			if ( ci->op == OP_MODI || ci->op == OP_MODU ) {
+				EmitString( "89 D0" );				// mov eax, edx
+			}
+			PopOpStack( 1 );
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_BCOM:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
+			EmitTopToEAX();							// mov eax, dword ptr [edi]
 			EmitString( "F7 D0" );					// not eax
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_LSH:
-			EmitMovECXEDI( vm );					// mov ecx, dword ptr [edi]
-			EmitString( "D3 67 FC" );				// shl dword ptr [edi-4], cl
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
 		case OP_RSHI:
-			EmitMovECXEDI( vm );					// mov ecx, dword ptr [edi]
-			EmitString( "D3 7F FC" );				// sar dword ptr [edi-4], cl
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
-			break;
-
 		case OP_RSHU:
-			EmitMovECXEDI( vm );					// mov ecx, dword ptr [edi]
-			EmitString( "D3 6F FC" );				// shr dword ptr [edi-4], cl
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			EmitTopToECX();							// mov ecx, dword ptr [edi]
+			EmitString( "8B" );						// mov eax, dword ptr [edi-4]
+			EmitOpStackAddr( REG_EAX, 1 );
+			switch ( ci->op ) {
+				case OP_LSH:  EmitString( "D3 E0" ); break;	// shl eax, cl
+				case OP_RSHI: EmitString( "D3 F8" ); break;	// sar eax, cl
+				default:      EmitString( "D3 E8" ); break;	// shr eax, cl
+			}
+			PopOpStack( 1 );
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_NEGF:
-			EmitLoadFloatEDI( vm );
-			EmitString( "0f 57 c9" );			// xorps xmm1, xmm1
-			EmitString( "0f 5c c8" );			// subps xmm1, xmm0
-			EmitString( "0f 28 c1" );			// movaps xmm0, xmm1
-			EmitCommand( LAST_COMMAND_STORE_FLOAT_EDI );
+			// flipping the sign bit gives -0.0 like the interpreter does, 0 - x wouldn't
+			if ( opStackTop == TOP_XMM0 ) {
+				EmitString( "B8 00 00 00 80" );	// mov eax, 0x80000000
+				EmitString( "66 0f 6e c8" );	// movd xmm1, eax
+				EmitString( "0f 57 c1" );		// xorps xmm0, xmm1
+				SetTop( TOP_XMM0 );
+			} else {
+				EmitTopToEAX();
+				EmitString( "35 00 00 00 80" );	// xor eax, 0x80000000
+				SetTop( TOP_EAX );
+			}
 			break;
 
 		case OP_ADDF:
+		case OP_MULF:
+			EmitTopToXMM0();
+			if ( ci->op == OP_ADDF )
+				EmitString( "f3 0f 58" );		// addss xmm0, dword ptr [edi-4]
+			else
+				EmitString( "f3 0f 59" );		// mulss xmm0, dword ptr [edi-4]
+			EmitOpStackAddr( REG_EAX, 1 );
+			PopOpStack( 1 );
+			SetTop( TOP_XMM0 );
+			break;
+
 		case OP_SUBF:
 		case OP_DIVF:
-		case OP_MULF:
-			EmitString( "f3 0f 10 47 fc" );		// movss xmm0, dword ptr [edi-4]
-			EmitString( "f3 0f 10 0f" );		// movss xmm1, dword ptr [edi]
-			switch( ci->op ) {
-				case OP_ADDF: EmitString( "0f 58 c1" ); break;	// addps xmm0, xmm1
-				case OP_SUBF: EmitString( "0f 5c c1" ); break;	// subps xmm0, xmm1
-				case OP_MULF: EmitString( "0f 59 c1" ); break;	// mulps xmm0, xmm1
-				case OP_DIVF: EmitString( "0f 5e c1" ); break;	// divps xmm0, xmm1
-			}
-			EmitString( "f3 0f 11 47 fc" );		// movss dword ptr [edi-4], xmm0
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			EmitTopToXMM0();
+			EmitString( "0f 28 c8" );			// movaps xmm1, xmm0
+			EmitString( "f3 0f 10" );			// movss xmm0, dword ptr [edi-4]
+			EmitOpStackAddr( REG_EAX, 1 );
+			if ( ci->op == OP_SUBF )
+				EmitString( "f3 0f 5c c1" );	// subss xmm0, xmm1
+			else
+				EmitString( "f3 0f 5e c1" );	// divss xmm0, xmm1
+			PopOpStack( 1 );
+			SetTop( TOP_XMM0 );
 			break;
 
 		case OP_CVIF:
-			EmitString( "f3 0f 2a 07" );		// cvtsi2ss xmm0, dword ptr [edi]
-			EmitCommand( LAST_COMMAND_STORE_FLOAT_EDI );
+			if ( opStackTop == TOP_MEMORY ) {
+				EmitString( "f3 0f 2a" );		// cvtsi2ss xmm0, dword ptr [edi]
+				EmitOpStackAddr( REG_EAX, 0 );
+			} else {
+				EmitTopToEAX();
+				EmitString( "f3 0f 2a c0" );	// cvtsi2ss xmm0, eax
+			}
+			SetTop( TOP_XMM0 );
 			break;
 
 		case OP_CVFI:
-			EmitLoadFloatEDI( vm );
+			EmitTopToXMM0();
 			EmitString( "f3 0f 2c c0" );		// cvttss2si eax, xmm0
-			EmitString( "89 07" );				// mov dword ptr [edi], eax
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_SEX8:
-			EmitString( "0F BE 07" );				// movsx eax, byte ptr [edi]
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
+			EmitTopToEAX();
+			EmitString( "0F BE C0" );				// movsx eax, al
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_SEX16:
-			EmitString( "0F BF 07" );				// movsx eax, word ptr [edi]
-			EmitCommand( LAST_COMMAND_MOV_EDI_EAX );// mov dword ptr [edi], eax
+			EmitTopToEAX();
+			EmitString( "0F BF C0" );				// movsx eax, ax
+			SetTop( TOP_EAX );
 			break;
 
 		case OP_BLOCK_COPY:
+			// the copy function pops both addresses from the opStack in memory
+			EmitFlushOpStack();
 			EmitString( "B9" );						// mov ecx, 0x12345678
 			Emit4( ci->value >> 2 );
 			EmitCallOffset( FUNC_BCPY );
 			break;
 
 		case OP_JUMP:
-			EmitMovEAXEDI( vm );					// mov eax, dword ptr [edi]
-			EmitCommand( LAST_COMMAND_SUB_DI_4 );	// sub edi, 4
+			EmitTopToEAX();							// mov eax, dword ptr [edi]
+			PopOpStack( 1 );
+			EmitFlushOpStack();
 
 			// jump target range check
 			if ( vm_rtChecks & 4 ) {
@@ -2132,6 +2694,10 @@ __compile:
 		case MOP_SUB4:
 		case MOP_BAND4:
 		case MOP_BOR4:
+		case MOP_CALCF4:
+		case MOP_CMP_LOCAL_CONST:
+		case MOP_CMP_LOCAL_LOCAL:
+		case MOP_STORE_LOCAL4:
 
 			if ( !EmitMOPs( vm, ci->op ) )
 				Com_Error( ERR_FATAL, "VM_CompileX86: bad opcode %02X", ci->op );
@@ -2142,8 +2708,6 @@ __compile:
 			VM_FreeBuffers();
 			return qfalse;
 		}
-
-		pop1 = (opcode_t)ci->op;
 	} // while( ip < header->instructionCount )
 
 		// ****************
@@ -2197,6 +2761,8 @@ __compile:
 			return qfalse;
 		}
 		instructionPointers = (intptr_t*)(byte*)(code + compiledOfs);
+		maxRelocs = numRelocs;
+		relocs = (vmReloc_t*)Z_Malloc( max( maxRelocs, 1 ) * sizeof( vmReloc_t ) );
 		goto __compile;
 	}
 
@@ -2204,31 +2770,18 @@ __compile:
 	for ( i = 0 ; i < header->instructionCount ; i++ ) {
 		if ( !inst[i].jused ) {
 			instructionPointers[ i ] = (intptr_t)badJumpPtr;
+			instructionOffsets[ i ] = -1; // so that the cache can rebuild the table
 			continue;
 		}
 		instructionPointers[ i ] = (intptr_t)vm->codeBase.ptr + instructionOffsets[ i ];
 	}
 
+	VM_WriteCompiledCache( vm );
+
 	VM_FreeBuffers();
 
-#ifdef VM_X86_MMAP
-	if ( mprotect( vm->codeBase.ptr, vm->allocSize, PROT_READ|PROT_EXEC ) ) {
-		VM_Destroy_Compiled( vm );
-		Com_Error( ERR_FATAL, "VM_CompileX86: mprotect failed" );
+	if ( !VM_Protect_Compiled( vm ) )
 		return qfalse;
-	}
-#elif _WIN32
-	{
-		DWORD oldProtect = 0;
-
-		// remove write permissions.
-		if ( !VirtualProtect( vm->codeBase.ptr, vm->allocSize, PAGE_EXECUTE_READ, &oldProtect ) ) {
-			VM_Destroy_Compiled( vm );
-			Com_Error( ERR_FATAL, "VM_CompileX86: VirtualProtect failed" );
-			return qfalse;
-		}
-	}
-#endif
 
 	vm->destroy = VM_Destroy_Compiled;
 
@@ -2273,6 +2826,34 @@ static void *VM_Alloc_Compiled(vm_t *vm, int codeLength, int tableLength)
 }
 
 
+/*
+=================
+VM_Protect_Compiled
+
+Removes the write permissions once the code is in place
+=================
+*/
+static qbool VM_Protect_Compiled( vm_t *vm )
+{
+#ifdef VM_X86_MMAP
+	if ( mprotect( vm->codeBase.ptr, vm->allocSize, PROT_READ|PROT_EXEC ) ) {
+		VM_Destroy_Compiled( vm );
+		Com_Error( ERR_FATAL, "VM_CompileX86: mprotect failed" );
+		return qfalse;
+	}
+#elif _WIN32
+	DWORD oldProtect = 0;
+	if ( !VirtualProtect( vm->codeBase.ptr, vm->allocSize, PAGE_EXECUTE_READ, &oldProtect ) ) {
+		VM_Destroy_Compiled( vm );
+		Com_Error( ERR_FATAL, "VM_CompileX86: VirtualProtect failed" );
+		return qfalse;
+	}
+#endif
+
+	return qtrue;
+}
+
+
 /*
 ==============
 VM_Destroy_Compiled
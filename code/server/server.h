@@ -33,15 +33,13 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define	MAX_ENT_CLUSTERS	16
 
 typedef struct svEntity_s {
-	struct worldSector_s *worldSector;
-	struct svEntity_s *nextEntityInWorldSector;
+	int			worldLeaf;			// index + 1 of the entity's leaf in the world tree, 0 if not linked
 	
 	entityState_t	baseline;		// for delta compression of initial sighting
 	int			numClusters;		// if -1, use headnode instead
 	int			clusternums[MAX_ENT_CLUSTERS];
 	int			lastCluster;		// if all the clusters don't fit in clusternums
 	int			areanum, areanum2;
-	int			snapshotCounter;	// used to prevent double adding from portal views
 } svEntity_t;
 
 typedef enum {
@@ -59,7 +57,6 @@ struct server_t {
 	// https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=475
 	// the serverId associated with the current checksumFeed (always <= serverId)
 	int				checksumFeedServerId;
-	int				snapshotCounter;	// incremented for each snapshot built
 	int				timeResidual;		// <= 1000 / sv_frame->value
 	int				nextFrameTime;		// when time > nextFrameTime, process world
 	struct cmodel_s	*models[MAX_MODELS];
@@ -110,10 +107,12 @@ typedef struct netchan_buffer_s {
 	struct netchan_buffer_s *next;
 } netchan_buffer_t;
 
-// KHB  these are basically WORTHLESS, because netchan will cap blocks at FRAGMENT_SIZE
-// so the best possible dl rate is essentially 1K per snap, REGARDLESS OF RATE, ie 30K/s ABSOLUTE MAX
+// downloads are sent by SV_SendClientDownloads at the client's rate, independently of snapshots
 #define MAX_DOWNLOAD_WINDOW		8 // max number of unacked download packets
 #define MAX_DOWNLOAD_BLKSIZE	2048
+#define DOWNLOAD_INITIAL_RTO	1000 // retransmit timeout in ms until we have round-trip times
+#define DOWNLOAD_MIN_RTO		200
+#define DOWNLOAD_MAX_RTO		4000
 
 typedef struct client_s {
 	clientState_t	state;
@@ -137,16 +136,18 @@ typedef struct client_s {
 
 	// downloading
 	char			downloadName[MAX_QPATH]; // if not empty string, we are downloading
-	fileHandle_t	download;			// file being downloaded
+	const byte*		downloadData;		// the mapped file being downloaded
 	int				downloadSize;		// total bytes (can't use EOF because of paks)
-	int				downloadCount;		// bytes sent
+	int				downloadBlockCount;	// including the empty EOF block
 	int				downloadClientBlock;	// last block we sent to the client, awaiting ack
-	int				downloadCurrentBlock;	// current block number
-	int				downloadXmitBlock;	// last block we xmited
-	byte*			downloadBlocks[MAX_DOWNLOAD_WINDOW];	// the buffers for the download blocks
-	int				downloadBlockSize[MAX_DOWNLOAD_WINDOW];
-	qbool			downloadEOF;		// We have sent the EOF block
-	int				downloadSendTime;	// time we last got an ack from the client
+	int				downloadXmitBlock;	// next block we xmit
+	int				downloadNewBlock;	// first block that was never sent
+	int				downloadBlockTimes[MAX_DOWNLOAD_WINDOW];	// first send time of each block, 0 if resent
+	int				downloadSendTime;	// Sys_Milliseconds time we last sent a block or got an ack
+	int				downloadNextTime;	// Sys_Milliseconds time when the rate allows sending again
+	int				downloadSRTT;		// smoothed block round-trip time, 0 until the first ack
+	int				downloadRTTVar;		// round-trip time variation
+	int				downloadRTO;		// retransmit timeout in ms
 
 	int				deltaMessage;		// frame last client usercmd message
 	int				nextReliableTime;	// svs.time when another reliable command will be allowed
@@ -180,6 +181,10 @@ typedef struct client_s {
 // out before legitimate users connected
 #define	MAX_CHALLENGES	1024
 
+// challenges are looked up by IP through hash chains
+#define	CHALLENGE_HASH_BITS	10
+#define	CHALLENGE_HASH_SIZE	(1 << CHALLENGE_HASH_BITS)
+
 #define	AUTHORIZE_TIMEOUT	5000
 
 typedef struct {
@@ -189,6 +194,8 @@ typedef struct {
 	int			pingTime;			// time the challenge response was sent to client
 	int			firstTime;			// time the adr was first used, for authorize timeout checks
 	qbool	connected;
+	qbool	cleared;			// waiting in svs.freeChallenges
+	int			hashNext;			// index + 1 of the next challenge in the chain, 0 ends it
 } challenge_t;
 
 
@@ -210,6 +217,10 @@ struct serverStatic_t
 	entityState_t	*snapshotEntities;		// [numSnapshotEntities]
 	int			nextHeartbeatTime;
 	challenge_t	challenges[MAX_CHALLENGES];	// to prevent invalid IPs from connecting
+	int			challengeHash[CHALLENGE_HASH_SIZE];	// index + 1 of the first challenge, 0 is empty
+	int			nextChallenge;				// the oldest challenge gets replaced next
+	int			freeChallenges[MAX_CHALLENGES];	// cleared challenges, reused before the ring advances
+	int			numFreeChallenges;
 	netadr_t	redirectAddress;			// for rcon return messages
 
 	netadr_t	authorizeAddress;			// for rcon return messages
@@ -249,6 +260,11 @@ extern	cvar_t	*sv_floodProtect;
 extern	cvar_t	*sv_lanForceRate;
 extern	cvar_t	*sv_strictAuth;
 extern	cvar_t	*sv_minRestartDelay;
+extern	cvar_t	*sv_snapshotThreads;
+extern	cvar_t	*sv_profileWriteInterval;
+extern	cvar_t	*sv_oobRate;
+extern	cvar_t	*sv_oobBurst;
+extern	cvar_t	*sv_traceCache;
 
 //===========================================================
 
@@ -262,6 +278,9 @@ void QDECL SV_SendServerCommand( client_t *cl, const char *fmt, ...);
 void SV_AddOperatorCommands();
 void SV_RemoveOperatorCommands();
 
+void SV_Profile_f();
+void SV_OOBStats_f();
+
 
 void SV_MasterHeartbeat (void);
 void SV_MasterShutdown (void);
@@ -300,7 +319,8 @@ void SV_DropClient( client_t *drop, const char *reason );
 void SV_ExecuteClientCommand( client_t *cl, const char *s, qbool clientOK );
 void SV_ClientThink( client_t* cl, const usercmd_t* cmd );
 
-void SV_WriteDownloadToClient( client_t *cl , msg_t *msg );
+void SV_SendClientDownloads();
+void SV_CloseClientDownloads();
 
 //
 // sv_ccmds.c
@@ -314,8 +334,12 @@ void SV_AddServerCommand( client_t *client, const char *cmd );
 void SV_UpdateServerCommandsToClient( client_t *client, msg_t *msg );
 void SV_WriteFrameToClient (client_t *client, msg_t *msg);
 void SV_SendMessageToClient( msg_t *msg, client_t *client );
+int SV_RateMsec( client_t *client, int messageSize );
 void SV_SendClientMessages( void );
 void SV_SendClientSnapshot( client_t *client );
+void SV_EndVisibilityCache();
+void SV_EndDeltaCache();
+void SV_DeltaStats_f();
 
 //
 // sv_game.c
@@ -354,6 +378,9 @@ void BotImport_DebugPolygonDelete(int id);
 void SV_ClearWorld();
 // called after the world model has been loaded, before linking any entities
 
+void SV_ClearTraceCache();
+// called before each game frame, the results of the previous one can't be reused
+
 void SV_UnlinkEntity( sharedEntity_t *ent );
 // call before removing an entity, and before trying to move one,
 // so it doesn't clip against itself
@@ -384,6 +411,8 @@ int SV_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int
 int SV_PointContents( const vec3_t p, int passEntityNum );
 // returns the CONTENTS_* value from the world and all entities at the given point.
 
+void SV_PointContentsBatch( int *results, const gamePointContentsQuery_t *queries, int count );
+
 
 void SV_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule );
 // mins and maxs are relative
@@ -396,6 +425,9 @@ void SV_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const ve
 
 // passEntityNum is explicitly excluded from clipping checks (normally ENTITYNUM_NONE)
 
+void SV_TraceBatch( trace_t *results, const gameTraceQuery_t *queries, int count );
+// same results as calling SV_Trace for each query
+
 
 void SV_ClipToEntity( trace_t *trace, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int entityNum, int contentmask, int capsule );
 // clip to a specific entity
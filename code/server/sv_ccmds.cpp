@@ -766,7 +766,10 @@ static const cmdTableItem_t sv_cmds[] =
 	{ "systeminfo", SV_Systeminfo_f, NULL, "prints all system info cvars" },
 	{ "dumpuser", SV_DumpUser_f, NULL, "prints a user's info cvars" },
 	{ "map_restart", SV_MapRestart_f, NULL, "resets the game without reloading the map" },
-	{ "sectorlist", SV_SectorList_f, NULL, "prints entity count for all sectors" },
+	{ "sectorlist", SV_SectorList_f, NULL, "prints entity tree and area query stats, " S_COLOR_VAL "reset " S_COLOR_HELP "clears them" },
+	{ "deltastats", SV_DeltaStats_f, NULL, "prints entity delta cache hits, " S_COLOR_VAL "reset " S_COLOR_HELP "clears the counters" },
+	{ "oobstats", SV_OOBStats_f, NULL, "prints connectionless packet counts, " S_COLOR_VAL "reset " S_COLOR_HELP "clears the counters" },
+	{ "serverprofile", SV_Profile_f, NULL, "prints server frame timings, " S_COLOR_VAL "reset " S_COLOR_HELP "clears them, " S_COLOR_VAL "write " S_COLOR_HELP "saves a JSON file" },
 	{ "map", SV_Map_f, SV_CompleteMap_f, "loads a map" },
 	{ "devmap", SV_DevMap_f, SV_CompleteMap_f, "loads a map with cheats enabled" },
 	{ "killserver", SV_KillServer_f, NULL, "shuts the server down" },
@@ -74,6 +74,70 @@ static void SV_UserinfoChanged( client_t *cl )
 }
 
 
+static int SV_ChallengeHash( const netadr_t& adr )
+{
+	// only the IP is hashed so that resetting the port keeps the challenge in its chain
+	const unsigned int ip = ((unsigned int)adr.ip[0] << 24) | ((unsigned int)adr.ip[1] << 16) | ((unsigned int)adr.ip[2] << 8) | (unsigned int)adr.ip[3];
+
+	return (int)((ip * 2654435761u) >> (32 - CHALLENGE_HASH_BITS));
+}
+
+
+// returns the first challenge whose IP hashes like adr's, the caller still compares the addresses
+
+static challenge_t* SV_FirstChallenge( const netadr_t& adr )
+{
+	const int index = svs.challengeHash[SV_ChallengeHash( adr )];
+
+	return index ? &svs.challenges[index - 1] : NULL;
+}
+
+
+static challenge_t* SV_NextChallenge( const challenge_t* challenge )
+{
+	return challenge->hashNext ? &svs.challenges[challenge->hashNext - 1] : NULL;
+}
+
+
+static void SV_LinkChallenge( challenge_t* challenge )
+{
+	int* const head = &svs.challengeHash[SV_ChallengeHash( challenge->adr )];
+
+	challenge->hashNext = *head;
+	*head = (int)(challenge - svs.challenges) + 1;
+}
+
+
+// does nothing if the challenge isn't linked
+
+static void SV_UnlinkChallenge( challenge_t* challenge )
+{
+	const int index = (int)(challenge - svs.challenges) + 1;
+
+	int* link = &svs.challengeHash[SV_ChallengeHash( challenge->adr )];
+	while ( *link != 0 ) {
+		if ( *link == index ) {
+			*link = challenge->hashNext;
+			challenge->hashNext = 0;
+			return;
+		}
+		link = &svs.challenges[*link - 1].hashNext;
+	}
+}
+
+
+static void SV_ClearChallenge( challenge_t* challenge )
+{
+	if ( challenge->cleared )
+		return;
+
+	SV_UnlinkChallenge( challenge );
+	Com_Memset( challenge, 0, sizeof( *challenge ) );
+	challenge->cleared = qtrue;
+	svs.freeChallenges[svs.numFreeChallenges++] = (int)(challenge - svs.challenges);
+}
+
+
 /*
 =================
 SV_GetChallenge
@@ -93,40 +157,38 @@ sent to that ip.
 =================
 */
 void SV_GetChallenge( netadr_t from ) {
-	int		i;
-	int		oldest;
-	int		oldestTime;
 	challenge_t	*challenge;
 
 	// ignore if we are in single player
 	if (Cvar_VariableValue("sv_singlePlayer"))
 		return;
 
-	oldest = 0;
-	oldestTime = 0x7fffffff;
-
 	// see if we already have a challenge for this ip
-	challenge = &svs.challenges[0];
-	for (i = 0 ; i < MAX_CHALLENGES ; i++, challenge++) {
+	for (challenge = SV_FirstChallenge( from ); challenge; challenge = SV_NextChallenge( challenge )) {
 		if ( !challenge->connected && NET_CompareAdr( from, challenge->adr ) ) {
 			break;
 		}
-		if ( challenge->time < oldestTime ) {
-			oldestTime = challenge->time;
-			oldest = i;
-		}
 	}
 
-	if (i == MAX_CHALLENGES) {
+	if (!challenge) {
 		// this is the first time this client has asked for a challenge
-		challenge = &svs.challenges[oldest];
+		// cleared challenges are reused first so that no pending one gets dropped,
+		// otherwise they're handed out in a ring and the one we replace is the oldest
+		if ( svs.numFreeChallenges > 0 ) {
+			challenge = &svs.challenges[svs.freeChallenges[--svs.numFreeChallenges]];
+		} else {
+			challenge = &svs.challenges[svs.nextChallenge];
+			svs.nextChallenge = (svs.nextChallenge + 1) % MAX_CHALLENGES;
+			SV_UnlinkChallenge( challenge );
+		}
 
+		challenge->cleared = qfalse;
 		challenge->challenge = ( (rand() << 16) ^ rand() ) ^ svs.time;
 		challenge->adr = from;
 		challenge->firstTime = svs.time;
 		challenge->time = svs.time;
 		challenge->connected = qfalse;
-		i = oldest;
+		SV_LinkChallenge( challenge );
 	}
 
 	// if they are on a lan address, send the challengeResponse immediately
@@ -176,7 +238,7 @@ void SV_GetChallenge( netadr_t from ) {
 		// the 0 is for backwards compatibility with obsolete sv_allowanonymous flags
 		// getIpAuthorize <challenge> <IP> <game> 0 <auth-flag>
 		NET_OutOfBandPrint( NS_SERVER, svs.authorizeAddress,
-			"getIpAuthorize %i %i.%i.%i.%i %s 0 %s", svs.challenges[i].challenge,
+			"getIpAuthorize %i %i.%i.%i.%i %s 0 %s", challenge->challenge,
 			from.ip[0], from.ip[1], from.ip[2], from.ip[3], game, sv_strictAuth->string );
 	}
 }
@@ -224,7 +286,7 @@ void SV_AuthorizeIpPacket( netadr_t from )
 			NET_OutOfBandPrint( NS_SERVER, svs.challenges[i].adr, "print\n%s\n", r );
 		}
 		// clear the challenge record so it won't timeout and let them through
-		Com_Memset( &svs.challenges[i], 0, sizeof( svs.challenges[i] ) );
+		SV_ClearChallenge( &svs.challenges[i] );
 		return;
 	}
 
@@ -236,7 +298,7 @@ void SV_AuthorizeIpPacket( netadr_t from )
 	}
 
 	// clear the challenge record so it won't timeout and let them through
-	Com_Memset( &svs.challenges[i], 0, sizeof( svs.challenges[i] ) );
+	SV_ClearChallenge( &svs.challenges[i] );
 }
 
 
@@ -312,15 +374,16 @@ void SV_DirectConnect( netadr_t from )
 	// see if the challenge is valid (LAN clients don't need to challenge)
 	if ( !NET_IsLocalAddress (from) ) {
 		int		ping;
+		challenge_t* ch;
 
-		for (i=0 ; i<MAX_CHALLENGES ; i++) {
-			if (NET_CompareAdr(from, svs.challenges[i].adr)) {
-				if ( challenge == svs.challenges[i].challenge ) {
+		for (ch = SV_FirstChallenge( from ); ch; ch = SV_NextChallenge( ch )) {
+			if (NET_CompareAdr(from, ch->adr)) {
+				if ( challenge == ch->challenge ) {
 					break;		// good
 				}
 			}
 		}
-		if (i == MAX_CHALLENGES) {
+		if (!ch) {
 			NET_OutOfBandPrint( NS_SERVER, from, "print\nNo or bad challenge for address.\n" );
 			return;
 		}
@@ -329,9 +392,9 @@ void SV_DirectConnect( netadr_t from )
 //		Info_SetValueForKey( userinfo, "ip", NET_AdrToString( from ) );
 // !Cgg
 
-		ping = svs.time - svs.challenges[i].pingTime;
-		Com_Printf( "Client %i connecting with %i challenge ping\n", i, ping );
-		svs.challenges[i].connected = qtrue;
+		ping = svs.time - ch->pingTime;
+		Com_Printf( "Client %i connecting with %i challenge ping\n", (int)(ch - svs.challenges), ping );
+		ch->connected = qtrue;
 
 		// never reject a LAN client based on ping
 		if ( !Sys_IsLANAddress( from ) ) {
@@ -341,7 +404,7 @@ void SV_DirectConnect( netadr_t from )
 				Com_DPrintf ("Client %i rejected on a too low ping\n", i);
 				// reset the address otherwise their ping will keep increasing
 				// with each connect message and they'd eventually be able to connect
-				svs.challenges[i].adr.port = 0;
+				ch->adr.port = 0;
 				return;
 			}
 			if ( sv_maxPing->value && ping > sv_maxPing->value ) {
@@ -511,9 +574,9 @@ void SV_DropClient( client_t* drop, const char* reason )
 
 	if (drop->netchan.remoteAddress.type != NA_BOT) {
 		// see if we already have a challenge for this ip
-		challenge_t* challenge = &svs.challenges[0];
-		for ( i = 0; i < MAX_CHALLENGES; ++i, ++challenge ) {
-			if ( NET_CompareAdr( drop->netchan.remoteAddress, challenge->adr ) ) {
+		const netadr_t& adr = drop->netchan.remoteAddress;
+		for ( challenge_t* challenge = SV_FirstChallenge( adr ); challenge; challenge = SV_NextChallenge( challenge ) ) {
+			if ( NET_CompareAdr( adr, challenge->adr ) ) {
 				challenge->connected = qfalse;
 				break;
 			}
@@ -528,10 +591,6 @@ void SV_DropClient( client_t* drop, const char* reason )
 
 	Com_DPrintf( "Going to CS_ZOMBIE for %s\n", drop->name );
 	drop->state = CS_ZOMBIE;		// become free in a few seconds
-	if (drop->download)	{
-		FS_FCloseFile( drop->download );
-		drop->download = 0;
-	}
 
 	// call the prog function for removing a client
 	// this will remove the body, among other things
@@ -674,21 +733,11 @@ CLIENT COMMAND EXECUTION
 
 static void SV_CloseDownload( client_t* cl )
 {
-	int i;
-
-	if (cl->download) {
-		FS_FCloseFile( cl->download );
+	if (cl->downloadData) {
+		Sys_UnmapFile( cl->downloadData, cl->downloadSize );
 	}
-	cl->download = 0;
+	cl->downloadData = NULL;
 	*cl->downloadName = 0;
-
-	// free the temporary buffer space
-	for (i = 0; i < MAX_DOWNLOAD_WINDOW; i++) {
-		if (cl->downloadBlocks[i]) {
-			Z_Free( cl->downloadBlocks[i] );
-			cl->downloadBlocks[i] = NULL;
-		}
-	}
 }
 
 
@@ -713,6 +762,32 @@ static void SV_DoneDownload_f( client_t* cl )
 }
 
 
+// the last block is always empty to signal the end of the file
+
+static int SV_DownloadBlockSize( const client_t* cl, int block )
+{
+	const int offset = block * MAX_DOWNLOAD_BLKSIZE;
+
+	return max( 0, min( cl->downloadSize - offset, MAX_DOWNLOAD_BLKSIZE ) );
+}
+
+
+// the retransmit timeout is derived from the block round-trip times like TCP's (RFC 6298)
+
+static void SV_UpdateDownloadRTO( client_t* cl, int rtt )
+{
+	if (cl->downloadSRTT == 0) {
+		cl->downloadSRTT = max( rtt, 1 );
+		cl->downloadRTTVar = rtt / 2;
+	} else {
+		cl->downloadRTTVar = (3 * cl->downloadRTTVar + abs( cl->downloadSRTT - rtt )) / 4;
+		cl->downloadSRTT = max( (7 * cl->downloadSRTT + rtt) / 8, 1 );
+	}
+
+	cl->downloadRTO = max( DOWNLOAD_MIN_RTO, min( cl->downloadSRTT + 4 * cl->downloadRTTVar, DOWNLOAD_MAX_RTO ) );
+}
+
+
 // argv[1] will be the last acknowledged block from the client
 // it should be the same as cl->downloadClientBlock
 
@@ -724,13 +799,20 @@ static void SV_NextDownload_f( client_t* cl )
 		Com_DPrintf( "clientDownload: %d : client acknowledge of block %d\n", cl - svs.clients, block );
 
 		// Find out if we are done.  A zero-length block indicates EOF
-		if (cl->downloadBlockSize[cl->downloadClientBlock % MAX_DOWNLOAD_WINDOW] == 0) {
+		if (SV_DownloadBlockSize( cl, cl->downloadClientBlock ) == 0) {
 			Com_Printf( "clientDownload: %d : file \"%s\" completed\n", cl - svs.clients, cl->downloadName );
 			SV_CloseDownload( cl );
 			return;
 		}
 
-		cl->downloadSendTime = svs.time;
+		// retransmitted blocks have no send time since we can't tell which copy got acknowledged
+		const int now = Sys_Milliseconds();
+		const int sendTime = cl->downloadBlockTimes[cl->downloadClientBlock % MAX_DOWNLOAD_WINDOW];
+		if (sendTime != 0) {
+			SV_UpdateDownloadRTO( cl, now - sendTime );
+		}
+
+		cl->downloadSendTime = now;
 		cl->downloadClientBlock++;
 		return;
 	}
@@ -749,231 +831,256 @@ static void SV_BeginDownload_f( client_t* cl )
 	// kill any existing download
 	SV_CloseDownload( cl );
 
-	// set cl->downloadName: SV_WriteDownloadToClient will see this and handle the startup
+	// set cl->downloadName: SV_SendClientDownloads will see this and handle the startup
 	Q_strncpyz( cl->downloadName, Cmd_Argv(1), sizeof(cl->downloadName) );
 }
 
 
+// download messages only carry the reliable command acknowledge and download data
+
+static void SV_BeginDownloadMessage( client_t* cl, msg_t* msg, byte* buffer )
+{
+	MSG_Init( msg, buffer, MAX_MSGLEN );
+	MSG_WriteLong( msg, cl->lastClientCommand );
+}
+
+
 /*
 ==================
-SV_WriteDownloadToClient
+SV_OpenDownload
 
-Check to see if the client wants a file, open it if needed and start pumping the client
-Fill up msg with data
+Check to see if the client is allowed to download the file and map it
+Sends the reason to the client and returns qfalse if it can't be downloaded
 ==================
 */
-void SV_WriteDownloadToClient( client_t *cl , msg_t *msg )
+static qbool SV_OpenDownload( client_t* cl )
 {
 	int curindex;
-	int rate;
-	int blockspersnap;
 	int idPack = 0, missionPack = 0, unreferenced = 1;
 	char errorMessage[1024];
 	char pakbuf[MAX_QPATH], *pakptr;
 	int numRefPaks;
 
-	if (!*cl->downloadName)
-		return;	// Nothing being downloaded
+	// Chop off filename extension.
+	Com_sprintf(pakbuf, sizeof(pakbuf), "%s", cl->downloadName);
+	pakptr = Q_strrchr(pakbuf, '.');
 
-	if (!cl->download) {
-		// Chop off filename extension.
-		Com_sprintf(pakbuf, sizeof(pakbuf), "%s", cl->downloadName);
-		pakptr = Q_strrchr(pakbuf, '.');
+	if(pakptr)
+	{
+		*pakptr = '\0';
 
-		if(pakptr)
+		// Check for pk3 filename extension
+		if(!Q_stricmp(pakptr + 1, "pk3"))
 		{
-			*pakptr = '\0';
-
-			// Check for pk3 filename extension
-			if(!Q_stricmp(pakptr + 1, "pk3"))
-			{
-				const char *referencedPaks = FS_ReferencedPakNames();
+			const char *referencedPaks = FS_ReferencedPakNames();
 
-				// Check whether the file appears in the list of referenced
-				// paks to prevent downloading of arbitrary files.
-				Cmd_TokenizeStringIgnoreQuotes(referencedPaks);
-				numRefPaks = Cmd_Argc();
+			// Check whether the file appears in the list of referenced
+			// paks to prevent downloading of arbitrary files.
+			Cmd_TokenizeStringIgnoreQuotes(referencedPaks);
+			numRefPaks = Cmd_Argc();
 
-				for(curindex = 0; curindex < numRefPaks; curindex++)
+			for(curindex = 0; curindex < numRefPaks; curindex++)
+			{
+				if(!FS_FilenameCompare(Cmd_Argv(curindex), pakbuf))
 				{
-					if(!FS_FilenameCompare(Cmd_Argv(curindex), pakbuf))
-					{
-						unreferenced = 0;
+					unreferenced = 0;
 
-						// now that we know the file is referenced,
-						// check whether it's legal to download it.
-						missionPack = FS_idPak(pakbuf, "missionpack");
-						idPack = missionPack || FS_idPak(pakbuf, BASEGAME);
+					// now that we know the file is referenced,
+					// check whether it's legal to download it.
+					missionPack = FS_idPak(pakbuf, "missionpack");
+					idPack = missionPack || FS_idPak(pakbuf, BASEGAME);
 
-						break;
-					}
+					break;
 				}
 			}
 		}
+	}
 
-		// We open the file here
-		if ( !sv_allowDownload->integer || idPack || unreferenced ||
-			( cl->downloadSize = FS_SV_FOpenFileRead( cl->downloadName, &cl->download ) ) <= 0 ) {
-			// cannot auto-download file
-			if(unreferenced)
-			{
-				Com_Printf("clientDownload: %d : \"%s\" is not referenced and cannot be downloaded.\n", cl - svs.clients, cl->downloadName);
-				Com_sprintf(errorMessage, sizeof(errorMessage), "File \"%s\" is not referenced and cannot be downloaded.", cl->downloadName);
+	// We map the file here
+	if ( !sv_allowDownload->integer || idPack || unreferenced ||
+		( cl->downloadData = FS_SV_MapFileRead( cl->downloadName, &cl->downloadSize ) ) == NULL ) {
+		// cannot auto-download file
+		if(unreferenced)
+		{
+			Com_Printf("clientDownload: %d : \"%s\" is not referenced and cannot be downloaded.\n", cl - svs.clients, cl->downloadName);
+			Com_sprintf(errorMessage, sizeof(errorMessage), "File \"%s\" is not referenced and cannot be downloaded.", cl->downloadName);
+		}
+		else if (idPack) {
+			Com_Printf("clientDownload: %d : \"%s\" cannot download id pk3 files\n", cl - svs.clients, cl->downloadName);
+			if (missionPack) {
+				Com_sprintf(errorMessage, sizeof(errorMessage),
+					"Cannot autodownload Team Arena file \"%s\"\n"
+					"The Team Arena mission pack can be found in your local game store.", cl->downloadName);
 			}
-			else if (idPack) {
-				Com_Printf("clientDownload: %d : \"%s\" cannot download id pk3 files\n", cl - svs.clients, cl->downloadName);
-				if (missionPack) {
-					Com_sprintf(errorMessage, sizeof(errorMessage),
-						"Cannot autodownload Team Arena file \"%s\"\n"
-						"The Team Arena mission pack can be found in your local game store.", cl->downloadName);
-				}
-				else {
-					Com_sprintf(errorMessage, sizeof(errorMessage), "Cannot autodownload id pk3 file \"%s\"", cl->downloadName);
-				}
-			} else if ( !sv_allowDownload->integer ) {
-				Com_Printf("clientDownload: %d : \"%s\" download disabled", cl - svs.clients, cl->downloadName);
-				if (sv_pure->integer) {
-					Com_sprintf(errorMessage, sizeof(errorMessage),
-						"Could not download \"%s\" because autodownloading is disabled on the server.\n\n"
-						"You will need to get this file elsewhere before you "
-						"can connect to this pure server.\n", cl->downloadName);
-				} else {
-					Com_sprintf(errorMessage, sizeof(errorMessage),
-						"Could not download \"%s\" because autodownloading is disabled on the server.\n\n"
-						"The server you are connecting to is not a pure server, "
-						"set autodownload to No in your settings and you might be "
-						"able to join the game anyway.\n", cl->downloadName);
-				}
+			else {
+				Com_sprintf(errorMessage, sizeof(errorMessage), "Cannot autodownload id pk3 file \"%s\"", cl->downloadName);
+			}
+		} else if ( !sv_allowDownload->integer ) {
+			Com_Printf("clientDownload: %d : \"%s\" download disabled", cl - svs.clients, cl->downloadName);
+			if (sv_pure->integer) {
+				Com_sprintf(errorMessage, sizeof(errorMessage),
+					"Could not download \"%s\" because autodownloading is disabled on the server.\n\n"
+					"You will need to get this file elsewhere before you "
+					"can connect to this pure server.\n", cl->downloadName);
 			} else {
-				// NOTE TTimo this is NOT supposed to happen unless bug in our filesystem scheme?
-				//   if the pk3 is referenced, it must have been found somewhere in the filesystem
-				Com_Printf("clientDownload: %d : \"%s\" file not found on server\n", cl - svs.clients, cl->downloadName);
-				Com_sprintf(errorMessage, sizeof(errorMessage), "File \"%s\" not found on server for autodownloading.\n", cl->downloadName);
+				Com_sprintf(errorMessage, sizeof(errorMessage),
+					"Could not download \"%s\" because autodownloading is disabled on the server.\n\n"
+					"The server you are connecting to is not a pure server, "
+					"set autodownload to No in your settings and you might be "
+					"able to join the game anyway.\n", cl->downloadName);
 			}
-			MSG_WriteByte( msg, svc_download );
-			MSG_WriteShort( msg, 0 ); // client is expecting block zero
-			MSG_WriteLong( msg, -1 ); // illegal file size
-			MSG_WriteString( msg, errorMessage );
-
-			*cl->downloadName = 0;
-			return;
+		} else {
+			// NOTE TTimo this is NOT supposed to happen unless bug in our filesystem scheme?
+			//   if the pk3 is referenced, it must have been found somewhere in the filesystem
+			Com_Printf("clientDownload: %d : \"%s\" file not found on server\n", cl - svs.clients, cl->downloadName);
+			Com_sprintf(errorMessage, sizeof(errorMessage), "File \"%s\" not found on server for autodownloading.\n", cl->downloadName);
 		}
 
-		Com_Printf( "clientDownload: %d : beginning \"%s\"\n", cl - svs.clients, cl->downloadName );
-
-		cl->downloadCurrentBlock = cl->downloadClientBlock = cl->downloadXmitBlock = 0;
-		cl->downloadCount = 0;
-		cl->downloadEOF = qfalse;
+		byte msgBuffer[MAX_MSGLEN];
+		msg_t msg;
+		SV_BeginDownloadMessage( cl, &msg, msgBuffer );
+		MSG_WriteByte( &msg, svc_download );
+		MSG_WriteShort( &msg, 0 ); // client is expecting block zero
+		MSG_WriteLong( &msg, -1 ); // illegal file size
+		MSG_WriteString( &msg, errorMessage );
+		SV_Netchan_Transmit( cl, &msg );
+
+		cl->downloadData = NULL;
+		*cl->downloadName = 0;
+		return qfalse;
 	}
 
-	// Perform any reads that we need to
-	while (cl->downloadCurrentBlock - cl->downloadClientBlock < MAX_DOWNLOAD_WINDOW &&
-		cl->downloadSize != cl->downloadCount) {
+	Com_Printf( "clientDownload: %d : beginning \"%s\"\n", cl - svs.clients, cl->downloadName );
 
-		curindex = (cl->downloadCurrentBlock % MAX_DOWNLOAD_WINDOW);
+	cl->downloadClientBlock = cl->downloadXmitBlock = cl->downloadNewBlock = 0;
+	cl->downloadBlockCount = (cl->downloadSize + MAX_DOWNLOAD_BLKSIZE - 1) / MAX_DOWNLOAD_BLKSIZE + 1;
+	cl->downloadSendTime = Sys_Milliseconds();
+	cl->downloadNextTime = cl->downloadSendTime;
+	cl->downloadSRTT = 0;
+	cl->downloadRTTVar = 0;
+	cl->downloadRTO = DOWNLOAD_INITIAL_RTO;
 
-		if (!cl->downloadBlocks[curindex])
-			cl->downloadBlocks[curindex] = (byte*)Z_Malloc( MAX_DOWNLOAD_BLKSIZE );
+	return qtrue;
+}
 
-		cl->downloadBlockSize[curindex] = FS_Read( cl->downloadBlocks[curindex], MAX_DOWNLOAD_BLKSIZE, cl->download );
 
-		if (cl->downloadBlockSize[curindex] < 0) {
-			// EOF right now
-			cl->downloadCount = cl->downloadSize;
-			break;
-		}
+// sends the next block of the window if there is one and returns the message's size
 
-		cl->downloadCount += cl->downloadBlockSize[curindex];
+static int SV_SendDownloadBlock( client_t* cl, int now )
+{
+	const int windowEnd = min( cl->downloadClientBlock + MAX_DOWNLOAD_WINDOW, cl->downloadBlockCount );
+
+	if (cl->downloadClientBlock == windowEnd)
+		return 0; // Nothing to transmit
 
-		// Load in next block
-		cl->downloadCurrentBlock++;
+	if (cl->downloadXmitBlock == windowEnd) {
+		// We have transmitted the complete window, should we start resending?
+		if (now - cl->downloadSendTime <= cl->downloadRTO)
+			return 0;
+
+		// go back to the first unacknowledged block and back off like TCP does
+		Com_DPrintf( "clientDownload: %d : retransmitting from block %d (RTO %d ms)\n", cl - svs.clients, cl->downloadClientBlock, cl->downloadRTO );
+		for (int i = 0; i < MAX_DOWNLOAD_WINDOW; i++) {
+			cl->downloadBlockTimes[i] = 0;
+		}
+		cl->downloadXmitBlock = cl->downloadClientBlock;
+		cl->downloadRTO = min( cl->downloadRTO * 2, DOWNLOAD_MAX_RTO );
 	}
 
-	// Check to see if we have eof condition and add the EOF block
-	if (cl->downloadCount == cl->downloadSize &&
-		!cl->downloadEOF &&
-		cl->downloadCurrentBlock - cl->downloadClientBlock < MAX_DOWNLOAD_WINDOW) {
+	byte msgBuffer[MAX_MSGLEN];
+	msg_t msg;
+	SV_BeginDownloadMessage( cl, &msg, msgBuffer );
 
-		cl->downloadBlockSize[cl->downloadCurrentBlock % MAX_DOWNLOAD_WINDOW] = 0;
-		cl->downloadCurrentBlock++;
+	// Send current block
+	const int block = cl->downloadXmitBlock;
+	const int blockSize = SV_DownloadBlockSize( cl, block );
 
-		cl->downloadEOF = qtrue;  // We have added the EOF block
-	}
+	MSG_WriteByte( &msg, svc_download );
+	MSG_WriteShort( &msg, block );
 
-	// Loop up to window size times based on how many blocks we can fit in the
-	// client snapMsec and rate
+	// block zero is special, contains file size
+	if ( block == 0 )
+		MSG_WriteLong( &msg, cl->downloadSize );
 
-	// based on the rate, how many bytes can we fit in the snapMsec time of the client
-	// normal rate / snapshotMsec calculation
-	rate = cl->rate;
-	if ( sv_maxRate->integer ) {
-		if ( sv_maxRate->integer < 1000 ) {
-			Cvar_Set( "sv_MaxRate", "1000" );
-		}
-		if ( sv_maxRate->integer < rate ) {
-			rate = sv_maxRate->integer;
-		}
-	}
-	if ( sv_minRate->integer ) {
-		if ( sv_minRate->integer < 1000 )
-			Cvar_Set( "sv_minRate", "1000" );
-		if ( sv_minRate->integer > rate )
-			rate = sv_minRate->integer;
+	MSG_WriteShort( &msg, blockSize );
+
+	// Write the block straight from the mapped file
+	if ( blockSize ) {
+		MSG_WriteData( &msg, cl->downloadData + block * MAX_DOWNLOAD_BLKSIZE, blockSize );
 	}
 
-	if (!rate) {
-		blockspersnap = 1;
-	} else {
-		blockspersnap = ( (rate * cl->snapshotMsec) / 1000 + MAX_DOWNLOAD_BLKSIZE ) /
-			MAX_DOWNLOAD_BLKSIZE;
+	Com_DPrintf( "clientDownload: %d : writing block %d\n", cl - svs.clients, block );
+
+	// only the first transmission of a block gives a valid round-trip time
+	if (block >= cl->downloadNewBlock) {
+		cl->downloadBlockTimes[block % MAX_DOWNLOAD_WINDOW] = now;
+		cl->downloadNewBlock = block + 1;
 	}
 
-	if (blockspersnap < 0)
-		blockspersnap = 1;
+	cl->downloadXmitBlock++;
+	cl->downloadSendTime = now;
 
-	while (blockspersnap--) {
+	SV_Netchan_Transmit( cl, &msg );
 
-		// Write out the next section of the file, if we have already reached our window,
-		// automatically start retransmitting
+	return msg.cursize;
+}
 
-		if (cl->downloadClientBlock == cl->downloadCurrentBlock)
-			return; // Nothing to transmit
 
-		if (cl->downloadXmitBlock == cl->downloadCurrentBlock) {
-			// We have transmitted the complete window, should we start resending?
+// sends download blocks and pending fragments at the client's rate,
+// so downloads no longer wait for the snapshot cadence
 
-			//FIXME:  This uses a hardcoded one second timeout for lost blocks
-			//the timeout should be based on client rate somehow
-			if (svs.time - cl->downloadSendTime > 1000)
-				cl->downloadXmitBlock = cl->downloadClientBlock;
-			else
-				return;
-		}
+static void SV_PumpDownload( client_t* cl )
+{
+	if (!cl->downloadData && !SV_OpenDownload( cl ))
+		return;
 
-		// Send current block
-		curindex = (cl->downloadXmitBlock % MAX_DOWNLOAD_WINDOW);
+	const int now = Sys_Milliseconds();
+	const qbool unlimited = cl->netchan.remoteAddress.type == NA_LOOPBACK ||
+		(sv_lanForceRate->integer && Sys_IsLANAddress( cl->netchan.remoteAddress ));
 
-		MSG_WriteByte( msg, svc_download );
-		MSG_WriteShort( msg, cl->downloadXmitBlock );
+	// don't let unused time pile up into a burst, but keep enough to cover a server frame
+	const int maxCredit = 1000 / max( sv_fps->integer, 1 );
+	if (cl->downloadNextTime < now - maxCredit)
+		cl->downloadNextTime = now - maxCredit;
+
+	// a full window plus its fragments is the most we could ever send
+	for (int i = 0; i < 2 * MAX_DOWNLOAD_WINDOW; i++) {
+		if (!unlimited && now < cl->downloadNextTime)
+			break;
+
+		int messageSize;
+		if (cl->netchan.unsentFragments) {
+			messageSize = cl->netchan.unsentLength - cl->netchan.unsentFragmentStart;
+			SV_Netchan_TransmitNextFragment( cl );
+		} else {
+			messageSize = SV_SendDownloadBlock( cl, now );
+			if (messageSize == 0)
+				break;
+		}
 
-		// block zero is special, contains file size
-		if ( cl->downloadXmitBlock == 0 )
-			MSG_WriteLong( msg, cl->downloadSize );
+		cl->downloadNextTime += SV_RateMsec( cl, messageSize );
+	}
+}
 
-		MSG_WriteShort( msg, cl->downloadBlockSize[curindex] );
 
-		// Write the block
-		if ( cl->downloadBlockSize[curindex] ) {
-			MSG_WriteData( msg, cl->downloadBlocks[curindex], cl->downloadBlockSize[curindex] );
+void SV_SendClientDownloads()
+{
+	client_t* cl = svs.clients;
+	for (int i = 0; i < sv_maxclients->integer; i++, cl++) {
+		if (cl->state != CS_FREE && *cl->downloadName) {
+			SV_PumpDownload( cl );
 		}
+	}
+}
 
-		Com_DPrintf( "clientDownload: %d : writing block %d\n", cl - svs.clients, cl->downloadXmitBlock );
 
-		// Move on to the next block
-		// It will get sent with next snap shot.  The rate will keep us in line.
-		cl->downloadXmitBlock++;
+// releases the mapped files before the clients get freed
 
-		cl->downloadSendTime = svs.time;
+void SV_CloseClientDownloads()
+{
+	client_t* cl = svs.clients;
+	for (int i = 0; i < sv_maxclients->integer; i++, cl++) {
+		SV_CloseDownload( cl );
 	}
 }
 
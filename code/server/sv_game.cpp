@@ -244,6 +244,8 @@ static qbool SV_G_GetValue( char* value, int valueSize, const char* key )
 		{ "trap_Cvar_SetHelp", G_EXT_CVAR_SETHELP },
 		{ "trap_Cmd_SetHelp", G_EXT_CMD_SETHELP },
 		{ "trap_Error2", G_EXT_ERROR2 },
+		{ "trap_TraceBatch", G_EXT_TRACEBATCH },
+		{ "trap_PointContentsBatch", G_EXT_POINTCONTENTSBATCH },
 		// capabilities
 		{ "cap_ExtraColorCodes", 1 }
 	};
@@ -834,6 +836,20 @@ static intptr_t SV_GameSystemCalls( intptr_t* args )
 		Com_ErrorExt( ERR_DROP, EXT_ERRMOD_GAME, (qbool)args[2], "%s", (const char*)VMA(1) );
 		return 0;
 
+	case G_EXT_TRACEBATCH:
+		SV_TraceBatch(
+			(trace_t*)VM_ArgArray( args[2], args[3], sizeof(trace_t) ),
+			(const gameTraceQuery_t*)VM_ArgArray( args[1], args[3], sizeof(gameTraceQuery_t) ),
+			args[3] );
+		return 0;
+
+	case G_EXT_POINTCONTENTSBATCH:
+		SV_PointContentsBatch(
+			(int*)VM_ArgArray( args[2], args[3], sizeof(int) ),
+			(const gamePointContentsQuery_t*)VM_ArgArray( args[1], args[3], sizeof(gamePointContentsQuery_t) ),
+			args[3] );
+		return 0;
+
 	default:
 		Com_Error( ERR_DROP, "Bad game system trap: %i", args[0] );
 	}
@@ -571,7 +571,12 @@ static const cvarTableItem_t sv_cvars[] =
 	{ NULL, "sv_mapChecksum", "", CVAR_ROM, CVART_INTEGER, NULL, NULL, ".bsp file checksum" },
 	{ &sv_lanForceRate, "sv_lanForceRate", "1", CVAR_ARCHIVE, CVART_BOOL, NULL, NULL, S_COLOR_VAL "1 " S_COLOR_HELP "means uncapped rate on LAN" },
 	{ &sv_strictAuth, "sv_strictAuth", "0", CVAR_ARCHIVE, CVART_BOOL, NULL, NULL, "requires CD key authentication" },
-	{ &sv_minRestartDelay, "sv_minRestartDelay", "2", 0, CVART_INTEGER, "1", "48", "min. hours to wait before restarting the server" }
+	{ &sv_minRestartDelay, "sv_minRestartDelay", "2", 0, CVART_INTEGER, "1", "48", "min. hours to wait before restarting the server" },
+	{ &sv_snapshotThreads, "sv_snapshotThreads", "0", CVAR_ARCHIVE, CVART_INTEGER, "0", XSTRING(MAX_WORKER_THREADS), "number of threads building snapshots, " S_COLOR_VAL "0 " S_COLOR_HELP "means serial" },
+	{ &sv_profileWriteInterval, "sv_profileWriteInterval", "0", 0, CVART_INTEGER, "0", "3600", "seconds between " S_COLOR_CMD "/serverprofile " S_COLOR_HELP "JSON file writes, " S_COLOR_VAL "0 " S_COLOR_HELP "means never" },
+	{ &sv_oobRate, "sv_oobRate", "10", 0, CVART_INTEGER, "0", "1000", "connectionless packets per second allowed per IP, " S_COLOR_VAL "0 " S_COLOR_HELP "means no limit" },
+	{ &sv_oobBurst, "sv_oobBurst", "20", 0, CVART_INTEGER, "1", "1000", "connectionless packets per IP allowed in a burst" },
+	{ &sv_traceCache, "sv_traceCache", "0", 0, CVART_BOOL, NULL, NULL, "reuses identical traces within a game frame, misses entities changed without relinking" }
 };
 
 #undef SV_PURE_DEFAULT
@@ -647,6 +652,11 @@ void SV_Shutdown( const char* finalmsg )
 
 	Com_Printf( "----- Server Shutdown (%s) -----\n", finalmsg );
 
+	// an error might have interrupted SV_SendClientMessages
+	SV_EndDeltaCache();
+	SV_EndVisibilityCache();
+	Sys_EndPacketBatch();
+
 	if ( svs.clients && !com_errorEntered ) {
 		SV_FinalMessage( finalmsg );
 	}
@@ -660,6 +670,7 @@ void SV_Shutdown( const char* finalmsg )
 
 	// free server static data
 	if ( svs.clients ) {
+		SV_CloseClientDownloads();
 		Z_Free( svs.clients );
 	}
 	Com_Memset( &svs, 0, sizeof( svs ) );
@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include "server.h"
+#include "../qcommon/crash.h"
 
 serverStatic_t	svs;				// persistant server info
 server_t		sv;					// local server
@@ -52,6 +53,11 @@ cvar_t	*sv_floodProtect;
 cvar_t	*sv_lanForceRate;		// dedicated 1 (LAN) server forces local client rates to 99999 (bug #491)
 cvar_t	*sv_strictAuth;
 cvar_t	*sv_minRestartDelay;	// min. time before restart in hours
+cvar_t	*sv_snapshotThreads;	// 0 builds snapshots serially
+cvar_t	*sv_profileWriteInterval;	// 0 never writes the JSON profile
+cvar_t	*sv_oobRate;			// connectionless packets per second per IP, 0 is unlimited
+cvar_t	*sv_oobBurst;
+cvar_t	*sv_traceCache;			// reuses identical traces within a game frame
 
 
 
@@ -491,11 +497,123 @@ void SVC_RemoteCommand( netadr_t from, msg_t *msg ) {
 }
 
 
+/*
+=============================================================================
+
+Connectionless packet rate limiting
+
+Every source IP has a token bucket that refills at sv_oobRate tokens per
+second up to sv_oobBurst tokens and each connectionless packet costs one.
+The buckets are in a fixed-size table: the IP's hash selects a set of
+OOB_BUCKET_WAYS buckets and the least recently used one gets recycled,
+so a flood from many addresses can't make us allocate anything.
+
+=============================================================================
+*/
+
+#define OOB_BUCKET_SET_BITS		9
+#define OOB_BUCKET_SETS			(1 << OOB_BUCKET_SET_BITS)
+#define OOB_BUCKET_WAYS			4
+#define OOB_TOKEN_SCALE			1000	// tokens are stored in thousandths
+
+typedef struct {
+	unsigned int	ip;
+	int				lastTime;	// Sys_Milliseconds time of the last refill, 0 when unused
+	int				tokens;		// in thousandths of a packet
+} oobBucket_t;
+
+typedef struct {
+	oobBucket_t		buckets[OOB_BUCKET_SETS][OOB_BUCKET_WAYS];
+	int				answered;
+	int				dropped;
+	int				recycled;	// buckets taken over by another IP
+} oobLimiter_t;
+
+static oobLimiter_t sv_oobLimiter;
+
+
+static qbool SV_AllowConnectionlessPacket( const netadr_t& from )
+{
+	if ( sv_oobRate->integer <= 0 || Sys_IsLANAddress( from ) || NET_CompareBaseAdr( from, svs.authorizeAddress ) )
+		return qtrue;
+
+	const unsigned int ip = ((unsigned int)from.ip[0] << 24) | ((unsigned int)from.ip[1] << 16) | ((unsigned int)from.ip[2] << 8) | (unsigned int)from.ip[3];
+	oobBucket_t* const set = sv_oobLimiter.buckets[(ip * 2654435761u) >> (32 - OOB_BUCKET_SET_BITS)];
+	const int now = max( Sys_Milliseconds(), 1 );
+	const int maxTokens = sv_oobBurst->integer * OOB_TOKEN_SCALE;
+
+	oobBucket_t* bucket = NULL;
+	oobBucket_t* oldest = &set[0];
+	for ( int i = 0; i < OOB_BUCKET_WAYS; ++i ) {
+		if ( set[i].lastTime != 0 && set[i].ip == ip ) {
+			bucket = &set[i];
+			break;
+		}
+		if ( set[i].lastTime < oldest->lastTime ) {
+			oldest = &set[i];
+		}
+	}
+
+	if ( bucket == NULL ) {
+		if ( oldest->lastTime != 0 ) {
+			sv_oobLimiter.recycled++;
+		}
+		bucket = oldest;
+		bucket->ip = ip;
+		bucket->lastTime = now;
+		bucket->tokens = maxTokens;
+	} else {
+		const int64_t refill = (int64_t)( now - bucket->lastTime ) * sv_oobRate->integer;
+		bucket->tokens = (int)min( (int64_t)maxTokens, (int64_t)bucket->tokens + refill );
+		bucket->lastTime = now;
+	}
+
+	if ( bucket->tokens < OOB_TOKEN_SCALE ) {
+		return qfalse;
+	}
+
+	bucket->tokens -= OOB_TOKEN_SCALE;
+
+	return qtrue;
+}
+
+
+void SV_OOBStats_f()
+{
+	if ( Cmd_Argc() == 2 && !Q_stricmp( Cmd_Argv(1), "reset" ) ) {
+		sv_oobLimiter.answered = 0;
+		sv_oobLimiter.dropped = 0;
+		sv_oobLimiter.recycled = 0;
+		return;
+	}
+
+	int tracked = 0;
+	for ( int s = 0; s < OOB_BUCKET_SETS; ++s ) {
+		for ( int w = 0; w < OOB_BUCKET_WAYS; ++w ) {
+			if ( sv_oobLimiter.buckets[s][w].lastTime != 0 ) {
+				tracked++;
+			}
+		}
+	}
+
+	Com_Printf( "Connectionless packets answered: %d\n", sv_oobLimiter.answered );
+	Com_Printf( "Connectionless packets dropped : %d\n", sv_oobLimiter.dropped );
+	Com_Printf( "IPs tracked: %d/%d (%d buckets recycled)\n", tracked, OOB_BUCKET_SETS * OOB_BUCKET_WAYS, sv_oobLimiter.recycled );
+}
+
+
 // a connectionless packet has four leading 0xff characters to distinguish it from a game channel.
 // clients that are in the game can still send connectionless packets.
 
 static void SV_ConnectionlessPacket( const netadr_t from, msg_t* msg )
 {
+	// drop floods before spending any time parsing
+	if ( !SV_AllowConnectionlessPacket( from ) ) {
+		sv_oobLimiter.dropped++;
+		return;
+	}
+	sv_oobLimiter.answered++;
+
 	MSG_BeginReadingOOB( msg );
 	MSG_ReadLong( msg );		// skip the -1 marker
 
@@ -730,6 +848,152 @@ static void SV_IntegerOverflowShutDown( const char* msg )
 }
 
 
+/*
+=============================================================================
+
+Server frame profiler
+
+Keeps the per-phase times of the last SV_PROFILE_SAMPLES server frames
+in microseconds so that the median, 99th percentile and max. times can be
+printed with /serverprofile and written to a JSON file.
+
+=============================================================================
+*/
+
+#define SV_PROFILE_SAMPLES	1024
+#define SV_PROFILE_FILENAME	"serverprofile.json"
+
+typedef struct {
+	int		samples[SVP_COUNT][SV_PROFILE_SAMPLES];
+	int		current[SVP_COUNT];		// the frame being measured
+	int		sampleCount;
+	int		sampleIndex;			// where the next frame goes
+	int		lastWriteTime;			// Sys_Milliseconds time
+} serverProfile_t;
+
+typedef struct {
+	int		median;
+	int		p99;
+	int		max;
+} profileStats_t;
+
+static serverProfile_t sv_profile;
+
+static const char* sv_profilePhaseNames[SVP_COUNT] = {
+	"frame",
+	"packets",
+	"game",
+	"pings",
+	"timeouts",
+	"build",
+	"encode",
+	"send"
+};
+
+
+void SV_ProfileAdd( serverPhase_t phase, int64_t startUS )
+{
+	sv_profile.current[phase] += (int)( Sys_Microseconds() - startUS );
+}
+
+
+static int QDECL SV_CompareSamples( const void* a, const void* b )
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+
+static void SV_GetProfileStats( profileStats_t* stats, serverPhase_t phase )
+{
+	static int sorted[SV_PROFILE_SAMPLES];
+
+	const int count = sv_profile.sampleCount;
+	if ( count <= 0 ) {
+		Com_Memset( stats, 0, sizeof(*stats) );
+		return;
+	}
+
+	Com_Memcpy( sorted, sv_profile.samples[phase], count * sizeof(sorted[0]) );
+	qsort( sorted, count, sizeof(sorted[0]), SV_CompareSamples );
+	stats->median = sorted[count / 2];
+	stats->p99 = sorted[(count * 99) / 100];
+	stats->max = sorted[count - 1];
+}
+
+
+static void SV_WriteProfile()
+{
+	const char* const path = FS_BuildOSPath( Cvar_VariableString( "fs_homepath" ), "", SV_PROFILE_FILENAME );
+	FILE* const file = fopen( path, "wb" );
+	if ( file == NULL ) {
+		Com_Printf( "^3WARNING: couldn't open %s for writing\n", path );
+		return;
+	}
+
+	JSONW_BeginFile( file );
+	JSONW_IntegerValue( "frames", sv_profile.sampleCount );
+	JSONW_IntegerValue( "sv_fps", sv_fps->integer );
+	JSONW_IntegerValue( "sv_maxclients", sv_maxclients->integer );
+	JSONW_BeginNamedArray( "phases" );
+	for ( int p = 0; p < SVP_COUNT; ++p ) {
+		profileStats_t stats;
+		SV_GetProfileStats( &stats, (serverPhase_t)p );
+		JSONW_BeginObject();
+		JSONW_StringValue( "name", sv_profilePhaseNames[p] );
+		JSONW_IntegerValue( "median_us", stats.median );
+		JSONW_IntegerValue( "p99_us", stats.p99 );
+		JSONW_IntegerValue( "max_us", stats.max );
+		JSONW_EndObject();
+	}
+	JSONW_EndArray();
+	JSONW_EndFile();
+
+	fclose( file );
+}
+
+
+static void SV_ProfileEndFrame()
+{
+	serverProfile_t* const prof = &sv_profile;
+
+	for ( int p = 0; p < SVP_COUNT; ++p ) {
+		prof->samples[p][prof->sampleIndex] = prof->current[p];
+		prof->current[p] = 0;
+	}
+	prof->sampleIndex = (prof->sampleIndex + 1) % SV_PROFILE_SAMPLES;
+	prof->sampleCount = min( prof->sampleCount + 1, SV_PROFILE_SAMPLES );
+
+	const int interval = sv_profileWriteInterval->integer * 1000;
+	const int now = Sys_Milliseconds();
+	if ( interval > 0 && now - prof->lastWriteTime >= interval ) {
+		prof->lastWriteTime = now;
+		SV_WriteProfile();
+	}
+}
+
+
+void SV_Profile_f()
+{
+	if ( Cmd_Argc() == 2 && !Q_stricmp( Cmd_Argv(1), "reset" ) ) {
+		Com_Memset( &sv_profile, 0, sizeof(sv_profile) );
+		return;
+	}
+
+	if ( Cmd_Argc() == 2 && !Q_stricmp( Cmd_Argv(1), "write" ) ) {
+		SV_WriteProfile();
+		return;
+	}
+
+	Com_Printf( "Last %d server frames, times in microseconds\n", sv_profile.sampleCount );
+	Com_Printf( "phase      median     p99     max\n" );
+	for ( int p = 0; p < SVP_COUNT; ++p ) {
+		profileStats_t stats;
+		SV_GetProfileStats( &stats, (serverPhase_t)p );
+		Com_Printf( "%-8s %8d %7d %7d\n", sv_profilePhaseNames[p], stats.median, stats.p99, stats.max );
+	}
+}
+
+
 /*
 ==================
 SV_Frame
@@ -824,9 +1088,13 @@ void SV_Frame( int msec ) {
 	}
 
 	int startTime = com_speeds->integer ? Sys_Milliseconds() : 0;
+	const int64_t frameStartUS = Sys_Microseconds();
 
 	// update pings based on the OOB packets received while we were sleeping
 	SV_CalcPings();
+	SV_ProfileAdd( SVP_PINGS, frameStartUS );
+
+	const int64_t gameStartUS = Sys_Microseconds();
 
 	if (com_dedicated->integer)
 		SV_BotFrame( svs.time );
@@ -836,21 +1104,32 @@ void SV_Frame( int msec ) {
 		sv.timeResidual -= frameMsec;
 		svs.time += frameMsec;
 		// let everything in the world think and move
+		SV_ClearTraceCache();
 		VM_Call( gvm, GAME_RUN_FRAME, svs.time );
 	}
 
+	// client commands are processed between game frames
+	SV_ClearTraceCache();
+
+	SV_ProfileAdd( SVP_GAME, gameStartUS );
+
 	if ( com_speeds->integer ) {
 		time_game = Sys_Milliseconds() - startTime;
 	}
 
 	// check timeouts
+	const int64_t timeoutsStartUS = Sys_Microseconds();
 	SV_CheckTimeouts();
+	SV_ProfileAdd( SVP_TIMEOUTS, timeoutsStartUS );
 
 	// send messages back to the clients
 	SV_SendClientMessages();
 
 	// send a heartbeat to the master if needed
 	SV_MasterHeartbeat();
+
+	SV_ProfileAdd( SVP_FRAME, frameStartUS );
+	SV_ProfileEndFrame();
 }
 
 
@@ -46,6 +46,161 @@ A normal server packet will look like:
 */
 
 
+/*
+=============================================================================
+
+Entity delta cache
+
+Clients that acknowledged the same snapshot delta compress an entity
+from the same old state to the same new state, so the encoded bits are
+stored and copied into the next messages that need them.
+The new states can't change during SV_SendClientMessages, so the key is
+the entity number, the old state and the force flag.
+
+=============================================================================
+*/
+
+#define MAX_DELTA_CACHE_ENTRIES		2048		// must be a power of 2
+#define DELTA_CACHE_BUFFER_SIZE		(256 << 10)
+#define MAX_ENTITY_DELTA_SIZE		1024		// more than the largest possible entity delta
+
+typedef struct {
+	entityState_t	from;
+	unsigned int	hash;
+	int				generation;		// the entry is free when it doesn't match the cache's
+	int				number;
+	qbool			force;
+	int				numBits;
+	int				offset;			// into deltaCache_t::buffer
+} deltaCacheEntry_t;
+
+typedef struct {
+	deltaCacheEntry_t	entries[MAX_DELTA_CACHE_ENTRIES];
+	byte				buffer[DELTA_CACHE_BUFFER_SIZE];
+	int					bufferUsed;
+	int					numEntries;
+	int					generation;
+	qbool				enabled;
+	qbool				locked;			// qtrue while worker threads are writing snapshots
+	int64_t				hits;
+	int64_t				misses;
+	int64_t				bitsReused;
+} deltaCache_t;
+
+static deltaCache_t sv_deltaCache;
+
+
+static unsigned int SV_HashEntityDelta( const entityState_t* from, int number, qbool force )
+{
+	const unsigned int* const data = (const unsigned int*)from;
+	const int count = sizeof(*from) / 4;
+
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for ( int i = 0; i < count; ++i ) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	hash = (hash ^ (unsigned int)number) * 16777619u;
+	hash = (hash ^ (unsigned int)force) * 16777619u;
+
+	return hash;
+}
+
+
+static void SV_WriteDeltaEntity( msg_t* msg, const entityState_t* from, const entityState_t* to, qbool force )
+{
+	deltaCache_t* const cache = &sv_deltaCache;
+
+	if ( !cache->enabled || cache->locked ) {
+		MSG_WriteDeltaEntity( msg, from, to, force );
+		return;
+	}
+
+	const unsigned int hash = SV_HashEntityDelta( from, to->number, force );
+	int index = hash & (MAX_DELTA_CACHE_ENTRIES - 1);
+	for (;;) {
+		const deltaCacheEntry_t* const entry = &cache->entries[index];
+		if ( entry->generation != cache->generation ) {
+			break;
+		}
+		if ( entry->hash == hash && entry->number == to->number && entry->force == force &&
+			!memcmp( &entry->from, from, sizeof(*from) ) ) {
+			MSG_WriteBitstream( msg, cache->buffer + entry->offset, entry->numBits );
+			cache->hits++;
+			cache->bitsReused += entry->numBits;
+			return;
+		}
+		index = (index + 1) & (MAX_DELTA_CACHE_ENTRIES - 1);
+	}
+
+	cache->misses++;
+
+	// the delta gets written to its own message first so that it starts on a byte boundary
+	byte deltaBuffer[MAX_ENTITY_DELTA_SIZE];
+	msg_t delta;
+	MSG_Init( &delta, deltaBuffer, sizeof(deltaBuffer) );
+	MSG_WriteDeltaEntity( &delta, from, to, force );
+	MSG_WriteBitstream( msg, deltaBuffer, delta.bit );
+
+	// keep the table at most half full so that the probe sequences stay short
+	const int numBytes = (delta.bit + 7) >> 3;
+	if ( cache->numEntries >= MAX_DELTA_CACHE_ENTRIES / 2 ||
+		cache->bufferUsed + numBytes > DELTA_CACHE_BUFFER_SIZE ) {
+		return;
+	}
+
+	deltaCacheEntry_t* const entry = &cache->entries[index];
+	entry->from = *from;
+	entry->hash = hash;
+	entry->generation = cache->generation;
+	entry->number = to->number;
+	entry->force = force;
+	entry->numBits = delta.bit;
+	entry->offset = cache->bufferUsed;
+	Com_Memcpy( cache->buffer + cache->bufferUsed, deltaBuffer, numBytes );
+	cache->bufferUsed += numBytes;
+	cache->numEntries++;
+}
+
+
+static void SV_BeginDeltaCache()
+{
+	sv_deltaCache.generation++;
+	sv_deltaCache.numEntries = 0;
+	sv_deltaCache.bufferUsed = 0;
+	sv_deltaCache.enabled = qtrue;
+	sv_deltaCache.locked = qfalse;
+}
+
+
+void SV_EndDeltaCache()
+{
+	sv_deltaCache.enabled = qfalse;
+	sv_deltaCache.locked = qfalse;
+}
+
+
+void SV_DeltaStats_f()
+{
+	deltaCache_t* const cache = &sv_deltaCache;
+
+	if ( Cmd_Argc() == 2 && !Q_stricmp( Cmd_Argv(1), "reset" ) ) {
+		cache->hits = 0;
+		cache->misses = 0;
+		cache->bitsReused = 0;
+		return;
+	}
+
+	const int64_t lookups = cache->hits + cache->misses;
+	Com_Printf( "Entity delta cache: %lld hits, %lld misses, %.1f%% hit rate\n",
+		(long long)cache->hits, (long long)cache->misses, lookups > 0 ? (100.0 * (double)cache->hits) / (double)lookups : 0.0 );
+	Com_Printf( "Reused: %lld KB of encoded deltas\n", (long long)(cache->bitsReused >> 13) );
+	if ( sv_snapshotThreads->integer > 0 ) {
+		Com_Printf( "The cache isn't used when sv_snapshotThreads is greater than 0\n" );
+	}
+}
+
+
 // write a delta update of an entityState_t list to the message
 
 static void SV_EmitPacketEntities( const clientSnapshot_t* from, clientSnapshot_t* to, msg_t* msg )
@@ -74,7 +229,7 @@ static void SV_EmitPacketEntities( const clientSnapshot_t* from, clientSnapshot_
 		if ( newnum == oldnum ) {
 			// delta update from old position: because the force parm is false,
 			// no bytes will be emitted if the entity has not changed at all
-			MSG_WriteDeltaEntity( msg, oldent, newent, qfalse );
+			SV_WriteDeltaEntity( msg, oldent, newent, qfalse );
 			oldindex++;
 			newindex++;
 			continue;
@@ -82,7 +237,7 @@ static void SV_EmitPacketEntities( const clientSnapshot_t* from, clientSnapshot_
 
 		if ( newnum < oldnum ) {
 			// this is a new entity, send it from the baseline
-			MSG_WriteDeltaEntity( msg, &sv.svEntities[newnum].baseline, newent, qtrue );
+			SV_WriteDeltaEntity( msg, &sv.svEntities[newnum].baseline, newent, qtrue );
 			newindex++;
 			continue;
 		}
@@ -101,42 +256,57 @@ static void SV_EmitPacketEntities( const clientSnapshot_t* from, clientSnapshot_
 
 /*
 ==================
-SV_WriteSnapshotToClient
+SV_SelectDeltaFrame
+
+Returns the snapshot to delta compress from or NULL for a full snapshot.
+nextSnapshotEntities is the value of svs.nextSnapshotEntities right after
+the current snapshot's entities were stored.
 ==================
 */
-static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg ) {
-	clientSnapshot_t	*frame, *oldframe;
-	int					lastframe;
-	int					i;
-	int					snapFlags;
-
-	// this is the snapshot we are creating
-	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+static const clientSnapshot_t* SV_SelectDeltaFrame( const client_t* client, int nextSnapshotEntities, int* lastframe )
+{
+	*lastframe = 0;
 
 	// try to use a previous frame as the source for delta compressing the snapshot
 	if ( client->deltaMessage <= 0 || client->state != CS_ACTIVE ) {
 		// client is asking for a retransmit
-		oldframe = NULL;
-		lastframe = 0;
-	} else if ( client->netchan.outgoingSequence - client->deltaMessage 
-		>= (PACKET_BACKUP - 3) ) {
+		return NULL;
+	}
+
+	if ( client->netchan.outgoingSequence - client->deltaMessage >= (PACKET_BACKUP - 3) ) {
 		// client hasn't gotten a good message through in a long time
 		Com_DPrintf ("%s: Delta request from out of date packet.\n", client->name);
-		oldframe = NULL;
-		lastframe = 0;
-	} else {
-		// we have a valid snapshot to delta from
-		oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
-		lastframe = client->netchan.outgoingSequence - client->deltaMessage;
+		return NULL;
+	}
 
-		// the snapshot's entities may still have rolled off the buffer, though
-		if ( oldframe->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities ) {
-			Com_DPrintf ("%s: Delta request from out of date entities.\n", client->name);
-			oldframe = NULL;
-			lastframe = 0;
-		}
+	// we have a valid snapshot to delta from
+	const clientSnapshot_t* const oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
+
+	// the snapshot's entities may still have rolled off the buffer, though
+	if ( oldframe->first_entity <= nextSnapshotEntities - svs.numSnapshotEntities ) {
+		Com_DPrintf ("%s: Delta request from out of date entities.\n", client->name);
+		return NULL;
 	}
 
+	*lastframe = client->netchan.outgoingSequence - client->deltaMessage;
+
+	return oldframe;
+}
+
+
+/*
+==================
+SV_WriteSnapshotToClient
+==================
+*/
+static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg, const clientSnapshot_t *oldframe, int lastframe ) {
+	clientSnapshot_t	*frame;
+	int					i;
+	int					snapFlags;
+
+	// this is the snapshot we are creating
+	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+
 	MSG_WriteByte (msg, svc_snapshot);
 
 	// NOTE, MRE: now sent at the start of every message from server to client
@@ -224,6 +394,8 @@ Build a client snapshot structure
 typedef struct {
 	int		numSnapshotEntities;
 	int		snapshotEntities[MAX_SNAPSHOT_ENTITIES];
+	byte	added[MAX_GENTITIES / 8];	// used to prevent double adding from portal views
+	const char*	error;					// Com_Error is raised by the caller
 } snapshotEntityNumbers_t;
 
 
@@ -232,10 +404,6 @@ static int QDECL SV_QsortEntityNumbers( const void *a, const void *b )
 	const int *ea = (const int *)a;
 	const int *eb = (const int *)b;
 
-	if ( *ea == *eb ) {
-		Com_Error( ERR_DROP, "SV_QsortEntityStates: duplicated entity" );
-	}
-
 	if ( *ea < *eb ) {
 		return -1;
 	}
@@ -244,43 +412,71 @@ static int QDECL SV_QsortEntityNumbers( const void *a, const void *b )
 }
 
 
-static void SV_AddEntToSnapshot( svEntity_t *svEnt, const sharedEntity_t *gEnt, snapshotEntityNumbers_t *eNums )
+static qbool SV_WasAddedToSnapshot( const snapshotEntityNumbers_t *eNums, int entityNum )
+{
+	return ( eNums->added[entityNum >> 3] & (1 << (entityNum & 7)) ) != 0;
+}
+
+
+static void SV_AddEntToSnapshot( int entityNum, snapshotEntityNumbers_t *eNums )
 {
 	// if we have already added this entity to this snapshot, don't add again
-	if ( svEnt->snapshotCounter == sv.snapshotCounter ) {
+	if ( SV_WasAddedToSnapshot( eNums, entityNum ) ) {
 		return;
 	}
-	svEnt->snapshotCounter = sv.snapshotCounter;
+	eNums->added[entityNum >> 3] |= 1 << (entityNum & 7);
 
 	// if we are full, silently discard entities
 	if ( eNums->numSnapshotEntities == MAX_SNAPSHOT_ENTITIES ) {
 		return;
 	}
 
-	eNums->snapshotEntities[ eNums->numSnapshotEntities ] = gEnt->s.number;
+	eNums->snapshotEntities[ eNums->numSnapshotEntities ] = entityNum;
 	eNums->numSnapshotEntities++;
 }
 
 
-static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin,
-		clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums )
+/*
+=============================================================================
+
+Entity visibility sets
+
+Clients standing in the same cluster and area see the same entities
+before the per-client filters (SVF_SINGLECLIENT, SVF_CLIENTMASK, etc) are
+applied, so the PVS and area tests are only done once per pair.
+The sets are only cached during SV_SendClientMessages because the game
+can move entities around between two calls.
+
+=============================================================================
+*/
+
+#define MAX_VISIBILITY_SETS	256
+
+typedef struct {
+	int		cluster;
+	int		area;
+	int		entities[MAX_GENTITIES / 32];	// bit set when the entity could be sent
+} visibilitySet_t;
+
+typedef struct {
+	visibilitySet_t	sets[MAX_VISIBILITY_SETS];
+	int				numSets;
+	qbool			enabled;	// qfalse means every set gets rebuilt
+	qbool			locked;		// qtrue while worker threads are reading the sets
+} visibilityCache_t;
+
+static visibilityCache_t sv_visCache;
+
+
+static void SV_BuildVisibilitySet( visibilitySet_t* set, int cluster, int area )
 {
 	int i, l;
 
-	// during an error shutdown message we may need to transmit
-	// the shutdown message after the server has shutdown, so
-	// specfically check for it
-	if ( !sv.state ) {
-		return;
-	}
-
-	int leafnum = CM_PointLeafnum( origin );
-	int clientarea = CM_LeafArea( leafnum );
-	int clientcluster = CM_LeafCluster( leafnum );
-	const byte* clientpvs = CM_ClusterPVS( clientcluster );
+	const byte* clientpvs = CM_ClusterPVS( cluster );
 
-	// calculate the visible areas
-	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
+	set->cluster = cluster;
+	set->area = area;
+	Com_Memset( set->entities, 0, sizeof( set->entities ) );
 
 	for (int e = 0; e < sv.num_entities; ++e) {
 		const sharedEntity_t* ent = SV_GentityNum(e);
@@ -295,45 +491,21 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin,
 			continue;
 		}
 
-		// entities can be flagged to be sent to only one client
-		if ( ent->r.svFlags & SVF_SINGLECLIENT ) {
-			if ( ent->r.singleClient != frame->ps.clientNum ) {
-				continue;
-			}
-		}
-		// entities can be flagged to be sent to everyone but one client
-		if ( ent->r.svFlags & SVF_NOTSINGLECLIENT ) {
-			if ( ent->r.singleClient == frame->ps.clientNum ) {
-				continue;
-			}
-		}
-		// entities can be flagged to be sent to a given mask of clients
-		if ( ent->r.svFlags & SVF_CLIENTMASK ) {
-			if (frame->ps.clientNum >= 32)
-				Com_Error( ERR_DROP, "SVF_CLIENTMASK: clientNum >= 32\n" );
-			if (~ent->r.singleClient & (1 << frame->ps.clientNum))
-				continue;
-		}
-
-		svEntity_t* svEnt = SV_SvEntityForGentity( ent );
-
-		// don't double add an entity through portals
-		if ( svEnt->snapshotCounter == sv.snapshotCounter ) {
-			continue;
-		}
-
 		// broadcast entities are always sent
-		if ( ent->r.svFlags & SVF_BROADCAST ) {
-			SV_AddEntToSnapshot( svEnt, ent, eNums );
+		// and a bad entity number is reported by the caller
+		const int entityNum = ent->s.number;
+		if ( (ent->r.svFlags & SVF_BROADCAST) || entityNum < 0 || entityNum >= MAX_GENTITIES ) {
+			set->entities[e >> 5] |= 1 << (e & 31);
 			continue;
 		}
+		const svEntity_t* svEnt = &sv.svEntities[ entityNum ];
 
 		// ignore if not touching a PV leaf
 		// check area
-		if ( !CM_AreasConnected( clientarea, svEnt->areanum ) ) {
+		if ( !CM_AreasConnected( area, svEnt->areanum ) ) {
 			// doors can legally straddle two areas, so
 			// we may need to check another one
-			if ( !CM_AreasConnected( clientarea, svEnt->areanum2 ) ) {
+			if ( !CM_AreasConnected( area, svEnt->areanum2 ) ) {
 				continue;		// blocked by a door
 			}
 		}
@@ -367,8 +539,139 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin,
 			}
 		}
 
+		set->entities[e >> 5] |= 1 << (e & 31);
+	}
+}
+
+
+// returns the cached set or builds it, into scratch when it can't be stored
+
+static const visibilitySet_t* SV_GetVisibilitySet( int cluster, int area, visibilitySet_t* scratch )
+{
+	visibilityCache_t* const cache = &sv_visCache;
+
+	if ( cache->enabled ) {
+		for ( int i = 0; i < cache->numSets; ++i ) {
+			const visibilitySet_t* const set = &cache->sets[i];
+			if ( set->cluster == cluster && set->area == area ) {
+				return set;
+			}
+		}
+
+		if ( !cache->locked && cache->numSets < MAX_VISIBILITY_SETS ) {
+			visibilitySet_t* const set = &cache->sets[cache->numSets++];
+			SV_BuildVisibilitySet( set, cluster, area );
+			return set;
+		}
+	}
+
+	SV_BuildVisibilitySet( scratch, cluster, area );
+
+	return scratch;
+}
+
+
+static void SV_BeginVisibilityCache()
+{
+	sv_visCache.numSets = 0;
+	sv_visCache.enabled = qtrue;
+	sv_visCache.locked = qfalse;
+}
+
+
+void SV_EndVisibilityCache()
+{
+	sv_visCache.enabled = qfalse;
+	sv_visCache.locked = qfalse;
+}
+
+
+// caches the set of the client's own viewpoint, which is all most snapshots need
+
+static void SV_CacheClientVisibilitySet( const client_t* client )
+{
+	if ( !sv.state || !client->gentity || client->state == CS_ZOMBIE ) {
+		return;
+	}
+
+	const playerState_t* const ps = SV_GameClientNum( client - svs.clients );
+	vec3_t org;
+	VectorCopy( ps->origin, org );
+	org[2] += ps->viewheight;
+
+	const int leafnum = CM_PointLeafnum( org );
+	visibilitySet_t scratch;
+	SV_GetVisibilitySet( CM_LeafCluster( leafnum ), CM_LeafArea( leafnum ), &scratch );
+}
+
+
+static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin,
+		clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums )
+{
+	// during an error shutdown message we may need to transmit
+	// the shutdown message after the server has shutdown, so
+	// specfically check for it
+	if ( !sv.state ) {
+		return;
+	}
+
+	int leafnum = CM_PointLeafnum( origin );
+	int clientarea = CM_LeafArea( leafnum );
+	int clientcluster = CM_LeafCluster( leafnum );
+
+	// calculate the visible areas
+	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
+
+	// only the entities that can be seen from this cluster and area are candidates
+	visibilitySet_t scratch;
+	const visibilitySet_t* const set = SV_GetVisibilitySet( clientcluster, clientarea, &scratch );
+
+	for (int e = 0; e < sv.num_entities; ++e) {
+		if ( !set->entities[e >> 5] ) {
+			e |= 31;
+			continue;
+		}
+		if ( !(set->entities[e >> 5] & (1 << (e & 31))) ) {
+			continue;
+		}
+
+		const sharedEntity_t* ent = SV_GentityNum(e);
+
+		// entities can be flagged to be sent to only one client
+		if ( ent->r.svFlags & SVF_SINGLECLIENT ) {
+			if ( ent->r.singleClient != frame->ps.clientNum ) {
+				continue;
+			}
+		}
+		// entities can be flagged to be sent to everyone but one client
+		if ( ent->r.svFlags & SVF_NOTSINGLECLIENT ) {
+			if ( ent->r.singleClient == frame->ps.clientNum ) {
+				continue;
+			}
+		}
+		// entities can be flagged to be sent to a given mask of clients
+		if ( ent->r.svFlags & SVF_CLIENTMASK ) {
+			if (frame->ps.clientNum >= 32) {
+				eNums->error = "SVF_CLIENTMASK: clientNum >= 32\n";
+				return;
+			}
+			if (~ent->r.singleClient & (1 << frame->ps.clientNum))
+				continue;
+		}
+
+		const int entityNum = ent->s.number;
+		if ( entityNum < 0 || entityNum >= MAX_GENTITIES ) {
+			eNums->error = "SV_SvEntityForGentity: bad gEnt";
+			return;
+		}
+
+		// don't double add an entity through portals
+		if ( SV_WasAddedToSnapshot( eNums, entityNum ) ) {
+			continue;
+		}
+
 		// add it
-		SV_AddEntToSnapshot( svEnt, ent, eNums );
+		SV_AddEntToSnapshot( entityNum, eNums );
 
 		// if its a portal entity, add everything visible from its camera position
 		if ( ent->r.svFlags & SVF_PORTAL ) {
@@ -380,6 +683,9 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin,
 				}
 			}
 			SV_AddEntitiesVisibleFromPoint( ent->s.origin2, frame, eNums );
+			if ( eNums->error ) {
+				return;
+			}
 		}
 
 	}
@@ -388,10 +694,13 @@ static void SV_AddEntitiesVisibleFromPoint( const vec3_t origin,
 
 /*
 =============
-SV_BuildClientSnapshot
+SV_CullClientSnapshot
 
 Decides which entities are going to be visible to the client, and
 copies off the playerstate and areabits.
+Only writes to the client's current frame and eNums, so it's safe
+to run for several clients in parallel.
+Returns qfalse if there is no snapshot to build.
 
 This properly handles multiple recursive portals, but the render
 currently doesn't.
@@ -399,32 +708,27 @@ currently doesn't.
 For viewing through other player's eyes, clent can be something other than client->gentity
 =============
 */
-static void SV_BuildClientSnapshot( client_t *client ) {
+static qbool SV_CullClientSnapshot( client_t *client, snapshotEntityNumbers_t *eNums ) {
 	vec3_t						org;
 	clientSnapshot_t			*frame;
-	snapshotEntityNumbers_t		entityNumbers;
 	int							i;
-	sharedEntity_t				*ent;
-	entityState_t				*state;
-	svEntity_t					*svEnt;
 	sharedEntity_t				*clent;
 	int							clientNum;
 	playerState_t				*ps;
 
-	// bump the counter used to prevent double adding
-	sv.snapshotCounter++;
-
 	// this is the frame we are creating
 	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
 
 	// clear everything in this snapshot
-	entityNumbers.numSnapshotEntities = 0;
+	eNums->numSnapshotEntities = 0;
+	eNums->error = NULL;
+	Com_Memset( eNums->added, 0, sizeof( eNums->added ) );
 	Com_Memset( frame->areabits, 0, sizeof( frame->areabits ) );
 	frame->num_entities = 0;
 
 	clent = client->gentity;
 	if ( !clent || client->state == CS_ZOMBIE ) {
-		return;
+		return qfalse;
 	}
 
 	// grab the current playerState_t
@@ -435,11 +739,10 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 	// be regenerated from the playerstate
 	clientNum = frame->ps.clientNum;
 	if ( clientNum < 0 || clientNum >= MAX_GENTITIES ) {
-		Com_Error( ERR_DROP, "SV_SvEntityForGentity: bad gEnt" );
+		eNums->error = "SV_SvEntityForGentity: bad gEnt";
+		return qtrue;
 	}
-	svEnt = &sv.svEntities[ clientNum ];
-
-	svEnt->snapshotCounter = sv.snapshotCounter;
+	eNums->added[clientNum >> 3] |= 1 << (clientNum & 7);
 
 	// find the client's viewpoint
 	VectorCopy( ps->origin, org );
@@ -447,14 +750,16 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 
 	// add all the entities directly visible to the eye,
 	// which may include portal entities that merge other viewpoints
-	SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers );
+	SV_AddEntitiesVisibleFromPoint( org, frame, eNums );
+	if ( eNums->error ) {
+		return qtrue;
+	}
 
 	// if there were portals visible, there may be out of order entities
 	// in the list which will need to be resorted for the delta compression
-	// to work correctly.  This also catches the error condition
-	// of an entity being included twice.
-	qsort( entityNumbers.snapshotEntities, entityNumbers.numSnapshotEntities, 
-		sizeof( entityNumbers.snapshotEntities[0] ), SV_QsortEntityNumbers );
+	// to work correctly
+	qsort( eNums->snapshotEntities, eNums->numSnapshotEntities, 
+		sizeof( eNums->snapshotEntities[0] ), SV_QsortEntityNumbers );
 
 	// now that all viewpoint's areabits have been OR'd together, invert
 	// all of them to make it a mask vector, which is what the renderer wants
@@ -462,23 +767,66 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 		((int *)frame->areabits)[i] = ((int *)frame->areabits)[i] ^ -1;
 	}
 
-	// copy the entity states out
+	return qtrue;
+}
+
+
+/*
+=============
+SV_CopySnapshotEntities
+
+Copies the entity states out to svs.snapshotEntities, starting at firstEntity.
+=============
+*/
+static void SV_CopySnapshotEntities( client_t *client, const snapshotEntityNumbers_t *eNums, int firstEntity ) {
+	clientSnapshot_t *frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+
 	frame->num_entities = 0;
-	frame->first_entity = svs.nextSnapshotEntities;
-	for ( i = 0 ; i < entityNumbers.numSnapshotEntities ; i++ ) {
-		ent = SV_GentityNum(entityNumbers.snapshotEntities[i]);
-		state = &svs.snapshotEntities[svs.nextSnapshotEntities % svs.numSnapshotEntities];
-		*state = ent->s;
-		svs.nextSnapshotEntities++;
-		// this should never hit, map should always be restarted first in SV_Frame
-		if ( svs.nextSnapshotEntities >= 0x7FFFFFFE ) {
-			Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
-		}
+	frame->first_entity = firstEntity;
+	for ( int i = 0 ; i < eNums->numSnapshotEntities ; i++ ) {
+		const sharedEntity_t* ent = SV_GentityNum(eNums->snapshotEntities[i]);
+		svs.snapshotEntities[(firstEntity + i) % svs.numSnapshotEntities] = ent->s;
 		frame->num_entities++;
 	}
 }
 
 
+// reserves room for a snapshot's entities and returns the index of the first one
+
+static int SV_AllocSnapshotEntities( int count ) {
+	const int firstEntity = svs.nextSnapshotEntities;
+
+	svs.nextSnapshotEntities += count;
+	// this should never hit, map should always be restarted first in SV_Frame
+	if ( svs.nextSnapshotEntities >= 0x7FFFFFFE ) {
+		Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
+	}
+
+	return firstEntity;
+}
+
+
+/*
+=============
+SV_BuildClientSnapshot
+=============
+*/
+static void SV_BuildClientSnapshot( client_t *client ) {
+	snapshotEntityNumbers_t		entityNumbers;
+
+	if ( !SV_CullClientSnapshot( client, &entityNumbers ) ) {
+		return;
+	}
+
+	if ( entityNumbers.error ) {
+		Com_Error( ERR_DROP, "%s", entityNumbers.error );
+	}
+
+	const int firstEntity = SV_AllocSnapshotEntities( entityNumbers.numSnapshotEntities );
+	SV_CopySnapshotEntities( client, &entityNumbers, firstEntity );
+}
+
+
 /*
 ====================
 SV_RateMsec
@@ -488,7 +836,7 @@ to take to clear, based on the current rate
 ====================
 */
 #define	HEADER_RATE_BYTES	48		// include our header, IP header, and some overhead
-static int SV_RateMsec( client_t *client, int messageSize )
+int SV_RateMsec( client_t *client, int messageSize )
 {
 	// individual messages will never be larger than fragment size
 	// FIXME - use MAX_PACKETLEN or FRAGMENT_SIZE here, not random numbers...
@@ -561,14 +909,46 @@ void SV_SendMessageToClient( msg_t *msg, client_t *client ) {
 	if ( client->state != CS_ACTIVE ) {
 		// a gigantic connection message may have already put the nextSnapshotTime
 		// more than a second away, so don't shorten it
-		// do shorten if client is downloading
-		if ( !*client->downloadName && client->nextSnapshotTime < svs.time + 1000 ) {
+		// downloads don't need snapshots since SV_SendClientDownloads sends them
+		if ( client->nextSnapshotTime < svs.time + 1000 ) {
 			client->nextSnapshotTime = svs.time + 1000;
 		}
 	}
 }
 
 
+static qbool SV_IsBot( const client_t *client )
+{
+	return client->gentity && (client->gentity->r.svFlags & SVF_BOT);
+}
+
+
+static void SV_BeginSnapshotMessage( client_t *client, msg_t *msg, byte *buffer )
+{
+	MSG_Init (msg, buffer, MAX_MSGLEN);
+	msg->allowoverflow = qtrue;
+
+	// NOTE, MRE: all server->client messages now acknowledge
+	// let the client know which reliable clientCommands we have received
+	MSG_WriteLong( msg, client->lastClientCommand );
+
+	// (re)send any reliable server commands
+	SV_UpdateServerCommandsToClient( client, msg );
+}
+
+
+static void SV_EndSnapshotMessage( client_t *client, msg_t *msg )
+{
+	// check for overflow
+	if ( msg->overflowed ) {
+		Com_Printf ("WARNING: msg overflowed for %s\n", client->name);
+		MSG_Clear (msg);
+	}
+
+	SV_SendMessageToClient( msg, client );
+}
+
+
 /*
 SV_SendClientSnapshot
 Also called by SV_FinalMessage
@@ -577,55 +957,152 @@ void SV_SendClientSnapshot( client_t *client )
 {
 
 	// build the snapshot
+	const int64_t buildStartUS = Sys_Microseconds();
 	SV_BuildClientSnapshot( client );
+	SV_ProfileAdd( SVP_BUILD, buildStartUS );
 
 	// bots need to have their snapshots built, but
 	// then query them directly without needing to be sent
-	if ( client->gentity && client->gentity->r.svFlags & SVF_BOT ) {
+	if ( SV_IsBot( client ) ) {
 		return;
 	}
 
     byte		msg_buf[MAX_MSGLEN];
     msg_t		msg;
     
-	MSG_Init (&msg, msg_buf, sizeof(msg_buf));
-	msg.allowoverflow = qtrue;
-
-	// NOTE, MRE: all server->client messages now acknowledge
-	// let the client know which reliable clientCommands we have received
-	MSG_WriteLong( &msg, client->lastClientCommand );
-
-	// (re)send any reliable server commands
-	SV_UpdateServerCommandsToClient( client, &msg );
+	const int64_t encodeStartUS = Sys_Microseconds();
+	SV_BeginSnapshotMessage( client, &msg, msg_buf );
 
 	// send over all the relevant entityState_t
 	// and the playerState_t
-	SV_WriteSnapshotToClient( client, &msg );
+	int lastframe;
+	const clientSnapshot_t* oldframe = SV_SelectDeltaFrame( client, svs.nextSnapshotEntities, &lastframe );
+	SV_WriteSnapshotToClient( client, &msg, oldframe, lastframe );
+	SV_ProfileAdd( SVP_ENCODE, encodeStartUS );
+
+	const int64_t sendStartUS = Sys_Microseconds();
+	SV_EndSnapshotMessage( client, &msg );
+	SV_ProfileAdd( SVP_SEND, sendStartUS );
+}
 
-	// Add any download data if the client is downloading
-	SV_WriteDownloadToClient( client, &msg );
 
-	// check for overflow
-	if ( msg.overflowed ) {
-		Com_Printf ("WARNING: msg overflowed for %s\n", client->name);
-		MSG_Clear (&msg);
+/*
+=============================================================================
+
+Parallel snapshot building (sv_snapshotThreads > 0)
+
+Culling and delta encoding run on worker threads, everything else
+(reliable commands, downloads, netchan) stays on the main thread.
+The messages are identical to the ones SV_SendClientSnapshot writes.
+
+=============================================================================
+*/
+
+typedef struct {
+	client_t*				client;
+	snapshotEntityNumbers_t	entityNumbers;
+	qbool					hasSnapshot;	// qfalse when there was nothing to build
+	int						firstEntity;	// into svs.snapshotEntities
+	const clientSnapshot_t*	oldframe;		// delta source
+	int						lastframe;
+	msg_t					msg;
+	byte					msgBuffer[MAX_MSGLEN];
+} snapshotJob_t;
+
+static snapshotJob_t sv_snapshotJobs[MAX_CLIENTS];
+
+
+static void SV_CullSnapshotJob( void* data, int index )
+{
+	snapshotJob_t* const job = (snapshotJob_t*)data + index;
+
+	job->hasSnapshot = SV_CullClientSnapshot( job->client, &job->entityNumbers );
+}
+
+
+static void SV_WriteSnapshotJob( void* data, int index )
+{
+	snapshotJob_t* const job = (snapshotJob_t*)data + index;
+
+	if ( job->hasSnapshot ) {
+		SV_CopySnapshotEntities( job->client, &job->entityNumbers, job->firstEntity );
+	}
+
+	if ( !SV_IsBot( job->client ) ) {
+		SV_WriteSnapshotToClient( job->client, &job->msg, job->oldframe, job->lastframe );
 	}
+}
 
-	SV_SendMessageToClient( &msg, client );
 
-/* this works fine on lan (160K/s dl, yay) and SEEMS okay over the net, but needs more testing
-#define UNSUCK_DOWNLOADS
-#if defined( UNSUCK_DOWNLOADS )
-	// KHB 071111  the whole reason Q3 dl's SUCK is that there's a "secret" artificial cap
-	// based on UDP packet sizes. so the server "sends" a 2K block each snap, but it's actually
-	// cut down to 1300 bytes, MINUS the game traffic, so the ABSOLUTE peak dl speed is roughly
-	// 1K * 30 snaps, EVEN ON LAN; and the realistic dl speed from an active server is about
-	// 400 bytes * svfps, depending on how many random newbs are spamming plasma and chat etc
-	while (client->netchan.unsentFragments) {
-		SV_Netchan_TransmitNextFragment( client );
+static void SV_SendClientSnapshotsParallel( client_t **clients, int count )
+{
+	snapshotJob_t* const jobs = sv_snapshotJobs;
+	const int threadCount = sv_snapshotThreads->integer;
+	const int64_t buildStartUS = Sys_Microseconds();
+
+	for ( int i = 0; i < count; ++i ) {
+		jobs[i].client = clients[i];
+		if ( !SV_IsBot( clients[i] ) ) {
+			SV_BeginSnapshotMessage( clients[i], &jobs[i].msg, jobs[i].msgBuffer );
+		}
 	}
-#endif
-*/
+
+	// the workers can only read the cache, so the sets they need are built first
+	for ( int i = 0; i < count; ++i ) {
+		SV_CacheClientVisibilitySet( clients[i] );
+	}
+	sv_visCache.locked = qtrue;
+	Sys_RunParallel( SV_CullSnapshotJob, jobs, count, threadCount );
+	sv_visCache.locked = qfalse;
+
+	for ( int i = 0; i < count; ++i ) {
+		if ( jobs[i].hasSnapshot && jobs[i].entityNumbers.error ) {
+			Com_Error( ERR_DROP, "%s", jobs[i].entityNumbers.error );
+		}
+	}
+
+	// hand out the ranges in client order like the serial path does
+	for ( int i = 0; i < count; ++i ) {
+		snapshotJob_t* const job = &jobs[i];
+		job->firstEntity = 0;
+		if ( job->hasSnapshot ) {
+			job->firstEntity = SV_AllocSnapshotEntities( job->entityNumbers.numSnapshotEntities );
+		}
+		job->oldframe = NULL;
+		job->lastframe = 0;
+		if ( !SV_IsBot( job->client ) ) {
+			job->oldframe = SV_SelectDeltaFrame( job->client, svs.nextSnapshotEntities, &job->lastframe );
+		}
+	}
+
+	SV_ProfileAdd( SVP_BUILD, buildStartUS );
+
+	// the entity copies are timed as encoding since they share the jobs
+	const int64_t encodeStartUS = Sys_Microseconds();
+
+	// a delta source that later snapshots of this frame will overwrite
+	// must be read before they're written, so we fall back to the serial order
+	qbool inOrder = qfalse;
+	for ( int i = 0; i < count; ++i ) {
+		const clientSnapshot_t* const oldframe = jobs[i].oldframe;
+		if ( oldframe && oldframe->first_entity + svs.numSnapshotEntities < svs.nextSnapshotEntities ) {
+			inOrder = qtrue;
+			break;
+		}
+	}
+
+	sv_deltaCache.locked = qtrue;
+	Sys_RunParallel( SV_WriteSnapshotJob, jobs, count, inOrder ? 1 : threadCount );
+	sv_deltaCache.locked = qfalse;
+	SV_ProfileAdd( SVP_ENCODE, encodeStartUS );
+
+	const int64_t sendStartUS = Sys_Microseconds();
+	for ( int i = 0; i < count; ++i ) {
+		if ( !SV_IsBot( jobs[i].client ) ) {
+			SV_EndSnapshotMessage( jobs[i].client, &jobs[i].msg );
+		}
+	}
+	SV_ProfileAdd( SVP_SEND, sendStartUS );
 }
 
 
@@ -637,6 +1114,13 @@ SV_SendClientMessages
 void SV_SendClientMessages( void ) {
 	int			i;
 	client_t	*c;
+	client_t	*snapshotClients[MAX_CLIENTS];
+	int			numSnapshotClients = 0;
+
+	// gather all datagrams so they go out in as few syscalls as possible
+	Sys_BeginPacketBatch();
+	SV_BeginVisibilityCache();
+	SV_BeginDeltaCache();
 
 	// send a message to each connected client
 	for (i=0, c = svs.clients ; i < sv_maxclients->integer ; i++, c++) {
@@ -656,12 +1140,33 @@ void SV_SendClientMessages( void ) {
 		if ( c->netchan.unsentFragments ) {
 			c->nextSnapshotTime = svs.time + 
 				SV_RateMsec( c, c->netchan.unsentLength - c->netchan.unsentFragmentStart );
+			const int64_t sendStartUS = Sys_Microseconds();
 			SV_Netchan_TransmitNextFragment( c );
+			SV_ProfileAdd( SVP_SEND, sendStartUS );
 			continue;
 		}
 
 		// generate and send a new message
-		SV_SendClientSnapshot( c );
+		if ( sv_snapshotThreads->integer > 0 ) {
+			snapshotClients[numSnapshotClients++] = c;
+		} else {
+			SV_SendClientSnapshot( c );
+		}
+	}
+
+	if ( numSnapshotClients > 0 ) {
+		SV_SendClientSnapshotsParallel( snapshotClients, numSnapshotClients );
 	}
+
+	// downloads go out at the client's rate, not the snapshot rate
+	const int64_t downloadStartUS = Sys_Microseconds();
+	SV_SendClientDownloads();
+	SV_ProfileAdd( SVP_SEND, downloadStartUS );
+
+	SV_EndDeltaCache();
+	SV_EndVisibilityCache();
+	const int64_t flushStartUS = Sys_Microseconds();
+	Sys_EndPacketBatch();
+	SV_ProfileAdd( SVP_SEND, flushStartUS );
 }
 
@@ -54,25 +54,272 @@ clipHandle_t SV_ClipHandleForEntity( const sharedEntity_t *ent ) {
 ENTITY CHECKING
 
 To avoid linearly searching through lists of entities during environment testing,
-the world is carved up with an evenly spaced, axially aligned bsp tree.  Entities
-are kept in chains either at the final leafs, or at the first node that splits
-them, which prevents having to deal with multiple fragments of a single entity.
+the linked entities are kept in a dynamic bounding volume hierarchy.
+Every entity is a leaf whose box is its absmin / absmax grown by WORLD_LEAF_MARGIN,
+so small moves don't need to touch the tree at all.
+Leaves are inserted next to the sibling that grows the surface area the least
+and the tree is kept balanced with rotations, like an AVL tree.
 
 ===============================================================================
 */
 
-typedef struct worldSector_s {
-	int		axis;		// -1 = leaf node
-	float	dist;
-	struct worldSector_s	*children[2];
-	svEntity_t	*entities;
-} worldSector_t;
+#define	MAX_WORLD_NODES		(2 * MAX_GENTITIES)
+#define	WORLD_LEAF_MARGIN	16.0f
+#define	WORLD_NULL_NODE		(-1)
 
-#define	AREA_DEPTH	4
-#define	AREA_NODES	64
+typedef struct {
+	vec3_t	mins, maxs;		// leaves have the entity's box plus the margin
+	int		parent;			// WORLD_NULL_NODE for the root, next free node when unused
+	int		children[2];	// WORLD_NULL_NODE for leaves
+	int		height;			// 0 for leaves, -1 when unused
+	int		entityNum;		// leaves only
+} worldNode_t;
+
+typedef struct {
+	worldNode_t	nodes[MAX_WORLD_NODES];
+	int			root;
+	int			freeList;
+	int			numLeaves;
+
+	// query stats for /sectorlist
+	int			queries;
+	int64_t		nodesVisited;
+	int64_t		candidates;		// leaves whose box touched the query
+	int64_t		results;
+	int64_t		linkedEntities;	// what a linear scan would have tested
+	int			relinks;		// SV_LinkEntity calls that had to update the tree
+	int			links;
+} worldTree_t;
+
+static worldTree_t sv_world;
+
+
+static qbool SV_IsWorldLeaf( const worldNode_t* node )
+{
+	return node->children[0] == WORLD_NULL_NODE;
+}
+
+
+// half the surface area, which is all the insertion cost needs
+
+static float SV_WorldBoxArea( const vec3_t mins, const vec3_t maxs )
+{
+	const float dx = maxs[0] - mins[0];
+	const float dy = maxs[1] - mins[1];
+	const float dz = maxs[2] - mins[2];
+
+	return dx * dy + dy * dz + dz * dx;
+}
+
+
+static float SV_WorldUnionArea( const worldNode_t* a, const worldNode_t* b )
+{
+	vec3_t mins, maxs;
+	for ( int i = 0; i < 3; ++i ) {
+		mins[i] = min( a->mins[i], b->mins[i] );
+		maxs[i] = max( a->maxs[i], b->maxs[i] );
+	}
+
+	return SV_WorldBoxArea( mins, maxs );
+}
+
+
+static void SV_WorldUnionBox( worldNode_t* node, const worldNode_t* a, const worldNode_t* b )
+{
+	for ( int i = 0; i < 3; ++i ) {
+		node->mins[i] = min( a->mins[i], b->mins[i] );
+		node->maxs[i] = max( a->maxs[i], b->maxs[i] );
+	}
+}
+
+
+static void SV_FitWorldNode( int index )
+{
+	worldNode_t* const node = &sv_world.nodes[index];
+	const worldNode_t* const c0 = &sv_world.nodes[node->children[0]];
+	const worldNode_t* const c1 = &sv_world.nodes[node->children[1]];
+
+	SV_WorldUnionBox( node, c0, c1 );
+	node->height = 1 + max( c0->height, c1->height );
+}
+
+
+static int SV_AllocWorldNode()
+{
+	if ( sv_world.freeList == WORLD_NULL_NODE ) {
+		Com_Error( ERR_DROP, "SV_AllocWorldNode: MAX_WORLD_NODES hit" );
+	}
+
+	const int index = sv_world.freeList;
+	worldNode_t* const node = &sv_world.nodes[index];
+	sv_world.freeList = node->parent;
+	node->parent = WORLD_NULL_NODE;
+	node->children[0] = WORLD_NULL_NODE;
+	node->children[1] = WORLD_NULL_NODE;
+	node->height = 0;
+	node->entityNum = ENTITYNUM_NONE;
+
+	return index;
+}
+
+
+static void SV_FreeWorldNode( int index )
+{
+	worldNode_t* const node = &sv_world.nodes[index];
+	node->parent = sv_world.freeList;
+	node->height = -1;
+	sv_world.freeList = index;
+}
+
+
+static void SV_ReplaceWorldChild( int parent, int oldChild, int newChild )
+{
+	if ( parent == WORLD_NULL_NODE ) {
+		sv_world.root = newChild;
+		return;
+	}
+
+	worldNode_t* const node = &sv_world.nodes[parent];
+	if ( node->children[0] == oldChild ) {
+		node->children[0] = newChild;
+	} else {
+		node->children[1] = newChild;
+	}
+}
+
+
+// if one child of a is 2+ levels taller than the other, that child takes a's place
+// returns the index of the node now at a's position
+
+static int SV_BalanceWorldNode( int a )
+{
+	worldNode_t* const A = &sv_world.nodes[a];
+	if ( SV_IsWorldLeaf( A ) || A->height < 2 ) {
+		return a;
+	}
+
+	const int balance = sv_world.nodes[A->children[1]].height - sv_world.nodes[A->children[0]].height;
+	if ( balance >= -1 && balance <= 1 ) {
+		return a;
+	}
+
+	// u is the child moving up, s is the one staying below a
+	const int uSide = balance > 1 ? 1 : 0;
+	const int u = A->children[uSide];
+	worldNode_t* const U = &sv_world.nodes[u];
+	const int f = U->children[0];
+	const int g = U->children[1];
+	worldNode_t* const F = &sv_world.nodes[f];
+	worldNode_t* const G = &sv_world.nodes[g];
+
+	// u replaces a
+	U->children[0] = a;
+	U->parent = A->parent;
+	A->parent = u;
+	SV_ReplaceWorldChild( U->parent, a, u );
+
+	// u keeps its taller child and a adopts the shorter one
+	if ( F->height > G->height ) {
+		U->children[1] = f;
+		A->children[uSide] = g;
+		G->parent = a;
+	} else {
+		U->children[1] = g;
+		A->children[uSide] = f;
+		F->parent = a;
+	}
+
+	SV_FitWorldNode( a );
+	SV_FitWorldNode( u );
+
+	return u;
+}
+
+
+static void SV_RefitWorldAncestors( int index )
+{
+	while ( index != WORLD_NULL_NODE ) {
+		index = SV_BalanceWorldNode( index );
+		SV_FitWorldNode( index );
+		index = sv_world.nodes[index].parent;
+	}
+}
+
+
+static void SV_InsertWorldLeaf( int leaf )
+{
+	sv_world.numLeaves++;
+
+	if ( sv_world.root == WORLD_NULL_NODE ) {
+		sv_world.root = leaf;
+		sv_world.nodes[leaf].parent = WORLD_NULL_NODE;
+		return;
+	}
+
+	// find the best sibling: the cost of a node is the area it would have with
+	// the leaf added plus the area growth forced onto all of its ancestors
+	const worldNode_t* const leafNode = &sv_world.nodes[leaf];
+	int index = sv_world.root;
+	while ( !SV_IsWorldLeaf( &sv_world.nodes[index] ) ) {
+		const worldNode_t* const node = &sv_world.nodes[index];
+		const float area = SV_WorldBoxArea( node->mins, node->maxs );
+		const float combinedArea = SV_WorldUnionArea( node, leafNode );
+		const float cost = 2.0f * combinedArea;
+		const float inheritanceCost = 2.0f * ( combinedArea - area );
+
+		float childCosts[2];
+		for ( int c = 0; c < 2; ++c ) {
+			const worldNode_t* const child = &sv_world.nodes[node->children[c]];
+			childCosts[c] = SV_WorldUnionArea( child, leafNode ) + inheritanceCost;
+			if ( !SV_IsWorldLeaf( child ) ) {
+				childCosts[c] -= SV_WorldBoxArea( child->mins, child->maxs );
+			}
+		}
+
+		if ( cost < childCosts[0] && cost < childCosts[1] ) {
+			break;
+		}
+
+		index = node->children[childCosts[0] < childCosts[1] ? 0 : 1];
+	}
+
+	// create a new parent for the sibling and the leaf
+	const int sibling = index;
+	const int oldParent = sv_world.nodes[sibling].parent;
+	const int newParent = SV_AllocWorldNode();
+	worldNode_t* const parentNode = &sv_world.nodes[newParent];
+	parentNode->parent = oldParent;
+	parentNode->children[0] = sibling;
+	parentNode->children[1] = leaf;
+	sv_world.nodes[sibling].parent = newParent;
+	sv_world.nodes[leaf].parent = newParent;
+	SV_ReplaceWorldChild( oldParent, sibling, newParent );
+
+	SV_RefitWorldAncestors( newParent );
+}
 
-static worldSector_t sv_worldSectors[AREA_NODES];
-static int sv_numworldSectors;
+
+static void SV_RemoveWorldLeaf( int leaf )
+{
+	sv_world.numLeaves--;
+
+	if ( leaf == sv_world.root ) {
+		sv_world.root = WORLD_NULL_NODE;
+		return;
+	}
+
+	// the sibling takes the parent's place
+	const int parent = sv_world.nodes[leaf].parent;
+	const worldNode_t* const parentNode = &sv_world.nodes[parent];
+	const int grandParent = parentNode->parent;
+	const int sibling = parentNode->children[0] == leaf ? parentNode->children[1] : parentNode->children[0];
+
+	SV_ReplaceWorldChild( grandParent, parent, sibling );
+	sv_world.nodes[sibling].parent = grandParent;
+	SV_FreeWorldNode( parent );
+
+	SV_RefitWorldAncestors( grandParent );
+}
 
 
 /*
@@ -81,75 +328,204 @@ SV_SectorList_f
 ===============
 */
 void SV_SectorList_f( void ) {
-	int				i, c;
-	worldSector_t	*sec;
-	svEntity_t		*ent;
+	if ( Cmd_Argc() == 2 && !Q_stricmp( Cmd_Argv(1), "reset" ) ) {
+		sv_world.queries = 0;
+		sv_world.nodesVisited = 0;
+		sv_world.candidates = 0;
+		sv_world.results = 0;
+		sv_world.linkedEntities = 0;
+		sv_world.relinks = 0;
+		sv_world.links = 0;
+		return;
+	}
 
-	for ( i = 0 ; i < AREA_NODES ; i++ ) {
-		sec = &sv_worldSectors[i];
+	const int height = sv_world.root != WORLD_NULL_NODE ? sv_world.nodes[sv_world.root].height : 0;
+	Com_Printf( "%d linked entities, tree height %d\n", sv_world.numLeaves, height );
+	Com_Printf( "%d of %d links updated the tree\n", sv_world.relinks, sv_world.links );
 
-		c = 0;
-		for ( ent = sec->entities ; ent ; ent = ent->nextEntityInWorldSector ) {
-			c++;
-		}
-		Com_Printf( "sector %i: %i entities\n", i, c );
+	if ( sv_world.queries <= 0 ) {
+		Com_Printf( "no area queries yet\n" );
+		return;
 	}
+
+	const double q = (double)sv_world.queries;
+	Com_Printf( "%d area queries, averages per query:\n", sv_world.queries );
+	Com_Printf( "  %6.1f linked entities (linear scan candidates)\n", (double)sv_world.linkedEntities / q );
+	Com_Printf( "  %6.1f tree nodes visited\n", (double)sv_world.nodesVisited / q );
+	Com_Printf( "  %6.1f leaf candidates\n", (double)sv_world.candidates / q );
+	Com_Printf( "  %6.1f entities returned\n", (double)sv_world.results / q );
 }
 
+
 /*
-===============
-SV_CreateworldSector
+===============================================================================
 
-Builds a uniformly subdivided tree for the given world size
-===============
+TRACE CACHE
+
+With sv_traceCache 1, the results of SV_Trace and SV_PointContents are reused
+when the exact same query is made again during the same game frame.
+SV_LinkEntity and SV_UnlinkEntity log the boxes entities leave and enter,
+and an entry is only reused when none of the boxes logged since it was stored
+touch the area its query looked at.
+Entities the game modifies without relinking them aren't noticed,
+which is why the cache is opt-in.
+
+===============================================================================
 */
-static worldSector_t* SV_CreateworldSector( int depth, const vec3_t mins, const vec3_t maxs )
+
+#define	TRACE_CACHE_SIZE		2048	// must be a power of 2
+#define	TRACE_CACHE_PROBES		8
+#define	TRACE_CACHE_MAX_CHANGES	256		// when there are more, all entries are dropped
+
+typedef struct {
+	vec3_t	start;
+	vec3_t	end;
+	vec3_t	mins;
+	vec3_t	maxs;
+	int		passEntityNum;
+	int		contentmask;
+	int		capsule;		// -1 for SV_PointContents
+} traceCacheKey_t;
+
+typedef struct {
+	traceCacheKey_t	key;
+	vec3_t		boxmins;		// everything the query could have touched
+	vec3_t		boxmaxs;
+	int			frame;			// only valid when equal to traceCache.frame
+	int			firstChange;	// older changes are already reflected in the result
+	trace_t		trace;			// SV_PointContents only uses contents
+} traceCacheEntry_t;
+
+typedef struct {
+	traceCacheEntry_t	entries[TRACE_CACHE_SIZE];
+	vec3_t		changes[TRACE_CACHE_MAX_CHANGES][2];
+	int			numChanges;
+	int			frame;
+
+	// stats for com_showtrace
+	int			hits;
+	int			lookups;
+} traceCache_t;
+
+static traceCache_t traceCache;
+
+
+void SV_ClearTraceCache()
+{
+	// the entries of older frames are never reused
+	traceCache.frame++;
+	traceCache.numChanges = 0;
+}
+
+
+void SV_TakeTraceCacheStats( int* hits, int* lookups )
 {
-	worldSector_t	*anode;
-	vec3_t		size;
-	vec3_t		mins1, maxs1, mins2, maxs2;
+	*hits = traceCache.hits;
+	*lookups = traceCache.lookups;
+	traceCache.hits = 0;
+	traceCache.lookups = 0;
+}
 
-	anode = &sv_worldSectors[sv_numworldSectors];
-	sv_numworldSectors++;
 
-	if (depth == AREA_DEPTH) {
-		anode->axis = -1;
-		anode->children[0] = anode->children[1] = NULL;
-		return anode;
+static void SV_TraceCacheChanged( const vec3_t mins, const vec3_t maxs )
+{
+	if ( traceCache.numChanges >= TRACE_CACHE_MAX_CHANGES ) {
+		SV_ClearTraceCache();
+		return;
 	}
 
-	VectorSubtract (maxs, mins, size);
-	if (size[0] > size[1]) {
-		anode->axis = 0;
-	} else {
-		anode->axis = 1;
+	VectorCopy( mins, traceCache.changes[traceCache.numChanges][0] );
+	VectorCopy( maxs, traceCache.changes[traceCache.numChanges][1] );
+	traceCache.numChanges++;
+}
+
+
+static unsigned int SV_HashTraceCacheKey( const traceCacheKey_t* key )
+{
+	// FNV-1a
+	const byte* const data = (const byte*)key;
+	unsigned int hash = 2166136261u;
+	for ( int i = 0; i < (int)sizeof(*key); ++i ) {
+		hash = (hash ^ data[i]) * 16777619u;
 	}
 
-	anode->dist = 0.5 * (maxs[anode->axis] + mins[anode->axis]);
-	VectorCopy (mins, mins1);
-	VectorCopy (mins, mins2);
-	VectorCopy (maxs, maxs1);
-	VectorCopy (maxs, maxs2);
+	return hash;
+}
 
-	maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
 
-	anode->children[0] = SV_CreateworldSector (depth+1, mins2, maxs2);
-	anode->children[1] = SV_CreateworldSector (depth+1, mins1, maxs1);
+static qbool SV_TraceCacheEntryValid( const traceCacheEntry_t* entry )
+{
+	for ( int i = entry->firstChange; i < traceCache.numChanges; ++i ) {
+		const vec3_t* const box = traceCache.changes[i];
+		if ( box[0][0] <= entry->boxmaxs[0] && box[1][0] >= entry->boxmins[0] &&
+			 box[0][1] <= entry->boxmaxs[1] && box[1][1] >= entry->boxmins[1] &&
+			 box[0][2] <= entry->boxmaxs[2] && box[1][2] >= entry->boxmins[2] ) {
+			return qfalse;
+		}
+	}
+
+	return qtrue;
+}
 
-	return anode;
+
+// returns the entry to reuse or to store the new result in
+// *hit is set to qtrue when the entry's result can be used as is
+static traceCacheEntry_t* SV_FindTraceCacheEntry( const traceCacheKey_t* key, qbool* hit )
+{
+	const unsigned int hash = SV_HashTraceCacheKey( key );
+	traceCacheEntry_t* freeEntry = NULL;
+
+	traceCache.lookups++;
+	for ( int i = 0; i < TRACE_CACHE_PROBES; ++i ) {
+		traceCacheEntry_t* const entry = &traceCache.entries[(hash + i) & (TRACE_CACHE_SIZE - 1)];
+		if ( entry->frame != traceCache.frame ) {
+			if ( !freeEntry )
+				freeEntry = entry;
+			continue;
+		}
+
+		if ( memcmp( &entry->key, key, sizeof(*key) ) )
+			continue;
+
+		*hit = SV_TraceCacheEntryValid( entry );
+		if ( *hit )
+			traceCache.hits++;
+		return entry;
+	}
+
+	*hit = qfalse;
+
+	// when all probed slots are in use, the first one gets evicted
+	return freeEntry ? freeEntry : &traceCache.entries[hash & (TRACE_CACHE_SIZE - 1)];
+}
+
+
+static void SV_StoreTraceCacheEntry( traceCacheEntry_t* entry, const traceCacheKey_t* key, const vec3_t boxmins, const vec3_t boxmaxs, const trace_t* trace )
+{
+	entry->key = *key;
+	VectorCopy( boxmins, entry->boxmins );
+	VectorCopy( boxmaxs, entry->boxmaxs );
+	entry->frame = traceCache.frame;
+	entry->firstChange = traceCache.numChanges;
+	entry->trace = *trace;
 }
 
 
+//===========================================================================
+
+
 void SV_ClearWorld()
 {
-	Com_Memset( sv_worldSectors, 0, sizeof(sv_worldSectors) );
-	sv_numworldSectors = 0;
+	Com_Memset( &sv_world, 0, sizeof(sv_world) );
+	sv_world.root = WORLD_NULL_NODE;
 
-	// get world map bounds
-	vec3_t mins, maxs;
-	clipHandle_t h = CM_InlineModel( 0 );
-	CM_ModelBounds( h, mins, maxs );
-	SV_CreateworldSector( 0, mins, maxs );
+	for ( int i = 0; i < MAX_WORLD_NODES; ++i ) {
+		sv_world.nodes[i].parent = i + 1 < MAX_WORLD_NODES ? i + 1 : WORLD_NULL_NODE;
+		sv_world.nodes[i].height = -1;
+	}
+	sv_world.freeList = 0;
+
+	SV_ClearTraceCache();
 }
 
 
@@ -161,32 +537,20 @@ SV_UnlinkEntity
 */
 void SV_UnlinkEntity( sharedEntity_t *gEnt ) {
 	svEntity_t		*ent;
-	svEntity_t		*scan;
-	worldSector_t	*ws;
 
 	ent = SV_SvEntityForGentity( gEnt );
 
 	gEnt->r.linked = qfalse;
 
-	ws = ent->worldSector;
-	if ( !ws ) {
+	if ( !ent->worldLeaf ) {
 		return;		// not linked in anywhere
 	}
-	ent->worldSector = NULL;
-
-	if ( ws->entities == ent ) {
-		ws->entities = ent->nextEntityInWorldSector;
-		return;
-	}
 
-	for ( scan = ws->entities ; scan ; scan = scan->nextEntityInWorldSector ) {
-		if ( scan->nextEntityInWorldSector == ent ) {
-			scan->nextEntityInWorldSector = ent->nextEntityInWorldSector;
-			return;
-		}
-	}
-
-	Com_Printf( "WARNING: SV_UnlinkEntity: not found in worldSector\n" );
+	const int leaf = ent->worldLeaf - 1;
+	ent->worldLeaf = 0;
+	SV_TraceCacheChanged( sv_world.nodes[leaf].mins, sv_world.nodes[leaf].maxs );
+	SV_RemoveWorldLeaf( leaf );
+	SV_FreeWorldNode( leaf );
 }
 
 
@@ -198,7 +562,6 @@ SV_LinkEntity
 */
 #define MAX_TOTAL_ENT_LEAFS		128
 void SV_LinkEntity( sharedEntity_t *gEnt ) {
-	worldSector_t	*node;
 	int			leafs[MAX_TOTAL_ENT_LEAFS];
 	int			cluster;
 	int			num_leafs;
@@ -210,8 +573,10 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 
 	ent = SV_SvEntityForGentity( gEnt );
 
-	if ( ent->worldSector ) {
-		SV_UnlinkEntity( gEnt );	// unlink from old position
+	// the leaf's box contains wherever the entity was last linked
+	if ( ent->worldLeaf ) {
+		const int leaf = ent->worldLeaf - 1;
+		SV_TraceCacheChanged( sv_world.nodes[leaf].mins, sv_world.nodes[leaf].maxs );
 	}
 
 	// encode the size into the entityState_t for client prediction
@@ -272,6 +637,8 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 	gEnt->r.absmax[1] += 1;
 	gEnt->r.absmax[2] += 1;
 
+	SV_TraceCacheChanged( gEnt->r.absmin, gEnt->r.absmax );
+
 	// link to PVS leafs
 	ent->numClusters = 0;
 	ent->lastCluster = 0;
@@ -285,6 +652,7 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 	// if none of the leafs were inside the map, the
 	// entity is outside the world and can be considered unlinked
 	if ( !num_leafs ) {
+		SV_UnlinkEntity( gEnt );
 		return;
 	}
 
@@ -326,24 +694,31 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 
 	gEnt->r.linkcount++;
 
-	// find the first world sector node that the ent's box crosses
-	node = sv_worldSectors;
-	while (1)
-	{
-		if (node->axis == -1)
-			break;
-		if ( gEnt->r.absmin[node->axis] > node->dist)
-			node = node->children[0];
-		else if ( gEnt->r.absmax[node->axis] < node->dist)
-			node = node->children[1];
-		else
-			break;		// crosses the node
+	// the tree only needs updating when the box left its leaf's margin
+	sv_world.links++;
+	int leaf = ent->worldLeaf - 1;
+	if ( ent->worldLeaf ) {
+		const worldNode_t* const node = &sv_world.nodes[leaf];
+		if ( node->mins[0] <= gEnt->r.absmin[0] && node->maxs[0] >= gEnt->r.absmax[0] &&
+			 node->mins[1] <= gEnt->r.absmin[1] && node->maxs[1] >= gEnt->r.absmax[1] &&
+			 node->mins[2] <= gEnt->r.absmin[2] && node->maxs[2] >= gEnt->r.absmax[2] ) {
+			gEnt->r.linked = qtrue;
+			return;
+		}
+		SV_RemoveWorldLeaf( leaf );
+	} else {
+		leaf = SV_AllocWorldNode();
+		ent->worldLeaf = leaf + 1;
 	}
 
-	// link it in
-	ent->worldSector = node;
-	ent->nextEntityInWorldSector = node->entities;
-	node->entities = ent;
+	sv_world.relinks++;
+	worldNode_t* const node = &sv_world.nodes[leaf];
+	node->entityNum = ent - sv.svEntities;
+	for ( i = 0; i < 3; ++i ) {
+		node->mins[i] = gEnt->r.absmin[i] - WORLD_LEAF_MARGIN;
+		node->maxs[i] = gEnt->r.absmax[i] + WORLD_LEAF_MARGIN;
+	}
+	SV_InsertWorldLeaf( leaf );
 
 	gEnt->r.linked = qtrue;
 }
@@ -358,64 +733,64 @@ bounds.  This does NOT mean that they actually touch in the case of bmodels.
 ============================================================================
 */
 
-typedef struct {
-	const float	*mins;
-	const float	*maxs;
-	int			*list;
-	int			count, maxcount;
-} areaParms_t;
+int SV_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount )
+{
+	// the balanced tree's height is logarithmic, so the stack never gets close to full
+	int stack[256];
+	int stackSize = 0;
+	int count = 0;
+	int visited = 0;
+	int candidates = 0;
+
+	if ( sv_world.root != WORLD_NULL_NODE ) {
+		stack[stackSize++] = sv_world.root;
+	}
 
+	while ( stackSize > 0 ) {
+		const worldNode_t* const node = &sv_world.nodes[stack[--stackSize]];
+		visited++;
 
-static void SV_AreaEntities_r( const worldSector_t* node, areaParms_t* ap )
-{
-	for (const svEntity_t* check = node->entities; check; check = check->nextEntityInWorldSector ) {
-		const sharedEntity_t* gcheck = SV_GEntityForSvEntity( check );
-
-		if ( gcheck->r.absmin[0] > ap->maxs[0]
-		|| gcheck->r.absmin[1] > ap->maxs[1]
-		|| gcheck->r.absmin[2] > ap->maxs[2]
-		|| gcheck->r.absmax[0] < ap->mins[0]
-		|| gcheck->r.absmax[1] < ap->mins[1]
-		|| gcheck->r.absmax[2] < ap->mins[2]) {
+		if ( node->mins[0] > maxs[0] || node->mins[1] > maxs[1] || node->mins[2] > maxs[2] ||
+			 node->maxs[0] < mins[0] || node->maxs[1] < mins[1] || node->maxs[2] < mins[2] ) {
 			continue;
 		}
 
-		if ( ap->count == ap->maxcount ) {
-			Com_Printf ("SV_AreaEntities: MAXCOUNT\n");
-			return;
+		if ( !SV_IsWorldLeaf( node ) ) {
+			if ( stackSize + 2 > (int)ARRAY_LEN( stack ) ) {
+				Com_Error( ERR_DROP, "SV_AreaEntities: stack overflow" );
+			}
+			stack[stackSize++] = node->children[1];
+			stack[stackSize++] = node->children[0];
+			continue;
 		}
 
-		ap->list[ap->count] = check - sv.svEntities;
-		ap->count++;
-	}
+		// the leaf's box has a margin, so check the entity's actual box
+		candidates++;
+		const sharedEntity_t* const gcheck = SV_GentityNum( node->entityNum );
+		if ( gcheck->r.absmin[0] > maxs[0]
+		|| gcheck->r.absmin[1] > maxs[1]
+		|| gcheck->r.absmin[2] > maxs[2]
+		|| gcheck->r.absmax[0] < mins[0]
+		|| gcheck->r.absmax[1] < mins[1]
+		|| gcheck->r.absmax[2] < mins[2]) {
+			continue;
+		}
 
-	if (node->axis == -1) {
-		return;		// terminal node
-	}
+		if ( count == maxcount ) {
+			Com_Printf ("SV_AreaEntities: MAXCOUNT\n");
+			break;
+		}
 
-	// recurse down both sides
-	if ( ap->maxs[node->axis] > node->dist ) {
-		SV_AreaEntities_r( node->children[0], ap );
+		entityList[count++] = node->entityNum;
 	}
-	if ( ap->mins[node->axis] < node->dist ) {
-		SV_AreaEntities_r( node->children[1], ap );
-	}
-}
-
-
-int SV_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount )
-{
-	areaParms_t ap;
 
-	ap.mins = mins;
-	ap.maxs = maxs;
-	ap.list = entityList;
-	ap.count = 0;
-	ap.maxcount = maxcount;
+	sv_world.queries++;
+	sv_world.nodesVisited += visited;
+	sv_world.candidates += candidates;
+	sv_world.results += count;
+	sv_world.linkedEntities += sv_world.numLeaves;
 
-	SV_AreaEntities_r( sv_worldSectors, &ap );
-
-	return ap.count;
+	return count;
 }
 
 
@@ -557,31 +932,37 @@ static void SV_ClipMoveToEntities( moveclip_t *clip )
 }
 
 
-/*
-==================
-SV_Trace
+static traceCacheEntry_t* SV_FindTraceInCache( traceCacheKey_t* key, qbool* hit, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule )
+{
+	VectorCopy( start, key->start );
+	VectorCopy( end, key->end );
+	VectorCopy( mins, key->mins );
+	VectorCopy( maxs, key->maxs );
+	key->passEntityNum = passEntityNum;
+	key->contentmask = contentmask;
+	key->capsule = capsule;
+
+	return SV_FindTraceCacheEntry( key, hit );
+}
 
-Moves the given mins/maxs volume through the world from start to end.
-passEntityNum and entities owned by passEntityNum are explicitly not checked.
-==================
-*/
-void SV_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule ) {
+
+// finishes a trace given its world result: clips it against the entities
+// and stores the final result in the cache entry if there is one
+static void SV_ClipTraceToEntities( trace_t *results, const trace_t *worldTrace, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule, traceCacheEntry_t *entry, const traceCacheKey_t *key ) {
 	moveclip_t	clip;
 	int			i;
 
-	if ( !mins ) {
-		mins = vec3_origin;
-	}
-	if ( !maxs ) {
-		maxs = vec3_origin;
-	}
-
 	Com_Memset ( &clip, 0, sizeof ( moveclip_t ) );
 
-	// clip to world
-	CM_BoxTrace( &clip.trace, start, end, mins, maxs, 0, contentmask, capsule );
+	clip.trace = *worldTrace;
 	clip.trace.entityNum = clip.trace.fraction != 1.0 ? ENTITYNUM_WORLD : ENTITYNUM_NONE;
 	if ( clip.trace.fraction == 0 ) {
+		if ( entry ) {
+			// entities weren't tested, so no change can make it stale
+			const vec3_t nowhereMins = { MAX_WORLD_COORD, MAX_WORLD_COORD, MAX_WORLD_COORD };
+			const vec3_t nowhereMaxs = { MIN_WORLD_COORD, MIN_WORLD_COORD, MIN_WORLD_COORD };
+			SV_StoreTraceCacheEntry( entry, key, nowhereMins, nowhereMaxs, &clip.trace );
+		}
 		*results = clip.trace;
 		return;		// blocked immediately by the world
 	}
@@ -612,12 +993,130 @@ void SV_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const ve
 	// clip to other solid entities
 	SV_ClipMoveToEntities ( &clip );
 
+	if ( entry ) {
+		SV_StoreTraceCacheEntry( entry, key, clip.boxmins, clip.boxmaxs, &clip.trace );
+	}
+
 	*results = clip.trace;
 }
 
 
+/*
+==================
+SV_Trace
+
+Moves the given mins/maxs volume through the world from start to end.
+passEntityNum and entities owned by passEntityNum are explicitly not checked.
+==================
+*/
+void SV_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule ) {
+	if ( !mins ) {
+		mins = vec3_origin;
+	}
+	if ( !maxs ) {
+		maxs = vec3_origin;
+	}
+
+	traceCacheKey_t key;
+	traceCacheEntry_t* entry = NULL;
+	if ( sv_traceCache->integer ) {
+		qbool hit;
+		entry = SV_FindTraceInCache( &key, &hit, start, mins, maxs, end, passEntityNum, contentmask, capsule );
+		if ( hit ) {
+			*results = entry->trace;
+			return;
+		}
+	}
+
+	// clip to world
+	trace_t trace;
+	CM_BoxTrace( &trace, start, end, mins, maxs, 0, contentmask, capsule );
+
+	SV_ClipTraceToEntities( results, &trace, start, mins, maxs, end, passEntityNum, contentmask, capsule, entry, &key );
+}
+
+
+/*
+==================
+SV_TraceBatch
+
+Same results as calling SV_Trace for each query,
+but the world traces of the cache misses are done together with CM_BoxTraceBatch
+==================
+*/
+#define TRACE_BATCH_SIZE	64
+
+void SV_TraceBatch( trace_t *results, const gameTraceQuery_t *queries, int count ) {
+	cmTraceQuery_t		worldQueries[TRACE_BATCH_SIZE];
+	trace_t				worldTraces[TRACE_BATCH_SIZE];
+	traceCacheKey_t		keys[TRACE_BATCH_SIZE];
+	traceCacheEntry_t	*entries[TRACE_BATCH_SIZE];
+	int					indices[TRACE_BATCH_SIZE];
+	int					passEntityNums[TRACE_BATCH_SIZE];
+
+	for ( int first = 0; first < count; first += TRACE_BATCH_SIZE ) {
+		const int last = min( first + TRACE_BATCH_SIZE, count );
+
+		int numMisses = 0;
+		for ( int i = first; i < last; ++i ) {
+			const gameTraceQuery_t* const q = &queries[i];
+			const int capsule = q->capsule ? qtrue : qfalse;
+
+			traceCacheEntry_t* entry = NULL;
+			if ( sv_traceCache->integer ) {
+				qbool hit;
+				entry = SV_FindTraceInCache( &keys[numMisses], &hit, q->start, q->mins, q->maxs, q->end, q->passEntityNum, q->contentmask, capsule );
+				if ( hit ) {
+					results[i] = entry->trace;
+					continue;
+				}
+			}
+
+			cmTraceQuery_t* const wq = &worldQueries[numMisses];
+			VectorCopy( q->start, wq->start );
+			VectorCopy( q->end, wq->end );
+			VectorCopy( q->mins, wq->mins );
+			VectorCopy( q->maxs, wq->maxs );
+			wq->brushmask = q->contentmask;
+			wq->capsule = capsule;
+			entries[numMisses] = entry;
+			indices[numMisses] = i;
+			passEntityNums[numMisses] = q->passEntityNum;
+			numMisses++;
+		}
+
+		CM_BoxTraceBatch( worldTraces, worldQueries, numMisses, 0 );
+
+		// the queries aren't read again: the game could have them overlap the results
+		for ( int m = 0; m < numMisses; ++m ) {
+			const cmTraceQuery_t* const wq = &worldQueries[m];
+			SV_ClipTraceToEntities( &results[indices[m]], &worldTraces[m], wq->start, wq->mins, wq->maxs, wq->end,
+				passEntityNums[m], wq->brushmask, wq->capsule, entries[m], &keys[m] );
+		}
+	}
+}
+
+
 int SV_PointContents( const vec3_t p, int passEntityNum )
 {
+	traceCacheKey_t key;
+	traceCacheEntry_t* entry = NULL;
+	if ( sv_traceCache->integer ) {
+		VectorCopy( p, key.start );
+		VectorCopy( p, key.end );
+		VectorClear( key.mins );
+		VectorClear( key.maxs );
+		key.passEntityNum = passEntityNum;
+		key.contentmask = 0;
+		key.capsule = -1;
+
+		qbool hit;
+		entry = SV_FindTraceCacheEntry( &key, &hit );
+		if ( hit ) {
+			return entry->trace.contents;
+		}
+	}
+
 	// get base contents from world
 	int contents = CM_PointContents( p, 0 );
 
@@ -640,6 +1139,21 @@ int SV_PointContents( const vec3_t p, int passEntityNum )
 		contents |= CM_TransformedPointContents( p, clipHandle, hit->s.origin, hit->s.angles );
 	}
 
+	if ( entry ) {
+		trace_t trace;
+		Com_Memset( &trace, 0, sizeof(trace) );
+		trace.contents = contents;
+		SV_StoreTraceCacheEntry( entry, &key, p, p, &trace );
+	}
+
 	return contents;
 }
 
+
+void SV_PointContentsBatch( int *results, const gamePointContentsQuery_t *queries, int count )
+{
+	for ( int i = 0; i < count; ++i ) {
+		results[i] = SV_PointContents( queries[i].point, queries[i].passEntityNum );
+	}
+}
+
@@ -0,0 +1,27 @@
+/*
+===========================================================================
+This file is part of Challenge Quake 3 (CNQ3).
+
+Challenge Quake 3 is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Challenge Quake 3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Challenge Quake 3. If not, see <https://www.gnu.org/licenses/>.
+===========================================================================
+*/
+// the interpreter built a second time with instruction counting
+// vmbench only runs this one in an untimed pass,
+// the timed runs use vm_interpreted.cpp as the engine builds it
+
+#define VM_COUNT_INSTRUCTIONS
+#define VM_PrepareInterpreter2	VM_PrepareCountingInterpreter
+#define VM_CallInterpreted2		VM_CallCountingInterpreter
+
+#include "../../qcommon/vm_interpreted.cpp"
@@ -0,0 +1,634 @@
+/*
+===========================================================================
+This file is part of Challenge Quake 3 (CNQ3).
+
+Challenge Quake 3 is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Challenge Quake 3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Challenge Quake 3. If not, see <https://www.gnu.org/licenses/>.
+===========================================================================
+*/
+// replays a /vmtrace recording against the interpreter and the JIT
+
+#include "../../qcommon/vm_local.h"
+#include "../../qcommon/crash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#if defined(_WIN32)
+#include <Windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#include <cpuid.h>
+#endif
+
+
+/*
+The trace holds everything the QVM received from the engine,
+so replaying it needs none of the engine besides the VM code itself.
+The functions below are the few engine services vm.cpp and vm_x86.cpp rely on.
+*/
+
+
+#define MAX_CALLNUMS	64	// vmMain commands with their own timings
+
+
+// vm_counted.cpp
+extern int64_t vm_executedInstructions;
+qboolean VM_PrepareCountingInterpreter( vm_t* vm, vmHeader_t* header );
+int VM_CallCountingInterpreter( vm_t* vm, int* args );
+
+
+typedef struct {
+	const char*	qvmPath;
+
+	byte*		trace;			// the whole file
+	int			traceSize;
+	const vmTraceHeader_t* header;
+	const byte*	data;			// data segment snapshot
+	const int*	events;
+	int			numEvents;		// in ints, ends after the last complete vmMain call
+	const int*	event;			// replay cursor
+
+	vm_t*		vm;
+	qbool		counting;		// calls go to the instruction counting interpreter
+	int			numCalls;		// top-level vmMain calls
+	int			numNestedCalls;
+	int			numSyscalls;
+	int			mismatches;		// return values that differ from the recording
+
+	int64_t		callTimes[MAX_CALLNUMS];	// per vmMain command, in ticks
+	int			callCounts[MAX_CALLNUMS];
+} replay_t;
+
+static replay_t replay;
+
+
+/*
+===============================================================================
+
+ENGINE STUBS
+
+===============================================================================
+*/
+
+
+static cvar_t cvars[16];
+static int numCvars;
+
+cvar_t* com_developer;
+int cpu_features;
+
+
+void QDECL Com_Error( int level, const char* fmt, ... )
+{
+	va_list ap;
+	va_start( ap, fmt );
+	fprintf( stderr, "ERROR: " );
+	vfprintf( stderr, fmt, ap );
+	fprintf( stderr, "\n" );
+	va_end( ap );
+	exit( 1 );
+}
+
+
+void QDECL Com_Printf( const char* fmt, ... )
+{
+	va_list ap;
+	va_start( ap, fmt );
+	vprintf( fmt, ap );
+	va_end( ap );
+}
+
+
+void QDECL Com_DPrintf( const char* fmt, ... )
+{
+}
+
+
+#ifdef HUNK_DEBUG
+void* Hunk_AllocDebug( int size, ha_pref preference, char* label, char* file, int line )
+#else
+void* Hunk_Alloc( int size, ha_pref preference )
+#endif
+{
+	void* const ptr = calloc( size, 1 );
+	if ( ptr == NULL )
+		Com_Error( ERR_FATAL, "Hunk_Alloc failed on %d bytes", size );
+
+	return ptr;
+}
+
+
+int Hunk_MemoryRemaining()
+{
+	return 0;
+}
+
+
+#ifdef ZONE_DEBUG
+void* Z_MallocDebug( int size, char* label, char* file, int line )
+#else
+void* Z_Malloc( int size )
+#endif
+{
+	void* const ptr = calloc( size, 1 );
+	if ( ptr == NULL )
+		Com_Error( ERR_FATAL, "Z_Malloc failed on %d bytes", size );
+
+	return ptr;
+}
+
+
+void Z_Free( void* ptr )
+{
+	free( ptr );
+}
+
+
+static void* ReadWholeFile( const char* path, int* size )
+{
+	FILE* const file = fopen( path, "rb" );
+	if ( file == NULL )
+		return NULL;
+
+	fseek( file, 0, SEEK_END );
+	const long length = ftell( file );
+	fseek( file, 0, SEEK_SET );
+	byte* const buffer = (byte*)malloc( length + 1 );
+	if ( buffer == NULL || fread( buffer, 1, length, file ) != (size_t)length ) {
+		fclose( file );
+		free( buffer );
+		return NULL;
+	}
+	fclose( file );
+	buffer[length] = '\0';
+	*size = (int)length;
+
+	return buffer;
+}
+
+
+// only the QVM itself is available, .map files are never found
+int FS_ReadFile( const char* qpath, void** buffer )
+{
+	const int length = strlen( qpath );
+	int size = -1;
+	*buffer = NULL;
+	if ( length > 4 && !Q_stricmp( qpath + length - 4, ".qvm" ) ) {
+		*buffer = ReadWholeFile( replay.qvmPath, &size );
+		if ( *buffer == NULL )
+			size = -1;
+	}
+
+	return size;
+}
+
+
+void FS_FreeFile( void* buffer )
+{
+	free( buffer );
+}
+
+
+// nothing is ever written by the benchmark: vm_cache is off and neither command runs
+fileHandle_t FS_FOpenFileWrite( const char* qpath ) { return 0; }
+fileHandle_t FS_SV_FOpenFileWrite( const char* filename ) { return 0; }
+int FS_Write( const void* buffer, int len, fileHandle_t f ) { return 0; }
+void QDECL FS_Printf( fileHandle_t f, const char* fmt, ... ) {}
+void FS_FCloseFile( fileHandle_t f ) {}
+const byte* FS_SV_MapFileRead( const char* filename, int* size ) { return NULL; }
+void FS_SV_RemoveFile( const char* filename ) {}
+qbool FS_SV_ReplaceFile( const char* from, const char* to ) { return qfalse; }
+void Sys_UnmapFile( const byte* data, int size ) {}
+
+
+void Cvar_RegisterTable( const cvarTableItem_t* cvarTable, int count, module_t module )
+{
+	for ( int i = 0; i < count; ++i ) {
+		if ( numCvars >= ARRAY_LEN( cvars ) )
+			Com_Error( ERR_FATAL, "too many cvars" );
+
+		cvar_t* const var = &cvars[numCvars++];
+		var->name = (char*)cvarTable[i].name;
+		var->string = (char*)cvarTable[i].reset;
+		var->value = atof( var->string );
+		var->integer = atoi( var->string );
+		if ( cvarTable[i].cvar != NULL )
+			*cvarTable[i].cvar = var;
+	}
+}
+
+
+float Cvar_VariableValue( const char* var_name )
+{
+	return 0.0f;
+}
+
+
+void Cmd_RegisterTable( const cmdTableItem_t* cmds, int count, module_t module ) {}
+int Cmd_Argc() { return 0; }
+const char* Cmd_Argv( int arg ) { return ""; }
+
+
+void* QDECL Sys_LoadDll( const char* name, dllSyscall_t* entryPoint, dllSyscall_t systemcalls ) { return NULL; }
+void Sys_UnloadDll( void* dllHandle ) {}
+qbool Sys_StartProfileSampling( int intervalUS, profileSampler_t sampler ) { return qfalse; }
+void Sys_StopProfileSampling() {}
+
+
+void Crash_SaveQVMPointer( vmIndex_t vmIndex, vm_t* vm ) {}
+void Crash_SaveQVMChecksum( vmIndex_t vmIndex, unsigned int crc32 ) {}
+
+
+static unsigned int CRC32_table[256];
+
+
+void CRC32_Begin( unsigned int* crc )
+{
+	for ( int i = 0; i < 256; i++ ) {
+		unsigned int c = i;
+		for ( int j = 0; j < 8; j++ )
+			c = c & 1 ? (c >> 1) ^ 0xEDB88320UL : c >> 1;
+		CRC32_table[i] = c;
+	}
+
+	*crc = 0xFFFFFFFFUL;
+}
+
+
+void CRC32_ProcessBlock( unsigned int* crc, const void* buffer, unsigned int length )
+{
+	unsigned int hash = *crc;
+	const unsigned char* buf = (const unsigned char*)buffer;
+	while ( length-- ) {
+		hash = CRC32_table[(hash ^ *buf++) & 0xFF] ^ (hash >> 8);
+	}
+	*crc = hash;
+}
+
+
+void CRC32_End( unsigned int* crc )
+{
+	*crc ^= 0xFFFFFFFFUL;
+}
+
+
+// the JIT only cares about SSE4.1 for floor and ceil
+static void DetectCPUFeatures()
+{
+	int regs[4];
+#if defined(_WIN32)
+	__cpuid( regs, 1 );
+#else
+	unsigned int a, b, c, d;
+	if ( !__get_cpuid( 1, &a, &b, &c, &d ) )
+		return;
+	regs[2] = (int)c;
+#endif
+	if ( regs[2] & ( 1 << 19 ) )
+		cpu_features |= CPU_SSE41;
+}
+
+
+static int64_t GetTicks()
+{
+#if defined(_WIN32)
+	LARGE_INTEGER ticks;
+	QueryPerformanceCounter( &ticks );
+	return ticks.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+static double TicksToNS( int64_t ticks )
+{
+#if defined(_WIN32)
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency( &frequency );
+	return (double)ticks * 1000000000.0 / (double)frequency.QuadPart;
+#else
+	return (double)ticks;
+#endif
+}
+
+
+/*
+===============================================================================
+
+REPLAY
+
+===============================================================================
+*/
+
+
+static void LoadTrace( const char* path )
+{
+	replay.trace = (byte*)ReadWholeFile( path, &replay.traceSize );
+	if ( replay.trace == NULL )
+		Com_Error( ERR_FATAL, "couldn't read %s", path );
+
+	const vmTraceHeader_t* const header = (const vmTraceHeader_t*)replay.trace;
+	if ( replay.traceSize < (int)sizeof(*header) || memcmp( header->magic, "QVMT", 4 ) )
+		Com_Error( ERR_FATAL, "%s isn't a QVM trace", path );
+	if ( header->version != VM_TRACE_VERSION )
+		Com_Error( ERR_FATAL, "%s has version %d instead of %d", path, header->version, VM_TRACE_VERSION );
+	if ( (unsigned int)header->vmIndex >= VM_COUNT || header->dataSize <= 0 ||
+		 header->dataSize > replay.traceSize - (int)sizeof(*header) )
+		Com_Error( ERR_FATAL, "%s is corrupted", path );
+
+	replay.header = header;
+	replay.data = replay.trace + sizeof(*header);
+	replay.events = (const int*)( replay.data + header->dataSize );
+	const int numInts = ( replay.traceSize - (int)sizeof(*header) - header->dataSize ) / 4;
+
+	// find the end of the last complete vmMain call:
+	// the recording can stop anywhere
+	int depth = 0;
+	int i = 0;
+	while ( i < numInts ) {
+		const int event = replay.events[i];
+		int length;
+		if ( event == VMTE_CALL ) {
+			length = 1 + VMMAIN_CALL_ARGS;
+		} else if ( event == VMTE_RETURN ) {
+			length = 2;
+		} else if ( event == VMTE_SYSCALL && i + 4 <= numInts ) {
+			length = 4;
+			for ( int w = 0; w < replay.events[i + 3]; ++w ) {
+				if ( i + length + 2 > numInts )
+					break;
+				length += 2 + VM_TRACE_PAD( replay.events[i + length + 1] ) / 4;
+			}
+		} else {
+			break;
+		}
+		if ( i + length > numInts )
+			break;
+
+		i += length;
+		if ( event == VMTE_CALL ) {
+			depth++;
+		} else if ( event == VMTE_RETURN ) {
+			if ( --depth == 0 )
+				replay.numEvents = i;
+		}
+	}
+
+	if ( replay.numEvents == 0 )
+		Com_Error( ERR_FATAL, "%s has no complete vmMain call", path );
+}
+
+
+static int ReadEvent()
+{
+	if ( replay.event >= replay.events + replay.numEvents )
+		Com_Error( ERR_FATAL, "the trace ended in the middle of a call" );
+
+	return *replay.event++;
+}
+
+
+static int ReplayCall( int callnum, const int* args )
+{
+	if ( replay.counting ) {
+		int callArgs[VMMAIN_CALL_ARGS];
+		callArgs[0] = callnum;
+		memcpy( callArgs + 1, args, sizeof(callArgs) - sizeof(callArgs[0]) );
+		return VM_CallCountingInterpreter( replay.vm, callArgs );
+	}
+
+	return (int)VM_Call( replay.vm, callnum,
+		args[0], args[1], args[2], args[3], args[4], args[5],
+		args[6], args[7], args[8], args[9], args[10], args[11] );
+}
+
+
+static void ReplayReturn()
+{
+	if ( ReadEvent() != VMTE_RETURN )
+		Com_Error( ERR_FATAL, "replay diverged: expected a vmMain return" );
+}
+
+
+// a nested vmMain call made by the engine during a system call
+static void ReplayNestedCall()
+{
+	const int callnum = ReadEvent();
+	const int* const args = replay.event;
+	replay.event += VMMAIN_CALL_ARGS - 1;
+
+	const int result = ReplayCall( callnum, args );
+	ReplayReturn();
+	if ( result != *replay.event++ )
+		replay.mismatches++;
+
+	replay.numNestedCalls++;
+}
+
+
+static intptr_t QDECL ReplaySystemCall( intptr_t* args )
+{
+	int event;
+	while ( ( event = ReadEvent() ) == VMTE_CALL ) {
+		ReplayNestedCall();
+	}
+
+	if ( event != VMTE_SYSCALL )
+		Com_Error( ERR_FATAL, "replay diverged: expected a system call" );
+
+	const int number = ReadEvent();
+	const int value = ReadEvent();
+	const int numWrites = ReadEvent();
+	if ( number != (int)args[0] )
+		Com_Error( ERR_FATAL, "replay diverged: system call %d instead of %d", (int)args[0], number );
+
+	const int dataSize = replay.header->dataSize;
+	for ( int i = 0; i < numWrites; ++i ) {
+		const int offset = ReadEvent();
+		const int length = ReadEvent();
+		if ( offset < 0 || length < 0 || offset + length > dataSize )
+			Com_Error( ERR_FATAL, "the trace is corrupted" );
+		memcpy( replay.vm->dataBase + offset, replay.event, length );
+		replay.event += VM_TRACE_PAD( length ) / 4;
+	}
+
+	replay.numSyscalls++;
+
+	return value;
+}
+
+
+static void ReplayTrace()
+{
+	memcpy( replay.vm->dataBase, replay.data, replay.header->dataSize );
+	replay.event = replay.events;
+
+	while ( replay.event < replay.events + replay.numEvents ) {
+		if ( ReadEvent() != VMTE_CALL )
+			Com_Error( ERR_FATAL, "the trace is corrupted" );
+
+		const int callnum = ReadEvent();
+		const int* const args = replay.event;
+		replay.event += VMMAIN_CALL_ARGS - 1;
+
+		const int64_t start = GetTicks();
+		const int result = ReplayCall( callnum, args );
+		const int64_t ticks = GetTicks() - start;
+
+		ReplayReturn();
+		if ( result != *replay.event++ )
+			replay.mismatches++;
+
+		const int index = (unsigned int)callnum < MAX_CALLNUMS ? callnum : MAX_CALLNUMS - 1;
+		replay.callTimes[index] += ticks;
+		replay.callCounts[index]++;
+		replay.numCalls++;
+	}
+}
+
+
+typedef struct {
+	int64_t	callTimes[MAX_CALLNUMS];
+	int		callCounts[MAX_CALLNUMS];
+	int64_t	totalTicks;
+	int		calls;
+	int		nestedCalls;
+	int		syscalls;
+	int		mismatches;
+} runResults_t;
+
+
+static void CreateVM( vmInterpret_t interpret )
+{
+	replay.vm = VM_Create( (vmIndex_t)replay.header->vmIndex, ReplaySystemCall, interpret );
+	if ( replay.vm == NULL )
+		Com_Error( ERR_FATAL, "couldn't load %s", replay.qvmPath );
+	if ( replay.vm->checksum != replay.header->checksum )
+		Com_Error( ERR_FATAL, "%s isn't the QVM that was recorded", replay.qvmPath );
+	if ( replay.vm->dataMask + 1 != replay.header->dataSize )
+		Com_Error( ERR_FATAL, "the data segment size doesn't match the recording" );
+}
+
+
+// counting slows every instruction down, so it gets a pass of its own
+// the replay is deterministic, so one iteration is enough
+static int64_t CountInstructions()
+{
+	CreateVM( VMI_BYTECODE );
+
+	// decode the code again for the counting interpreter's handlers
+	// VM_Create already validated the file, which x86 needs no byte swapping for
+	int size;
+	vmHeader_t* const header = (vmHeader_t*)ReadWholeFile( replay.qvmPath, &size );
+	if ( header == NULL || !VM_PrepareCountingInterpreter( replay.vm, header ) )
+		Com_Error( ERR_FATAL, "couldn't prepare the counting interpreter" );
+	free( header );
+
+	vm_executedInstructions = 0;
+	replay.counting = qtrue;
+	ReplayTrace();
+	replay.counting = qfalse;
+
+	VM_Free( replay.vm );
+	replay.vm = NULL;
+
+	return vm_executedInstructions;
+}
+
+
+static void Run( runResults_t* results, vmInterpret_t interpret, int iterations )
+{
+	CreateVM( interpret );
+
+	memset( replay.callTimes, 0, sizeof(replay.callTimes) );
+	memset( replay.callCounts, 0, sizeof(replay.callCounts) );
+	replay.numCalls = 0;
+	replay.numNestedCalls = 0;
+	replay.numSyscalls = 0;
+	replay.mismatches = 0;
+
+	const int64_t start = GetTicks();
+	for ( int i = 0; i < iterations; ++i ) {
+		ReplayTrace();
+	}
+	results->totalTicks = GetTicks() - start;
+
+	memcpy( results->callTimes, replay.callTimes, sizeof(results->callTimes) );
+	memcpy( results->callCounts, replay.callCounts, sizeof(results->callCounts) );
+	results->calls = replay.numCalls;
+	results->nestedCalls = replay.numNestedCalls;
+	results->syscalls = replay.numSyscalls;
+	results->mismatches = replay.mismatches;
+
+	VM_Free( replay.vm );
+	replay.vm = NULL;
+}
+
+
+static void PrintResults( const char* name, const runResults_t* results, int64_t instructions )
+{
+	const double ns = TicksToNS( results->totalTicks );
+	printf( "%-12s %8.1f ms %10.1f M instructions/s %10.0f ns/call",
+		name, ns / 1000000.0, (double)instructions * 1000.0 / ns, ns / (double)results->calls );
+	if ( results->mismatches > 0 )
+		printf( "   %d return values differ from the recording!", results->mismatches );
+	printf( "\n" );
+}
+
+
+int main( int argc, char** argv )
+{
+	if ( argc < 3 ) {
+		printf( "usage: %s <qvm> <trace> [iterations]\n", argv[0] );
+		return 1;
+	}
+
+	const int iterations = argc >= 4 ? max( atoi( argv[3] ), 1 ) : 10;
+	replay.qvmPath = argv[1];
+	LoadTrace( argv[2] );
+
+	DetectCPUFeatures();
+	VM_Init();
+	vm_cache->integer = 0;
+	com_developer = &cvars[numCvars++];
+
+	runResults_t interpreted, compiled;
+	const int64_t instructions = CountInstructions() * iterations;
+	Run( &interpreted, VMI_BYTECODE, iterations );
+	Run( &compiled, VMI_COMPILED, iterations );
+
+	// the JIT runs the same instructions, only the interpreter can count them
+	printf( "\n%s: %d vmMain calls, %d nested calls, %d system calls, %d iterations\n",
+		argv[2], interpreted.calls / iterations, interpreted.nestedCalls / iterations,
+		interpreted.syscalls / iterations, iterations );
+	printf( "%.1f M instructions per iteration\n\n", (double)instructions / ( 1000000.0 * iterations ) );
+	PrintResults( "interpreted", &interpreted, instructions );
+	PrintResults( "compiled", &compiled, instructions );
+
+	printf( "\ncommand       calls   interpreted ns/call   compiled ns/call\n" );
+	for ( int i = 0; i < MAX_CALLNUMS; ++i ) {
+		if ( interpreted.callCounts[i] == 0 )
+			continue;
+		const double count = (double)interpreted.callCounts[i];
+		printf( "%s%-9d %9d %21.0f %18.0f\n", i == MAX_CALLNUMS - 1 ? ">=" : "  ", i,
+			interpreted.callCounts[i] / iterations,
+			TicksToNS( interpreted.callTimes[i] ) / count,
+			TicksToNS( compiled.callTimes[i] ) / count );
+	}
+
+	return 0;
+}
@@ -315,6 +315,44 @@ void Sys_FreeFileList( char **list )
 }
 
 
+const byte* Sys_MapFile( const char* path, int* size )
+{
+	*size = 0;
+
+	const HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( file == INVALID_HANDLE_VALUE )
+		return NULL;
+
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart <= 0 || fileSize.QuadPart > INT_MAX ) {
+		CloseHandle( file );
+		return NULL;
+	}
+
+	// the view keeps the mapping and the file referenced
+	const HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	CloseHandle( file );
+	if ( mapping == NULL )
+		return NULL;
+
+	const void* const data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	CloseHandle( mapping );
+	if ( data == NULL )
+		return NULL;
+
+	*size = (int)fileSize.QuadPart;
+
+	return (const byte*)data;
+}
+
+
+void Sys_UnmapFile( const byte* data, int size )
+{
+	if ( data )
+		UnmapViewOfFile( data );
+}
+
+
 char *Sys_GetClipboardData( void )
 {
 	char *data = NULL;
@@ -435,9 +473,7 @@ void WIN_QueEvent( int time, sysEventType_t type, int value, int value2, int ptr
 	if ( eventHead - eventTail >= MAX_QUED_EVENTS ) {
 		Com_Printf("Sys_QueEvent: overflow\n");
 		// we are discarding an event, but don't leak memory
-		if ( ev->evPtr ) {
-			Z_Free( ev->evPtr );
-		}
+		Com_FreeEventPtr( ev->evPtr );
 		eventTail++;
 	}
 
@@ -489,18 +525,29 @@ sysEvent_t Sys_GetEvent()
 	}
 
 	// check for network packets
+	// they're received straight into a packet slot unless they're all in use
 	msg_t		netmsg;
 	netadr_t	adr;
 	static byte sys_packetReceived[MAX_MSGLEN]; // static or it'll blow half the stack
-	MSG_Init( &netmsg, sys_packetReceived, sizeof( sys_packetReceived ) );
+	packetSlot_t* const slot = Com_GetPacketSlot();
+	MSG_Init( &netmsg, slot ? slot->data : sys_packetReceived, MAX_MSGLEN );
 	if ( Sys_GetPacket( &adr, &netmsg ) ) {
-		// copy out to a seperate buffer for qeueing
 		// the readcount stepahead is for SOCKS support
 		int len = sizeof( netadr_t ) + netmsg.cursize - netmsg.readcount;
-		netadr_t* buf = (netadr_t*)Z_Malloc( len );
-		*buf = adr;
-		memcpy( buf+1, &netmsg.data[netmsg.readcount], netmsg.cursize - netmsg.readcount );
-		WIN_QueEvent( 0, SE_PACKET, 0, 0, len, buf );
+		if ( slot ) {
+			slot->from = adr;
+			if ( netmsg.readcount > 0 ) {
+				memmove( slot->data, &slot->data[netmsg.readcount], netmsg.cursize - netmsg.readcount );
+			}
+			Com_QueuePacketSlot( slot );
+			WIN_QueEvent( 0, SE_PACKET, 0, 0, len, slot );
+		} else {
+			// copy out to a seperate buffer for qeueing
+			netadr_t* buf = (netadr_t*)Z_Malloc( len );
+			*buf = adr;
+			memcpy( buf+1, &netmsg.data[netmsg.readcount], netmsg.cursize - netmsg.readcount );
+			WIN_QueEvent( 0, SE_PACKET, 0, 0, len, buf );
+		}
 	}
 
 	// return if we have data
@@ -80,6 +80,210 @@ int64_t Sys_Microseconds()
 }
 
 
+// the worker threads are created on first use and live until the process exits
+// each batch bumps the generation so sleeping workers know there's new work
+
+typedef struct {
+	HANDLE				threads[MAX_WORKER_THREADS];
+	int					numThreads;
+	CRITICAL_SECTION	mutex;
+	CONDITION_VARIABLE	wakeCond;
+	CONDITION_VARIABLE	doneCond;
+	jobFunction_t		function;
+	void*				data;
+	int					count;
+	volatile LONG		nextIndex;
+	int					generation;
+	int					startGeneration[MAX_WORKER_THREADS];	// generation when the thread was created
+	int					activeWorkers;	// workers taking part in the current batch
+	int					busyWorkers;	// active workers that haven't finished yet
+} workers_t;
+
+static workers_t workers;
+
+
+static void WIN_RunJobs()
+{
+	for (;;) {
+		const int index = (int)InterlockedIncrement( &workers.nextIndex ) - 1;
+		if (index >= workers.count)
+			break;
+		workers.function( workers.data, index );
+	}
+}
+
+
+static DWORD WINAPI WIN_WorkerThread( LPVOID arg )
+{
+	const int workerIndex = (int)(intptr_t)arg;
+
+	EnterCriticalSection( &workers.mutex );
+	int generation = workers.startGeneration[workerIndex];
+	for (;;) {
+		while (generation == workers.generation)
+			SleepConditionVariableCS( &workers.wakeCond, &workers.mutex, INFINITE );
+		generation = workers.generation;
+		if (workerIndex >= workers.activeWorkers)
+			continue;
+
+		LeaveCriticalSection( &workers.mutex );
+		WIN_RunJobs();
+		EnterCriticalSection( &workers.mutex );
+
+		if (--workers.busyWorkers == 0)
+			WakeConditionVariable( &workers.doneCond );
+	}
+
+	return 0;
+}
+
+
+static void WIN_CreateWorkers( int count )
+{
+	if (workers.numThreads == 0) {
+		InitializeCriticalSection( &workers.mutex );
+		InitializeConditionVariable( &workers.wakeCond );
+		InitializeConditionVariable( &workers.doneCond );
+	}
+
+	while (workers.numThreads < count) {
+		const int index = workers.numThreads;
+		workers.startGeneration[index] = workers.generation;
+		workers.threads[index] = CreateThread( NULL, 0, WIN_WorkerThread, (LPVOID)(intptr_t)index, 0, NULL );
+		if (workers.threads[index] == NULL)
+			break;
+		++workers.numThreads;
+	}
+}
+
+
+int Sys_GetCoreCount()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+
+void Sys_RunParallel( jobFunction_t function, void* data, int count, int threadCount )
+{
+	if (count <= 0)
+		return;
+
+	const int workerCount = min( min( threadCount, count ), MAX_WORKER_THREADS + 1 ) - 1;
+	if (workerCount > workers.numThreads)
+		WIN_CreateWorkers( workerCount );
+
+	workers.function = function;
+	workers.data = data;
+	workers.count = count;
+	workers.nextIndex = 0;
+
+	const int activeWorkers = min( workerCount, workers.numThreads );
+	if (activeWorkers <= 0) {
+		WIN_RunJobs();
+		return;
+	}
+
+	EnterCriticalSection( &workers.mutex );
+	workers.activeWorkers = activeWorkers;
+	workers.busyWorkers = activeWorkers;
+	workers.generation++;
+	WakeAllConditionVariable( &workers.wakeCond );
+	LeaveCriticalSection( &workers.mutex );
+
+	WIN_RunJobs();
+
+	EnterCriticalSection( &workers.mutex );
+	while (workers.busyWorkers > 0)
+		SleepConditionVariableCS( &workers.doneCond, &workers.mutex, INFINITE );
+	LeaveCriticalSection( &workers.mutex );
+}
+
+
+int Sys_AtomicAdd( volatile int* value, int amount )
+{
+	return (int)InterlockedExchangeAdd( (volatile LONG*)value, (LONG)amount );
+}
+
+
+// Windows has no profiling timer signal,
+// so a thread suspends the profiled thread to take each sample
+typedef struct {
+	HANDLE				profiledThread;
+	HANDLE				samplerThread;
+	HANDLE				stopEvent;
+	DWORD				intervalMS;
+	profileSampler_t	sampler;
+} profiling_t;
+
+static profiling_t profiling;
+
+
+static DWORD WINAPI WIN_ProfileThread( LPVOID )
+{
+	while (WaitForSingleObject( profiling.stopEvent, profiling.intervalMS ) == WAIT_TIMEOUT) {
+		if (SuspendThread( profiling.profiledThread ) == (DWORD)-1)
+			continue;
+
+		// makes sure the thread really is suspended before we read its state
+		CONTEXT context;
+		context.ContextFlags = CONTEXT_CONTROL;
+		GetThreadContext( profiling.profiledThread, &context );
+
+		profiling.sampler();
+		ResumeThread( profiling.profiledThread );
+	}
+
+	return 0;
+}
+
+
+qbool Sys_StartProfileSampling( int intervalUS, profileSampler_t sampler )
+{
+	if (profiling.samplerThread != NULL)
+		Sys_StopProfileSampling();
+
+	if (!DuplicateHandle( GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &profiling.profiledThread,
+	                      THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, 0 ))
+		return qfalse;
+
+	profiling.stopEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+	profiling.intervalMS = (DWORD)max( intervalUS / 1000, 1 );
+	profiling.sampler = sampler;
+	if (profiling.stopEvent != NULL)
+		profiling.samplerThread = CreateThread( NULL, 0, WIN_ProfileThread, NULL, 0, NULL );
+
+	if (profiling.samplerThread == NULL) {
+		Sys_StopProfileSampling();
+		return qfalse;
+	}
+
+	SetThreadPriority( profiling.samplerThread, THREAD_PRIORITY_TIME_CRITICAL );
+
+	return qtrue;
+}
+
+
+void Sys_StopProfileSampling()
+{
+	if (profiling.samplerThread != NULL) {
+		SetEvent( profiling.stopEvent );
+		WaitForSingleObject( profiling.samplerThread, INFINITE );
+		CloseHandle( profiling.samplerThread );
+	}
+	if (profiling.stopEvent != NULL)
+		CloseHandle( profiling.stopEvent );
+	if (profiling.profiledThread != NULL)
+		CloseHandle( profiling.profiledThread );
+
+	profiling.samplerThread = NULL;
+	profiling.stopEvent = NULL;
+	profiling.profiledThread = NULL;
+}
+
+
 const char* Sys_DefaultHomePath()
 {
 	return NULL;
@@ -501,7 +501,7 @@ local function ApplyExeProjectSettings(exeName, server)
 		end
 
 	filter "system:not windows"
-		links { "dl", "m" }
+		links { "dl", "m", "pthread" }
 		if (server == 0) then
 			links { "SDL2", "GL" }
 		end
@@ -712,6 +712,24 @@ solution "cnq3"
 		filter "action:gmake"
 			buildoptions { "-std=c++98" }
 
+	project "cnq3-vmbench"
+
+		kind "ConsoleApp"
+		language "C++"
+		AddSourcesFromArray("qcommon", { "q_math.c", "q_shared.c", "vm.cpp", "vm_interpreted.cpp", "vm_x86.cpp" })
+		AddSourcesFromArray("tools/vmbench", { "vmbench.cpp", "vm_counted.cpp" })
+		ApplyProjectSettings(true)
+		filter { }
+		targetname("cnq3-vmbench"..GetExeNameSuffix())
+		if os.is("windows") then
+			prebuildcommands { path.translate(CreateGitPreBuildCommand(".cmd"), "\\") }
+		else
+			prebuildcommands { CreateGitPreBuildCommand(".sh") }
+			links { "m" }
+		end
+		filter "action:gmake"
+			buildoptions { "-std=c++98" }
+
 	project "botlib"
 
 		kind "StaticLib"